@@ -0,0 +1,117 @@
+/*
+  ===========================================================================
+
+  block_ring - Single producer, single consumer ring of timestamped blocks
+  of int16 IQ samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "block_ring.h"
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+int block_ring_init(struct block_ring *r, unsigned int blocks, int block_samples) {
+	memset(r, 0, sizeof(*r));
+	r->size = 1;
+	while (r->size < blocks) r->size <<= 1;
+	r->block_samples = block_samples;
+	r->blocks = calloc(r->size, sizeof(*r->blocks));
+	if (!r->blocks) {
+		perror("Could not allocate block ring");
+		return -1;
+	}
+
+	size_t size = (size_t) r->size * 2 * block_samples * sizeof(int16_t);
+	r->mapping_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	r->mapping = mmap(NULL, r->mapping_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	r->hugepages = r->mapping != MAP_FAILED;
+	if (!r->hugepages) {
+		r->mapping = mmap(NULL, r->mapping_size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (r->mapping == MAP_FAILED) {
+			r->mapping = NULL;
+			perror("Could not allocate block ring");
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(r->mapping, r->mapping_size, MADV_HUGEPAGE);
+#endif
+		// Fault in the pages now rather than in the capture thread
+		memset(r->mapping, 0, r->mapping_size);
+	}
+
+	int16_t *samples = r->mapping;
+	for (unsigned int j = 0; j < r->size; j++) {
+		r->blocks[j].samples = samples + (size_t) j * 2 * block_samples;
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->dropped, 0);
+	sem_init(&r->sem, 0, 0);
+	return 0;
+}
+
+struct block_ring_block *block_ring_write_begin(struct block_ring *r) {
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail >= r->size) {
+		atomic_fetch_add(&r->dropped, 1);
+		return NULL;
+	}
+	return &r->blocks[head & (r->size - 1)];
+}
+
+void block_ring_write_commit(struct block_ring *r) {
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	sem_post(&r->sem);
+}
+
+struct block_ring_block *block_ring_read_begin(struct block_ring *r) {
+	sem_wait(&r->sem);
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (head == tail) return NULL;
+	return &r->blocks[tail & (r->size - 1)];
+}
+
+void block_ring_read_commit(struct block_ring *r) {
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+unsigned int block_ring_count(struct block_ring *r) {
+	return atomic_load(&r->head) - atomic_load(&r->tail);
+}
+
+void block_ring_wake(struct block_ring *r) {
+	sem_post(&r->sem);
+}
+
+void block_ring_free(struct block_ring *r) {
+	if (r->mapping) munmap(r->mapping, r->mapping_size);
+	free(r->blocks);
+	sem_destroy(&r->sem);
+}
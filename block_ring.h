@@ -0,0 +1,68 @@
+/*
+  ===========================================================================
+
+  block_ring - Single producer, single consumer ring of timestamped blocks
+  of int16 IQ samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef BLOCK_RING_H
+#define BLOCK_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+struct block_ring_block {
+	int16_t *samples;
+	uint64_t timestamp; // device timestamp of the first sample
+	double host_time; // CLOCK_REALTIME when the block was read
+	int count; // samples, for writers that fill less than block_samples
+};
+
+struct block_ring {
+	unsigned int size; // power of 2
+	int block_samples;
+	struct block_ring_block *blocks;
+	void *mapping; // backing of the samples
+	size_t mapping_size;
+	int hugepages; // 1 if mapping uses explicit huge pages
+	atomic_uint head, tail;
+	atomic_ulong dropped;
+	sem_t sem;
+};
+
+// The number of blocks is rounded up to a power of 2. The samples are
+// backed by huge pages if the kernel has some reserved, or else by
+// transparent huge pages when available
+int block_ring_init(struct block_ring *r, unsigned int blocks, int block_samples);
+// Returns the block to fill next, or NULL if the ring is full, in which case
+// the block is counted as dropped
+struct block_ring_block *block_ring_write_begin(struct block_ring *r);
+void block_ring_write_commit(struct block_ring *r);
+// Waits for a block. Returns NULL if woken up by block_ring_wake()
+struct block_ring_block *block_ring_read_begin(struct block_ring *r);
+void block_ring_read_commit(struct block_ring *r);
+// Blocks written and not yet read
+unsigned int block_ring_count(struct block_ring *r);
+// Makes a pending block_ring_read_begin() return
+void block_ring_wake(struct block_ring *r);
+void block_ring_free(struct block_ring *r);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+  ===========================================================================
+
+  demod_bank - Bank of SSB and CW demodulators that send the audio of
+  narrowband channels of the RX passband as PCM over UDP.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The front-end shared by all the demodulators is a polyphase channelizer
+  with bins 12.5 kHz apart, decimated by half the number of bins, so that
+  the bins overlap and any SSB channel fits in one of them. The polyphase
+  sums are computed once per output, and each demodulator only takes the
+  DFT of them at its own bin, which is a dot product of bins samples. The
+  demodulator then moves the carrier to 0 Hz and goes to the audio rate
+  with a polyphase resampler whose filter is a complex band-pass that
+  only passes the wanted sideband, so that the audio is its real part.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "fir.h"
+#include "demod_bank.h"
+
+#define BIN_SPACING 12500.0 // Hz, approximately
+#define CHANNELIZER_ATTENUATION 70.0 // dB
+#define AUDIO_LOW 200.0 // Hz, -6 dB edges of the SSB filter
+#define AUDIO_HIGH 3100.0
+#define CW_PITCH 700.0 // Hz, audio frequency of the carrier in CW
+#define CW_WIDTH 500.0 // Hz
+#define FILTER_TRANSITION 400.0 // Hz
+#define FILTER_ATTENUATION 60.0 // dB, opposite sideband
+#define AGC_TARGET 0.5 // peak audio level
+#define AGC_MAX_GAIN 80.0 // dB
+#define AGC_HANG 0.25 // s
+#define AGC_RELEASE 20.0 // dB/s
+#define PACKET_TIME 0.02 // s of audio per UDP packet
+#define RING_SECONDS 0.5
+#define MIN_RING_BLOCKS 16
+
+static const char *mode_names[] = {
+	[DEMOD_USB] = "usb",
+	[DEMOD_LSB] = "lsb",
+	[DEMOD_CW] = "cw"
+};
+
+static int parse_spec(struct demod_bank *b, const char *spec) {
+	const char *p = spec;
+	while (*p) {
+		if (b->channel_count == DEMOD_BANK_MAX_CHANNELS) {
+			fprintf(stderr, "ERROR: at most %d demodulators\n", DEMOD_BANK_MAX_CHANNELS);
+			return -1;
+		}
+		struct demod_channel *c = &b->channels[b->channel_count++];
+		const char *colon = strchr(p, ':');
+		int k;
+		for (k = 0; k < DEMOD_MODES; k++) {
+			size_t len = strlen(mode_names[k]);
+			if (colon == p + len && !strncmp(p, mode_names[k], len)) break;
+		}
+		char *end;
+		if (k == DEMOD_MODES || (c->offset = strtod(colon + 1, &end), end == colon + 1)
+		    || (*end && *end != ',')) {
+			fprintf(stderr, "ERROR: invalid demodulator %s\n", p);
+			return -1;
+		}
+		c->mode = k;
+		p = *end ? end + 1 : end;
+	}
+	if (!b->channel_count) {
+		fprintf(stderr, "ERROR: no demodulators\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int channel_init(struct demod_bank *b, struct demod_channel *c, int n,
+			const char *ip, int port) {
+	double spacing = b->sample_rate / b->bins;
+	double rate = 2 * spacing;
+	if (fabs(c->offset) + AUDIO_HIGH > b->sample_rate / 2) {
+		fprintf(stderr, "ERROR: demodulator offset %.0f Hz is outside the passband\n",
+			c->offset);
+		return -1;
+	}
+	long bin = lround(c->offset / spacing);
+	c->bin = (bin % b->bins + b->bins) % b->bins;
+	double pitch = c->mode == DEMOD_CW ? CW_PITCH : 0;
+	c->nco_step = -2 * M_PI * (c->offset - bin * spacing - pitch) / rate;
+
+	int max_bin_output = b->max_block / (b->bins / 2) + 1;
+	int max_audio = (long) max_bin_output * b->interp / b->decim + 1;
+	int proto_taps = b->interp * b->phase_taps;
+	float *proto = malloc(proto_taps * sizeof(float));
+	c->dft_i = malloc(b->bins * sizeof(float));
+	c->dft_q = malloc(b->bins * sizeof(float));
+	c->phases_i = malloc(proto_taps * sizeof(float));
+	c->phases_q = malloc(proto_taps * sizeof(float));
+	c->baseband_i = calloc(b->phase_taps - 1 + max_bin_output, sizeof(float));
+	c->baseband_q = calloc(b->phase_taps - 1 + max_bin_output, sizeof(float));
+	c->audio = malloc((b->packet_samples + max_audio) * sizeof(int16_t));
+	if (!proto || !c->dft_i || !c->dft_q || !c->phases_i || !c->phases_q
+	    || !c->baseband_i || !c->baseband_q || !c->audio) {
+		fprintf(stderr, "Could not allocate demodulator\n");
+		free(proto);
+		return -1;
+	}
+
+	// The polyphase sums are stored in reverse order of the branches
+	for (int q = 0; q < b->bins; q++) {
+		double w = 2 * M_PI * c->bin * (b->bins - 1 - q) / b->bins;
+		c->dft_i[q] = cos(w);
+		c->dft_q[q] = sin(w);
+	}
+
+	double centre = c->mode == DEMOD_USB ? (AUDIO_HIGH + AUDIO_LOW) / 2
+		: c->mode == DEMOD_LSB ? -(AUDIO_HIGH + AUDIO_LOW) / 2 : CW_PITCH;
+	double width = c->mode == DEMOD_CW ? CW_WIDTH : AUDIO_HIGH - AUDIO_LOW;
+	double upsampled_rate = b->interp * rate;
+	fir_lowpass(proto, proto_taps, width / 2 / upsampled_rate,
+		    fir_kaiser_beta(FILTER_ATTENUATION));
+	for (int p = 0; p < b->interp; p++) {
+		for (int k = 0; k < b->phase_taps; k++) {
+			int j = p + k * b->interp;
+			double w = 2 * M_PI * centre / upsampled_rate * (j - (proto_taps - 1) / 2.0);
+			int r = p * b->phase_taps + b->phase_taps - 1 - k;
+			c->phases_i[r] = b->interp * proto[j] * cos(w);
+			c->phases_q[r] = b->interp * proto[j] * sin(w);
+		}
+	}
+	free(proto);
+
+	c->addr.sin_family = AF_INET;
+	c->addr.sin_port = htons(port + n);
+	inet_aton(ip, &c->addr.sin_addr);
+	atomic_init(&c->sent, 0);
+	atomic_init(&c->errors, 0);
+	fprintf(stderr, "Demodulator %d: %s at %+.0f Hz, bin %d, UDP port %d\n",
+		n, mode_names[c->mode], c->offset, c->bin, port + n);
+	return 0;
+}
+
+int demod_bank_init(struct demod_bank *b, const char *spec, double sample_rate,
+		    double audio_rate, int max_block, const char *ip, int port) {
+	memset(b, 0, sizeof(*b));
+	b->socket = -1;
+	b->sample_rate = sample_rate;
+	b->audio_rate = audio_rate;
+	b->max_block = max_block;
+	if (parse_spec(b, spec) < 0) return -1;
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		fprintf(stderr, "ERROR: invalid demodulator IP\n");
+		return -1;
+	}
+
+	b->bins = FIR_VECTOR * lround(sample_rate / (FIR_VECTOR * BIN_SPACING));
+	if (b->bins < FIR_VECTOR) b->bins = FIR_VECTOR;
+	double spacing = sample_rate / b->bins;
+	// Signals up to half a bin plus the audio bandwidth away from the
+	// centre of a bin must not alias
+	double transition = spacing - 2 * AUDIO_HIGH;
+	if (transition <= 0) {
+		fprintf(stderr, "ERROR: sample rate too low for the demodulators\n");
+		return -1;
+	}
+	int taps = fir_kaiser_taps(CHANNELIZER_ATTENUATION, transition / sample_rate);
+	b->taps = (taps + b->bins - 1) / b->bins * b->bins;
+
+	long fa = lround(audio_rate) * b->bins, fs = lround(2 * sample_rate);
+	long g = fa > 0 && fs > 0 ? fir_gcd(fs, fa) : 0;
+	if (audio_rate < 2 * AUDIO_HIGH || audio_rate > 2 * spacing || !g
+	    || fa / g > DEMOD_BANK_MAX_INTERP) {
+		fprintf(stderr, "ERROR: invalid demodulator audio rate\n");
+		return -1;
+	}
+	b->interp = fa / g;
+	b->decim = fs / g;
+	b->phase_taps = fir_padded(fir_kaiser_taps(FILTER_ATTENUATION,
+						   FILTER_TRANSITION / (2 * spacing)));
+	b->packet_samples = lround(PACKET_TIME * audio_rate);
+	b->agc_release = pow(10, -AGC_RELEASE / 20 / audio_rate);
+	b->agc_max_gain = pow(10, AGC_MAX_GAIN / 20);
+	b->agc_hang = AGC_HANG * audio_rate;
+
+	b->proto = malloc(b->taps * sizeof(float));
+	b->input_i = calloc(b->taps - 1 + max_block, sizeof(float));
+	b->input_q = calloc(b->taps - 1 + max_block, sizeof(float));
+	b->bin_i = malloc(b->bins * sizeof(float));
+	b->bin_q = malloc(b->bins * sizeof(float));
+	if (!b->proto || !b->input_i || !b->input_q || !b->bin_i || !b->bin_q) {
+		fprintf(stderr, "Could not allocate demodulators\n");
+		demod_bank_free(b);
+		return -1;
+	}
+	// The prototype is symmetric, so reversing it is only a reminder of
+	// how it is applied
+	fir_lowpass(b->proto, b->taps, 1.0 / b->bins, fir_kaiser_beta(CHANNELIZER_ATTENUATION));
+	fprintf(stderr, "Demodulators: %d bins of %.0f Hz, %d taps, audio at %.0f Hz\n",
+		b->bins, spacing, b->taps, audio_rate);
+
+	for (int n = 0; n < b->channel_count; n++) {
+		if (channel_init(b, &b->channels[n], n, ip, port) < 0) {
+			demod_bank_free(b);
+			return -1;
+		}
+	}
+	if ((b->socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("Could not open demodulator UDP socket");
+		demod_bank_free(b);
+		return -1;
+	}
+
+	unsigned int blocks = RING_SECONDS * sample_rate / max_block;
+	if (blocks < MIN_RING_BLOCKS) blocks = MIN_RING_BLOCKS;
+	if (block_ring_init(&b->ring, blocks, max_block) < 0) {
+		demod_bank_free(b);
+		return -1;
+	}
+	return 0;
+}
+
+// Polyphase sums of the channelizer for the window starting at input
+static void polyphase(struct demod_bank *b, int input) {
+	fir_polyphase(b->proto, b->input_i + input, b->taps, b->bins, b->bin_i);
+	fir_polyphase(b->proto, b->input_q + input, b->taps, b->bins, b->bin_q);
+}
+
+static void send_audio(struct demod_bank *b, struct demod_channel *c) {
+	if (sendto(b->socket, c->audio, b->packet_samples * sizeof(int16_t), MSG_DONTWAIT,
+		   (struct sockaddr *) &c->addr, sizeof(c->addr)) < 0) {
+		atomic_fetch_add(&c->errors, 1);
+	}
+	else {
+		atomic_fetch_add(&c->sent, 1);
+	}
+	c->audio_count -= b->packet_samples;
+	memmove(c->audio, c->audio + b->packet_samples, c->audio_count * sizeof(int16_t));
+}
+
+// Fine tuning, resampling and AGC of n new channelizer outputs
+static void demodulate(struct demod_bank *b, struct demod_channel *c, int n) {
+	float *bi = c->baseband_i + b->phase_taps - 1;
+	float *bq = c->baseband_q + b->phase_taps - 1;
+	double rot_c = cos(c->nco_phase), rot_s = sin(c->nco_phase);
+	double step_c = cos(c->nco_step), step_s = sin(c->nco_step);
+	for (int k = 0; k < n; k++) {
+		float i = bi[k], q = bq[k];
+		bi[k] = i * rot_c - q * rot_s;
+		bq[k] = i * rot_s + q * rot_c;
+		double t = rot_c * step_c - rot_s * step_s;
+		rot_s = rot_c * step_s + rot_s * step_c;
+		rot_c = t;
+	}
+	c->nco_phase = fmod(c->nco_phase + c->nco_step * n, 2 * M_PI);
+
+	while (c->input < n) {
+		const float *hi = c->phases_i + c->phase * b->phase_taps;
+		const float *hq = c->phases_q + c->phase * b->phase_taps;
+		float y = fir_dot(hi, c->baseband_i + c->input, b->phase_taps)
+			- fir_dot(hq, c->baseband_q + c->input, b->phase_taps);
+		c->phase += b->decim;
+		c->input += c->phase / b->interp;
+		c->phase %= b->interp;
+
+		// Instant attack, so that the output never goes over the target
+		float a = fabsf(y);
+		if (a > c->envelope) {
+			c->envelope = a;
+			c->hang = b->agc_hang;
+		}
+		else if (c->hang) {
+			c->hang--;
+		}
+		else {
+			c->envelope *= b->agc_release;
+		}
+		float floor = AGC_TARGET / b->agc_max_gain;
+		float gain = AGC_TARGET / (c->envelope > floor ? c->envelope : floor);
+		c->audio[c->audio_count++] = lrintf(32767 * gain * y);
+		if (c->audio_count >= b->packet_samples) send_audio(b, c);
+	}
+	c->input -= n;
+	memmove(c->baseband_i, c->baseband_i + n, (b->phase_taps - 1) * sizeof(float));
+	memmove(c->baseband_q, c->baseband_q + n, (b->phase_taps - 1) * sizeof(float));
+}
+
+void demod_bank_process(struct demod_bank *b, const int16_t *samples, int count) {
+	float *xi = b->input_i + b->taps - 1, *xq = b->input_q + b->taps - 1;
+	for (int j = 0; j < count; j++) {
+		xi[j] = samples[2*j] * (1.0f / 32768);
+		xq[j] = samples[2*j+1] * (1.0f / 32768);
+	}
+
+	int n = 0;
+	for (; b->input < count; b->input += b->bins / 2, n++) {
+		polyphase(b, b->input);
+		for (int k = 0; k < b->channel_count; k++) {
+			struct demod_channel *c = &b->channels[k];
+			float i, q;
+			fir_dot_complex(b->bin_i, b->bin_q, c->dft_i, c->dft_q, b->bins, &i, &q);
+			// Decimating by half the bins leaves odd bins alternating
+			// in sign
+			if (b->odd && (c->bin & 1)) {
+				i = -i;
+				q = -q;
+			}
+			c->baseband_i[b->phase_taps - 1 + n] = i;
+			c->baseband_q[b->phase_taps - 1 + n] = q;
+		}
+		b->odd ^= 1;
+	}
+	b->input -= count;
+	memmove(b->input_i, b->input_i + count, (b->taps - 1) * sizeof(float));
+	memmove(b->input_q, b->input_q + count, (b->taps - 1) * sizeof(float));
+
+	for (int k = 0; k < b->channel_count; k++) {
+		demodulate(b, &b->channels[k], n);
+	}
+}
+
+static void *demod_thread(void *arg) {
+	struct demod_bank *b = arg;
+	while (!atomic_load(&b->stop)) {
+		struct block_ring_block *block = block_ring_read_begin(&b->ring);
+		if (!block) continue;
+		demod_bank_process(b, block->samples, block->count);
+		block_ring_read_commit(&b->ring);
+	}
+	return NULL;
+}
+
+int demod_bank_start(struct demod_bank *b) {
+	if (pthread_create(&b->thread, NULL, demod_thread, b) != 0) {
+		fprintf(stderr, "Could not create demodulator thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+void demod_bank_push(struct demod_bank *b, const int16_t *samples, int count) {
+	struct block_ring_block *block = block_ring_write_begin(&b->ring);
+	if (!block) return;
+	memcpy(block->samples, samples, 2 * count * sizeof(int16_t));
+	block->count = count;
+	block_ring_write_commit(&b->ring);
+}
+
+void demod_bank_print(struct demod_bank *b) {
+	for (int n = 0; n < b->channel_count; n++) {
+		struct demod_channel *c = &b->channels[n];
+		fprintf(stderr, "Demodulator %d (%s %+.0f Hz): sent = %lu, errors = %lu\n",
+			n, mode_names[c->mode], c->offset, atomic_load(&c->sent),
+			atomic_load(&c->errors));
+	}
+	fprintf(stderr, "Demodulators: queued = %u, dropped = %lu\n",
+		block_ring_count(&b->ring), atomic_load(&b->ring.dropped));
+}
+
+void demod_bank_stop(struct demod_bank *b) {
+	atomic_store(&b->stop, 1);
+	block_ring_wake(&b->ring);
+	pthread_join(b->thread, NULL);
+}
+
+void demod_bank_free(struct demod_bank *b) {
+	for (int n = 0; n < b->channel_count; n++) {
+		struct demod_channel *c = &b->channels[n];
+		free(c->dft_i);
+		free(c->dft_q);
+		free(c->phases_i);
+		free(c->phases_q);
+		free(c->baseband_i);
+		free(c->baseband_q);
+		free(c->audio);
+	}
+	free(b->proto);
+	free(b->input_i);
+	free(b->input_q);
+	free(b->bin_i);
+	free(b->bin_q);
+	if (b->socket >= 0) close(b->socket);
+	if (b->ring.blocks) block_ring_free(&b->ring);
+}
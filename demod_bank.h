@@ -0,0 +1,115 @@
+/*
+  ===========================================================================
+
+  demod_bank - Bank of SSB and CW demodulators that send the audio of
+  narrowband channels of the RX passband as PCM over UDP.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef DEMOD_BANK_H
+#define DEMOD_BANK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "block_ring.h"
+
+#define DEMOD_BANK_MAX_CHANNELS 32
+#define DEMOD_BANK_MAX_INTERP 1024
+
+enum demod_mode {
+	DEMOD_USB,
+	DEMOD_LSB,
+	DEMOD_CW, // USB with a narrow filter around the CW pitch
+	DEMOD_MODES
+};
+
+struct demod_channel {
+	enum demod_mode mode;
+	double offset; // Hz from the RX frequency, of the carrier
+	int bin; // channelizer output
+	float *dft_i, *dft_q; // DFT coefficients of the bin
+
+	// Frequency shift that takes the carrier to 0 Hz, or to the CW pitch
+	double nco_step, nco_phase; // radians per channelizer sample
+
+	// Polyphase resampler to the audio rate, with a complex band-pass
+	// filter that selects the sideband. Only the real part is computed
+	float *phases_i, *phases_q; // interp filters, reversed
+	int phase, input; // of the next audio sample
+	float *baseband_i, *baseband_q; // phase_taps - 1 samples of history, then the block
+
+	// AGC
+	float envelope;
+	int hang;
+
+	int16_t *audio; // packet being filled
+	int audio_count;
+	struct sockaddr_in addr;
+	atomic_ulong sent, errors;
+};
+
+struct demod_bank {
+	double sample_rate, audio_rate;
+	int max_block; // samples per block
+
+	// Channelizer with bins spaced sample_rate / bins, decimated by bins / 2
+	int bins;
+	int taps; // bins * taps per bin
+	float *proto; // prototype lowpass, reversed
+	float *input_i, *input_q; // taps - 1 samples of history, then the block
+	int input; // of the next channelizer output
+	int odd; // parity of the channelizer output
+	float *bin_i, *bin_q; // polyphase sums of the last output
+
+	int interp, decim;
+	int phase_taps;
+	int packet_samples;
+	float agc_release, agc_max_gain;
+	int agc_hang;
+
+	int channel_count;
+	struct demod_channel channels[DEMOD_BANK_MAX_CHANNELS];
+	int socket;
+
+	// The demodulators run in their own thread, so that they never delay
+	// the Linrad packets
+	struct block_ring ring;
+	pthread_t thread;
+	atomic_int stop;
+};
+
+// spec is a comma separated list of <usb|lsb|cw>:<offset in Hz>. Channel n
+// is sent to port + n of ip
+int demod_bank_init(struct demod_bank *b, const char *spec, double sample_rate,
+		    double audio_rate, int max_block, const char *ip, int port);
+int demod_bank_start(struct demod_bank *b);
+// Queues count interleaved int16 IQ samples, up to max_block, for the
+// demodulators. The block is dropped if they are behind
+void demod_bank_push(struct demod_bank *b, const int16_t *samples, int count);
+// Runs the demodulators on count samples, up to max_block, in the calling
+// thread
+void demod_bank_process(struct demod_bank *b, const int16_t *samples, int count);
+void demod_bank_print(struct demod_bank *b);
+void demod_bank_stop(struct demod_bank *b);
+void demod_bank_free(struct demod_bank *b);
+
+#endif
@@ -0,0 +1,629 @@
+/*
+  ===========================================================================
+
+  dpd - Adaptive digital predistortion of the TX samples, with a memory
+  polynomial learnt from the TX signal received back in RX.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The predistorter is a memory polynomial with odd orders,
+  y[n] = sum over m, t of c[m,t] x[n-m] |x[n-m]|^(2t), which needs no
+  square roots and is evaluated by Horner's rule in SSE2 passes over
+  chunks of samples. It is learnt by indirect learning: every second the
+  worker takes a capture of RX samples and the TX samples around them
+  from the rings, finds the loop delay by FFT cross-correlation, divides
+  RX by the small signal gain of the loop, and fits by least squares the
+  polynomial that maps it back to the predistorter output. That fit is
+  the inverse of the PA, and the coefficients move part of the way to it.
+  The NMSE between the RX samples and the predistorter input, and the
+  ACPR of RX, show how far the loop is from linear.
+
+  ===========================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fir.h"
+#include "dpd.h"
+
+#define FULL_SCALE 32768.0
+#define CHUNK 256 // samples processed in each pass
+#define RING_SECONDS 2.0
+#define CAPTURE 16384 // minimum samples in each fit
+#define MAX_LAG 0.01 // s between the TX and RX timestamps of a sample
+#define MIN_LAG 256 // samples
+#define INTERVAL 1 // s between updates
+#define STEP 0.5 // of the way to the new fit
+#define MIN_STEP 0.05 // shortest step tried before keeping the coefficients
+#define MAX_GAIN 6.0 // dB of the predistorter at any amplitude in the capture
+#define GAIN_POINTS 32 // amplitudes where that is checked
+#define MIN_LEVEL -40.0 // dBFS of the TX samples to learn from them
+#define MIN_CORRELATION 0.8 // normalized, to trust the loop delay
+#define REGULARIZATION 1e-6 // relative to the mean of the diagonal
+#define RESYNC 2e-3 // s of error of an estimated timestamp that is followed
+#define PSD_BINS 32 // per channel bandwidth
+#define PSD_SEGMENTS 8 // half overlapping, in a capture
+
+int dpd_init(struct dpd *p, double sample_rate, int order, int memory, double bandwidth,
+	     double rx_offset, FILE *log) {
+	memset(p, 0, sizeof(*p));
+	p->sample_rate = sample_rate;
+	p->order = order;
+	p->memory = memory;
+	p->bandwidth = bandwidth;
+	p->rx_offset = rx_offset;
+	p->log = log;
+	pthread_mutex_init(&p->lock, NULL);
+	atomic_init(&p->clipped, 0);
+	atomic_init(&p->updated, 0);
+	p->nmse = p->acpr = p->gain_db = p->delay = p->change = NAN;
+	if (order < 1 || order > DPD_MAX_ORDER || order % 2 == 0
+	    || memory < 1 || memory > DPD_MAX_MEMORY) {
+		fprintf(stderr, "ERROR: DPD order must be odd and up to %d, and memory up to %d\n",
+			DPD_MAX_ORDER, DPD_MAX_MEMORY);
+		return -1;
+	}
+	if (bandwidth <= 0 || 3 * bandwidth > sample_rate
+	    || fabs(rx_offset) + 1.5 * bandwidth > sample_rate / 2) {
+		fprintf(stderr, "ERROR: the DPD channel and its neighbours must fit in the RX passband\n");
+		return -1;
+	}
+	p->terms = (order + 1) / 2;
+	p->coefs = p->terms * memory;
+	// Starts as a straight wire
+	p->coef_i[0] = 1;
+	p->pending[0] = 1;
+
+	p->psd_size = 1;
+	while (p->psd_size < PSD_BINS * sample_rate / bandwidth) p->psd_size <<= 1;
+	p->capture = PSD_SEGMENTS / 2 * p->psd_size;
+	if (p->capture < CAPTURE) p->capture = CAPTURE;
+	p->max_lag = MAX_LAG * sample_rate;
+	if (p->max_lag < MIN_LAG) p->max_lag = MIN_LAG;
+	p->fft_size = 1;
+	while (p->fft_size < p->capture + 2 * p->max_lag) p->fft_size <<= 1;
+
+	int history = memory - 1;
+	p->x_i = calloc(history + CHUNK, sizeof(float));
+	p->x_q = calloc(history + CHUNK, sizeof(float));
+	p->power = calloc(history + CHUNK, sizeof(float));
+	p->y_i = malloc(CHUNK * sizeof(float));
+	p->y_q = malloc(CHUNK * sizeof(float));
+	int window = p->capture + 2 * p->max_lag;
+	p->tx_in_copy = malloc(2 * window * sizeof(float));
+	p->tx_out_copy = malloc(2 * window * sizeof(float));
+	p->rx_copy = malloc(2 * p->capture * sizeof(float));
+	p->u = malloc(p->capture * sizeof(double complex));
+	p->x = malloc(p->capture * sizeof(double complex));
+	p->y = malloc(p->capture * sizeof(double complex));
+	p->fft_a = fftwf_malloc(p->fft_size * sizeof(fftwf_complex));
+	p->fft_b = fftwf_malloc(p->fft_size * sizeof(fftwf_complex));
+	p->psd_window = malloc(p->psd_size * sizeof(float));
+	p->psd_in = fftwf_malloc(p->psd_size * sizeof(fftwf_complex));
+	p->psd_out = fftwf_malloc(p->psd_size * sizeof(fftwf_complex));
+	p->psd_tx = malloc(p->psd_size * sizeof(double));
+	p->psd_rx = malloc(p->psd_size * sizeof(double));
+	if (!p->x_i || !p->x_q || !p->power || !p->y_i || !p->y_q
+	    || sample_ring_init(&p->tx_in, RING_SECONDS * sample_rate) < 0
+	    || sample_ring_init(&p->tx_out, RING_SECONDS * sample_rate) < 0
+	    || sample_ring_init(&p->rx, RING_SECONDS * sample_rate) < 0
+	    || !p->tx_in_copy || !p->tx_out_copy || !p->rx_copy || !p->u || !p->x
+	    || !p->y || !p->fft_a || !p->fft_b || !p->psd_window || !p->psd_in || !p->psd_out
+	    || !p->psd_tx || !p->psd_rx) {
+		fprintf(stderr, "Could not allocate DPD buffers\n");
+		dpd_free(p);
+		return -1;
+	}
+	p->forward_a = fftwf_plan_dft_1d(p->fft_size, p->fft_a, p->fft_a, FFTW_FORWARD,
+					 FFTW_ESTIMATE);
+	p->forward_b = fftwf_plan_dft_1d(p->fft_size, p->fft_b, p->fft_b, FFTW_FORWARD,
+					 FFTW_ESTIMATE);
+	p->inverse = fftwf_plan_dft_1d(p->fft_size, p->fft_a, p->fft_a, FFTW_BACKWARD,
+				       FFTW_ESTIMATE);
+	p->psd_plan = fftwf_plan_dft_1d(p->psd_size, p->psd_in, p->psd_out, FFTW_FORWARD,
+					FFTW_ESTIMATE);
+	// Blackman-Harris, so that the leakage of the channel stays well under
+	// the distortion in the adjacent channels
+	fir_blackman_harris(p->psd_window, p->psd_size);
+	fprintf(stderr, "DPD: order %d, %d taps, loop delay search +-%d samples\n",
+		order, memory, p->max_lag);
+	return 0;
+}
+
+// Adds x[n-m] times the polynomial in |x[n-m]|^2 with coefficients c to y,
+// for the count samples after the history
+static void add_tap(const float *x_i, const float *x_q, const float *power,
+		    const float *c_i, const float *c_q, int terms,
+		    float *y_i, float *y_q, int count) {
+	int j = 0;
+#ifdef __SSE2__
+	for (; j + 4 <= count; j += 4) {
+		__m128 p = _mm_loadu_ps(power + j);
+		__m128 g_i = _mm_set1_ps(c_i[terms - 1]), g_q = _mm_set1_ps(c_q[terms - 1]);
+		for (int t = terms - 2; t >= 0; t--) {
+			g_i = _mm_add_ps(_mm_mul_ps(g_i, p), _mm_set1_ps(c_i[t]));
+			g_q = _mm_add_ps(_mm_mul_ps(g_q, p), _mm_set1_ps(c_q[t]));
+		}
+		__m128 xi = _mm_loadu_ps(x_i + j), xq = _mm_loadu_ps(x_q + j);
+		__m128 yi = _mm_loadu_ps(y_i + j), yq = _mm_loadu_ps(y_q + j);
+		yi = _mm_add_ps(yi, _mm_sub_ps(_mm_mul_ps(xi, g_i), _mm_mul_ps(xq, g_q)));
+		yq = _mm_add_ps(yq, _mm_add_ps(_mm_mul_ps(xi, g_q), _mm_mul_ps(xq, g_i)));
+		_mm_storeu_ps(y_i + j, yi);
+		_mm_storeu_ps(y_q + j, yq);
+	}
+#endif
+	for (; j < count; j++) {
+		float g_i = c_i[terms - 1], g_q = c_q[terms - 1];
+		for (int t = terms - 2; t >= 0; t--) {
+			g_i = g_i * power[j] + c_i[t];
+			g_q = g_q * power[j] + c_q[t];
+		}
+		y_i[j] += x_i[j] * g_i - x_q[j] * g_q;
+		y_q[j] += x_i[j] * g_q + x_q[j] * g_i;
+	}
+}
+
+void dpd_process(struct dpd *p, int16_t *samples, int count, uint64_t timestamp, int estimated) {
+	int history = p->memory - 1;
+	int64_t error = (int64_t) (timestamp - p->next_timestamp);
+	if (!p->started || (estimated ? llabs(error) > RESYNC * p->sample_rate : error != 0)) {
+		// A new transmission, after silence
+		p->next_timestamp = timestamp;
+		memset(p->x_i, 0, history * sizeof(float));
+		memset(p->x_q, 0, history * sizeof(float));
+		memset(p->power, 0, history * sizeof(float));
+		p->started = 1;
+	}
+	if (atomic_load(&p->updated)) {
+		pthread_mutex_lock(&p->lock);
+		for (int k = 0; k < p->coefs; k++) {
+			p->coef_i[k] = creal(p->pending[k]);
+			p->coef_q[k] = cimag(p->pending[k]);
+		}
+		atomic_store(&p->updated, 0);
+		p->coef_timestamp = p->next_timestamp;
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	float in[2 * CHUNK], out[2 * CHUNK];
+	unsigned long clipped = 0;
+	for (int pos = 0; pos < count; pos += CHUNK) {
+		int n = count - pos < CHUNK ? count - pos : CHUNK;
+		int16_t *s = samples + 2 * pos;
+		float *x_i = p->x_i + history, *x_q = p->x_q + history, *power = p->power + history;
+		for (int j = 0; j < n; j++) {
+			x_i[j] = s[2*j] / FULL_SCALE;
+			x_q[j] = s[2*j+1] / FULL_SCALE;
+			power[j] = x_i[j] * x_i[j] + x_q[j] * x_q[j];
+		}
+		memset(p->y_i, 0, n * sizeof(float));
+		memset(p->y_q, 0, n * sizeof(float));
+		for (int m = 0; m < p->memory; m++) {
+			add_tap(x_i - m, x_q - m, power - m, p->coef_i + m * p->terms,
+				p->coef_q + m * p->terms, p->terms, p->y_i, p->y_q, n);
+		}
+		for (int j = 0; j < n; j++) {
+			float yi = p->y_i[j] * FULL_SCALE, yq = p->y_q[j] * FULL_SCALE;
+			if (yi > 32767 || yi < -32768 || yq > 32767 || yq < -32768) clipped++;
+			yi = yi > 32767 ? 32767 : yi < -32768 ? -32768 : yi;
+			yq = yq > 32767 ? 32767 : yq < -32768 ? -32768 : yq;
+			s[2*j] = lrintf(yi);
+			s[2*j+1] = lrintf(yq);
+			in[2*j] = x_i[j];
+			in[2*j+1] = x_q[j];
+			out[2*j] = yi / FULL_SCALE;
+			out[2*j+1] = yq / FULL_SCALE;
+		}
+
+		// Both rings hold the same span
+		pthread_mutex_lock(&p->lock);
+		sample_ring_write(&p->tx_in, in, n, p->next_timestamp);
+		sample_ring_write(&p->tx_out, out, n, p->next_timestamp);
+		pthread_mutex_unlock(&p->lock);
+		p->next_timestamp += n;
+
+		memmove(p->x_i, p->x_i + n, history * sizeof(float));
+		memmove(p->x_q, p->x_q + n, history * sizeof(float));
+		memmove(p->power, p->power + n, history * sizeof(float));
+	}
+	if (clipped) atomic_fetch_add(&p->clipped, clipped);
+}
+
+void dpd_push_rx(struct dpd *p, const int16_t *samples, int count, uint64_t timestamp) {
+	float block[2 * CHUNK];
+	pthread_mutex_lock(&p->lock);
+	for (int pos = 0; pos < count; pos += CHUNK) {
+		int n = count - pos < CHUNK ? count - pos : CHUNK;
+		for (int j = 0; j < 2 * n; j++) block[j] = samples[2 * pos + j] / FULL_SCALE;
+		sample_ring_write(&p->rx, block, n, timestamp + pos);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Takes the last capture of RX and the TX samples up to max_lag around
+// it. Returns 0 if the rings do not have them yet
+static int take_capture(struct dpd *p, uint64_t *timestamp) {
+	int ret = 0;
+	pthread_mutex_lock(&p->lock);
+	// The TX samples after the capture may still be in the FIFO
+	const struct sample_ring *tx = &p->tx_in, *rx = &p->rx;
+	uint64_t end = rx->end;
+	if (tx->end < end + p->max_lag) end = tx->end - p->max_lag;
+	uint64_t r0 = end - p->capture;
+	if (tx->end >= p->max_lag + p->capture && end <= rx->end
+	    && r0 >= rx->start && r0 >= p->coef_timestamp + p->max_lag
+	    && r0 >= tx->start + p->max_lag) {
+		int window = p->capture + 2 * p->max_lag;
+		sample_ring_read(&p->rx, p->rx_copy, p->capture, r0);
+		sample_ring_read(&p->tx_in, p->tx_in_copy, window, r0 - p->max_lag);
+		sample_ring_read(&p->tx_out, p->tx_out_copy, window, r0 - p->max_lag);
+		*timestamp = r0;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+// Offset in the TX window of the TX sample that comes back as the first RX
+// sample, from the peak of the cross-correlation. Returns -1 if there is
+// no clear peak
+static int find_delay(struct dpd *p, const double complex *rx, double *fraction) {
+	int window = p->capture + 2 * p->max_lag;
+	double tx_energy = 0, rx_energy = 0;
+	for (int j = 0; j < p->fft_size; j++) {
+		if (j < window) {
+			p->fft_a[j][0] = p->tx_out_copy[2*j];
+			p->fft_a[j][1] = p->tx_out_copy[2*j+1];
+		}
+		else {
+			p->fft_a[j][0] = p->fft_a[j][1] = 0;
+		}
+		if (j < p->capture) {
+			p->fft_b[j][0] = creal(rx[j]);
+			p->fft_b[j][1] = cimag(rx[j]);
+			rx_energy += creal(rx[j]) * creal(rx[j]) + cimag(rx[j]) * cimag(rx[j]);
+		}
+		else {
+			p->fft_b[j][0] = p->fft_b[j][1] = 0;
+		}
+	}
+	fftwf_execute(p->forward_a);
+	fftwf_execute(p->forward_b);
+	for (int j = 0; j < p->fft_size; j++) {
+		// A times the conjugate of B
+		float ar = p->fft_a[j][0], ai = p->fft_a[j][1];
+		float br = p->fft_b[j][0], bi = p->fft_b[j][1];
+		p->fft_a[j][0] = ar * br + ai * bi;
+		p->fft_a[j][1] = ai * br - ar * bi;
+	}
+	fftwf_execute(p->inverse);
+
+	int best = 0;
+	double best_power = -1;
+	for (int s = 0; s <= 2 * p->max_lag; s++) {
+		double c = hypot(p->fft_a[s][0], p->fft_a[s][1]);
+		if (c > best_power) {
+			best_power = c;
+			best = s;
+		}
+	}
+	for (int j = 0; j < p->capture; j++) {
+		float xi = p->tx_out_copy[2 * (best + j)], xq = p->tx_out_copy[2 * (best + j) + 1];
+		tx_energy += xi * xi + xq * xq;
+	}
+	double correlation = best_power / p->fft_size / sqrt(tx_energy * rx_energy);
+	if (!(correlation >= MIN_CORRELATION)) return -1;
+	// Parabolic interpolation of the peak, only for the status
+	*fraction = 0;
+	if (best > 0 && best < 2 * p->max_lag) {
+		double a = hypot(p->fft_a[best - 1][0], p->fft_a[best - 1][1]);
+		double c = hypot(p->fft_a[best + 1][0], p->fft_a[best + 1][1]);
+		double d = a - 2 * best_power + c;
+		if (d < 0) *fraction = 0.5 * (a - c) / d;
+	}
+	return best;
+}
+
+// Power spectral density, averaged over half overlapping segments, with 0 Hz
+// in the middle
+static void psd(struct dpd *p, const double complex *samples, double *out) {
+	int n = p->psd_size;
+	memset(out, 0, n * sizeof(double));
+	for (int pos = 0; pos + n <= p->capture; pos += n / 2) {
+		for (int j = 0; j < n; j++) {
+			p->psd_in[j][0] = p->psd_window[j] * creal(samples[pos + j]);
+			p->psd_in[j][1] = p->psd_window[j] * cimag(samples[pos + j]);
+		}
+		fftwf_execute(p->psd_plan);
+		for (int j = 0; j < n; j++) {
+			const fftwf_complex *z = &p->psd_out[(j + n / 2) % n];
+			out[j] += (*z)[0] * (*z)[0] + (*z)[1] * (*z)[1];
+		}
+	}
+}
+
+// Power of RX in the adjacent channels relative to the channel, which is
+// centred on the TX signal
+static double acpr(struct dpd *p) {
+	int n = p->psd_size;
+	double *tx = p->psd_tx, *rx = p->psd_rx;
+	psd(p, p->u, tx);
+	psd(p, p->y, rx);
+	double sum = 0, weighted = 0;
+	for (int j = 0; j < n; j++) {
+		double f = (j - n / 2) * p->sample_rate / n;
+		sum += tx[j];
+		weighted += f * tx[j];
+	}
+	double center = sum > 0 ? weighted / sum : 0;
+	double main = 0, lower = 0, upper = 0, bw = p->bandwidth;
+	for (int j = 0; j < n; j++) {
+		double f = (j - n / 2) * p->sample_rate / n - center;
+		if (fabs(f) <= bw / 2) main += rx[j];
+		else if (f < 0 && f >= -1.5 * bw) lower += rx[j];
+		else if (f > 0 && f <= 1.5 * bw) upper += rx[j];
+	}
+	return 10 * log10(fmax(lower, upper) / main);
+}
+
+// Solves the Hermitian positive definite system a x = b by Cholesky
+// decomposition, overwriting a and b. Only the lower triangle of a is
+// used. Returns -1 if it is singular
+static int solve(double complex *a, double complex *b, int n) {
+	for (int j = 0; j < n; j++) {
+		double complex d = a[j * n + j];
+		for (int k = 0; k < j; k++) d -= a[j * n + k] * conj(a[j * n + k]);
+		if (!(creal(d) > 0)) return -1;
+		double l = sqrt(creal(d));
+		a[j * n + j] = l;
+		for (int i = j + 1; i < n; i++) {
+			double complex s = a[i * n + j];
+			for (int k = 0; k < j; k++) s -= a[i * n + k] * conj(a[j * n + k]);
+			a[i * n + j] = s / l;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < i; k++) b[i] -= a[i * n + k] * b[k];
+		b[i] /= a[i * n + i];
+	}
+	for (int i = n - 1; i >= 0; i--) {
+		for (int k = i + 1; k < n; k++) b[i] -= conj(a[k * n + i]) * b[k];
+		b[i] /= a[i * n + i];
+	}
+	return 0;
+}
+
+// Least squares fit of the memory polynomial that maps v to x, from the
+// normal equations
+static int fit_inverse(struct dpd *p, const double complex *v, const double complex *x,
+		       double complex *w) {
+	int n = p->coefs;
+	double complex a[n * n], phi[n];
+	memset(a, 0, sizeof(a));
+	memset(w, 0, n * sizeof(*w));
+	for (int j = p->memory - 1; j < p->capture; j++) {
+		for (int m = 0; m < p->memory; m++) {
+			double complex s = v[j - m];
+			double power = creal(s) * creal(s) + cimag(s) * cimag(s);
+			for (int t = 0; t < p->terms; t++) {
+				phi[m * p->terms + t] = s;
+				s *= power;
+			}
+		}
+		for (int r = 0; r < n; r++) {
+			w[r] += conj(phi[r]) * x[j];
+			for (int c = 0; c <= r; c++) a[r * n + c] += conj(phi[r]) * phi[c];
+		}
+	}
+	double trace = 0;
+	for (int r = 0; r < n; r++) trace += creal(a[r * n + r]);
+	for (int r = 0; r < n; r++) a[r * n + r] += REGULARIZATION * trace / n;
+	return solve(a, w, n);
+}
+
+// RMS change of the predistorter output on the capture for a change delta
+// of the coefficients
+static double change(struct dpd *p, const double complex *delta) {
+	double sum = 0;
+	for (int j = p->memory - 1; j < p->capture; j++) {
+		double complex d = 0;
+		for (int m = 0; m < p->memory; m++) {
+			double complex s = p->u[j - m];
+			double power = creal(s) * creal(s) + cimag(s) * cimag(s);
+			for (int t = 0; t < p->terms; t++) {
+				d += delta[m * p->terms + t] * s;
+				s *= power;
+			}
+		}
+		sum += creal(d * conj(d));
+	}
+	return sqrt(sum / p->capture);
+}
+
+// Largest gain of the predistorter with coefficients c for a constant
+// envelope of amplitude up to peak
+static double max_gain(struct dpd *p, const double complex *c, double peak) {
+	double largest = 0;
+	for (int k = 0; k <= GAIN_POINTS; k++) {
+		double power = (peak * k / GAIN_POINTS) * (peak * k / GAIN_POINTS);
+		double complex g = 0;
+		for (int m = 0; m < p->memory; m++) {
+			double complex term = 1;
+			for (int t = 0; t < p->terms; t++) {
+				g += c[m * p->terms + t] * term;
+				term *= power;
+			}
+		}
+		largest = cabs(g) > largest ? cabs(g) : largest;
+	}
+	return largest;
+}
+
+static void update(void *arg) {
+	struct dpd *p = arg;
+	uint64_t timestamp;
+	if (!take_capture(p, &timestamp)) goto skip;
+
+	// RX mixed so that TX is at 0 Hz
+	double cycles = fmod((double) timestamp * (p->rx_offset / p->sample_rate), 1.0);
+	double complex rot = cexp(-2 * M_PI * I * cycles);
+	double complex step = cexp(-2 * M_PI * I * p->rx_offset / p->sample_rate);
+	for (int j = 0; j < p->capture; j++) {
+		p->y[j] = (p->rx_copy[2*j] + I * p->rx_copy[2*j+1]) * rot;
+		rot *= step;
+		if ((j & 1023) == 1023) rot /= cabs(rot);
+	}
+
+	double fraction;
+	int offset = find_delay(p, p->y, &fraction);
+	if (offset < 0) goto skip;
+	double input_power = 0, output_power = 0, input_peak = 0;
+	for (int j = 0; j < p->capture; j++) {
+		int k = offset + j;
+		p->u[j] = p->tx_in_copy[2*k] + I * p->tx_in_copy[2*k+1];
+		p->x[j] = p->tx_out_copy[2*k] + I * p->tx_out_copy[2*k+1];
+		double power = creal(p->u[j] * conj(p->u[j]));
+		input_power += power;
+		input_peak = power > input_peak ? power : input_peak;
+		output_power += creal(p->x[j] * conj(p->x[j]));
+	}
+	input_power /= p->capture;
+	output_power /= p->capture;
+	if (10 * log10(input_power) < MIN_LEVEL) goto skip;
+
+	// Small signal gain of the loop, over the samples under the average
+	// power of the PA input. The linearized loop is to keep it. It is
+	// measured on every capture, as the RX gain or the path can change
+	double complex num = 0;
+	double den = 0;
+	for (int j = 0; j < p->capture; j++) {
+		double power = creal(p->x[j] * conj(p->x[j]));
+		if (power > output_power) continue;
+		num += p->y[j] * conj(p->x[j]);
+		den += power;
+	}
+	if (!(den > 0) || cabs(num) == 0) goto skip;
+	p->gain = num / den;
+
+	double error = 0;
+	for (int j = 0; j < p->capture; j++) {
+		p->y[j] /= p->gain;
+		double complex e = p->y[j] - p->u[j];
+		error += creal(e * conj(e));
+	}
+	double nmse = 10 * log10(error / p->capture / input_power);
+	double acpr_db = acpr(p);
+
+	double complex w[DPD_MAX_COEFS], next[DPD_MAX_COEFS];
+	if (fit_inverse(p, p->y, p->x, w) < 0) goto skip;
+	double complex delta[DPD_MAX_COEFS];
+	pthread_mutex_lock(&p->lock);
+	// A bad fit must not drive the PA into saturation, so the step is
+	// shortened until the gain stays within MAX_GAIN, and if it has to be
+	// too short the coefficients stay as they are
+	double move = STEP;
+	for (;;) {
+		for (int k = 0; k < p->coefs; k++) {
+			next[k] = p->pending[k] + move * (w[k] - p->pending[k]);
+			delta[k] = next[k] - p->pending[k];
+			if (!isfinite(creal(next[k])) || !isfinite(cimag(next[k]))) {
+				pthread_mutex_unlock(&p->lock);
+				goto skip;
+			}
+		}
+		if (move == 0 || max_gain(p, next, sqrt(input_peak)) <= pow(10, MAX_GAIN / 20)) break;
+		move /= 2;
+		if (move < MIN_STEP) move = 0;
+	}
+	if (move < STEP) p->limited++;
+	if (move > 0) {
+		memcpy(p->pending, next, p->coefs * sizeof(*next));
+		atomic_store(&p->updated, 1);
+	}
+	p->nmse = nmse;
+	p->acpr = acpr_db;
+	p->gain_db = 20 * log10(cabs(p->gain));
+	p->delay = p->max_lag - offset - fraction;
+	p->change = change(p, delta) / sqrt(input_power);
+	p->updates++;
+	if (p->log) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		fprintf(p->log, "%.3f,%.2f,%.2f,%.2f,%.2f,%.3e\n", now.tv_sec + 1e-9 * now.tv_nsec, p->nmse,
+			p->acpr, p->gain_db, p->delay, p->change);
+		fflush(p->log);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return;
+
+skip:
+	pthread_mutex_lock(&p->lock);
+	p->skipped++;
+	pthread_mutex_unlock(&p->lock);
+}
+
+int dpd_start(struct dpd *p) {
+	if (p->log) fprintf(p->log, "# time,nmse_db,acpr_db,loop_gain_db,delay_samples,change\n");
+	return idle_worker_start(&p->worker, "DPD", INTERVAL, update, p);
+}
+
+void dpd_print(struct dpd *p) {
+	pthread_mutex_lock(&p->lock);
+	fprintf(stderr, "DPD: NMSE %.1f dB, ACPR %.1f dB, loop gain %.1f dB, delay %.1f samples, "
+		"change %.1e, %lu updates, %lu skipped, %lu limited, %lu clipped\n",
+		p->nmse, p->acpr, p->gain_db, p->delay, p->change, p->updates, p->skipped,
+		p->limited, atomic_load(&p->clipped));
+	pthread_mutex_unlock(&p->lock);
+}
+
+void dpd_stop(struct dpd *p) {
+	idle_worker_stop(&p->worker);
+}
+
+void dpd_free(struct dpd *p) {
+	if (p->forward_a) fftwf_destroy_plan(p->forward_a);
+	if (p->forward_b) fftwf_destroy_plan(p->forward_b);
+	if (p->inverse) fftwf_destroy_plan(p->inverse);
+	if (p->psd_plan) fftwf_destroy_plan(p->psd_plan);
+	fftwf_free(p->fft_a);
+	fftwf_free(p->fft_b);
+	fftwf_free(p->psd_in);
+	fftwf_free(p->psd_out);
+	free(p->psd_window);
+	free(p->psd_tx);
+	free(p->psd_rx);
+	free(p->x_i);
+	free(p->x_q);
+	free(p->power);
+	free(p->y_i);
+	free(p->y_q);
+	sample_ring_free(&p->tx_in);
+	sample_ring_free(&p->tx_out);
+	sample_ring_free(&p->rx);
+	free(p->tx_in_copy);
+	free(p->tx_out_copy);
+	free(p->rx_copy);
+	free(p->u);
+	free(p->x);
+	free(p->y);
+}
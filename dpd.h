@@ -0,0 +1,113 @@
+/*
+  ===========================================================================
+
+  dpd - Adaptive digital predistortion of the TX samples, with a memory
+  polynomial learnt from the TX signal received back in RX.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef DPD_H
+#define DPD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <complex.h>
+
+#include <fftw3.h>
+
+#include "idle_worker.h"
+#include "sample_ring.h"
+
+#define DPD_MAX_ORDER 9 // odd orders only
+#define DPD_MAX_MEMORY 8
+#define DPD_MAX_COEFS ((DPD_MAX_ORDER + 1) / 2 * DPD_MAX_MEMORY)
+
+struct dpd {
+	double sample_rate;
+	int order, memory;
+	int terms; // odd orders up to order
+	int coefs; // terms * memory, coefficient m * terms + t multiplies
+		   // x[n-m] |x[n-m]|^(2t)
+	double bandwidth; // of the channel, for the ACPR
+	double rx_offset; // Hz of the TX frequency in the loopback RX
+	FILE *log;
+
+	// Predistorter, used only by the TX thread. The arrays hold memory - 1
+	// samples of history followed by a chunk
+	float coef_i[DPD_MAX_COEFS], coef_q[DPD_MAX_COEFS];
+	float *x_i, *x_q, *power;
+	float *y_i, *y_q;
+	uint64_t next_timestamp; // of the next TX sample
+	int started;
+	atomic_ulong clipped;
+	atomic_int updated; // there are new coefficients in pending
+
+	// Loopback capture: TX samples before and after the predistorter, and
+	// RX samples, in rings indexed by the device timestamp and normalized to
+	// full scale. Protected by lock
+	struct sample_ring tx_in, tx_out, rx;
+	// First TX sample with the coefficients in use, protected by lock
+	uint64_t coef_timestamp;
+
+	// Used only by the worker thread
+	int capture, max_lag;
+	float *tx_in_copy, *tx_out_copy, *rx_copy; // taken from the rings
+	double complex *u, *x, *y; // aligned capture: input, output and RX
+	int fft_size;
+	fftwf_complex *fft_a, *fft_b;
+	fftwf_plan forward_a, forward_b, inverse;
+	int psd_size;
+	float *psd_window;
+	fftwf_complex *psd_in, *psd_out;
+	fftwf_plan psd_plan;
+	double *psd_tx, *psd_rx; // of the capture, for the ACPR
+	double complex fit[DPD_MAX_COEFS];
+	double complex gain; // of the loop, from the small signal samples
+
+	struct idle_worker worker;
+	pthread_mutex_t lock;
+	// Protected by lock
+	double complex pending[DPD_MAX_COEFS];
+	double nmse, acpr; // dB, of the last capture
+	double gain_db, delay; // of the loop, delay in samples
+	double change; // RMS change of the output in the last update, relative to the input
+	unsigned long updates, skipped;
+	unsigned long limited; // updates whose step was shortened by the gain limit
+};
+
+// order is the highest odd order of the polynomial and memory the number
+// of taps. bandwidth is that of the signal, for the ACPR measurements,
+// and rx_offset the frequency of TX in the loopback RX. If log is not
+// NULL a line with the measurements is written to it after each update
+int dpd_init(struct dpd *p, double sample_rate, int order, int memory, double bandwidth,
+	     double rx_offset, FILE *log);
+int dpd_start(struct dpd *p);
+// Predistorts count interleaved int16 IQ samples in place. timestamp is
+// the device timestamp of the first one. If it is estimated, it is only
+// followed when it is far from the end of the previous samples
+void dpd_process(struct dpd *p, int16_t *samples, int count, uint64_t timestamp, int estimated);
+// Takes count RX samples of the loopback with their device timestamp
+void dpd_push_rx(struct dpd *p, const int16_t *samples, int count, uint64_t timestamp);
+void dpd_print(struct dpd *p);
+void dpd_stop(struct dpd *p);
+void dpd_free(struct dpd *p);
+
+#endif
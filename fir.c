@@ -0,0 +1,139 @@
+/*
+  ===========================================================================
+
+  fir - FIR filter design and the vectorized inner product used to run the
+  filters.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  fir_dot() uses the GCC vector extensions with FIR_VECTOR partial sums, so
+  that it does not depend on -ffast-math to be vectorized. It has only been
+  built and measured on x86, where they become SSE or AVX. The ARM build is
+  untested.
+
+  ===========================================================================
+*/
+
+#include <string.h>
+#include <math.h>
+
+#include "fir.h"
+
+typedef float vfloat __attribute__((vector_size(FIR_VECTOR * sizeof(float))));
+
+int fir_padded(int n) {
+	return (n + FIR_VECTOR - 1) / FIR_VECTOR * FIR_VECTOR;
+}
+
+double fir_kaiser_beta(double attenuation) {
+	if (attenuation > 50) return 0.1102 * (attenuation - 8.7);
+	if (attenuation > 21) return 0.5842 * pow(attenuation - 21, 0.4)
+				      + 0.07886 * (attenuation - 21);
+	return 0;
+}
+
+int fir_kaiser_taps(double attenuation, double transition) {
+	return ceil((attenuation - 8) / (2.285 * 2 * M_PI * transition)) + 1;
+}
+
+long fir_gcd(long a, long b) {
+	while (b) {
+		long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < 1e-12 * sum) break;
+	}
+	return sum;
+}
+
+void fir_lowpass(float *h, int n, double cutoff, double beta) {
+	double sum = 0;
+	for (int j = 0; j < n; j++) {
+		double t = j - (n - 1) / 2.0;
+		double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+		double r = n > 1 ? 2.0 * j / (n - 1) - 1 : 0;
+		double tap = sinc * bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+		h[j] = tap;
+		sum += tap;
+	}
+	for (int j = 0; j < n; j++) h[j] /= sum;
+}
+
+void fir_blackman_harris(float *w, int n) {
+	for (int j = 0; j < n; j++) {
+		double x = 2 * M_PI * j / n;
+		w[j] = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x);
+	}
+}
+
+// Pairwise, which is shorter than a chain of additions for short filters
+static float sum_lanes(const vfloat *acc) {
+	vfloat v = *acc;
+	for (int w = FIR_VECTOR / 2; w > 0; w /= 2) {
+		for (int j = 0; j < w; j++) v[j] += v[j + w];
+	}
+	return v[0];
+}
+
+float fir_dot(const float *a, const float *b, int n) {
+	vfloat acc = {0};
+	for (int j = 0; j < n; j += FIR_VECTOR) {
+		vfloat va, vb;
+		memcpy(&va, a + j, sizeof(va));
+		memcpy(&vb, b + j, sizeof(vb));
+		acc += va * vb;
+	}
+	return sum_lanes(&acc);
+}
+
+void fir_dot_complex(const float *a_i, const float *a_q, const float *b_i, const float *b_q,
+		     int n, float *i, float *q) {
+	vfloat acc_i = {0}, acc_q = {0};
+	for (int j = 0; j < n; j += FIR_VECTOR) {
+		vfloat vai, vaq, vbi, vbq;
+		memcpy(&vai, a_i + j, sizeof(vai));
+		memcpy(&vaq, a_q + j, sizeof(vaq));
+		memcpy(&vbi, b_i + j, sizeof(vbi));
+		memcpy(&vbq, b_q + j, sizeof(vbq));
+		acc_i += vai * vbi - vaq * vbq;
+		acc_q += vai * vbq + vaq * vbi;
+	}
+	*i = sum_lanes(&acc_i);
+	*q = sum_lanes(&acc_q);
+}
+
+void fir_polyphase(const float *h, const float *x, int n, int branches, float *out) {
+	// The partial sums of FIR_VECTOR branches stay in registers
+	for (int q = 0; q < branches; q += FIR_VECTOR) {
+		vfloat acc = {0};
+		for (int j = q; j < n; j += branches) {
+			vfloat vh, vx;
+			memcpy(&vh, h + j, sizeof(vh));
+			memcpy(&vx, x + j, sizeof(vx));
+			acc += vh * vx;
+		}
+		memcpy(out + q, &acc, sizeof(acc));
+	}
+}
@@ -0,0 +1,56 @@
+/*
+  ===========================================================================
+
+  fir - FIR filter design and the vectorized inner product used to run the
+  filters.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef FIR_H
+#define FIR_H
+
+// Filter lengths passed to fir_dot() must be a multiple of this
+#define FIR_VECTOR 8
+
+// Rounds n up to a multiple of FIR_VECTOR
+int fir_padded(int n);
+// Kaiser window beta for a stopband attenuation in dB
+double fir_kaiser_beta(double attenuation);
+// Kaiser window length for a stopband attenuation in dB and a transition
+// width given as a fraction of the sample rate
+int fir_kaiser_taps(double attenuation, double transition);
+// Greatest common divisor, for the ratios of rational resamplers
+long fir_gcd(long a, long b);
+// Windowed sinc lowpass with unity DC gain. cutoff is the -6 dB
+// frequency as a fraction of the sample rate
+void fir_lowpass(float *h, int n, double cutoff, double beta);
+// 4 term Blackman-Harris window of n points, periodic for FFTs, with
+// sidelobes 92 dB down
+void fir_blackman_harris(float *w, int n);
+// Sum of a[j] * b[j]. n must be a multiple of FIR_VECTOR
+float fir_dot(const float *a, const float *b, int n);
+// Complex dot product of (a_i + j a_q) and (b_i + j b_q), without
+// conjugation. n must be a multiple of FIR_VECTOR
+void fir_dot_complex(const float *a_i, const float *a_q, const float *b_i, const float *b_q,
+		     int n, float *i, float *q);
+// Sums of h[j] * x[j] over the j that are equal modulo branches, which
+// must be a multiple of FIR_VECTOR, as well as n
+void fir_polyphase(const float *h, const float *x, int n, int branches, float *out);
+
+#endif
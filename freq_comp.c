@@ -0,0 +1,447 @@
+/*
+  ===========================================================================
+
+  freq_comp - Frequency pre-compensation of the LimeSDR reference drift,
+  from a model of the frequency error against the chip temperature that is
+  learnt on the beacon.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The reference of the LimeSDR drifts with its temperature, and the error
+  in ppm is the same for all the LOs and NCOs derived from it. Every few
+  seconds a thread at idle priority reads the chip temperature and, if
+  there is a beacon, measures its frequency on the samples that the feed
+  thread has mixed to 0 Hz and decimated. The error found is averaged in
+  a temperature bin, and a polynomial fitted to the bins gives the error
+  at the current temperature, which is cancelled by retuning the NCOs.
+  Writing the NCO frequency does not stop the streams, so the correction
+  follows the temperature in small steps while they keep running.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "freq_comp.h"
+#include "fir.h"
+
+#define INTERVAL 10 // seconds between updates
+#define MIN_TEMP (-40.0) // C, of the first bin
+#define BIN_WIDTH 0.5 // C
+#define MAX_WEIGHT 30 // measurements averaged in a bin, so that it can follow aging
+#define QUADRATIC_SPAN 5.0 // C of data needed to fit a quadratic
+#define LINEAR_SPAN 1.0 // C of data needed to fit a line
+#define MIN_STEP 1.0 // Hz, smaller corrections are not applied
+#define SETTLE 1.0 // seconds of beacon samples dropped after a correction
+#define BOXCAR_RATE 16e3 // Hz, approximately
+#define BEACON_BANDWIDTH 3e3 // Hz
+#define FILTER_TAPS 64
+#define FILTER_ATTENUATION 60.0 // dB
+#define FILTER_DECIM 4
+#define MIN_COHERENCE 0.5
+
+static double bin_temp(int k) {
+	return MIN_TEMP + (k + 0.5) * BIN_WIDTH;
+}
+
+static int temp_bin(double temp) {
+	double k = floor((temp - MIN_TEMP) / BIN_WIDTH);
+	return k >= 0 && k < FREQ_COMP_BINS ? (int) k : -1;
+}
+
+// Solves the n x n system a x = b in place, by Gaussian elimination
+static int solve(double a[3][3], double *b, int n) {
+	for (int c = 0; c < n; c++) {
+		int p = c;
+		for (int r = c + 1; r < n; r++) {
+			if (fabs(a[r][c]) > fabs(a[p][c])) p = r;
+		}
+		if (fabs(a[p][c]) < 1e-12) return -1;
+		for (int k = 0; k < n; k++) {
+			double t = a[c][k]; a[c][k] = a[p][k]; a[p][k] = t;
+		}
+		double t = b[c]; b[c] = b[p]; b[p] = t;
+		for (int r = c + 1; r < n; r++) {
+			double f = a[r][c] / a[c][c];
+			for (int k = c; k < n; k++) a[r][k] -= f * a[c][k];
+			b[r] -= f * b[c];
+		}
+	}
+	for (int c = n - 1; c >= 0; c--) {
+		for (int k = c + 1; k < n; k++) b[c] -= a[c][k] * b[k];
+		b[c] /= a[c][c];
+	}
+	return 0;
+}
+
+// Weighted least squares fit of the bins. The degree grows with the
+// temperature range seen, since a quadratic over a few degrees is mostly
+// noise
+static void fit(struct freq_comp *fc) {
+	double weight = 0, sum = 0;
+	int bins = 0;
+	fc->min_temp = INFINITY;
+	fc->max_temp = -INFINITY;
+	for (int k = 0; k < FREQ_COMP_BINS; k++) {
+		if (fc->bin_weight[k] <= 0) continue;
+		double t = bin_temp(k);
+		weight += fc->bin_weight[k];
+		sum += fc->bin_weight[k] * t;
+		bins++;
+		if (t < fc->min_temp) fc->min_temp = t;
+		if (t > fc->max_temp) fc->max_temp = t;
+	}
+	if (!bins) {
+		fc->degree = -1;
+		return;
+	}
+	fc->center = sum / weight;
+	double span = fc->max_temp - fc->min_temp;
+	int degree = bins >= 3 && span >= QUADRATIC_SPAN ? 2 : bins >= 2 && span >= LINEAR_SPAN;
+
+	for (; degree >= 0; degree--) {
+		double a[3][3] = {{0}}, b[3] = {0};
+		for (int k = 0; k < FREQ_COMP_BINS; k++) {
+			double w = fc->bin_weight[k];
+			if (w <= 0) continue;
+			double x = bin_temp(k) - fc->center;
+			double p[3] = {1, x, x * x};
+			for (int r = 0; r <= degree; r++) {
+				for (int c = 0; c <= degree; c++) a[r][c] += w * p[r] * p[c];
+				b[r] += w * p[r] * fc->bin_ppm[k];
+			}
+		}
+		if (solve(a, b, degree + 1) == 0) {
+			memset(fc->coef, 0, sizeof(fc->coef));
+			memcpy(fc->coef, b, (degree + 1) * sizeof(double));
+			fc->degree = degree;
+			return;
+		}
+	}
+	fc->degree = -1;
+}
+
+// Error in ppm at temp. Outside the range with data the model holds the
+// value at the nearest end instead of extrapolating
+static double model(struct freq_comp *fc, double temp) {
+	if (fc->degree < 0) return 0;
+	if (temp < fc->min_temp) temp = fc->min_temp;
+	if (temp > fc->max_temp) temp = fc->max_temp;
+	double x = temp - fc->center;
+	return fc->coef[0] + fc->coef[1] * x + fc->coef[2] * x * x;
+}
+
+static void learn(struct freq_comp *fc, double temp, double ppm) {
+	int k = temp_bin(temp);
+	if (k < 0) return;
+	double n = fc->bin_weight[k] + 1;
+	if (n > MAX_WEIGHT) n = MAX_WEIGHT;
+	fc->bin_ppm[k] += (ppm - fc->bin_ppm[k]) / n;
+	fc->bin_weight[k] = n;
+}
+
+static int load_model(struct freq_comp *fc) {
+	FILE *f = fopen(fc->model_path, "r");
+	if (!f) {
+		if (errno == ENOENT) return 0;
+		perror("Could not open frequency model");
+		return -1;
+	}
+	char line[256];
+	int points = 0;
+	while (fgets(line, sizeof(line), f)) {
+		double temp, weight, ppm;
+		if (line[0] == '#' || sscanf(line, "%lf,%lf,%lf", &temp, &weight, &ppm) != 3) continue;
+		int k = temp_bin(temp);
+		if (k < 0 || weight <= 0) continue;
+		fc->bin_ppm[k] = ppm;
+		fc->bin_weight[k] = weight > MAX_WEIGHT ? MAX_WEIGHT : weight;
+		points++;
+	}
+	fclose(f);
+	fit(fc);
+	fprintf(stderr, "Frequency model: %d points from %s\n", points, fc->model_path);
+	return 0;
+}
+
+// Replaces the file in one step, so that it is never left half written
+static void save_model(struct freq_comp *fc) {
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fc->model_path);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		perror("Could not write frequency model");
+		return;
+	}
+	fprintf(f, "# temperature_c,weight,error_ppm\n");
+	for (int k = 0; k < FREQ_COMP_BINS; k++) {
+		if (fc->bin_weight[k] <= 0) continue;
+		fprintf(f, "%.2f,%.0f,%.6f\n", bin_temp(k), fc->bin_weight[k], fc->bin_ppm[k]);
+	}
+	if (fclose(f) != 0 || rename(tmp, fc->model_path) < 0) {
+		perror("Could not write frequency model");
+	}
+}
+
+int freq_comp_init(struct freq_comp *fc, const char *model_path, double sample_rate,
+		   int max_block, double beacon_offset, int bpsk) {
+	memset(fc, 0, sizeof(*fc));
+	fc->degree = -1;
+	fc->model_path = strdup(model_path);
+	pthread_mutex_init(&fc->lock, NULL);
+	fc->residual = fc->coherence = NAN;
+	fc->temperature = fc->last_temp = NAN;
+	if (!fc->model_path || load_model(fc) < 0) return -1;
+
+	if (isnan(beacon_offset)) return 0;
+	fc->use_beacon = 1;
+	fc->bpsk = bpsk;
+	fc->decim = round(sample_rate / BOXCAR_RATE);
+	if (fc->decim < 1) fc->decim = 1;
+	fc->rate = sample_rate / fc->decim;
+	// Enough for the thread to be one interval late
+	fc->max_window = 2 * INTERVAL * fc->rate;
+	fc->filter_taps = FILTER_TAPS;
+	fc->rot_i = malloc(max_block * sizeof(float));
+	fc->rot_q = malloc(max_block * sizeof(float));
+	fc->block = malloc(2 * (max_block / fc->decim + 1) * sizeof(float));
+	fc->window = malloc(2 * fc->max_window * sizeof(float));
+	fc->spare = malloc(2 * fc->max_window * sizeof(float));
+	fc->work_i = malloc(fc->max_window * sizeof(float));
+	fc->work_q = malloc(fc->max_window * sizeof(float));
+	fc->filter = malloc(fc->filter_taps * sizeof(float));
+	if (!fc->rot_i || !fc->rot_q || !fc->block || !fc->window || !fc->spare
+	    || !fc->work_i || !fc->work_q || !fc->filter) {
+		fprintf(stderr, "Could not allocate frequency compensation buffers\n");
+		return -1;
+	}
+	fc->rot_step = -2 * M_PI * beacon_offset / sample_rate;
+	for (int j = 0; j < max_block; j++) {
+		fc->rot_i[j] = cos(fc->rot_step * j);
+		fc->rot_q[j] = sin(fc->rot_step * j);
+	}
+	fir_lowpass(fc->filter, fc->filter_taps, BEACON_BANDWIDTH / 2 / fc->rate,
+		    fir_kaiser_beta(FILTER_ATTENUATION));
+	return 0;
+}
+
+int freq_comp_add(struct freq_comp *fc, lms_device_t *device, int is_tx,
+		  unsigned int channel, double tune, double if_freq) {
+	if (fc->output_count == FREQ_COMP_MAX_OUTPUTS || (!fc->output_count && is_tx)) {
+		fprintf(stderr, "Invalid frequency compensation channel\n");
+		return -1;
+	}
+	fc->outputs[fc->output_count++] = (struct freq_comp_output) {
+		.device = device,
+		.is_tx = is_tx,
+		.channel = channel,
+		.tune = tune,
+		.if_freq = if_freq
+	};
+	return 0;
+}
+
+// shift is added to the LO frequency. The NCO only takes positive
+// frequencies, so the sign is in the conversion direction
+static int set_nco(struct freq_comp_output *o, double shift) {
+	float_type nco_freqs[16] = {fabs(shift), 0};
+	if (LMS_SetNCOFrequency(o->device, o->is_tx, o->channel, nco_freqs, 0.0) < 0) {
+		fprintf(stderr, "LMS_SetNCOFrequency() : %s\n", LMS_GetLastErrorMessage());
+		return -1;
+	}
+	int downconvert = o->is_tx ? shift < 0 : shift >= 0;
+	if (LMS_SetNCOIndex(o->device, o->is_tx, o->channel, 0, downconvert) < 0) {
+		fprintf(stderr, "LMS_SetNCOIndex() : %s\n", LMS_GetLastErrorMessage());
+		return -1;
+	}
+	return 0;
+}
+
+static void apply(struct freq_comp *fc, double ppm) {
+	int changed = 0;
+	for (int k = 0; k < fc->output_count; k++) {
+		struct freq_comp_output *o = &fc->outputs[k];
+		double correction = -1e-6 * ppm * o->tune;
+		if (fabs(correction - o->correction) < MIN_STEP) continue;
+		if (set_nco(o, o->if_freq + correction) < 0) continue;
+		pthread_mutex_lock(&fc->lock);
+		o->correction = correction;
+		pthread_mutex_unlock(&fc->lock);
+		changed |= k == 0;
+	}
+	if (changed && fc->use_beacon) {
+		// The samples in flight were taken with the old correction
+		pthread_mutex_lock(&fc->lock);
+		fc->window_count = 0;
+		fc->discard = SETTLE * fc->rate;
+		pthread_mutex_unlock(&fc->lock);
+	}
+}
+
+// Frequency of the beacon relative to its nominal frequency, from the
+// phase advance between samples (Kay's estimator)
+static int measure(struct freq_comp *fc, const float *window, int count,
+		   double *residual, double *coherence) {
+	for (int j = 0; j < count; j++) {
+		fc->work_i[j] = window[2*j];
+		fc->work_q[j] = window[2*j+1];
+	}
+	double acc_i = 0, acc_q = 0, power = 0;
+	float last_i = 0, last_q = 0;
+	int outputs = 0;
+	for (int j = 0; j + fc->filter_taps <= count; j += FILTER_DECIM, outputs++) {
+		float zi = fir_dot(fc->filter, fc->work_i + j, fc->filter_taps);
+		float zq = fir_dot(fc->filter, fc->work_q + j, fc->filter_taps);
+		if (fc->bpsk) {
+			// Squaring removes the modulation and doubles the frequency
+			float t = zi * zi - zq * zq;
+			zq = 2 * zi * zq;
+			zi = t;
+		}
+		if (outputs) {
+			acc_i += zi * last_i + zq * last_q;
+			acc_q += zq * last_i - zi * last_q;
+			power += zi * zi + zq * zq;
+		}
+		last_i = zi;
+		last_q = zq;
+	}
+	if (outputs < 16 || power <= 0) return 0;
+	*coherence = hypot(acc_i, acc_q) / power;
+	*residual = atan2(acc_q, acc_i) * fc->rate / FILTER_DECIM / (2 * M_PI)
+		/ (fc->bpsk ? 2 : 1);
+	return 1;
+}
+
+static void update(struct freq_comp *fc, const float *window, int count) {
+	float_type temp;
+	if (LMS_GetChipTemperature(fc->outputs[0].device, 0, &temp) < 0) {
+		fprintf(stderr, "LMS_GetChipTemperature() : %s\n", LMS_GetLastErrorMessage());
+		return;
+	}
+	double residual = NAN, coherence = NAN;
+	int measured = fc->use_beacon && measure(fc, window, count, &residual, &coherence);
+	if (measured && coherence >= MIN_COHERENCE) {
+		// The beacon is moved by the reference error plus the correction.
+		// The window spans the time since the previous update
+		struct freq_comp_output *o = &fc->outputs[0];
+		double window_temp = isnan(fc->last_temp) ? temp : (temp + fc->last_temp) / 2;
+		learn(fc, window_temp, 1e6 * (-residual - o->correction) / o->tune);
+		fit(fc);
+		save_model(fc);
+	}
+	fc->last_temp = temp;
+	double ppm = model(fc, temp);
+	pthread_mutex_lock(&fc->lock);
+	fc->temperature = temp;
+	fc->model_ppm = ppm;
+	if (measured) {
+		fc->residual = residual;
+		fc->coherence = coherence;
+		fc->measurements += coherence >= MIN_COHERENCE;
+	}
+	pthread_mutex_unlock(&fc->lock);
+	apply(fc, ppm);
+}
+
+static void run(void *arg) {
+	struct freq_comp *fc = arg;
+	pthread_mutex_lock(&fc->lock);
+	float *window = fc->window;
+	int count = fc->window_count;
+	fc->window = fc->spare;
+	fc->spare = window;
+	fc->window_count = 0;
+	pthread_mutex_unlock(&fc->lock);
+	update(fc, window, count);
+}
+
+int freq_comp_start(struct freq_comp *fc) {
+	if (!fc->output_count) {
+		fprintf(stderr, "No channels for frequency compensation\n");
+		return -1;
+	}
+	update(fc, NULL, 0);
+	return idle_worker_start(&fc->worker, "frequency compensation", INTERVAL, run, fc);
+}
+
+void freq_comp_process(struct freq_comp *fc, const int16_t *samples, int count) {
+	if (!fc->use_beacon) return;
+	float pc = cos(fc->rot_phase), ps = sin(fc->rot_phase);
+	float acc_i = fc->acc_i, acc_q = fc->acc_q;
+	int acc_count = fc->acc_count, outputs = 0;
+	for (int j = 0; j < count; j++) {
+		float c = pc * fc->rot_i[j] - ps * fc->rot_q[j];
+		float s = pc * fc->rot_q[j] + ps * fc->rot_i[j];
+		float xi = samples[2*j], xq = samples[2*j+1];
+		acc_i += xi * c - xq * s;
+		acc_q += xi * s + xq * c;
+		if (++acc_count == fc->decim) {
+			fc->block[2*outputs] = acc_i;
+			fc->block[2*outputs+1] = acc_q;
+			outputs++;
+			acc_i = acc_q = 0;
+			acc_count = 0;
+		}
+	}
+	fc->acc_i = acc_i;
+	fc->acc_q = acc_q;
+	fc->acc_count = acc_count;
+	fc->rot_phase = fmod(fc->rot_phase + fc->rot_step * count, 2 * M_PI);
+
+	pthread_mutex_lock(&fc->lock);
+	int skip = outputs < fc->discard ? outputs : fc->discard;
+	fc->discard -= skip;
+	int n = outputs - skip;
+	if (n > fc->max_window - fc->window_count) n = fc->max_window - fc->window_count;
+	memcpy(fc->window + 2 * fc->window_count, fc->block + 2 * skip, 2 * n * sizeof(float));
+	fc->window_count += n;
+	pthread_mutex_unlock(&fc->lock);
+}
+
+void freq_comp_print(struct freq_comp *fc) {
+	pthread_mutex_lock(&fc->lock);
+	fprintf(stderr, "Frequency: %.1f C, model = %+.3f ppm, RX correction = %+.1f Hz",
+		fc->temperature, fc->model_ppm, fc->outputs[0].correction);
+	if (fc->use_beacon) {
+		fprintf(stderr, ", beacon = %+.1f Hz (coherence %.2f, %lu measurements)",
+			fc->residual, fc->coherence, fc->measurements);
+	}
+	fprintf(stderr, "\n");
+	pthread_mutex_unlock(&fc->lock);
+}
+
+void freq_comp_stop(struct freq_comp *fc) {
+	idle_worker_stop(&fc->worker);
+}
+
+void freq_comp_free(struct freq_comp *fc) {
+	free(fc->model_path);
+	free(fc->rot_i);
+	free(fc->rot_q);
+	free(fc->block);
+	free(fc->window);
+	free(fc->spare);
+	free(fc->work_i);
+	free(fc->work_q);
+	free(fc->filter);
+	pthread_mutex_destroy(&fc->lock);
+}
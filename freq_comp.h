@@ -0,0 +1,107 @@
+/*
+  ===========================================================================
+
+  freq_comp - Frequency pre-compensation of the LimeSDR reference drift,
+  from a model of the frequency error against the chip temperature that is
+  learnt on the beacon.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef FREQ_COMP_H
+#define FREQ_COMP_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <lime/LimeSuite.h>
+
+#include "idle_worker.h"
+
+#define FREQ_COMP_MAX_OUTPUTS 16
+#define FREQ_COMP_BINS 280 // of the temperature model
+
+// A channel whose NCO is corrected
+struct freq_comp_output {
+	lms_device_t *device;
+	int is_tx;
+	unsigned int channel;
+	double tune; // Hz of the LimeSDR LO plus NCO
+	double if_freq; // NCO frequency without correction
+	double correction; // Hz applied
+};
+
+struct freq_comp {
+	char *model_path;
+	int output_count;
+	struct freq_comp_output outputs[FREQ_COMP_MAX_OUTPUTS];
+
+	// Model: mean error in ppm and its weight, for each temperature bin,
+	// and the polynomial fitted to them around center
+	double bin_ppm[FREQ_COMP_BINS], bin_weight[FREQ_COMP_BINS];
+	int degree; // -1 while there is no data
+	double center, coef[3];
+	double min_temp, max_temp; // range with data
+	double last_temp; // of the previous update
+
+	// Beacon, mixed to 0 Hz and decimated in the feed thread by boxcar
+	// sums of decim samples
+	int use_beacon, bpsk;
+	int decim;
+	double rate; // after the boxcar
+	float *rot_i, *rot_q; // exp(-j w k) for the samples of a block
+	double rot_step, rot_phase;
+	float acc_i, acc_q;
+	int acc_count;
+	int discard; // boxcar outputs still to drop after a correction
+	float *window, *spare; // interleaved boxcar outputs
+	int window_count, max_window;
+	float *block; // boxcar outputs of a block
+	float *filter; // lowpass before the estimator, reversed
+	int filter_taps;
+	float *work_i, *work_q;
+
+	// Status, protected by lock
+	double temperature, model_ppm;
+	double residual, coherence; // of the last beacon measurement
+	unsigned long measurements;
+
+	struct idle_worker worker;
+	pthread_mutex_t lock;
+};
+
+// model_path is read if it exists, and rewritten as the model learns.
+// beacon_offset is the frequency of the beacon relative to the RX
+// frequency, or NAN to only apply the model. bpsk selects a BPSK beacon
+// instead of a carrier
+int freq_comp_init(struct freq_comp *fc, const char *model_path, double sample_rate,
+		   int max_block, double beacon_offset, int bpsk);
+// Adds a channel to correct. The beacon is measured on the first one,
+// which must be RX, and the temperature is read from its device
+int freq_comp_add(struct freq_comp *fc, lms_device_t *device, int is_tx,
+		  unsigned int channel, double tune, double if_freq);
+// Applies the model for the current temperature and starts the thread
+// that keeps it up to date
+int freq_comp_start(struct freq_comp *fc);
+// Takes count samples, up to max_block, of the first channel
+void freq_comp_process(struct freq_comp *fc, const int16_t *samples, int count);
+void freq_comp_print(struct freq_comp *fc);
+void freq_comp_stop(struct freq_comp *fc);
+void freq_comp_free(struct freq_comp *fc);
+
+#endif
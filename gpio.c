@@ -0,0 +1,120 @@
+/*
+  ===========================================================================
+
+  gpio - PTT GPIO access through the GPIO character device or through
+  a sysfs-style value file.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/gpio.h>
+
+#include "gpio.h"
+
+int gpio_open_chardev(struct gpio *g, const char *chip, unsigned int line, int value) {
+	int chip_fd = open(chip, O_RDONLY | O_CLOEXEC);
+	if (chip_fd < 0) return -1;
+
+	struct gpiohandle_request req;
+	memset(&req, 0, sizeof(req));
+	req.lineoffsets[0] = line;
+	req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+	req.default_values[0] = value ? 1 : 0;
+	req.lines = 1;
+	strncpy(req.consumer_label, "qo100-ptt", sizeof(req.consumer_label) - 1);
+
+	int ret = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+	int saved_errno = errno;
+	close(chip_fd);
+	if (ret < 0) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	g->fd = req.fd;
+	g->is_chardev = 1;
+	return 0;
+}
+
+int gpio_open_file(struct gpio *g, const char *path) {
+	g->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (g->fd < 0) return -1;
+	g->is_chardev = 0;
+	return 0;
+}
+
+int gpio_file_watch_edges(const char *path) {
+	char *copy = strdup(path);
+	if (!copy) return -1;
+	char edge[4096];
+	snprintf(edge, sizeof(edge), "%s/edge", dirname(copy));
+	free(copy);
+	int fd = open(edge, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) return errno == ENOENT ? 0 : -1;
+	int ret = write(fd, "both\n", 5) == 5 ? 0 : -1;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+int gpio_set(struct gpio *g, int value) {
+	if (g->is_chardev) {
+		struct gpiohandle_data data;
+		memset(&data, 0, sizeof(data));
+		data.values[0] = value ? 1 : 0;
+		return ioctl(g->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+	}
+
+	// Rewind and truncate so that a regular file standing in for sysfs
+	// always contains just the current value
+	const char *s = value ? "1\n" : "0\n";
+	if (pwrite(g->fd, s, 2, 0) != 2) return -1;
+	if (ftruncate(g->fd, 2) < 0 && errno != EINVAL) return -1;
+	return 0;
+}
+
+int gpio_get(struct gpio *g, int *value) {
+	if (g->is_chardev) {
+		struct gpiohandle_data data;
+		memset(&data, 0, sizeof(data));
+		if (ioctl(g->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0) return -1;
+		*value = data.values[0];
+		return 0;
+	}
+
+	char c;
+	if (pread(g->fd, &c, 1, 0) != 1) return -1;
+	*value = c != '0';
+	return 0;
+}
+
+void gpio_close(struct gpio *g) {
+	if (g->fd >= 0) close(g->fd);
+	g->fd = -1;
+}
@@ -0,0 +1,46 @@
+/*
+  ===========================================================================
+
+  gpio - PTT GPIO access through the GPIO character device or through
+  a sysfs-style value file.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef GPIO_H
+#define GPIO_H
+
+struct gpio {
+	int fd;
+	int is_chardev;
+};
+
+// Requests a line of a GPIO chip (/dev/gpiochipN) as an output
+int gpio_open_chardev(struct gpio *g, const char *chip, unsigned int line, int value);
+// Uses a sysfs value file (/sys/class/gpio/gpioN/value), or any regular
+// file standing in for it
+int gpio_open_file(struct gpio *g, const char *path);
+// Sets the "edge" attribute next to a sysfs value file to both, so that
+// value changes are notified. Succeeds if there is no such attribute, as
+// for a regular file standing in for sysfs
+int gpio_file_watch_edges(const char *path);
+int gpio_set(struct gpio *g, int value);
+int gpio_get(struct gpio *g, int *value);
+void gpio_close(struct gpio *g);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+  ===========================================================================
+
+  idle_worker - Thread at idle priority that runs a function at a fixed
+  interval, for the measurements that can wait for the streaming threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "idle_worker.h"
+
+static void *idle_worker_thread(void *arg) {
+	struct idle_worker *w = arg;
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		t.tv_sec += w->interval;
+		while (!w->stop && pthread_cond_timedwait(&w->wake, &w->lock, &t) != ETIMEDOUT);
+		if (w->stop) break;
+		pthread_mutex_unlock(&w->lock);
+		w->run(w->arg);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+int idle_worker_start(struct idle_worker *w, const char *name, int interval,
+		      void (*run)(void *arg), void *arg) {
+	memset(w, 0, sizeof(*w));
+	w->run = run;
+	w->arg = arg;
+	w->interval = interval;
+	w->name = name;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&w->thread, NULL, idle_worker_thread, w) != 0) {
+		fprintf(stderr, "Could not create %s thread\n", name);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+		return -1;
+	}
+	return 0;
+}
+
+void idle_worker_stop(struct idle_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->wake);
+}
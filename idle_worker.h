@@ -0,0 +1,49 @@
+/*
+  ===========================================================================
+
+  idle_worker - Thread at idle priority that runs a function at a fixed
+  interval, for the measurements that can wait for the streaming threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef IDLE_WORKER_H
+#define IDLE_WORKER_H
+
+#include <pthread.h>
+
+struct idle_worker {
+	void (*run)(void *arg);
+	void *arg;
+	int interval; // s
+	const char *name;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int stop;
+	pthread_t thread;
+};
+
+// Calls run(arg) every interval seconds, the first time one interval
+// after the start
+int idle_worker_start(struct idle_worker *w, const char *name, int interval,
+		      void (*run)(void *arg), void *arg);
+// Waits for the current run to finish
+void idle_worker_stop(struct idle_worker *w);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+  ===========================================================================
+
+  iq_bus - Ring of IQ sample blocks in POSIX shared memory, written by the
+  streamer and read without copies by any number of local processes.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The writer never waits for the readers, which only map the memory read
+  only. Each slot is a seqlock: its sequence number is odd while the
+  writer fills it, and even and tied to the block number once it is
+  complete. A reader checks the sequence number before and after using
+  the samples, so it knows if the writer came round the ring and
+  overwrote them in the meantime. The cursor counts the published blocks,
+  and a futex next to it lets the readers sleep until there is a new one.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "iq_bus.h"
+
+#define HEADER_SIZE 4096
+#define SLOT_ALIGN 64
+
+static struct iq_bus_slot *slot(struct iq_bus_header *h, uint64_t block) {
+	return (struct iq_bus_slot *) ((char *) h + h->header_size
+				       + (size_t) (block & (h->slots - 1)) * h->slot_size);
+}
+
+int iq_bus_create(struct iq_bus *b, const char *name, unsigned int slots, int block_samples,
+		  double sample_rate, double frequency) {
+	memset(b, 0, sizeof(*b));
+	snprintf(b->name, sizeof(b->name), "%s", name);
+	b->writer = 1;
+	unsigned int n = 1;
+	while (n < slots) n <<= 1;
+	size_t slot_size = sizeof(struct iq_bus_slot) + 2 * sizeof(int16_t) * block_samples;
+	slot_size = (slot_size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+	b->size = HEADER_SIZE + n * slot_size;
+
+	// A previous run that crashed may have left the object behind
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		perror("Could not create IQ bus");
+		return -1;
+	}
+	if (ftruncate(fd, b->size) < 0) {
+		perror("Could not size IQ bus");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	b->header = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (b->header == MAP_FAILED) {
+		b->header = NULL;
+		perror("Could not map IQ bus");
+		shm_unlink(name);
+		return -1;
+	}
+
+	struct iq_bus_header *h = b->header;
+	h->version = IQ_BUS_VERSION;
+	h->slots = n;
+	h->block_samples = block_samples;
+	h->header_size = HEADER_SIZE;
+	h->slot_size = slot_size;
+	h->sample_rate = sample_rate;
+	h->frequency = frequency;
+	atomic_init(&h->cursor, 0);
+	atomic_init(&h->futex, 0);
+	for (unsigned int j = 0; j < n; j++) atomic_init(&slot(h, j)->seq, 0);
+	// Readers check the magic last
+	atomic_thread_fence(memory_order_release);
+	h->magic = IQ_BUS_MAGIC;
+	return 0;
+}
+
+void iq_bus_publish(struct iq_bus *b, const int16_t *samples, int count,
+		    uint64_t timestamp, double host_time, uint32_t flags) {
+	struct iq_bus_header *h = b->header;
+	uint64_t block = atomic_load_explicit(&h->cursor, memory_order_relaxed);
+	struct iq_bus_slot *s = slot(h, block);
+	if (count > (int) h->block_samples) count = h->block_samples;
+
+	atomic_store_explicit(&s->seq, 2 * block + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->timestamp = timestamp;
+	s->host_time = host_time;
+	s->count = count;
+	s->flags = flags;
+	memcpy(s + 1, samples, 2 * sizeof(int16_t) * count);
+	atomic_store_explicit(&s->seq, 2 * block + 2, memory_order_release);
+	atomic_store_explicit(&h->cursor, block + 1, memory_order_release);
+
+	atomic_fetch_add_explicit(&h->futex, 1, memory_order_release);
+	syscall(SYS_futex, &h->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int iq_bus_open(struct iq_bus *b, const char *name) {
+	memset(b, 0, sizeof(*b));
+	snprintf(b->name, sizeof(b->name), "%s", name);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("Could not open IQ bus");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < HEADER_SIZE) {
+		fprintf(stderr, "IQ bus %s is not ready\n", name);
+		close(fd);
+		return -1;
+	}
+	b->size = st.st_size;
+	b->header = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b->header == MAP_FAILED) {
+		b->header = NULL;
+		perror("Could not map IQ bus");
+		return -1;
+	}
+
+	struct iq_bus_header *h = b->header;
+	int ready = h->magic == IQ_BUS_MAGIC;
+	atomic_thread_fence(memory_order_acquire);
+	if (!ready || h->version != IQ_BUS_VERSION
+	    || h->header_size + (size_t) h->slots * h->slot_size > b->size) {
+		fprintf(stderr, "IQ bus %s is not ready or has an unknown version\n", name);
+		iq_bus_close(b);
+		return -1;
+	}
+	b->next = atomic_load_explicit(&h->cursor, memory_order_acquire);
+	return 0;
+}
+
+// Moves a lapped reader to the newest complete block
+static int lapped(struct iq_bus *b, uint64_t cursor) {
+	uint64_t next = cursor ? cursor - 1 : 0;
+	if (next > b->next) b->lapped += next - b->next;
+	b->next = next;
+	return IQ_BUS_LAPPED;
+}
+
+int iq_bus_read_begin(struct iq_bus *b, struct iq_bus_block *block) {
+	struct iq_bus_header *h = b->header;
+	uint64_t cursor = atomic_load_explicit(&h->cursor, memory_order_acquire);
+	if (b->next >= cursor) return 0;
+	if (cursor - b->next > h->slots) return lapped(b, cursor);
+
+	struct iq_bus_slot *s = slot(h, b->next);
+	b->slot_seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if (b->slot_seq != 2 * b->next + 2) return lapped(b, cursor);
+	block->samples = (const int16_t *) (s + 1);
+	block->count = s->count;
+	block->flags = s->flags;
+	block->seq = b->next;
+	block->timestamp = s->timestamp;
+	block->host_time = s->host_time;
+	if (block->count > (int) h->block_samples) block->count = h->block_samples;
+	return 1;
+}
+
+int iq_bus_read_end(struct iq_bus *b) {
+	struct iq_bus_header *h = b->header;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot(h, b->next)->seq, memory_order_relaxed) != b->slot_seq) {
+		return lapped(b, atomic_load_explicit(&h->cursor, memory_order_acquire));
+	}
+	b->next++;
+	return 0;
+}
+
+int iq_bus_wait(struct iq_bus *b, double timeout) {
+	struct iq_bus_header *h = b->header;
+	unsigned int futex = atomic_load_explicit(&h->futex, memory_order_acquire);
+	if (atomic_load_explicit(&h->cursor, memory_order_acquire) > b->next) return 1;
+	struct timespec t = { .tv_sec = timeout, .tv_nsec = 1e9 * (timeout - floor(timeout)) };
+	syscall(SYS_futex, &h->futex, FUTEX_WAIT, futex, &t, NULL, 0);
+	return atomic_load_explicit(&h->cursor, memory_order_acquire) > b->next;
+}
+
+void iq_bus_close(struct iq_bus *b) {
+	if (b->header) munmap(b->header, b->size);
+	if (b->writer) shm_unlink(b->name);
+	b->header = NULL;
+}
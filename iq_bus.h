@@ -0,0 +1,106 @@
+/*
+  ===========================================================================
+
+  iq_bus - Ring of IQ sample blocks in POSIX shared memory, written by the
+  streamer and read without copies by any number of local processes.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef IQ_BUS_H
+#define IQ_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define IQ_BUS_MAGIC 0x53554251 // "QBUS"
+#define IQ_BUS_VERSION 1
+
+// Block flags
+#define IQ_BUS_TIMESTAMP_ESTIMATED 1 // from the TX FIFO level, not the device
+#define IQ_BUS_NO_TIMESTAMP 2
+
+// Return value of the reader functions when the writer has overwritten the
+// blocks that the reader had yet to read
+#define IQ_BUS_LAPPED (-2)
+
+// Layout of the shared memory: this header, then slots of slot_size bytes,
+// each a struct iq_bus_slot followed by the interleaved int16 IQ samples
+struct iq_bus_header {
+	uint32_t magic, version;
+	uint32_t slots; // power of 2
+	uint32_t block_samples; // capacity of a slot
+	uint32_t header_size, slot_size; // bytes
+	double sample_rate, frequency; // Hz
+	_Alignas(64) atomic_ullong cursor; // blocks published so far
+	atomic_uint futex; // incremented with the cursor, for iq_bus_wait()
+};
+
+struct iq_bus_slot {
+	// 2 * block + 1 while the block is written, 2 * block + 2 once complete
+	atomic_ullong seq;
+	uint64_t timestamp; // device timestamp of the first sample
+	double host_time; // CLOCK_REALTIME of the first sample
+	uint32_t count; // samples
+	uint32_t flags;
+};
+
+struct iq_bus_block {
+	const int16_t *samples; // interleaved IQ, in the shared memory
+	int count;
+	uint32_t flags;
+	uint64_t seq; // block number, consecutive unless the reader is lapped
+	uint64_t timestamp;
+	double host_time;
+};
+
+struct iq_bus {
+	char name[64];
+	int writer;
+	struct iq_bus_header *header;
+	size_t size;
+	// Reader state
+	uint64_t next; // block to read
+	uint64_t slot_seq; // of the block being read
+	uint64_t lapped; // blocks lost because the writer lapped the reader
+};
+
+// Writer. Creates the shared memory object, replacing any stale one
+int iq_bus_create(struct iq_bus *b, const char *name, unsigned int slots, int block_samples,
+		  double sample_rate, double frequency);
+// Copies count samples, up to block_samples, into the next slot
+void iq_bus_publish(struct iq_bus *b, const int16_t *samples, int count,
+		    uint64_t timestamp, double host_time, uint32_t flags);
+
+// Reader. Starts with the next block to be published
+int iq_bus_open(struct iq_bus *b, const char *name);
+// Points block to the next block, in the shared memory. Returns 1 if there
+// is one, 0 if there is none yet, or IQ_BUS_LAPPED if the reader has been
+// lapped, in which case it skips to a recent block
+int iq_bus_read_begin(struct iq_bus *b, struct iq_bus_block *block);
+// Finishes with the block of iq_bus_read_begin(). Returns 0 if the samples
+// were intact all along, or IQ_BUS_LAPPED if the writer may have changed them
+int iq_bus_read_end(struct iq_bus *b);
+// Waits up to timeout seconds for a block to read. Returns 1 if there is one
+int iq_bus_wait(struct iq_bus *b, double timeout);
+
+// Unmaps the bus. The writer also removes the shared memory object
+void iq_bus_close(struct iq_bus *b);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+  ===========================================================================
+
+  iq_bus_cat - Writes the IQ samples of an IQ bus of limesdr_linrad to
+  stdout, as interleaved int16, for recorders and other local tools.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "iq_bus.h"
+
+static volatile sig_atomic_t keep_reading = 1;
+
+static void handle_signal(int sig) {
+	(void) sig;
+	keep_reading = 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		printf("Usage: %s <BUS_NAME> [<SECONDS>]\n", argv[0]);
+		printf("  BUS_NAME is /<-sm NAME>-rx<N> or /<-sm NAME>-tx\n"
+		       "  SECONDS to read (default: until interrupted)\n");
+		return 1;
+	}
+	double seconds = argc > 2 ? atof(argv[2]) : 0;
+	struct iq_bus bus;
+	if (iq_bus_open(&bus, argv[1]) < 0) {
+		return 1;
+	}
+	fprintf(stderr, "%s: %.0f sps at %.6f MHz, %u blocks of %u samples\n",
+		argv[1], bus.header->sample_rate, 1e-6 * bus.header->frequency,
+		bus.header->slots, bus.header->block_samples);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	uint64_t samples = 0, expected = 0, gaps = 0;
+	int first = 1;
+	while (keep_reading && (!seconds || samples < seconds * bus.header->sample_rate)) {
+		struct iq_bus_block block;
+		int ret = iq_bus_read_begin(&bus, &block);
+		if (ret == 0) {
+			iq_bus_wait(&bus, 0.1);
+			continue;
+		}
+		if (ret == IQ_BUS_LAPPED) {
+			fprintf(stderr, "Lapped by the writer, %" PRIu64 " blocks lost so far\n",
+				bus.lapped);
+			continue;
+		}
+		if (!first && !block.flags && block.timestamp != expected) {
+			gaps++;
+		}
+		first = 0;
+		expected = block.timestamp + block.count;
+		size_t written = fwrite(block.samples, 2 * sizeof(int16_t), block.count, stdout);
+		if (iq_bus_read_end(&bus) == IQ_BUS_LAPPED) {
+			fprintf(stderr, "Lapped by the writer while copying block %" PRIu64 "\n",
+				block.seq);
+		}
+		if (written != (size_t) block.count) {
+			perror("Could not write samples");
+			break;
+		}
+		samples += block.count;
+	}
+	fprintf(stderr, "%" PRIu64 " samples, %" PRIu64 " blocks lost, "
+		"%" PRIu64 " timestamp gaps\n", samples, bus.lapped, gaps);
+	iq_bus_close(&bus);
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+  ===========================================================================
+
+  iq_corr - Adaptive correction of the DC offset and the IQ gain and phase
+  imbalance of the RX samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The estimate relies on the received signal being circular: the band is
+  made of many unrelated signals and noise, so I and Q have the same
+  power and are uncorrelated unless the receiver makes them otherwise. The
+  first and second moments of I and Q are smoothed over a few seconds,
+  using only a run of samples from each packet to keep the cost low. The
+  correction removes the mean, keeps I, and replaces Q by the part of it
+  that is uncorrelated with I, scaled to the power of I. That is a 2x2
+  real matrix and an offset, which together with the digital gain are
+  applied in fixed point in the same pass that copies the samples into
+  the packets.
+
+  ===========================================================================
+*/
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "iq_corr.h"
+#include "rx_level.h"
+
+#define FULL_SCALE 32768.0
+#define TIME_CONSTANT 2.0 // s
+#define CONVERGENCE 3.0 // time constants after a restart
+#define MIN_POWER 1.0 // LSB^2, below this there is nothing to balance
+#define MAX_GAIN_IMBALANCE 3.0 // dB, larger estimates are not applied
+#define MAX_PHASE_IMBALANCE 20.0 // degrees
+#define COEF_ONE 16384 // coefficients are kept below this, so that the
+		       // sums of products fit in 32 bits
+#define MAX_SHIFT 14
+
+static void moments(const int16_t *samples, int count, struct iq_corr_moments *m) {
+	int64_t si = 0, sq = 0, sii = 0, sqq = 0, siq = 0;
+	int j = 0;
+#ifdef __SSE2__
+	// 4 samples per iteration, each in a 32 bit lane. The sums of I and Q
+	// stay in 32 bits and the products go to 64 bits
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi32(0xffff);
+	const __m128i one_i = _mm_set1_epi32(1), one_q = _mm_set1_epi32(1 << 16);
+	__m128i acc_i = zero, acc_q = zero, acc_ii = zero, acc_qq = zero, acc_iq = zero;
+	for (; j + 4 <= count; j += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (samples + 2 * j));
+		__m128i xi = _mm_and_si128(x, low), xq = _mm_srli_epi32(x, 16);
+		acc_i = _mm_add_epi32(acc_i, _mm_madd_epi16(x, one_i));
+		acc_q = _mm_add_epi32(acc_q, _mm_madd_epi16(x, one_q));
+		__m128i ii = _mm_madd_epi16(xi, xi), qq = _mm_madd_epi16(xq, xq);
+		__m128i iq = _mm_madd_epi16(xi, xq);
+		__m128i sign = _mm_srai_epi32(iq, 31);
+		acc_ii = _mm_add_epi64(acc_ii, _mm_add_epi64(_mm_unpacklo_epi32(ii, zero),
+							     _mm_unpackhi_epi32(ii, zero)));
+		acc_qq = _mm_add_epi64(acc_qq, _mm_add_epi64(_mm_unpacklo_epi32(qq, zero),
+							     _mm_unpackhi_epi32(qq, zero)));
+		acc_iq = _mm_add_epi64(acc_iq, _mm_add_epi64(_mm_unpacklo_epi32(iq, sign),
+							     _mm_unpackhi_epi32(iq, sign)));
+	}
+	int32_t s32[4];
+	int64_t s64[2];
+	_mm_storeu_si128((__m128i *) s32, acc_i);
+	si += (int64_t) s32[0] + s32[1] + s32[2] + s32[3];
+	_mm_storeu_si128((__m128i *) s32, acc_q);
+	sq += (int64_t) s32[0] + s32[1] + s32[2] + s32[3];
+	_mm_storeu_si128((__m128i *) s64, acc_ii);
+	sii += s64[0] + s64[1];
+	_mm_storeu_si128((__m128i *) s64, acc_qq);
+	sqq += s64[0] + s64[1];
+	_mm_storeu_si128((__m128i *) s64, acc_iq);
+	siq += s64[0] + s64[1];
+#endif
+	for (j *= 2; j < 2 * count; j += 2) {
+		int i = samples[j], q = samples[j+1];
+		si += i;
+		sq += q;
+		sii += i * i;
+		sqq += q * q;
+		siq += i * q;
+	}
+	m->i += si;
+	m->q += sq;
+	m->ii += sii;
+	m->qq += sqq;
+	m->iq += siq;
+	m->samples += count;
+}
+
+double iq_corr_irr(double p_i, double p_q, double c) {
+	double power = p_i + p_q;
+	if (power <= 0) return NAN;
+	// Magnitude of E[z^2] relative to E[|z|^2]. With an image of relative
+	// amplitude r it is 2r / (1 + r^2)
+	double rho = sqrt((p_i - p_q) * (p_i - p_q) + 4 * c * c) / power;
+	if (rho <= 0) return INFINITY;
+	if (rho >= 1) return 0;
+	double r = (1 - sqrt(1 - rho * rho)) / rho;
+	return -20 * log10(r);
+}
+
+static double dbfs(double power) {
+	return 10 * log10(power / (FULL_SCALE * FULL_SCALE));
+}
+
+int iq_corr_init(struct iq_corr *c, double sample_rate, int packet_samples,
+		 int estimate_samples, FILE *log, unsigned int device) {
+	memset(c, 0, sizeof(*c));
+	if (estimate_samples <= 0 || estimate_samples > packet_samples) {
+		fprintf(stderr, "ERROR: IQ correction needs between 1 and %d samples per packet\n",
+			packet_samples);
+		return -1;
+	}
+	c->sample_rate = sample_rate;
+	c->packet_samples = packet_samples;
+	c->estimate_samples = estimate_samples;
+	c->log = log;
+	c->device = device;
+	c->alpha = 1 / (TIME_CONSTANT * sample_rate);
+	c->random = 1;
+	c->b = 1;
+	c->irr_raw = c->irr_corrected = NAN;
+	pthread_mutex_init(&c->lock, NULL);
+	return 0;
+}
+
+// Computes the correction matrix from the smoothed moments
+static void balance(struct iq_corr *c) {
+	double p_i = c->e_ii - c->mean_i * c->mean_i;
+	double p_q = c->e_qq - c->mean_q * c->mean_q;
+	double cross = c->e_iq - c->mean_i * c->mean_q;
+	double det = p_i * p_q - cross * cross;
+	c->balanced = 0;
+	c->a = 0;
+	c->b = 1;
+	if (p_i < MIN_POWER || p_q < MIN_POWER || det <= 0) return;
+	double gain_db = 10 * log10(p_q / p_i);
+	double phase_deg = asin(cross / sqrt(p_i * p_q)) * 180 / M_PI;
+	if (fabs(gain_db) > MAX_GAIN_IMBALANCE || fabs(phase_deg) > MAX_PHASE_IMBALANCE) return;
+	// Q - (cross / p_i) I is uncorrelated with I, and has power det / p_i
+	double scale = p_i / sqrt(det);
+	c->a = -cross / p_i * scale;
+	c->b = scale;
+	c->balanced = 1;
+}
+
+static void end_second(struct iq_corr *c) {
+	struct iq_corr_moments *m = &c->current;
+	double n = m->samples;
+	double mean_i = m->i / n, mean_q = m->q / n;
+	double p_i = m->ii / n - mean_i * mean_i;
+	double p_q = m->qq / n - mean_q * mean_q;
+	double cross = m->iq / n - mean_i * mean_q;
+	// The same moments after the correction in use
+	double dc_i = mean_i - c->mean_i, dc_q = mean_q - c->mean_q;
+	double res_i = dc_i, res_q = c->a * dc_i + c->b * dc_q;
+	double cor_q = c->a * c->a * p_i + 2 * c->a * c->b * cross + c->b * c->b * p_q;
+	double cor_cross = c->a * p_i + c->b * cross;
+
+	double est_p_i = c->e_ii - c->mean_i * c->mean_i;
+	double est_p_q = c->e_qq - c->mean_q * c->mean_q;
+	double est_cross = c->e_iq - c->mean_i * c->mean_q;
+	double gain_db = 10 * log10(est_p_q / est_p_i);
+	double phase_deg = asin(est_cross / sqrt(est_p_i * est_p_q)) * 180 / M_PI;
+	int converged = c->elapsed >= CONVERGENCE * TIME_CONSTANT;
+
+	pthread_mutex_lock(&c->lock);
+	c->dc_dbfs = dbfs(mean_i * mean_i + mean_q * mean_q);
+	c->residual_dc_dbfs = dbfs(res_i * res_i + res_q * res_q);
+	c->gain_db = gain_db;
+	c->phase_deg = phase_deg;
+	c->irr_raw = iq_corr_irr(p_i, p_q, cross);
+	c->irr_corrected = iq_corr_irr(p_i, cor_q, cor_cross);
+	c->converged = converged;
+	c->corrected = c->balanced;
+	c->seconds++;
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->log) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		fprintf(c->log, "%.3f,%u,%.1f,%.1f,%.3f,%.2f,%.1f,%.1f,%d,%d\n",
+			t.tv_sec + 1e-9 * t.tv_nsec, c->device,
+			dbfs(mean_i * mean_i + mean_q * mean_q),
+			dbfs(res_i * res_i + res_q * res_q), gain_db, phase_deg,
+			iq_corr_irr(p_i, p_q, cross), iq_corr_irr(p_i, cor_q, cor_cross),
+			c->balanced, converged);
+		fflush(c->log);
+	}
+	memset(&c->current, 0, sizeof(c->current));
+	c->current_samples = 0;
+}
+
+static void quantize(const struct iq_corr *c, int gain, struct iq_corr_coefs *k) {
+	double g = (double) gain / RX_LEVEL_GAIN_ONE;
+	double m00 = g, m10 = g * c->a, m11 = g * c->b;
+	double largest = fabs(m10) + fabs(m11);
+	if (m00 > largest) largest = m00;
+	int shift = MAX_SHIFT;
+	while (shift > 1 && largest * (1 << shift) > COEF_ONE) shift--;
+	k->shift = shift;
+	k->m00 = lrint(m00 * (1 << shift));
+	k->m10 = lrint(m10 * (1 << shift));
+	k->m11 = lrint(m11 * (1 << shift));
+	// The DC is removed with the quantized coefficients, so that none of it
+	// is left by their rounding
+	int32_t half = 1 << (shift - 1);
+	k->c_i = half - lrint(k->m00 * c->mean_i);
+	k->c_q = half - lrint(k->m10 * c->mean_i + k->m11 * c->mean_q);
+}
+
+void iq_corr_update(struct iq_corr *c, const int16_t *samples, int count, int gain,
+		    struct iq_corr_coefs *k) {
+	if (atomic_exchange(&c->restart, 0)) {
+		c->used = 0;
+		c->elapsed = 0;
+	}
+
+	// The estimate samples start at a random place in each packet. At a
+	// fixed place they would be periodic, and a signal at a multiple of
+	// half the packet rate would look like an imbalance
+	struct iq_corr_moments block = {0};
+	int span = c->packet_samples - c->estimate_samples + 1;
+	for (int j = 0; j + c->packet_samples <= count; j += c->packet_samples) {
+		c->random ^= c->random << 13;
+		c->random ^= c->random >> 17;
+		c->random ^= c->random << 5;
+		moments(samples + 2 * (j + c->random % span), c->estimate_samples, &block);
+	}
+	if (block.samples) {
+		// A plain average until a time constant has been seen
+		double w = 1 - exp(-c->alpha * count);
+		c->used += block.samples;
+		if (w < block.samples / c->used) w = block.samples / c->used;
+		double n = block.samples;
+		c->mean_i += w * (block.i / n - c->mean_i);
+		c->mean_q += w * (block.q / n - c->mean_q);
+		c->e_ii += w * (block.ii / n - c->e_ii);
+		c->e_qq += w * (block.qq / n - c->e_qq);
+		c->e_iq += w * (block.iq / n - c->e_iq);
+		balance(c);
+
+		c->current.i += block.i;
+		c->current.q += block.q;
+		c->current.ii += block.ii;
+		c->current.qq += block.qq;
+		c->current.iq += block.iq;
+		c->current.samples += block.samples;
+	}
+	c->elapsed += count / c->sample_rate;
+	c->current_samples += count;
+	if (c->current_samples >= c->sample_rate && c->current.samples) end_second(c);
+
+	quantize(c, gain, k);
+}
+
+void iq_corr_get_coefs(const struct iq_corr *c, int gain, struct iq_corr_coefs *k) {
+	quantize(c, gain, k);
+}
+
+static void apply_scalar(const struct iq_corr_coefs *k, int16_t *out, const int16_t *in, int count) {
+	for (int j = 0; j < 2 * count; j += 2) {
+		int i = in[j], q = in[j+1];
+		int x = (k->m00 * i + k->c_i) >> k->shift;
+		int y = (k->m10 * i + k->m11 * q + k->c_q) >> k->shift;
+		if (x > 32767) x = 32767;
+		if (x < -32768) x = -32768;
+		if (y > 32767) y = 32767;
+		if (y < -32768) y = -32768;
+		out[j] = x;
+		out[j+1] = y;
+	}
+}
+
+void iq_corr_apply(const struct iq_corr_coefs *k, int16_t *out, const int16_t *in, int count) {
+	int j = 0;
+#ifdef __SSE2__
+	// 4 samples per iteration. madd multiplies the IQ pairs by (m00, 0)
+	// and (m10, m11), giving I' and Q' in 32 bit lanes
+	const __m128i coef_i = _mm_set1_epi32((uint16_t) k->m00);
+	const __m128i coef_q = _mm_set1_epi32((uint16_t) k->m10 | (uint32_t) (uint16_t) k->m11 << 16);
+	const __m128i c_i = _mm_set1_epi32(k->c_i), c_q = _mm_set1_epi32(k->c_q);
+	const __m128i shift = _mm_cvtsi32_si128(k->shift);
+	for (; j + 4 <= count; j += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (in + 2 * j));
+		__m128i i = _mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(x, coef_i), c_i), shift);
+		__m128i q = _mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(x, coef_q), c_q), shift);
+		__m128i y = _mm_packs_epi32(_mm_unpacklo_epi32(i, q), _mm_unpackhi_epi32(i, q));
+		_mm_storeu_si128((__m128i *) (out + 2 * j), y);
+	}
+#endif
+	apply_scalar(k, out + 2 * j, in + 2 * j, count - j);
+}
+
+void iq_corr_restart(struct iq_corr *c) {
+	atomic_store(&c->restart, 1);
+	pthread_mutex_lock(&c->lock);
+	c->restarts++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void iq_corr_print(struct iq_corr *c, const char *prefix) {
+	pthread_mutex_lock(&c->lock);
+	if (!c->seconds) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	double dc = c->dc_dbfs, residual_dc = c->residual_dc_dbfs;
+	double gain_db = c->gain_db, phase_deg = c->phase_deg;
+	double irr_raw = c->irr_raw, irr_corrected = c->irr_corrected;
+	int converged = c->converged, corrected = c->corrected;
+	unsigned long restarts = c->restarts;
+	pthread_mutex_unlock(&c->lock);
+	fprintf(stderr, "%sIQ: DC = %.1f -> %.1f dBFS, imbalance = %+.3f dB %+.2f deg, "
+		"IRR = %.1f -> %.1f dB, %s%s, restarts = %lu\n",
+		prefix, dc, residual_dc, gain_db, phase_deg, irr_raw, irr_corrected,
+		converged ? "converged" : "converging",
+		corrected ? "" : " (imbalance out of range, not corrected)", restarts);
+}
+
+void iq_corr_free(struct iq_corr *c) {
+	pthread_mutex_destroy(&c->lock);
+}
@@ -0,0 +1,96 @@
+/*
+  ===========================================================================
+
+  iq_corr - Adaptive correction of the DC offset and the IQ gain and phase
+  imbalance of the RX samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef IQ_CORR_H
+#define IQ_CORR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Fixed point correction of a block, with the digital gain folded in:
+// I' = (m00 I + c_i) >> shift, Q' = (m10 I + m11 Q + c_q) >> shift
+struct iq_corr_coefs {
+	int16_t m00, m10, m11;
+	int32_t c_i, c_q; // DC and rounding
+	int shift;
+};
+
+struct iq_corr_moments {
+	int64_t i, q, ii, qq, iq; // sums
+	unsigned long samples;
+};
+
+struct iq_corr {
+	double sample_rate;
+	int packet_samples;
+	int estimate_samples; // of each packet that go into the estimate
+	FILE *log;
+	unsigned int device;
+
+	// Estimator, used only by the feed thread
+	double alpha; // exponential smoothing per sample
+	double mean_i, mean_q, e_ii, e_qq, e_iq; // smoothed moments
+	double used; // samples in the estimate since the last restart
+	double elapsed; // seconds since the last restart
+	double a, b; // Q' = a I + b Q after removing the DC
+	int balanced; // the imbalance is within range and corrected
+	uint32_t random; // xorshift, for where the estimate samples start
+	struct iq_corr_moments current; // of this second
+	unsigned long current_samples; // all of them, not only the estimate
+	atomic_int restart;
+
+	pthread_mutex_t lock;
+	// Protected by lock, from the last complete second
+	double dc_dbfs, residual_dc_dbfs;
+	double gain_db, phase_deg; // imbalance of Q relative to I
+	double irr_raw, irr_corrected; // dB, image rejection ratio
+	int converged, corrected; // corrected is 0 if the imbalance is out of range
+	unsigned long seconds, restarts;
+};
+
+// Image rejection ratio in dB of a signal with these moments about its mean
+double iq_corr_irr(double p_i, double p_q, double c);
+
+// estimate_samples of every packet_samples are used for the estimate. If
+// log is not NULL a line with the estimates is written to it each second
+int iq_corr_init(struct iq_corr *c, double sample_rate, int packet_samples,
+		 int estimate_samples, FILE *log, unsigned int device);
+// Updates the estimate with a block of count samples, a multiple of
+// packet_samples, and computes the correction for it with the digital
+// gain, in the Q8 format of rx_level
+void iq_corr_update(struct iq_corr *c, const int16_t *samples, int count, int gain,
+		    struct iq_corr_coefs *k);
+// Computes the correction of the last update with another digital gain
+void iq_corr_get_coefs(const struct iq_corr *c, int gain, struct iq_corr_coefs *k);
+// Copies count samples applying the correction. out can be the same as in
+void iq_corr_apply(const struct iq_corr_coefs *k, int16_t *out, const int16_t *in, int count);
+// Starts the estimate again, after a change of the analog gain. Can be
+// called from any thread
+void iq_corr_restart(struct iq_corr *c);
+void iq_corr_print(struct iq_corr *c, const char *prefix);
+void iq_corr_free(struct iq_corr *c);
+
+#endif
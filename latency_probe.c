@@ -0,0 +1,258 @@
+/*
+  ===========================================================================
+
+  latency_probe - Measures the TX to RX loopback latency with marker bursts.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  A marker is a 127 chip m-sequence, one sample per chip, that is added to
+  the TX samples as they are read from /tmp/txfifo. The occupancy of the
+  pipe and of the TX FIFO at that moment give the time that the marker
+  spends in each of them. The marker is found in RX by correlation, which
+  gives its RX timestamp, so the time spent between the TX FIFO and the
+  antenna and between the antenna and LMS_RecvStream() follow from the
+  relation between timestamps and host time.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "latency_probe.h"
+
+#define MARKER_AMPLITUDE 16384
+#define LOST_TIMEOUT 2.0 // seconds
+#define SEARCH_MARGIN 0.05 // seconds before the estimated TX timestamp
+#define BIN_MIN 10e-6 // seconds
+
+static const char *stage_names[LATENCY_STAGES] = {
+	[LATENCY_INGEST] = "ingest",
+	[LATENCY_TX_FIFO] = "tx fifo",
+	[LATENCY_RF] = "rf",
+	[LATENCY_RX_FIFO] = "rx fifo",
+	[LATENCY_NETWORK] = "network",
+	[LATENCY_TOTAL] = "total"
+};
+
+static int bin(double t) {
+	if (t < BIN_MIN) return 0;
+	int k = floor(10 * log10(t / BIN_MIN));
+	return k < LATENCY_PROBE_BINS ? k : LATENCY_PROBE_BINS;
+}
+
+static double bin_edge(int k) {
+	return BIN_MIN * pow(10, 0.1 * k);
+}
+
+static void histogram_add(struct latency_histogram *h, double t) {
+	if (h->count == 0 || t < h->min) h->min = t;
+	if (h->count == 0 || t > h->max) h->max = t;
+	h->count++;
+	h->sum += t;
+	h->bins[bin(t)]++;
+}
+
+// Upper edge of the bin that contains the quantile q
+static double histogram_quantile(const struct latency_histogram *h, double q) {
+	unsigned long acc = 0;
+	for (int k = 0; k <= LATENCY_PROBE_BINS; k++) {
+		acc += h->bins[k];
+		if (acc >= q * h->count) return k < LATENCY_PROBE_BINS ? bin_edge(k + 1) : h->max;
+	}
+	return h->max;
+}
+
+int latency_probe_init(struct latency_probe *p, double sample_rate, double interval,
+		       int block_samples) {
+	memset(p, 0, sizeof(*p));
+	p->sample_rate = sample_rate;
+	p->interval = interval;
+	p->threshold = 0.3;
+
+	// m-sequence of x^7 + x^6 + 1
+	unsigned int state = 1;
+	for (int n = 0; n < LATENCY_PROBE_MARKER; n++) {
+		p->chips[n] = state & 1 ? -1 : 1;
+		unsigned int feedback = (state ^ (state >> 1)) & 1;
+		state = (state >> 1) | (feedback << 6);
+		p->marker[2*n] = p->marker[2*n+1] = p->chips[n] * MARKER_AMPLITUDE;
+	}
+
+	p->window = calloc(2 * (block_samples + LATENCY_PROBE_MARKER - 1), sizeof(int16_t));
+	if (!p->window) {
+		perror("Could not allocate latency probe");
+		return -1;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	return 0;
+}
+
+int latency_probe_due(struct latency_probe *p, double now) {
+	pthread_mutex_lock(&p->lock);
+	if (p->pending && now - p->inject_time > LOST_TIMEOUT) {
+		p->lost++;
+		p->pending = 0;
+	}
+	int due = !p->pending && now >= p->next_marker;
+	pthread_mutex_unlock(&p->lock);
+	return due;
+}
+
+void latency_probe_inject(struct latency_probe *p, int16_t *samples, double now,
+			  double ingest, double tx_fifo, uint64_t tx_timestamp) {
+	for (int j = 0; j < 2 * LATENCY_PROBE_MARKER; j++) {
+		int x = samples[j] + p->marker[j];
+		if (x > 32767) x = 32767;
+		if (x < -32768) x = -32768;
+		samples[j] = x;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->pending = 1;
+	p->detected = 0;
+	p->inject_time = now;
+	p->tx_timestamp = tx_timestamp;
+	p->stage[LATENCY_INGEST] = ingest;
+	p->stage[LATENCY_TX_FIFO] = tx_fifo;
+	p->next_marker = now + p->interval;
+	p->injected++;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void latency_probe_detect(struct latency_probe *p, const int16_t *samples, int count,
+			  uint64_t timestamp, double read_time,
+			  double (*antenna_time)(void *, uint64_t), void *arg) {
+	const int m = LATENCY_PROBE_MARKER;
+	memcpy(p->window + 2 * (m - 1), samples, 2 * count * sizeof(int16_t));
+
+	pthread_mutex_lock(&p->lock);
+	uint64_t search_from = p->tx_timestamp - (uint64_t) (SEARCH_MARGIN * p->sample_rate);
+	int searching = p->pending && !p->detected;
+	if (p->searched != p->injected) {
+		p->searched = p->injected;
+		p->in_peak = 0;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	for (int n = 0; searching && n < count; n++) {
+		// timestamp of the last sample in the window
+		uint64_t ts = timestamp + n;
+		if ((int64_t) (ts - search_from) < 0) continue;
+		const int16_t *x = p->window + 2 * n;
+		double ci = 0, cq = 0, energy = 0;
+		for (int k = 0; k < m; k++) {
+			ci += p->chips[k] * x[2*k];
+			cq += p->chips[k] * x[2*k+1];
+			energy += (double) x[2*k] * x[2*k] + (double) x[2*k+1] * x[2*k+1];
+		}
+		double metric = energy > 0 ? (ci * ci + cq * cq) / (m * energy) : 0;
+		if (metric > p->threshold) {
+			if (!p->in_peak || metric > p->peak_metric) {
+				p->peak_metric = metric;
+				p->peak_timestamp = ts;
+				p->peak_read_time = read_time;
+			}
+			p->in_peak = 1;
+		}
+		else if (p->in_peak) {
+			double rx_time = antenna_time(arg, p->peak_timestamp);
+			pthread_mutex_lock(&p->lock);
+			p->stage[LATENCY_RF] = (double) (int64_t) (p->peak_timestamp - (m - 1)
+								  - p->tx_timestamp)
+				/ p->sample_rate;
+			p->stage[LATENCY_RX_FIFO] = p->peak_read_time - rx_time;
+			p->detected = 1;
+			pthread_mutex_unlock(&p->lock);
+			p->in_peak = 0;
+			searching = 0;
+		}
+	}
+
+	memmove(p->window, p->window + 2 * count, 2 * (m - 1) * sizeof(int16_t));
+}
+
+void latency_probe_sent(struct latency_probe *p, double now) {
+	pthread_mutex_lock(&p->lock);
+	if (p->pending && p->detected) {
+		p->stage[LATENCY_NETWORK] = now - p->peak_read_time;
+		p->stage[LATENCY_TOTAL] = now - p->inject_time + p->stage[LATENCY_INGEST];
+		for (int s = 0; s < LATENCY_STAGES; s++) {
+			histogram_add(&p->hist[s], p->stage[s]);
+		}
+		p->pending = 0;
+		p->detected = 0;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void latency_probe_total(struct latency_probe *p, unsigned long *count, double *sum) {
+	pthread_mutex_lock(&p->lock);
+	*count = p->hist[LATENCY_TOTAL].count;
+	*sum = p->hist[LATENCY_TOTAL].sum;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void latency_probe_print(struct latency_probe *p) {
+	pthread_mutex_lock(&p->lock);
+	fprintf(stderr, "Latency: %lu markers, %lu lost, median/p99 (ms):",
+		p->injected, p->lost);
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		const struct latency_histogram *h = &p->hist[s];
+		fprintf(stderr, "%s %s %.2f/%.2f", s ? "," : "", stage_names[s],
+			1e3 * histogram_quantile(h, 0.5), 1e3 * histogram_quantile(h, 0.99));
+	}
+	fprintf(stderr, "\n");
+	pthread_mutex_unlock(&p->lock);
+}
+
+void latency_probe_print_histograms(struct latency_probe *p) {
+	pthread_mutex_lock(&p->lock);
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		const struct latency_histogram *h = &p->hist[s];
+		if (!h->count) continue;
+		fprintf(stderr, "%s: %lu markers, min = %.3f ms, mean = %.3f ms, max = %.3f ms\n",
+			stage_names[s], h->count, 1e3 * h->min, 1e3 * h->sum / h->count,
+			1e3 * h->max);
+		unsigned long peak = 0;
+		for (int k = 0; k <= LATENCY_PROBE_BINS; k++) {
+			if (h->bins[k] > peak) peak = h->bins[k];
+		}
+		for (int k = 0; k <= LATENCY_PROBE_BINS; k++) {
+			if (!h->bins[k]) continue;
+			int bar = (50 * h->bins[k] + peak - 1) / peak;
+			if (k < LATENCY_PROBE_BINS) {
+				fprintf(stderr, "  %9.3f - %9.3f ms %6lu %.*s\n",
+					1e3 * (k ? bin_edge(k) : 0), 1e3 * bin_edge(k + 1),
+					h->bins[k], bar,
+					"##################################################");
+			}
+			else {
+				fprintf(stderr, "  %9.3f -           ms %6lu %.*s\n",
+					1e3 * bin_edge(k), h->bins[k], bar,
+					"##################################################");
+			}
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void latency_probe_free(struct latency_probe *p) {
+	free(p->window);
+	pthread_mutex_destroy(&p->lock);
+}
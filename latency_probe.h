@@ -0,0 +1,106 @@
+/*
+  ===========================================================================
+
+  latency_probe - Measures the TX to RX loopback latency with marker bursts.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define LATENCY_PROBE_MARKER 127 // samples
+#define LATENCY_PROBE_BINS 60 // 10 per decade from 10 us
+
+enum latency_stage {
+	LATENCY_INGEST, // /tmp/txfifo
+	LATENCY_TX_FIFO, // LimeSuite TX FIFO
+	LATENCY_RF, // device, RF path and whatever the FIFO fill misses
+	LATENCY_RX_FIFO, // from the antenna to LMS_RecvStream()
+	LATENCY_NETWORK, // ring, packetization and UDP send
+	LATENCY_TOTAL, // from /tmp/txfifo to the Linrad packet
+	LATENCY_STAGES
+};
+
+struct latency_histogram {
+	unsigned long bins[LATENCY_PROBE_BINS + 1]; // last bin is overflow
+	unsigned long count;
+	double sum, min, max;
+};
+
+struct latency_probe {
+	double sample_rate;
+	double interval; // seconds between markers
+	double threshold; // normalized correlation to detect a marker
+	int16_t marker[2 * LATENCY_PROBE_MARKER];
+	int8_t chips[LATENCY_PROBE_MARKER];
+
+	pthread_mutex_t lock;
+	// Everything below is protected by lock
+
+	double next_marker;
+	// The marker in flight
+	int pending;
+	double inject_time; // when it was read from /tmp/txfifo
+	uint64_t tx_timestamp; // estimated device timestamp of its transmission
+	double stage[LATENCY_STAGES];
+	int detected; // waiting for the Linrad packet to be sent
+
+	// Detector state. The window is the last LATENCY_PROBE_MARKER - 1
+	// samples of the previous block followed by the current one
+	int16_t *window;
+	unsigned long searched; // number of the marker being searched
+	int in_peak;
+	double peak_metric;
+	uint64_t peak_timestamp; // of the last sample of the marker
+	double peak_read_time;
+
+	unsigned long injected, lost;
+	struct latency_histogram hist[LATENCY_STAGES];
+};
+
+int latency_probe_init(struct latency_probe *p, double sample_rate, double interval,
+		       int block_samples);
+// Returns 1 if a marker should be injected now
+int latency_probe_due(struct latency_probe *p, double now);
+// Adds the marker to the start of samples (at least LATENCY_PROBE_MARKER
+// long). ingest and tx_fifo are the seconds of samples queued ahead of it
+// in /tmp/txfifo and in the TX FIFO, and tx_timestamp the device timestamp
+// at which it should be transmitted
+void latency_probe_inject(struct latency_probe *p, int16_t *samples, double now,
+			  double ingest, double tx_fifo, uint64_t tx_timestamp);
+// Searches a block of RX samples for the marker. read_time is the host
+// time at which the block was read, and antenna_time(ts) should give the
+// host time at which the sample with timestamp ts was received
+void latency_probe_detect(struct latency_probe *p, const int16_t *samples, int count,
+			  uint64_t timestamp, double read_time,
+			  double (*antenna_time)(void *, uint64_t), void *arg);
+// Called once the block last passed to latency_probe_detect() has been
+// sent to Linrad
+void latency_probe_sent(struct latency_probe *p, double now);
+// Gives the number of markers measured from end to end so far, and the sum
+// of their latencies in seconds
+void latency_probe_total(struct latency_probe *p, unsigned long *count, double *sum);
+void latency_probe_print(struct latency_probe *p);
+void latency_probe_print_histograms(struct latency_probe *p);
+void latency_probe_free(struct latency_probe *p);
+
+#endif
@@ -24,10 +24,13 @@
   ===========================================================================
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 
 #include <sys/types.h>
@@ -35,19 +38,63 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
 
 #include <unistd.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
 
 #include <lime/LimeSuite.h>
 
+#include "block_ring.h"
+#include "latency_probe.h"
+#include "rx_gap.h"
+#include "rx_level.h"
+#include "ssb_mod.h"
+#include "timeline.h"
+#include "tx_limiter.h"
+#include "demod_bank.h"
+#include "freq_comp.h"
+#include "iq_bus.h"
+#include "iq_corr.h"
+#include "occupancy.h"
+#include "rtl_tcp.h"
+#include "stream_tune.h"
+#include "dpd.h"
+#include "own_signal.h"
+#include "tx_watchdog.h"
+#include "udp_tx.h"
+#include "worker_pool.h"
+#include "xdp_tx.h"
+
 #define LINRAD_NET_MULTICAST_PAYLOAD 1392
 #define LINRAD_SAMPLES_PER_PACKET (LINRAD_NET_MULTICAST_PAYLOAD/(sizeof(int16_t) * 2))
 
 #define LINRAD_BUFSIZE 4096
 #define LINRAD_BASE_PORT 50100
+#define DEMOD_BASE_PORT 50200
+
+#define MAX_DEVICES 8
+#define RING_SECONDS 0.5
+#define MIN_RING_BLOCKS 16
+#define MAX_GAP_FILL 1.0 // seconds
+#define SEND_BACKOFF_MIN 1e-3 // seconds
+#define SEND_BACKOFF_MAX 0.1
+#define AGC_HYSTERESIS 6.0 // dB
+#define IQ_CORR_ESTIMATE_SAMPLES 64 // of each packet, for the DC and IQ imbalance estimate
+#define MODULATOR_QUEUE 0.02 // seconds of IQ samples between the modulator and TX
+#define TX_LEAD 0.01 // seconds of UDP TX samples in the FIFO ahead of their time
+#define TRIAL_POLL 0.01 // seconds between the stream status reads of a tuner trial
+// Linrad packets in a UDP GSO send, which must fit in a 64 KiB datagram
+#define GSO_PACKETS 46
 
 struct linrad_udp_packet {
 	double passband_center;
@@ -68,13 +115,8 @@ void init_linrad_header(struct linrad_udp_packet *p, double passband_center) {
 	p->ptr = LINRAD_NET_MULTICAST_PAYLOAD;
 }
 
-int linrad_header_fill_time(struct linrad_udp_packet *p) {
-	struct timespec t;
-
-	if (clock_gettime(CLOCK_REALTIME, &t) == -1) return -1;
-	p->time = t.tv_sec * 1000 + t.tv_nsec / 1000000;
-
-	return 0;
+void linrad_header_set_time(struct linrad_udp_packet *p, double host_time) {
+	p->time = (int64_t) (host_time * 1000);
 }
 
 void next_linrad_header(struct linrad_udp_packet *p) {
@@ -82,18 +124,41 @@ void next_linrad_header(struct linrad_udp_packet *p) {
 	p->block_no++;
 }
 
-int open_linrad_udp_socket(int *sock, struct sockaddr_in *sockaddr, const char *ip) {
+// Moves the header past count packets that are never sent. Both block_no
+// and ptr repeat every 65536 packets
+void skip_linrad_headers(struct linrad_udp_packet *p, uint64_t count) {
+	for (unsigned int j = 0; j < count % 65536; j++) next_linrad_header(p);
+}
+
+int open_linrad_udp_socket(int *sock, struct sockaddr_in *sockaddr, const char *ip, int port) {
 	*sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (*sock < 0) return -1;
 	
 	memset(sockaddr, 0, sizeof(*sockaddr));
 	sockaddr->sin_family = AF_INET;
-	sockaddr->sin_port = htons(LINRAD_BASE_PORT);
+	sockaddr->sin_port = htons(port);
 	sockaddr->sin_addr.s_addr = inet_addr(ip);
 
 	return 0;
 }
 
+int open_audio_socket(int *sock, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	*sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (*sock < 0) return -1;
+	unlink(path);
+	if (bind(*sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(*sock, 1) < 0) {
+		close(*sock);
+		return -1;
+	}
+	return 0;
+}
+
 int limesdr_open(unsigned int device_i, lms_device_t **device) {
 	int device_count = LMS_GetDeviceList(NULL);
 	if (device_count < 0) {
@@ -138,13 +203,14 @@ int limesdr_open(unsigned int device_i, lms_device_t **device) {
 }
 
 int limesdr_enable_channels(lms_device_t *device,
-			    unsigned int in_channel, unsigned int out_channel) {
-	if (LMS_EnableChannel(device, LMS_CH_TX, out_channel, true) < 0) {
+			    unsigned int in_channel, unsigned int out_channel,
+			    int has_rx, int has_tx) {
+	if (has_tx && LMS_EnableChannel(device, LMS_CH_TX, out_channel, true) < 0) {
 		fprintf(stderr, "LMS_EnableChannel() (TX) : %s\n", LMS_GetLastErrorMessage());
 		return -1;
 	}
 
-	if (LMS_EnableChannel(device, LMS_CH_RX, in_channel, true) < 0) {
+	if (has_rx && LMS_EnableChannel(device, LMS_CH_RX, in_channel, true) < 0) {
 		fprintf(stderr, "LMS_EnableChannel() (RX) : %s\n", LMS_GetLastErrorMessage());
 		return -1;
 	}
@@ -196,11 +262,1046 @@ int limesdr_set_frequency(lms_device_t *device, int is_tx, unsigned int channel,
 	return 0;
 }
 
+struct streamer_device {
+	int id; // position in the -d list, which selects the Linrad UDP port
+	unsigned int index;
+	lms_device_t *device;
+	int has_rx, has_tx;
+	double in_freq;
+	lms_stream_t rx_stream, tx_stream;
+
+	struct block_ring ring;
+	int16_t *scratch; // RX samples that do not fit in the ring
+	int16_t *corrected; // block for the consumers, with the IQ correction
+	struct rx_gap_reader gap;
+	struct rx_level level;
+	struct iq_corr iq;
+	struct iq_corr_coefs iq_coefs; // of the block being fed
+	struct iq_bus bus;
+	int use_bus;
+	atomic_ulong rx_samples;
+	unsigned long status_rx_samples;
+	double status_time;
+	struct timeline timeline;
+	// Timestamps plus offset give the common timeline
+	atomic_llong offset;
+	int offset_valid;
+	pthread_t capture_thread, feed_thread, tx_thread;
+
+	int linrad_udp_socket;
+	struct sockaddr_in linrad_udp_sockaddr;
+	struct linrad_udp_packet udp_packet; // header of the next packet
+	struct linrad_udp_packet *packets; // one block of packets
+	// Where the packets are built: packets, or AF_XDP frames
+	struct linrad_udp_packet **packet_buffers;
+	int use_xdp;
+	struct xdp_tx xdp;
+	struct worker_pool pool;
+	int use_gso;
+	double backoff; // seconds, 0 while sends succeed
+	double paused_until;
+	atomic_ulong udp_sent, udp_dropped, udp_errors;
+
+	atomic_int tx_underrun, tx_overrun, tx_dropped;
+};
+
+static atomic_int keep_reading = 1;
+static struct streamer_device devices[MAX_DEVICES];
+static int device_count;
+// The first device with RX. Its timestamps are the common timeline
+static struct streamer_device *timeline_reference;
+// All the devices share the reference clock given by -r
+static int shared_reference_clock;
+static int tx_fd;
+static struct tx_watchdog watchdog;
+static struct tx_limiter limiter;
+// Linrad packets in each RX read. For high sample rates, large reads cut
+// down the per-call overhead of LimeSuite and of the syscalls
+static int block_packets = 1;
+static int block_samples = LINRAD_SAMPLES_PER_PACKET;
+// Stream parameters tuned for this host and sample rate, given by -sc
+static struct stream_tune_params stream_params;
+static int use_stream_params;
+// What to do when Linrad packets cannot be sent
+enum send_policy {
+	SEND_DROP_OLDEST, // drop the block being sent once the ring is full
+	SEND_DROP_NEWEST, // keep retrying, the capture thread drops new blocks
+	SEND_PAUSE // drop everything during the backoff after an error
+};
+static enum send_policy send_policy = SEND_DROP_OLDEST;
+static const char *send_policy_names[] = {
+	[SEND_DROP_OLDEST] = "oldest",
+	[SEND_DROP_NEWEST] = "newest",
+	[SEND_PAUSE] = "pause"
+};
+// Loopback latency measurement, with RX of the TX device tuned to TX
+static int latency_mode;
+static struct latency_probe probe;
+static volatile sig_atomic_t print_histograms = 0;
+// Built-in modulator. It feeds the TX thread through a pipe that replaces
+// /tmp/txfifo
+static struct ssb_mod modulator;
+static int audio_socket = -1;
+static int modulator_pipe[2];
+static pthread_t modulator_thread_id;
+static const char *modulator_mode_names[] = {
+	[SSB_MOD_USB] = "usb",
+	[SSB_MOD_LSB] = "lsb",
+	[SSB_MOD_CW] = "cw"
+};
+// Peak level in dBFS for the analog AGC, 0 for a fixed gain
+static double agc_peak;
+// Demodulators of the first RX device
+static struct demod_bank demods;
+static int use_demods;
+// Shared memory bus of the TX samples, as sent to the FIFO
+static struct iq_bus tx_bus;
+static int use_tx_bus;
+// Temperature compensation of the reference frequency error
+static struct freq_comp freq_comp;
+static int use_freq_comp;
+static struct occupancy occupancy;
+static int use_occupancy;
+static struct rtl_tcp rtl_server;
+static int use_rtl_tcp;
+// TX samples from UDP packets, sent at their timestamps
+static struct udp_tx udp_input;
+static int use_udp_tx;
+// Predistortion of the TX samples, learnt from RX of the TX device
+static struct dpd dpd;
+static int use_dpd;
+static struct own_signal monitor;
+static int use_monitor;
+// DC and IQ imbalance correction of the Linrad packets
+static int use_iq_corr = 1;
+
+static double host_time_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// Maps a device timestamp to the common timeline, going through the host
+// time at which each device took the sample
+static uint64_t common_timestamp(struct streamer_device *d, uint64_t timestamp) {
+	if (d == timeline_reference || !timeline_valid(&timeline_reference->timeline)) {
+		return timestamp + atomic_load(&d->offset);
+	}
+	double t = timeline_timestamp(&timeline_reference->timeline,
+				      timeline_host_time(&d->timeline, timestamp));
+	int64_t offset = llround(t - (double) timestamp);
+	if (!shared_reference_clock) {
+		atomic_store(&d->offset, offset);
+		return timestamp + offset;
+	}
+
+	// With a common reference clock the offset is constant, so it is only
+	// updated if the estimate moves by more than a sample
+	if (!d->offset_valid || llabs(offset - atomic_load(&d->offset)) > 1) {
+		atomic_store(&d->offset, offset);
+		d->offset_valid = 1;
+	}
+	return timestamp + atomic_load(&d->offset);
+}
+
+static double antenna_time(void *arg, uint64_t timestamp) {
+	struct streamer_device *d = arg;
+	return timeline_host_time(&d->timeline, timestamp);
+}
+
+// Adds a latency marker at the start of the samples to send
+static void inject_marker(struct streamer_device *d, int16_t *samples,
+			  const lms_stream_status_t *tx_status) {
+	double now = host_time_now();
+	int queued = 0;
+	if (ioctl(tx_fd, FIONREAD, &queued) < 0) queued = 0;
+	double sample_rate = d->timeline.sample_rate;
+	// The TX limiter delays the samples before they go into the FIFO
+	int tx_queued = tx_status->fifoFilledCount + tx_limiter_delay(&limiter);
+	uint64_t tx_timestamp = llround(timeline_timestamp(&d->timeline, now)) + tx_queued;
+	latency_probe_inject(&probe, samples, now,
+			     queued / (2 * sizeof(int16_t)) / sample_rate,
+			     tx_queued / sample_rate, tx_timestamp);
+}
+
+// Without UDP TX the stream has no timestamps, so the device timestamp of
+// the first sample is estimated from the FIFO level
+static void publish_tx(struct streamer_device *d, const int16_t *samples, int count,
+		       const lms_stream_status_t *tx_status, const lms_stream_meta_t *meta) {
+	double now = host_time_now();
+	if (meta) {
+		iq_bus_publish(&tx_bus, samples, count, meta->timestamp,
+			       timeline_valid(&d->timeline)
+			       ? timeline_host_time(&d->timeline, meta->timestamp) : now, 0);
+		return;
+	}
+	if (!timeline_valid(&d->timeline)) {
+		iq_bus_publish(&tx_bus, samples, count, 0, now, IQ_BUS_NO_TIMESTAMP);
+		return;
+	}
+	uint64_t timestamp = llround(timeline_timestamp(&d->timeline, now))
+		+ tx_status->fifoFilledCount;
+	iq_bus_publish(&tx_bus, samples, count, timestamp,
+		       timeline_host_time(&d->timeline, timestamp), IQ_BUS_TIMESTAMP_ESTIMATED);
+}
+
+static void handle_sigusr1(int sig) {
+	(void) sig;
+	print_histograms = 1;
+}
+
+static void *capture_thread(void *arg) {
+	struct streamer_device *d = arg;
+
+	while (keep_reading) {
+		struct block_ring_block *b = block_ring_write_begin(&d->ring);
+		int16_t *buffer = b ? b->samples : d->scratch;
+		uint64_t timestamp;
+		if (rx_gap_read(&d->gap, &d->rx_stream, buffer, block_samples, &timestamp) < 0) {
+			keep_reading = 0;
+			break;
+		}
+
+		double host_time = host_time_now();
+		timeline_update(&d->timeline, timestamp + block_samples - 1, host_time);
+		atomic_fetch_add_explicit(&d->rx_samples, block_samples, memory_order_relaxed);
+		if (b) {
+			b->timestamp = timestamp;
+			b->host_time = host_time;
+			block_ring_write_commit(&d->ring);
+		}
+	}
+	return NULL;
+}
+
+struct packetize_job {
+	const int16_t *samples;
+	struct linrad_udp_packet **packets; // NULL if the block is not sent
+	int gain; // digital
+	const struct iq_corr_coefs *correction; // includes the gain, NULL if not used
+	// Copy for the consumers, with the correction but not the gain. NULL
+	// if there is no correction or no consumers
+	int16_t *corrected;
+	const struct iq_corr_coefs *consumer_correction;
+};
+
+static void packetize(void *arg, int begin, int end) {
+	struct packetize_job *job = arg;
+	for (int j = begin; j < end; j++) {
+		const int16_t *samples = job->samples + 2 * j * LINRAD_SAMPLES_PER_PACKET;
+		if (job->corrected) {
+			iq_corr_apply(job->consumer_correction,
+				      job->corrected + 2 * j * LINRAD_SAMPLES_PER_PACKET,
+				      samples, LINRAD_SAMPLES_PER_PACKET);
+		}
+		if (!job->packets) continue;
+		int16_t *buffer = (int16_t *) job->packets[j]->buffer;
+		if (job->correction) {
+			iq_corr_apply(job->correction, buffer, samples, LINRAD_SAMPLES_PER_PACKET);
+			continue;
+		}
+		if (job->gain == RX_LEVEL_GAIN_ONE) {
+			memcpy(buffer, samples, LINRAD_NET_MULTICAST_PAYLOAD);
+		}
+		else {
+			rx_level_apply(buffer, samples, LINRAD_SAMPLES_PER_PACKET, job->gain);
+		}
+
+		// Adjust DC bias
+		for (int i = 0; i < 2 * LINRAD_SAMPLES_PER_PACKET; i++) {
+			buffer[i] |= 8; // 3 LSBs are guaranteed to be zero
+		}
+	}
+}
+
+// Sends count packets starting at first without blocking. Returns the
+// number of packets sent, or -1 if none could be sent
+static int send_linrad_packets(struct streamer_device *d, int first, int count) {
+	struct linrad_udp_packet *p = d->packets + first;
+	if (count == 1) {
+		if (sendto(d->linrad_udp_socket, p, sizeof(*p), MSG_DONTWAIT,
+			   (struct sockaddr *) &d->linrad_udp_sockaddr,
+			   sizeof(d->linrad_udp_sockaddr)) < 0) {
+			return -1;
+		}
+		return 1;
+	}
+
+	int sent = 0;
+#ifdef UDP_SEGMENT
+	// The packets are contiguous, so the kernel can cut a large datagram
+	// into Linrad packets
+	while (d->use_gso && sent < count) {
+		int n = count - sent < GSO_PACKETS ? count - sent : GSO_PACKETS;
+		struct iovec iov = { .iov_base = p + sent, .iov_len = n * sizeof(*p) };
+		char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+		struct msghdr msg = {
+			.msg_name = &d->linrad_udp_sockaddr,
+			.msg_namelen = sizeof(d->linrad_udp_sockaddr),
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control,
+			.msg_controllen = sizeof(control)
+		};
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *) CMSG_DATA(cm) = sizeof(*p);
+		if (sendmsg(d->linrad_udp_socket, &msg, MSG_DONTWAIT) < 0) {
+			if (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT) {
+				return sent ? sent : -1;
+			}
+			fprintf(stderr, "UDP GSO not available. Using sendmmsg()\n");
+			d->use_gso = 0;
+			break;
+		}
+		sent += n;
+	}
+#endif
+
+	if (sent < count) {
+		int n = count - sent;
+		struct mmsghdr msgs[n];
+		struct iovec iovs[n];
+		for (int j = 0; j < n; j++) {
+			iovs[j] = (struct iovec) { .iov_base = &p[sent + j], .iov_len = sizeof(*p) };
+			msgs[j] = (struct mmsghdr) {
+				.msg_hdr = {
+					.msg_name = &d->linrad_udp_sockaddr,
+					.msg_namelen = sizeof(d->linrad_udp_sockaddr),
+					.msg_iov = &iovs[j],
+					.msg_iovlen = 1
+				}
+			};
+		}
+		int ret = sendmmsg(d->linrad_udp_socket, msgs, n, MSG_DONTWAIT);
+		if (ret < 0) return sent ? sent : -1;
+		sent += ret;
+	}
+	return sent;
+}
+
+// Errors that may go away by themselves: full socket buffers, or the
+// network or the Linrad host being down
+static int transient_send_error(int err) {
+	return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS || err == ENOMEM
+		|| err == ENETUNREACH || err == EHOSTUNREACH || err == ENETDOWN
+		|| err == EHOSTDOWN || err == ECONNREFUSED || err == EPERM;
+}
+
+static void sleep_seconds(double t) {
+	struct timespec ts = { .tv_sec = t, .tv_nsec = 1e9 * (t - (long) t) };
+	nanosleep(&ts, NULL);
+}
+
+// Called after a transient send error. Waits for the backoff and returns
+// 1 to retry, or returns 0 if the block should be dropped, according to
+// the send policy
+static int send_backoff(struct streamer_device *d) {
+	atomic_fetch_add(&d->udp_errors, 1);
+	if (d->backoff == 0) {
+		perror("Could not send UDP packet, retrying");
+	}
+	d->backoff = d->backoff ? 2 * d->backoff : SEND_BACKOFF_MIN;
+	if (d->backoff > SEND_BACKOFF_MAX) d->backoff = SEND_BACKOFF_MAX;
+
+	if (send_policy == SEND_PAUSE) {
+		// Discard everything until the backoff has elapsed
+		d->paused_until = host_time_now() + d->backoff;
+		return 0;
+	}
+	if (send_policy == SEND_DROP_OLDEST) {
+		// This is the oldest block in the ring. Drop it if the ring
+		// could overflow while we wait
+		unsigned int arriving = 2 * d->backoff * d->timeline.sample_rate / block_samples + 1;
+		if (block_ring_count(&d->ring) + arriving >= d->ring.size) return 0;
+	}
+	// With SEND_DROP_NEWEST the capture thread drops blocks when the
+	// ring is full
+	sleep_seconds(d->backoff);
+	return keep_reading;
+}
+
+// Sends a block of packets according to the send policy. Returns 1 if all
+// of them were sent, 0 if some were dropped, or -1 on a fatal error
+static int send_block(struct streamer_device *d) {
+	int sent = 0;
+	while (sent < block_packets) {
+		int n = send_linrad_packets(d, sent, block_packets - sent);
+		if (n > 0) {
+			sent += n;
+			atomic_fetch_add(&d->udp_sent, n);
+			d->backoff = 0;
+			continue;
+		}
+		if (!transient_send_error(errno)) return -1;
+		if (!send_backoff(d)) break;
+	}
+	if (sent < block_packets) {
+		atomic_fetch_add(&d->udp_dropped, block_packets - sent);
+		return 0;
+	}
+	return 1;
+}
+
+static void *feed_thread(void *arg) {
+	struct streamer_device *d = arg;
+	uint64_t next_timestamp = 0;
+	int started = 0;
+	// Whether anything besides Linrad takes the samples of this device
+	int consumers = d->use_bus
+		|| (d->has_tx && (use_dpd || use_monitor || latency_mode))
+		|| (d == timeline_reference
+		    && (use_demods || use_rtl_tcp || use_freq_comp || use_occupancy));
+
+	while (keep_reading) {
+		struct block_ring_block *b = block_ring_read_begin(&d->ring);
+		if (!b) continue;
+		uint64_t timestamp = common_timestamp(d, b->timestamp);
+
+		// Dropped packets also take a Linrad block number, so that
+		// Linrad sees them as lost. Those of the blocks that the capture
+		// thread could not put in the ring show as a timestamp jump
+		if (started && b->timestamp > next_timestamp) {
+			uint64_t skipped = (b->timestamp - next_timestamp) / LINRAD_SAMPLES_PER_PACKET;
+			skip_linrad_headers(&d->udp_packet, skipped);
+			atomic_fetch_add(&d->udp_dropped, skipped);
+		}
+		started = 1;
+		next_timestamp = b->timestamp + block_samples;
+		for (int j = 0; j < block_packets; j++) {
+			struct linrad_udp_packet *p = &d->udp_packet;
+			linrad_header_set_time(p, timeline_host_time(&timeline_reference->timeline,
+								     timestamp + j * LINRAD_SAMPLES_PER_PACKET));
+			memcpy(&d->packets[j], p, offsetof(struct linrad_udp_packet, buffer));
+			next_linrad_header(p);
+		}
+		int gain = rx_level_process(&d->level, b->samples, block_samples);
+		if (use_iq_corr) iq_corr_update(&d->iq, b->samples, block_samples, gain, &d->iq_coefs);
+
+		// Packets are not built for the blocks that are dropped
+		int ret = 1;
+		if (d->paused_until > host_time_now()) ret = 0;
+		else if (d->use_xdp) {
+			// Get frames in the UMEM to build the packets in
+			while (xdp_tx_reserve(&d->xdp, (void **) d->packet_buffers, block_packets) < 0) {
+				if (!send_backoff(d)) {
+					ret = 0;
+					break;
+				}
+			}
+			if (ret) {
+				d->backoff = 0;
+				for (int j = 0; j < block_packets; j++) {
+					memcpy(d->packet_buffers[j], &d->packets[j],
+					       offsetof(struct linrad_udp_packet, buffer));
+				}
+			}
+		}
+		struct iq_corr_coefs consumer_coefs;
+		struct packetize_job job = {
+			.samples = b->samples,
+			.packets = ret ? d->packet_buffers : NULL,
+			.gain = gain,
+			.correction = use_iq_corr ? &d->iq_coefs : NULL
+		};
+		if (use_iq_corr && consumers) {
+			iq_corr_get_coefs(&d->iq, RX_LEVEL_GAIN_ONE, &consumer_coefs);
+			job.corrected = d->corrected;
+			job.consumer_correction = &consumer_coefs;
+		}
+		if (job.packets || job.corrected) {
+			worker_pool_run(&d->pool, packetize, &job, block_packets);
+		}
+
+		const int16_t *samples = job.corrected ? job.corrected : b->samples;
+		if (use_dpd && d->has_tx) dpd_push_rx(&dpd, samples, block_samples, b->timestamp);
+		if (use_monitor && d->has_tx) {
+			own_signal_push_rx(&monitor, samples, block_samples, b->timestamp);
+		}
+		if (latency_mode && d->has_tx) {
+			latency_probe_detect(&probe, samples, block_samples, b->timestamp,
+					     b->host_time, antenna_time, d);
+		}
+		if (use_demods && d == timeline_reference) {
+			demod_bank_push(&demods, samples, block_samples);
+		}
+		if (use_rtl_tcp && d == timeline_reference) {
+			rtl_tcp_push(&rtl_server, samples, block_samples);
+		}
+		if (use_freq_comp && d == timeline_reference) {
+			freq_comp_process(&freq_comp, samples, block_samples);
+		}
+		if (use_occupancy && d == timeline_reference) {
+			occupancy_push(&occupancy, samples, block_samples,
+				       timeline_host_time(&d->timeline, b->timestamp));
+		}
+		if (d->use_bus) {
+			iq_bus_publish(&d->bus, samples, block_samples, b->timestamp,
+				       timeline_host_time(&d->timeline, b->timestamp), 0);
+		}
+
+		if (!ret) {
+			block_ring_read_commit(&d->ring);
+			atomic_fetch_add(&d->udp_dropped, block_packets);
+			continue;
+		}
+		if (d->use_xdp) {
+			xdp_tx_submit(&d->xdp);
+			atomic_fetch_add(&d->udp_sent, block_packets);
+		}
+		else {
+			ret = send_block(d);
+		}
+		block_ring_read_commit(&d->ring);
+		if (ret < 0) {
+			perror("Could not send UDP packet");
+			keep_reading = 0;
+			break;
+		}
+		if (ret > 0 && latency_mode && d->has_tx) {
+			latency_probe_sent(&probe, host_time_now());
+		}
+	}
+	return NULL;
+}
+
+// Waits until fd is ready. Returns 0 if the streamer is stopping
+static int wait_fd(int fd, short events) {
+	struct pollfd pfd = { .fd = fd, .events = events };
+	while (keep_reading) {
+		int ret = poll(&pfd, 1, 100);
+		if (ret > 0) return 1;
+		if (ret < 0 && errno != EINTR) return 0;
+	}
+	return 0;
+}
+
+static int write_modulator_pipe(const int16_t *samples, int count) {
+	const char *p = (const char *) samples;
+	size_t left = 2 * sizeof(int16_t) * count;
+	while (left) {
+		if (!wait_fd(modulator_pipe[1], POLLOUT)) return -1;
+		ssize_t ret = write(modulator_pipe[1], p, left);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR) continue;
+			return -1;
+		}
+		p += ret;
+		left -= ret;
+	}
+	return 0;
+}
+
+// Takes PCM audio (S16_LE, mono) from one client of the audio socket at a
+// time and writes the modulated IQ samples to the TX thread
+static void *modulator_thread(void *arg) {
+	(void) arg;
+	static int16_t audio[SSB_MOD_MAX_AUDIO];
+	int16_t *iq = malloc(2 * sizeof(int16_t) * ssb_mod_max_output(&modulator));
+	if (!iq) {
+		perror("Could not allocate modulator buffer");
+		keep_reading = 0;
+		return NULL;
+	}
+
+	while (keep_reading) {
+		if (!wait_fd(audio_socket, POLLIN)) break;
+		int client = accept(audio_socket, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("Could not accept audio client");
+			keep_reading = 0;
+			break;
+		}
+		fprintf(stderr, "Audio client connected\n");
+		size_t have = 0; // bytes, a sample may arrive split
+		while (wait_fd(client, POLLIN)) {
+			ssize_t ret = read(client, (char *) audio + have, sizeof(audio) - have);
+			if (ret < 0 && errno == EINTR) continue;
+			if (ret <= 0) break;
+			have += ret;
+			int count = have / sizeof(int16_t);
+			int n = ssb_mod_process(&modulator, audio, count, iq);
+			if (write_modulator_pipe(iq, n) < 0) break;
+			if (have % sizeof(int16_t)) {
+				((char *) audio)[0] = ((char *) audio)[have - 1];
+			}
+			have %= sizeof(int16_t);
+		}
+		close(client);
+		fprintf(stderr, "Audio client disconnected\n");
+	}
+	free(iq);
+	return NULL;
+}
+
+static void *tx_thread(void *arg) {
+	struct streamer_device *d = arg;
+	static int16_t txdata[20*LINRAD_SAMPLES_PER_PACKET];
+	const int capacity = sizeof(txdata) / (2 * sizeof(int16_t));
+	// Bytes of a sample split between two reads of /tmp/txfifo
+	char partial[2 * sizeof(int16_t)];
+	int partial_len = 0;
+	double sample_rate;
+	LMS_GetSampleRate(d->device, LMS_CH_TX, 0, &sample_rate, NULL);
+	// Device timestamp of the next sample from UDP, after the limiter
+	uint64_t udp_tx_next = 0;
+	// When there is nothing to do, wait for about one Linrad packet, as
+	// the TX FIFO was serviced once per RX packet
+	struct timespec idle = {
+		.tv_sec = 0,
+		.tv_nsec = 1e9 * LINRAD_SAMPLES_PER_PACKET / sample_rate
+	};
+
+	while (keep_reading) {
+		int ret;
+		lms_stream_status_t tx_status;
+		if (LMS_GetStreamStatus(&d->tx_stream, &tx_status) < 0) {
+			fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
+			break;
+		}
+		atomic_fetch_add(&d->tx_underrun, tx_status.underrun);
+		atomic_fetch_add(&d->tx_overrun, tx_status.overrun);
+		atomic_fetch_add(&d->tx_dropped, tx_status.droppedPackets);
+		// The FIFO can be larger than txdata
+		int to_read = tx_status.fifoSize - tx_status.fifoFilledCount;
+		if (to_read > capacity) to_read = capacity;
+		int to_write = 0;
+		lms_stream_meta_t meta = { .waitForTimestamp = true }, *tx_meta = NULL;
+		if (use_udp_tx) {
+			// The FIFO only gets the samples due in the next TX_LEAD, the
+			// rest wait in the reorder ring. The limiter output lags its
+			// input by its delay, so it is sent that much earlier for the
+			// samples to go out at their timestamps
+			uint64_t timestamp, delay = tx_limiter_delay(&limiter);
+			udp_tx_receive(&udp_input, tx_status.timestamp);
+			to_write = udp_tx_read(&udp_input, txdata, to_read, tx_status.timestamp + delay,
+					       TX_LEAD * sample_rate, &timestamp);
+			if (to_write > 0) udp_tx_next = timestamp - delay;
+		}
+		else if (to_read) {
+			// A read can end in the middle of a sample. Its bytes go
+			// in front of the next read, so that I and Q stay aligned
+			memcpy(txdata, partial, partial_len);
+			int tx_read = read(tx_fd, (char *) txdata + partial_len,
+					   2 * sizeof(int16_t) * to_read - partial_len);
+			if (tx_read < 0) {
+				if ( errno != EAGAIN && errno != EWOULDBLOCK) {
+					perror("Could not read from /tmp/txfifo");
+					break;
+				}
+			}
+			else {
+				int bytes = partial_len + tx_read;
+				to_write = bytes / (2 * sizeof(int16_t));
+				partial_len = bytes % (2 * sizeof(int16_t));
+				memcpy(partial, (char *) txdata + bytes - partial_len, partial_len);
+			}
+		}
+		if (latency_mode && to_read >= LATENCY_PROBE_MARKER
+		    && timeline_valid(&d->timeline) && latency_probe_due(&probe, host_time_now())) {
+			// Markers are sent even if there is nothing else to transmit
+			if (to_write < LATENCY_PROBE_MARKER) {
+				memset(txdata + 2 * to_write, 0,
+				       2 * (LATENCY_PROBE_MARKER - to_write) * sizeof(int16_t));
+				to_write = LATENCY_PROBE_MARKER;
+			}
+			inject_marker(d, txdata, &tx_status);
+		}
+		if (to_write > 0) {
+			tx_limiter_process(&limiter, txdata, to_write);
+		}
+		else if (tx_status.fifoFilledCount <= tx_limiter_delay(&limiter)) {
+			// The transmission is ending. Send what is left in the
+			// limiter before the FIFO runs dry, as much as fits each time
+			to_write = tx_limiter_flush(&limiter, txdata, to_read);
+		}
+		if (to_write > 0 && (use_dpd || use_monitor)) {
+			// Without UDP TX the samples go after those in the FIFO. After
+			// an underrun that estimate is followed, as the FIFO was empty
+			uint64_t timestamp = use_udp_tx ? udp_tx_next
+				: tx_status.timestamp + tx_status.fifoFilledCount;
+			int estimated = !use_udp_tx && !tx_status.underrun;
+			// The monitor compares the downlink with what we meant to send
+			if (use_monitor) {
+				own_signal_push_tx(&monitor, txdata, to_write, timestamp, estimated);
+			}
+			if (use_dpd) dpd_process(&dpd, txdata, to_write, timestamp, estimated);
+		}
+		if (to_write > 0) {
+			if (use_udp_tx) {
+				meta.timestamp = udp_tx_next;
+				udp_tx_next += to_write;
+				tx_meta = &meta;
+			}
+			tx_watchdog_process(&watchdog, txdata, to_write);
+			if (use_tx_bus) publish_tx(d, txdata, to_write, &tx_status, tx_meta);
+			if ((ret = LMS_SendStream(&d->tx_stream, txdata,
+						  to_write,
+						  tx_meta, 1000)) < 0) {
+				fprintf(stderr, "LMS_SendStream() : %s\n", LMS_GetLastErrorMessage());
+				break;
+			}
+			
+			if (ret != to_write) {
+				fprintf(stderr, "Didn't write to TX FIFO all we expected\n");
+				break;
+			}
+		}
+		else {
+			nanosleep(&idle, NULL);
+		}
+	}
+	keep_reading = 0;
+	return NULL;
+}
+
+static void print_status(void) {
+	fprintf(stderr,
+		"STREAM STATUS\n"
+		"-------------\n");
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		const char *prefix = "";
+		char device_prefix[32];
+		if (device_count > 1) {
+			snprintf(device_prefix, sizeof(device_prefix), "[%u] ", d->index);
+			prefix = device_prefix;
+		}
+		if (d->has_tx) {
+			lms_stream_status_t tx_status;
+			if (LMS_GetStreamStatus(&d->tx_stream, &tx_status) < 0) {
+				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
+				keep_reading = 0;
+				return;
+			}
+			atomic_fetch_add(&d->tx_underrun, tx_status.underrun);
+			atomic_fetch_add(&d->tx_overrun, tx_status.overrun);
+			atomic_fetch_add(&d->tx_dropped, tx_status.droppedPackets);
+			fprintf(stderr, "%sTX: %d / %d, under = %d, over = %d, dropped = %d\n",
+				prefix, tx_status.fifoFilledCount, tx_status.fifoSize,
+				atomic_load(&d->tx_underrun), atomic_load(&d->tx_overrun),
+				atomic_load(&d->tx_dropped));
+			tx_limiter_print(&limiter);
+			if (use_dpd) dpd_print(&dpd);
+			if (use_monitor) own_signal_print(&monitor);
+		}
+		if (d->has_rx) {
+			lms_stream_status_t rx_status;
+			if (LMS_GetStreamStatus(&d->rx_stream, &rx_status) < 0) {
+				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
+				keep_reading = 0;
+				return;
+			}
+			unsigned long rx_samples = atomic_load(&d->rx_samples);
+			double now = host_time_now();
+			double rate = d->status_time ? (rx_samples - d->status_rx_samples)
+				/ (now - d->status_time) : 0;
+			d->status_rx_samples = rx_samples;
+			d->status_time = now;
+			fprintf(stderr, "%sRX: %d / %d, under = %d, over = %d, dropped = %d, "
+				"ring dropped = %lu, rate = %.3f Msps\n",
+				prefix, rx_status.fifoFilledCount, rx_status.fifoSize,
+				rx_status.underrun, rx_status.overrun, rx_status.droppedPackets,
+				atomic_load(&d->ring.dropped), 1e-6 * rate);
+			rx_gap_print(&d->gap, prefix);
+			rx_level_print(&d->level, prefix);
+			if (use_iq_corr) iq_corr_print(&d->iq, prefix);
+			fprintf(stderr, "%sUDP: sent = %lu, queued = %u, dropped = %lu, errors = %lu\n",
+				prefix, atomic_load(&d->udp_sent),
+				block_ring_count(&d->ring) * block_packets,
+				atomic_load(&d->udp_dropped), atomic_load(&d->udp_errors));
+			if (device_count > 1) {
+				fprintf(stderr, "%stimeline offset = %lld samples, clock = %+.3f ppm\n",
+					prefix, atomic_load(&d->offset), timeline_ppm(&d->timeline));
+			}
+		}
+	}
+	tx_watchdog_print(&watchdog);
+	if (latency_mode) latency_probe_print(&probe);
+	if (use_demods) demod_bank_print(&demods);
+	if (use_freq_comp) freq_comp_print(&freq_comp);
+	if (use_occupancy) occupancy_print(&occupancy);
+	if (use_rtl_tcp) rtl_tcp_print(&rtl_server);
+	if (use_udp_tx) udp_tx_print(&udp_input);
+}
+
+// Sets up the streams and the RX buffers that depend on the read size,
+// with params, or with the defaults if it is NULL
+static int setup_streams(const struct stream_tune_params *params, unsigned int in_channel,
+			 unsigned int out_channel, double sample_rate) {
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx) {
+			d->rx_stream = (lms_stream_t) {
+				.channel = in_channel,
+				.fifoSize = params ? params->rx_fifo * LINRAD_SAMPLES_PER_PACKET
+					    : block_packets > 1 ? 8 * block_samples : LINRAD_SAMPLES_PER_PACKET*10,
+				.throughputVsLatency = params ? params->throughput
+						       : block_packets > 1 ? 1 : 0.5,
+				.isTx = LMS_CH_RX,
+				.dataFmt = LMS_FMT_I16
+			};
+			if ( LMS_SetupStream(d->device, &d->rx_stream) < 0 ) {
+				fprintf(stderr, "LMS_SetupStream() : %s\n", LMS_GetLastErrorMessage());
+				return -1;
+			}
+
+			unsigned int ring_blocks = RING_SECONDS * sample_rate / block_samples;
+			if (ring_blocks < MIN_RING_BLOCKS) ring_blocks = MIN_RING_BLOCKS;
+			if (block_ring_init(&d->ring, ring_blocks, block_samples) < 0) {
+				return -1;
+			}
+			fprintf(stderr, "RX ring: %u blocks of %d samples (%s)\n",
+				d->ring.size, block_samples,
+				d->ring.hugepages ? "huge pages" : "normal pages");
+			if (rx_gap_init(&d->gap, sample_rate, block_samples, MAX_GAP_FILL) < 0) {
+				return -1;
+			}
+			d->scratch = malloc(2 * block_samples * sizeof(int16_t));
+			d->corrected = malloc(2 * block_samples * sizeof(int16_t));
+			d->packets = malloc(block_packets * sizeof(*d->packets));
+			d->packet_buffers = malloc(block_packets * sizeof(*d->packet_buffers));
+			if (!d->scratch || !d->corrected || !d->packets || !d->packet_buffers) {
+				perror("Could not allocate RX buffer");
+				return -1;
+			}
+			for (int j = 0; j < block_packets; j++) {
+				d->packet_buffers[j] = &d->packets[j];
+			}
+			timeline_init(&d->timeline, sample_rate);
+			d->offset_valid = 0;
+			d->backoff = 0;
+			d->paused_until = 0;
+		}
+		if (d->has_tx) {
+			d->tx_stream = (lms_stream_t) {
+				.channel = out_channel,
+				// With UDP TX the FIFO holds the samples of the next TX_LEAD
+				.fifoSize = use_udp_tx ? 2 * TX_LEAD * sample_rate
+					    : params ? params->tx_fifo * LINRAD_SAMPLES_PER_PACKET
+					    : LINRAD_SAMPLES_PER_PACKET*10,
+				.throughputVsLatency = params ? params->throughput : 0.5,
+				.isTx = LMS_CH_TX,
+				.dataFmt = LMS_FMT_I16
+			};
+			if ( LMS_SetupStream(d->device, &d->tx_stream) < 0 ) {
+				fprintf(stderr, "LMS_SetupStream() : %s\n", LMS_GetLastErrorMessage());
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void destroy_streams(void) {
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx) {
+			LMS_DestroyStream(d->device, &d->rx_stream);
+			block_ring_free(&d->ring);
+			rx_gap_free(&d->gap);
+			free(d->scratch);
+			free(d->corrected);
+			free(d->packets);
+			free(d->packet_buffers);
+		}
+		if (d->has_tx) LMS_DestroyStream(d->device, &d->tx_stream);
+	}
+}
+
+static int start_streaming(void) {
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx && LMS_StartStream(&d->rx_stream) < 0) {
+			fprintf(stderr, "LMS_StartStream() (RX) : %s\n", LMS_GetLastErrorMessage());
+		}
+		if (d->has_tx && LMS_StartStream(&d->tx_stream) < 0) {
+			fprintf(stderr, "LMS_StartStream() (TX) : %s\n", LMS_GetLastErrorMessage());
+		}
+	}
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (!d->has_rx) continue;
+		if (pthread_create(&d->capture_thread, NULL, capture_thread, d) != 0
+		    || pthread_create(&d->feed_thread, NULL, feed_thread, d) != 0) {
+			fprintf(stderr, "Could not create RX threads\n");
+			return -1;
+		}
+	}
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_tx && pthread_create(&d->tx_thread, NULL, tx_thread, d) != 0) {
+			fprintf(stderr, "Could not create TX thread\n");
+			return -1;
+		}
+	}
+	if (audio_socket >= 0
+	    && pthread_create(&modulator_thread_id, NULL, modulator_thread, NULL) != 0) {
+		fprintf(stderr, "Could not create modulator thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Waits for the threads once keep_reading is 0, and stops the streams
+static void stop_streaming(void) {
+	for (int k = 0; k < device_count; k++) {
+		if (devices[k].has_tx) pthread_join(devices[k].tx_thread, NULL);
+	}
+	if (audio_socket >= 0) pthread_join(modulator_thread_id, NULL);
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx) {
+			pthread_join(d->capture_thread, NULL);
+			block_ring_wake(&d->ring);
+			pthread_join(d->feed_thread, NULL);
+			LMS_StopStream(&d->rx_stream);
+			// The feed thread may have stopped with frames reserved
+			if (d->use_xdp) xdp_tx_release(&d->xdp);
+		}
+		if (d->has_tx) LMS_StopStream(&d->tx_stream);
+	}
+}
+
+struct trial_setup {
+	unsigned int in_channel, out_channel;
+	double sample_rate;
+};
+
+// Polled during a trial. The FIFO levels are those of the fullest device,
+// summed over the polls
+struct trial_poll {
+	unsigned long rx_errors;
+	double rx_fill, tx_fill; // samples
+	unsigned long count;
+};
+
+// The stream status counters restart when they are read. Those of TX are
+// kept in the device, as the TX thread also reads them
+static int poll_trial(struct trial_poll *t) {
+	int rx_fill = 0, tx_fill = 0;
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		lms_stream_status_t status;
+		if (d->has_tx) {
+			if (LMS_GetStreamStatus(&d->tx_stream, &status) < 0) {
+				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
+				return -1;
+			}
+			atomic_fetch_add(&d->tx_underrun, status.underrun);
+			atomic_fetch_add(&d->tx_overrun, status.overrun);
+			atomic_fetch_add(&d->tx_dropped, status.droppedPackets);
+			if (status.fifoFilledCount > tx_fill) tx_fill = status.fifoFilledCount;
+		}
+		if (d->has_rx) {
+			if (LMS_GetStreamStatus(&d->rx_stream, &status) < 0) {
+				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
+				return -1;
+			}
+			t->rx_errors += status.overrun + status.droppedPackets;
+			if (status.fifoFilledCount > rx_fill) rx_fill = status.fifoFilledCount;
+		}
+	}
+	t->rx_fill += rx_fill;
+	t->tx_fill += tx_fill;
+	t->count++;
+	return 0;
+}
+
+// Samples lost anywhere between the RX FIFO and Linrad, and TX errors
+static void trial_errors(unsigned long *rx_errors, unsigned long *tx_errors) {
+	*rx_errors = *tx_errors = 0;
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx) {
+			*rx_errors += atomic_load(&d->gap.lost_samples) + atomic_load(&d->ring.dropped)
+				+ atomic_load(&d->udp_dropped);
+		}
+		if (d->has_tx) *tx_errors += atomic_load(&d->tx_underrun) + atomic_load(&d->tx_dropped);
+	}
+}
+
+// Trial of the stream tuner. It streams as usual, through all the enabled
+// consumers, and in latency mode it measures the latency with the markers
+static int stream_trial(void *arg, const struct stream_tune_params *params,
+			double seconds, struct stream_tune_result *result) {
+	const struct trial_setup *setup = arg;
+	double sample_rate = setup->sample_rate;
+	block_packets = params->block_packets;
+	block_samples = block_packets * LINRAD_SAMPLES_PER_PACKET;
+	if (setup_streams(params, setup->in_channel, setup->out_channel, sample_rate) < 0
+	    || start_streaming() < 0) {
+		return -1;
+	}
+
+	struct trial_poll poll = {0};
+	unsigned long rx_start = 0, tx_start = 0, rx_end, tx_end, markers = 0, markers_end;
+	double latency = 0, latency_end;
+	double start = host_time_now(), end = start + STREAM_TUNE_WARMUP + seconds;
+	int measuring = 0, ret = 0;
+	struct timespec poll_sleep = { .tv_sec = 0, .tv_nsec = 1e9 * TRIAL_POLL };
+	while (keep_reading && host_time_now() < end) {
+		nanosleep(&poll_sleep, NULL);
+		if (poll_trial(&poll) < 0) {
+			ret = -1;
+			break;
+		}
+		if (!measuring && host_time_now() >= start + STREAM_TUNE_WARMUP) {
+			measuring = 1;
+			poll = (struct trial_poll) {0};
+			trial_errors(&rx_start, &tx_start);
+			if (latency_mode) latency_probe_total(&probe, &markers, &latency);
+		}
+	}
+	// The threads only stop by themselves on errors
+	if (!keep_reading || !measuring) ret = -1;
+	keep_reading = 0;
+	stop_streaming();
+	keep_reading = 1;
+
+	if (ret == 0) {
+		trial_errors(&rx_end, &tx_end);
+		result->rx_errors = poll.rx_errors + rx_end - rx_start;
+		result->tx_errors = tx_end - tx_start;
+		// A sample waits in the RX FIFO and in the read block, and then
+		// in the TX FIFO
+		result->rx_latency = (poll.count ? poll.rx_fill / poll.count : 0) / sample_rate
+			+ block_samples / sample_rate;
+		result->tx_latency = (poll.count ? poll.tx_fill / poll.count : 0) / sample_rate;
+		result->latency = NAN;
+		if (latency_mode) {
+			latency_probe_total(&probe, &markers_end, &latency_end);
+			if (markers_end > markers) {
+				result->latency = (latency_end - latency) / (markers_end - markers);
+			}
+		}
+	}
+	destroy_streams();
+	return ret;
+}
+
+// Parses a comma separated list. A single value applies to all the devices
+static int parse_list(const char *arg, double *values, int max) {
+	int n = 0;
+	const char *p = arg;
+	while (n < max) {
+		char *end;
+		values[n++] = strtod(p, &end);
+		if (end == p) return -1;
+		if (*end != ',') break;
+		p = end + 1;
+	}
+	return n;
+}
+
 int main(int argc, char** argv)
 {
 	if ( argc < 2 ) {
 		printf("Usage: %s <OPTIONS>\n", argv[0]);
-		printf("  -if <INPUT_FREQUENCY>\n"
+		printf("  -if <INPUT_FREQUENCY>[,<INPUT_FREQUENCY>...] (one per device, 0 for no RX)\n"
 		       "  -ii <INPUT_IF_FREQUENCY> (default: 0Hz)\n"
 		       "  -il <INPUT_LO_FREQUENCY> (default: 0Hz)\n"
 		       "  -ib <INPUT_LPF_BW> (default: none)\n"
@@ -210,29 +1311,129 @@ int main(int argc, char** argv)
 		       "  -ob <OUTPUT_LPF_BW> (default: none)\n"
 		       "  -b <BANDWIDTH_CALIBRATING> (default: 8e6)\n"
 		       "  -s <SAMPLE_RATE> (default: 2e6)\n"
-		       "  -ig <INPUT_GAIN_NORMALIZED> (default: 1)\n"
+		       "  -ig <INPUT_GAIN_NORMALIZED> (default: 1, initial gain with -ag)\n"
+		       "  -ag <AGC_PEAK_dBFS> (default: 0, no AGC)\n"
+		       "  -dg <MAX_DIGITAL_GAIN_dB> (default: 0, no digital gain)\n"
+		       "  -lv <LEVEL_LOG_FILE> (default: none, RX level each second)\n"
+		       "  -iq <0|1> (default: 1, DC and IQ imbalance correction, 0 for a fixed bias)\n"
+		       "  -ix <IQ_LOG_FILE> (default: none, IQ correction estimates each second)\n"
 		       "  -og <OUTPUT_GAIN_NORMALIZED> (default: 1)\n"
-		       "  -d <DEVICE_INDEX> (default: 0)\n"
+		       "  -d <DEVICE_INDEX>[,<DEVICE_INDEX>...] (default: 0)\n"
+		       "  -td <TX_DEVICE_INDEX> (default: the first device)\n"
+		       "  -bk <PACKETS_PER_READ> (default: 1, larger for high sample rates)\n"
+		       "  -fw <FEED_THREADS> (default: 1)\n"
+		       "  -np <oldest|newest|pause> (default: oldest, packets to drop if Linrad UDP stalls)\n"
+		       "  -xdp <INTERFACE> (default: none, send Linrad packets through AF_XDP)\n"
+		       "  -xq <XDP_QUEUE> (default: 0, plus the position of the device in -d)\n"
+		       "  -xm <LINRAD_MAC> (default: from the ARP table)\n"
 		       "  -ic <CHANNEL_INDEX> (default: 0)\n"
 		       "  -oc <CHANNEL_INDEX> (default: 0)\n"
-		       "  -r <REFERENCE_CLOCK> (default: do not change))\n"
-		       "  -ip <IP TO SEND UDP>\n");
+		       "  -r <REFERENCE_CLOCK> (default: do not change, shared by all devices if given)\n"
+		       "  -ip <IP TO SEND UDP> (port 50100 for the first device, 50101 for the second...)\n"
+		       "  -wt <TX_TIMEOUT> (default: 900s, 0 to disable)\n"
+		       "  -wd <TX_DUTY_CYCLE_LIMIT> (default: 1, no limit)\n"
+		       "  -ww <TX_DUTY_CYCLE_WINDOW> (default: 3600s)\n"
+		       "  -we <TX_ENERGY_THRESHOLD> (default: -50dBFS)\n"
+		       "  -wg <PTT_GPIO> (default: none, sysfs value file)\n"
+		       "  -wr <RIGCTLD_PTT_IP:PORT> (default: none, watch the PTT through rigctld_ptt)\n"
+		       "  -tl <TX_PEAK_LIMIT_dBFS> (default: 0, no limiter)\n"
+		       "  -tc <TX_CREST_FACTOR_dB> (default: 0, no crest factor reduction)\n"
+		       "  -lm <LATENCY_MARKER_INTERVAL> (default: 0s, no latency measurement)\n"
+		       "  -ma <AUDIO_SOCKET> (default: none, modulate PCM audio instead of /tmp/txfifo)\n"
+		       "  -mm <usb|lsb|cw> (default: usb)\n"
+		       "  -mr <AUDIO_RATE> (default: 48000)\n"
+		       "  -mf <AUDIO_OFFSET_FREQUENCY> (default: 0Hz, relative to the TX frequency)\n"
+		       "  -ml <MODULATOR_LEVEL> (default: -6dBFS for full scale audio)\n"
+		       "  -dm <usb|lsb|cw>:<OFFSET>[,...] (default: none, demodulators of the first RX device)\n"
+		       "  -dr <DEMOD_AUDIO_RATE> (default: 8000)\n"
+		       "  -da <IP TO SEND AUDIO> (default: the -ip address)\n"
+		       "  -dp <DEMOD_PORT> (default: 50200 for the first demodulator, 50201 for the second...)\n"
+		       "  -sm <BUS_NAME> (default: none, publish RX in shared memory as /<BUS_NAME>-rx<N>)\n"
+		       "  -st <0|1> (default: 0, also publish TX as /<BUS_NAME>-tx)\n"
+		       "  -fm <FREQ_MODEL_FILE> (default: none, no temperature compensation)\n"
+		       "  -fb <BEACON_FREQUENCY> (default: 0, only apply the model in -fm)\n"
+		       "  -fk <cw|bpsk> (default: cw, beacon modulation)\n"
+		       "  -ut <UDP_TX_PORT> (default: none, take TX samples from UDP instead of /tmp/txfifo)\n"
+		       "  -uj <UDP_TX_DELAY> (default: 0.1s, playout delay for the network jitter)\n"
+		       "  -cf <OCCUPANCY_FILE> (default: none, log the busy channels of the first RX device)\n"
+		       "  -cw <OCCUPANCY_CHANNEL_WIDTH> (default: 2500Hz)\n"
+		       "  -ct <OCCUPANCY_THRESHOLD_dB> (default: 6dB over the noise floor)\n"
+		       "  -cb <OCCUPANCY_FFTS_PER_SECOND> (default: 50, CPU budget of the detector)\n"
+		       "  -rt <RTL_TCP_PORT> (default: none, serve the first RX device to rtl_tcp clients)\n"
+		       "  -sc <STREAM_CONFIG_FILE> (default: none, stream parameters for this host and sample rate)\n"
+		       "  -at <TRIAL_SECONDS> (default: 0, tune the stream parameters into -sc and exit)\n"
+		       "  -pd <DPD_ORDER> (default: 0, no predistortion, else an odd order up to %d)\n"
+		       "  -pm <DPD_MEMORY_TAPS> (default: 2)\n"
+		       "  -pb <DPD_CHANNEL_BW> (default: 3000Hz, for the ACPR)\n"
+		       "  -pl <DPD_LOG_FILE> (default: none, DPD measurements after each update)\n"
+		       "  -qt <TRANSPONDER_TRANSLATION> (default: none, no own signal monitor, 8089.5e6 for QO-100 NB)\n"
+		       "  -qf <MONITOR_OFFSET> (default: 0Hz, centre of our signal relative to the TX frequency)\n"
+		       "  -qb <MONITOR_BW> (default: 3000Hz)\n"
+		       "  -qd <MONITOR_MAX_DELAY> (default: 0.4s)\n"
+		       "  -ql <MONITOR_LOG_FILE> (default: none, own signal measurements every second)\n",
+		       DPD_MAX_ORDER);
 		return 1;
 	}
 	int i;
-	double in_freq = 0, out_freq = 0;
+	double in_freqs[MAX_DEVICES] = {0}, out_freq = 0;
+	int in_freq_count = 0;
 	double in_if_freq = 0, out_if_freq = 0;
 	double in_lo_freq = 0, out_lo_freq = 0;
 	double in_lpf_bw = 0, out_lpf_bw = 0;
 	double bandwidth_calibrating = 8e6;
 	double sample_rate = 2e6;
 	double in_gain = 1, out_gain = 1;
-	unsigned int device_i = 0;
+	double max_digital_gain = 0;
+	char *level_log_path = NULL;
+	FILE *level_log = NULL;
+	char *iq_log_path = NULL;
+	FILE *iq_log = NULL;
+	double device_indices[MAX_DEVICES] = {0};
+	int tx_device_i = -1;
 	unsigned int in_channel = 0, out_channel = 0;
 	double reference_clock = 0;
 	char *ip = NULL;
+	double tx_timeout = 15 * 60;
+	double tx_duty_limit = 1, tx_duty_window = 3600;
+	double tx_energy_threshold = -50;
+	char *ptt_gpio = NULL;
+	char *ptt_rigctld = NULL;
+	double tx_peak_limit = 0, tx_crest_factor = 0;
+	int block_packets_given = 0;
+	int feed_threads = 1;
+	double latency_interval = 0;
+	char *xdp_interface = NULL, *xdp_mac = NULL;
+	int xdp_queue = 0;
+	char *audio_path = NULL;
+	enum ssb_mod_mode modulator_mode = SSB_MOD_USB;
+	double audio_rate = 48000, audio_offset = 0, modulator_level = -6;
+	char *demod_spec = NULL, *demod_ip = NULL;
+	double demod_rate = 8000;
+	int demod_port = DEMOD_BASE_PORT;
+	char *bus_name = NULL;
+	int bus_tx = 0;
+	char *freq_model_path = NULL;
+	double beacon_freq = 0;
+	int beacon_bpsk = 0;
+	int udp_tx_port = 0;
+	double udp_tx_delay = 0.1;
+	char *occupancy_path = NULL;
+	double occupancy_width = 2500, occupancy_threshold = 6;
+	int occupancy_budget = 50;
+	int rtl_tcp_port = 0;
+	char *stream_config_path = NULL;
+	double autotune_trial = 0;
+	int dpd_order = 0, dpd_memory = 2;
+	double dpd_bandwidth = 3000;
+	char *dpd_log_path = NULL;
+	FILE *dpd_log = NULL;
+	double monitor_translation = NAN, monitor_offset = 0, monitor_bandwidth = 3000;
+	double monitor_max_delay = 0.4;
+	char *monitor_log_path = NULL;
+	FILE *monitor_log = NULL;
+	device_count = 1;
 	for ( i = 1; i < argc-1; i += 2 ) {
-		if      (strcmp(argv[i], "-if") == 0) { in_freq = atof( argv[i+1] ); }
+		if      (strcmp(argv[i], "-if") == 0) { in_freq_count = parse_list(argv[i+1], in_freqs, MAX_DEVICES); }
 		else if (strcmp(argv[i], "-ii") == 0) { in_if_freq = atof(argv[i+1]); }
 		else if (strcmp(argv[i], "-il") == 0) { in_lo_freq = atof(argv[i+1]); }
 		else if (strcmp(argv[i], "-ib") == 0) { in_lpf_bw = atof(argv[i+1]); }
@@ -244,16 +1445,148 @@ int main(int argc, char** argv)
 		else if (strcmp(argv[i], "-s") == 0) { sample_rate = atof( argv[i+1] ); }
 		else if (strcmp(argv[i], "-ig") == 0) { in_gain = atof( argv[i+1] ); }
 		else if (strcmp(argv[i], "-og") == 0) { out_gain = atof( argv[i+1] ); }
-		else if (strcmp(argv[i], "-d") == 0) { device_i = atoi( argv[i+1] ); }
+		else if (strcmp(argv[i], "-ag") == 0) { agc_peak = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-dg") == 0) { max_digital_gain = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-lv") == 0) { level_log_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-iq") == 0) { use_iq_corr = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-ix") == 0) { iq_log_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-d") == 0) { device_count = parse_list(argv[i+1], device_indices, MAX_DEVICES); }
+		else if (strcmp(argv[i], "-td") == 0) { tx_device_i = atoi( argv[i+1] ); }
+		else if (strcmp(argv[i], "-bk") == 0) {
+			block_packets = atoi( argv[i+1] );
+			block_packets_given = 1;
+		}
+		else if (strcmp(argv[i], "-fw") == 0) { feed_threads = atoi( argv[i+1] ); }
+		else if (strcmp(argv[i], "-np") == 0) {
+			int k;
+			for (k = 0; k < 3 && strcmp(argv[i+1], send_policy_names[k]); k++);
+			if (k == 3) {
+				fprintf(stderr, "ERROR: invalid send policy\n");
+				exit(1);
+			}
+			send_policy = k;
+		}
 		else if (strcmp(argv[i], "-ic") == 0) { in_channel = atoi( argv[i+1] ); }
 		else if (strcmp(argv[i], "-oc") == 0) { out_channel = atoi( argv[i+1] ); }
 		else if (strcmp(argv[i], "-r") == 0) { reference_clock = atof(argv[i+1]); }
 		else if (strcmp(argv[i], "-ip") == 0) { ip = argv[i+1]; }
+		else if (strcmp(argv[i], "-wt") == 0) { tx_timeout = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-wd") == 0) { tx_duty_limit = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ww") == 0) { tx_duty_window = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-we") == 0) { tx_energy_threshold = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-wg") == 0) { ptt_gpio = argv[i+1]; }
+		else if (strcmp(argv[i], "-wr") == 0) { ptt_rigctld = argv[i+1]; }
+		else if (strcmp(argv[i], "-tl") == 0) { tx_peak_limit = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-tc") == 0) { tx_crest_factor = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-lm") == 0) { latency_interval = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-xdp") == 0) { xdp_interface = argv[i+1]; }
+		else if (strcmp(argv[i], "-xq") == 0) { xdp_queue = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-xm") == 0) { xdp_mac = argv[i+1]; }
+		else if (strcmp(argv[i], "-ma") == 0) { audio_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-mm") == 0) {
+			int k;
+			for (k = 0; k < SSB_MOD_MODES && strcmp(argv[i+1], modulator_mode_names[k]); k++);
+			if (k == SSB_MOD_MODES) {
+				fprintf(stderr, "ERROR: invalid modulation\n");
+				exit(1);
+			}
+			modulator_mode = k;
+		}
+		else if (strcmp(argv[i], "-mr") == 0) { audio_rate = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-mf") == 0) { audio_offset = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ml") == 0) { modulator_level = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-dm") == 0) { demod_spec = argv[i+1]; }
+		else if (strcmp(argv[i], "-dr") == 0) { demod_rate = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-da") == 0) { demod_ip = argv[i+1]; }
+		else if (strcmp(argv[i], "-dp") == 0) { demod_port = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-sm") == 0) { bus_name = argv[i+1]; }
+		else if (strcmp(argv[i], "-st") == 0) { bus_tx = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-fm") == 0) { freq_model_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-fb") == 0) { beacon_freq = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-fk") == 0) {
+			if (strcmp(argv[i+1], "cw") && strcmp(argv[i+1], "bpsk")) {
+				fprintf(stderr, "ERROR: invalid beacon modulation\n");
+				exit(1);
+			}
+			beacon_bpsk = strcmp(argv[i+1], "bpsk") == 0;
+		}
+		else if (strcmp(argv[i], "-ut") == 0) { udp_tx_port = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-uj") == 0) { udp_tx_delay = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-cf") == 0) { occupancy_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-cw") == 0) { occupancy_width = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ct") == 0) { occupancy_threshold = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-cb") == 0) { occupancy_budget = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-rt") == 0) { rtl_tcp_port = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-sc") == 0) { stream_config_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-at") == 0) { autotune_trial = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-pd") == 0) { dpd_order = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-pm") == 0) { dpd_memory = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-pb") == 0) { dpd_bandwidth = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-pl") == 0) { dpd_log_path = argv[i+1]; }
+		else if (strcmp(argv[i], "-qt") == 0) { monitor_translation = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-qf") == 0) { monitor_offset = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-qb") == 0) { monitor_bandwidth = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-qd") == 0) { monitor_max_delay = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ql") == 0) { monitor_log_path = argv[i+1]; }
+	}
+	if (device_count < 1) {
+		fprintf(stderr, "ERROR: invalid device list\n");
+		exit(1);
 	}
-	if (in_freq == 0) {
+	if (in_freq_count != 1 && in_freq_count != device_count) {
 		fprintf(stderr, "ERROR: invalid RX frequency\n");
 		exit(1);
 	}
+	if (tx_device_i < 0) tx_device_i = device_indices[0];
+	if (ptt_gpio && ptt_rigctld) {
+		fprintf(stderr, "ERROR: -wg and -wr cannot be used together\n");
+		exit(1);
+	}
+	if (bus_tx && !bus_name) {
+		fprintf(stderr, "ERROR: -st needs a shared memory bus name in -sm\n");
+		exit(1);
+	}
+	if (autotune_trial > 0 && !stream_config_path) {
+		fprintf(stderr, "ERROR: -at needs a stream configuration file in -sc\n");
+		exit(1);
+	}
+	if (stream_config_path && autotune_trial <= 0) {
+		int ret = stream_tune_load(stream_config_path, sample_rate, &stream_params);
+		if (ret < 0) {
+			exit(1);
+		}
+		if (ret == 0) {
+			fprintf(stderr, "No stream parameters for this host and sample rate in %s, "
+				"using the defaults\n", stream_config_path);
+		}
+		else {
+			use_stream_params = 1;
+			if (block_packets_given && block_packets != stream_params.block_packets) {
+				// -bk wins. The FIFOs were tuned for the other read size,
+				// but the RX FIFO must at least hold two reads
+				fprintf(stderr, "WARNING: reading %d packets as given in -bk instead of "
+					"the tuned %d\n", block_packets, stream_params.block_packets);
+				stream_params.block_packets = block_packets;
+				if (stream_params.rx_fifo < 2 * block_packets) {
+					stream_params.rx_fifo = 2 * block_packets;
+				}
+			}
+			block_packets = stream_params.block_packets;
+			fprintf(stderr, "Stream parameters: %d packets per read, FIFO RX %d TX %d packets, "
+				"throughput %.2f (%.1f ms)\n", stream_params.block_packets,
+				stream_params.rx_fifo, stream_params.tx_fifo, stream_params.throughput,
+				1e3 * stream_params.latency);
+		}
+	}
+	if (block_packets < 1) {
+		fprintf(stderr, "ERROR: invalid packets per read\n");
+		exit(1);
+	}
+	block_samples = block_packets * LINRAD_SAMPLES_PER_PACKET;
+	// The tuner tries reads up to STREAM_TUNE_MAX_BLOCK packets, unless -bk
+	// gives one. The consumers take blocks up to this size
+	int max_block_samples = autotune_trial > 0 && !block_packets_given
+		? STREAM_TUNE_MAX_BLOCK * LINRAD_SAMPLES_PER_PACKET : block_samples;
 	if (out_freq == 0) {
 		fprintf(stderr, "ERROR: invalid TX frequency\n");
 		exit(1);
@@ -262,215 +1595,442 @@ int main(int argc, char** argv)
 		fprintf(stderr, "Need to specify send IP\n");
 		exit(1);
 	}
-
-	int linrad_udp_socket;
-	struct sockaddr_in linrad_udp_sockaddr;
-	static struct linrad_udp_packet udp_packet;
-
-	if (open_linrad_udp_socket(&linrad_udp_socket, &linrad_udp_sockaddr, ip) < 0) {
-		perror("Could not open Linrad UDP socket");
+	shared_reference_clock = reference_clock > 0;
+	if (agc_peak > 0 || agc_peak < -60) {
+		fprintf(stderr, "ERROR: invalid AGC peak level\n");
 		exit(1);
 	}
-	init_linrad_header(&udp_packet, 1e-6*in_freq);
-	
-	lms_device_t* device = NULL;
-	double host_sample_rate;
-
-	if (limesdr_open(device_i, &device) < 0) {
-		exit(1);
+	if (level_log_path) {
+		if (!(level_log = fopen(level_log_path, "a"))) {
+			perror("Could not open RX level log");
+			exit(1);
+		}
+		// For TX, the levels are after the limiter, clipped is before it and
+		// digital_gain_db is the limiter gain
+		fprintf(level_log, "# time,device,rms_dbfs,peak_dbfs,clipped,gain,digital_gain_db\n");
 	}
-
-	if (reference_clock > 0) {
-		if (LMS_SetClockFreq(device, LMS_CLOCK_REF, reference_clock) < 0) {
-			fprintf(stderr, "LMS_SetClockFreq() : %s\n", LMS_GetLastErrorMessage());
+	if (iq_log_path && use_iq_corr) {
+		if (!(iq_log = fopen(iq_log_path, "a"))) {
+			perror("Could not open IQ correction log");
 			exit(1);
 		}
+		// corrected is 0 while the imbalance is out of range
+		fprintf(iq_log, "# time,device,dc_dbfs,residual_dc_dbfs,gain_db,phase_deg,"
+			"irr_db,corrected_irr_db,corrected,converged\n");
 	}
 
-	if (limesdr_enable_channels(device, in_channel, out_channel) < 0) {
-		exit(1);
+	int has_tx_device = 0;
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		d->id = k;
+		d->index = device_indices[k];
+		d->in_freq = in_freqs[in_freq_count == 1 ? 0 : k];
+		d->has_rx = d->in_freq != 0;
+		d->has_tx = (int) d->index == tx_device_i;
+		has_tx_device |= d->has_tx;
+		if (d->has_rx && !timeline_reference) timeline_reference = d;
 	}
-	if (limesdr_set_sample_rate(device, sample_rate, &host_sample_rate) < 0) {
+	if (!timeline_reference) {
+		fprintf(stderr, "ERROR: invalid RX frequency\n");
 		exit(1);
 	}
-	fprintf(stderr, "sample_rate: %f\n", host_sample_rate);
-	
-	fprintf(stderr, "Setting RX frequency\n");
-	if (limesdr_set_frequency(device, LMS_CH_RX, in_channel,
-				  in_freq - in_lo_freq, in_if_freq, in_lpf_bw) < 0) {
+	if (!has_tx_device) {
+		fprintf(stderr, "ERROR: the TX device is not in the device list\n");
 		exit(1);
 	}
-	fprintf(stderr, "Setting TX frequency\n");
-	if (limesdr_set_frequency(device, LMS_CH_TX, out_channel,
-				  out_freq - out_lo_freq, out_if_freq, out_lpf_bw) < 0) {
-		exit(1);
+	latency_mode = latency_interval > 0;
+	for (int k = 0; k < device_count; k++) {
+		if (latency_mode && devices[k].has_tx && !devices[k].has_rx) {
+			fprintf(stderr, "ERROR: latency measurement needs RX on the TX device\n");
+			exit(1);
+		}
+		if (dpd_order && devices[k].has_tx && !devices[k].has_rx) {
+			fprintf(stderr, "ERROR: predistortion needs RX on the TX device\n");
+			exit(1);
+		}
+		if (!isnan(monitor_translation) && devices[k].has_tx && !devices[k].has_rx) {
+			fprintf(stderr, "ERROR: the own signal monitor needs RX on the TX device\n");
+			exit(1);
+		}
 	}
 
-	if (LMS_SetNormalizedGain(device, LMS_CH_RX, in_channel, in_gain) < 0) {
-		fprintf(stderr, "LMS_SetNormalizedGain() (RX) : %s\n", LMS_GetLastErrorMessage());
-		exit(1);
+	double host_sample_rate = 0;
+	struct streamer_device *tx_device = NULL;
+
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		double device_sample_rate;
+
+		if (limesdr_open(d->index, &d->device) < 0) {
+			exit(1);
+		}
+
+		if (reference_clock > 0) {
+			if (LMS_SetClockFreq(d->device, LMS_CLOCK_REF, reference_clock) < 0) {
+				fprintf(stderr, "LMS_SetClockFreq() : %s\n", LMS_GetLastErrorMessage());
+				exit(1);
+			}
+		}
+
+		if (limesdr_enable_channels(d->device, in_channel, out_channel, d->has_rx, d->has_tx) < 0) {
+			exit(1);
+		}
+		if (limesdr_set_sample_rate(d->device, sample_rate, &device_sample_rate) < 0) {
+			exit(1);
+		}
+		fprintf(stderr, "sample_rate: %f\n", device_sample_rate);
+		if (k == 0) {
+			host_sample_rate = device_sample_rate;
+		}
+		else if (device_sample_rate != host_sample_rate) {
+			fprintf(stderr, "ERROR: devices have different sample rates\n");
+			exit(1);
+		}
+
+		if (d->has_rx) {
+			fprintf(stderr, "Setting RX frequency\n");
+			if (limesdr_set_frequency(d->device, LMS_CH_RX, in_channel,
+						  d->in_freq - in_lo_freq, in_if_freq, in_lpf_bw) < 0) {
+				exit(1);
+			}
+			if (LMS_SetNormalizedGain(d->device, LMS_CH_RX, in_channel, in_gain) < 0) {
+				fprintf(stderr, "LMS_SetNormalizedGain() (RX) : %s\n", LMS_GetLastErrorMessage());
+				exit(1);
+			}
+			if (LMS_Calibrate(d->device, LMS_CH_RX, in_channel, bandwidth_calibrating, 0) < 0) {
+				fprintf(stderr, "LMS_Calibrate() (RX) : %s\n", LMS_GetLastErrorMessage());
+				exit(1);
+			}
+			unsigned int bus_blocks = RING_SECONDS * host_sample_rate / max_block_samples;
+			if (bus_blocks < MIN_RING_BLOCKS) bus_blocks = MIN_RING_BLOCKS;
+			if (bus_name) {
+				char name[64];
+				snprintf(name, sizeof(name), "/%s-rx%d", bus_name, d->id);
+				if (iq_bus_create(&d->bus, name, bus_blocks, max_block_samples,
+						  host_sample_rate, d->in_freq) < 0) {
+					exit(1);
+				}
+				d->use_bus = 1;
+				fprintf(stderr, "RX IQ bus: %s\n", name);
+			}
+			if (rx_level_init(&d->level, host_sample_rate, max_digital_gain,
+					  level_log, d->index, in_gain) < 0) {
+				exit(1);
+			}
+			if (use_iq_corr && iq_corr_init(&d->iq, host_sample_rate, LINRAD_SAMPLES_PER_PACKET,
+							IQ_CORR_ESTIMATE_SAMPLES, iq_log, d->index) < 0) {
+				exit(1);
+			}
+			if (worker_pool_init(&d->pool, feed_threads) < 0) {
+				exit(1);
+			}
+			d->use_gso = 1;
+			if (open_linrad_udp_socket(&d->linrad_udp_socket, &d->linrad_udp_sockaddr,
+						   ip, LINRAD_BASE_PORT + d->id) < 0) {
+				perror("Could not open Linrad UDP socket");
+				exit(1);
+			}
+			init_linrad_header(&d->udp_packet, 1e-6*d->in_freq);
+			if (xdp_interface) {
+				if (xdp_tx_init(&d->xdp, xdp_interface, xdp_queue + d->id,
+						&d->linrad_udp_sockaddr, xdp_mac,
+						sizeof(struct linrad_udp_packet)) < 0) {
+					exit(1);
+				}
+				d->use_xdp = 1;
+			}
+		}
+
+		if (d->has_tx) {
+			tx_device = d;
+			fprintf(stderr, "Setting TX frequency\n");
+			if (limesdr_set_frequency(d->device, LMS_CH_TX, out_channel,
+						  out_freq - out_lo_freq, out_if_freq, out_lpf_bw) < 0) {
+				exit(1);
+			}
+			if (LMS_SetNormalizedGain(d->device, LMS_CH_TX, out_channel, out_gain) < 0) {
+				fprintf(stderr, "LMS_SetNormalizedGain() (TX) : %s\n", LMS_GetLastErrorMessage());
+				exit(1);
+			}
+			if (LMS_Calibrate(d->device, LMS_CH_TX, out_channel, bandwidth_calibrating, 0) < 0) {
+				fprintf(stderr, "LMS_Calibrate() (TX) : %s\n", LMS_GetLastErrorMessage());
+				exit(1);
+			}
+		}
 	}
-	if (LMS_SetNormalizedGain(device, LMS_CH_TX, out_channel, out_gain) < 0) {
-		fprintf(stderr, "LMS_SetNormalizedGain() (TX) : %s\n", LMS_GetLastErrorMessage());
-		exit(1);
+
+	if (latency_mode) {
+		if (latency_probe_init(&probe, host_sample_rate, latency_interval,
+				       max_block_samples) < 0) {
+			exit(1);
+		}
+		signal(SIGUSR1, handle_sigusr1);
 	}
 
-	if (LMS_Calibrate(device, LMS_CH_RX, in_channel, bandwidth_calibrating, 0) < 0) {
-		fprintf(stderr, "LMS_Calibrate() (RX) : %s\n", LMS_GetLastErrorMessage());
+	if (tx_watchdog_init(&watchdog, host_sample_rate, tx_timeout,
+			     tx_duty_limit, tx_duty_window, tx_energy_threshold,
+			     ptt_gpio, ptt_rigctld) < 0) {
 		exit(1);
 	}
-
-	if (LMS_Calibrate(device, LMS_CH_TX, out_channel, bandwidth_calibrating, 0) < 0) {
-		fprintf(stderr, "LMS_Calibrate() (TX) : %s\n", LMS_GetLastErrorMessage());
+	if (tx_limiter_init(&limiter, host_sample_rate, tx_peak_limit, tx_crest_factor,
+			    level_log, out_gain) < 0) {
 		exit(1);
 	}
-	
-	lms_stream_t rx_stream = {
-		.channel = in_channel,
-		.fifoSize = LINRAD_SAMPLES_PER_PACKET*10,
-		.throughputVsLatency = 0.5,
-		.isTx = LMS_CH_RX,
-		.dataFmt = LMS_FMT_I16
-	};
-
-	lms_stream_t tx_stream = {
-		.channel = out_channel,
-		.fifoSize = LINRAD_SAMPLES_PER_PACKET*10,
-		.throughputVsLatency = 0.5,
-		.isTx = LMS_CH_TX,
-		.dataFmt = LMS_FMT_I16
-	};
-	
-	if ( LMS_SetupStream(device, &rx_stream) < 0 ) {
-		fprintf(stderr, "LMS_SetupStream() : %s\n", LMS_GetLastErrorMessage());
-		return 1;
+	if (dpd_order) {
+		if (dpd_log_path && !(dpd_log = fopen(dpd_log_path, "a"))) {
+			perror("Could not open DPD log");
+			exit(1);
+		}
+		// RX of the TX device receives the TX signal at this frequency
+		double rx_offset = (out_freq - out_lo_freq) - (tx_device->in_freq - in_lo_freq);
+		if (dpd_init(&dpd, host_sample_rate, dpd_order, dpd_memory, dpd_bandwidth,
+			     rx_offset, dpd_log) < 0
+		    || dpd_start(&dpd) < 0) {
+			exit(1);
+		}
+		use_dpd = 1;
 	}
-	if ( LMS_SetupStream(device, &tx_stream) < 0 ) {
-		fprintf(stderr, "LMS_SetupStream() : %s\n", LMS_GetLastErrorMessage());
-		return 1;
+	if (!isnan(monitor_translation)) {
+		if (monitor_log_path && !(monitor_log = fopen(monitor_log_path, "a"))) {
+			perror("Could not open own signal monitor log");
+			exit(1);
+		}
+		// Our signal and the beacon, as received on the TX device, which
+		// shares its timestamps with TX
+		double rx_offset = out_freq + monitor_offset + monitor_translation - tx_device->in_freq;
+		double beacon_offset = beacon_freq ? beacon_freq - tx_device->in_freq : NAN;
+		if (own_signal_init(&monitor, host_sample_rate, monitor_bandwidth, monitor_offset,
+				    rx_offset, beacon_offset, monitor_max_delay, monitor_log) < 0
+		    || own_signal_start(&monitor) < 0) {
+			exit(1);
+		}
+		use_monitor = 1;
 	}
 
-	int tx_fd;
-	if ((tx_fd = open("/tmp/txfifo", O_RDONLY | O_NONBLOCK)) < 0) {
-		perror("Could not open /tmp/txfifo");
-		exit(1);
+	if (udp_tx_port) {
+		if (audio_path || latency_mode) {
+			fprintf(stderr, "ERROR: UDP TX does not work with -ma or -lm\n");
+			exit(1);
+		}
+		if (udp_tx_init(&udp_input, udp_tx_port, host_sample_rate, udp_tx_delay) < 0) {
+			exit(1);
+		}
+		use_udp_tx = 1;
+		fprintf(stderr, "Listening for TX samples on UDP port %d. Starting to stream...\n",
+			udp_tx_port);
 	}
-	fprintf(stderr, "/tmp/txfifo opened. Starting to stream...\n");
-	
-	if (LMS_StartStream(&rx_stream) < 0) {
-		fprintf(stderr, "LMS_StartStream() (RX) : %s\n", LMS_GetLastErrorMessage());
+	else if (audio_path) {
+		if (ssb_mod_init(&modulator, modulator_mode, audio_rate, host_sample_rate,
+				 audio_offset, modulator_level) < 0) {
+			exit(1);
+		}
+		if (pipe2(modulator_pipe, O_NONBLOCK) < 0) {
+			perror("Could not create modulator pipe");
+			exit(1);
+		}
+		// Keep the queue, and so the TX latency, short
+		fcntl(modulator_pipe[1], F_SETPIPE_SZ,
+		      (int) (MODULATOR_QUEUE * host_sample_rate * 2 * sizeof(int16_t)));
+		tx_fd = modulator_pipe[0];
+		if (open_audio_socket(&audio_socket, audio_path) < 0) {
+			perror("Could not open audio socket");
+			exit(1);
+		}
+		fprintf(stderr, "Listening for %s audio on %s. Starting to stream...\n",
+			modulator_mode_names[modulator_mode], audio_path);
 	}
-	if (LMS_StartStream(&tx_stream) < 0) {
-		fprintf(stderr, "LMS_StartStream() (TX) : %s\n", LMS_GetLastErrorMessage());
+	else {
+		if ((tx_fd = open("/tmp/txfifo", O_RDONLY | O_NONBLOCK)) < 0) {
+			perror("Could not open /tmp/txfifo");
+			exit(1);
+		}
+		fprintf(stderr, "/tmp/txfifo opened. Starting to stream...\n");
 	}
-	int keep_reading = 1;
 
-	static int16_t txdata[20*LINRAD_SAMPLES_PER_PACKET];
-	unsigned int laps = 0;
-	int tx_underrun = 0, tx_overrun = 0, tx_dropped = 0;
-
-	while (keep_reading) {
-		if (laps++ % 0x512 == 0) {
-			// Print FIFOs status
-			lms_stream_status_t tx_status, rx_status;
-			if (LMS_GetStreamStatus(&tx_stream, &tx_status) < 0) {
-				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
-				break;
-			}
-			if (LMS_GetStreamStatus(&rx_stream, &rx_status) < 0) {
-				fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
-				break;
-			}
-			tx_underrun += tx_status.underrun;
-			tx_overrun += tx_status.overrun;
-			tx_dropped += tx_status.droppedPackets;
-			fprintf(stderr,
-				"STREAM STATUS\n"
-				"-------------\n"
-				"TX: %d / %d, under = %d, over = %d, dropped = %d\n"
-				"RX: %d / %d, under = %d, over = %d, dropped = %d\n",
-				tx_status.fifoFilledCount, tx_status.fifoSize,
-				tx_underrun, tx_overrun, tx_dropped,
-				rx_status.fifoFilledCount, rx_status.fifoSize,
-				rx_status.underrun, rx_status.overrun, rx_status.droppedPackets);
+	if (bus_name && bus_tx) {
+		char name[64];
+		snprintf(name, sizeof(name), "/%s-tx", bus_name);
+		if (iq_bus_create(&tx_bus, name, RING_SECONDS * host_sample_rate / LINRAD_SAMPLES_PER_PACKET,
+				  20 * LINRAD_SAMPLES_PER_PACKET, host_sample_rate, out_freq) < 0) {
+			exit(1);
 		}
-		
-		int just_read;
-		for (int read = 0; read < LINRAD_SAMPLES_PER_PACKET; read += just_read) {
-			int timeout_ms =  1000;
-			just_read = LMS_RecvStream(&rx_stream,
-						   udp_packet.buffer + read * 2 * sizeof(int16_t),
-						   LINRAD_SAMPLES_PER_PACKET - read,
-						   NULL, timeout_ms);
-			if (just_read < 0) {
-				fprintf(stderr, "LMS_RecvStream() : %s\n", LMS_GetLastErrorMessage());
-				keep_reading = 0;
-				break;
-			}
+		use_tx_bus = 1;
+		fprintf(stderr, "TX IQ bus: %s\n", name);
+	}
+
+	if (demod_spec) {
+		if (demod_bank_init(&demods, demod_spec, host_sample_rate, demod_rate,
+				    max_block_samples, demod_ip ? demod_ip : ip, demod_port) < 0
+		    || demod_bank_start(&demods) < 0) {
+			exit(1);
 		}
+		use_demods = 1;
+	}
 
-		int ret;
+	if (rtl_tcp_port) {
+		// The clients tune as if they were behind the same LNB
+		if (rtl_tcp_init(&rtl_server, rtl_tcp_port, host_sample_rate,
+				 timeline_reference->in_freq - in_lo_freq, max_block_samples) < 0
+		    || rtl_tcp_start(&rtl_server) < 0) {
+			exit(1);
+		}
+		use_rtl_tcp = 1;
+	}
 
-		lms_stream_status_t tx_status;
-		if (LMS_GetStreamStatus(&tx_stream, &tx_status) < 0) {
-			fprintf(stderr, "LMS_GetStreamStatus() : %s\n", LMS_GetLastErrorMessage());
-			break;
+	if (freq_model_path) {
+		// The beacon is measured on the first RX device. The other devices
+		// are only corrected if they share its reference
+		struct streamer_device *r = timeline_reference;
+		double beacon_offset = beacon_freq ? beacon_freq - r->in_freq : NAN;
+		if (fabs(beacon_offset) > 0.4 * host_sample_rate) {
+			fprintf(stderr, "ERROR: the beacon is outside the RX passband\n");
+			exit(1);
 		}
-		tx_underrun += tx_status.underrun;
-		tx_overrun += tx_status.overrun;
-		tx_dropped += tx_status.droppedPackets;
-		int to_read = tx_status.fifoSize - tx_status.fifoFilledCount;
-		int tx_read;
-		if (to_read) {
-			tx_read = read(tx_fd, txdata, 2 * sizeof(int16_t) * to_read);
-			if (tx_read < 0) {
-				if ( errno != EAGAIN && errno != EWOULDBLOCK) {
-					perror("Could not read from /tmp/txfifo");
-					break;
-				}
-			}
-			else if (tx_read % 2 * sizeof(int16_t)) {
-				fprintf(stderr, "Did not read an integer number of samples from /tmp/txfifo\n");
-				break;
+		if (freq_comp_init(&freq_comp, freq_model_path, host_sample_rate, max_block_samples,
+				   beacon_offset, beacon_bpsk) < 0
+		    || freq_comp_add(&freq_comp, r->device, LMS_CH_RX, in_channel,
+				     r->in_freq - in_lo_freq, in_if_freq) < 0) {
+			exit(1);
+		}
+		for (int k = 0; k < device_count; k++) {
+			struct streamer_device *d = &devices[k];
+			if (d != r && !shared_reference_clock) continue;
+			if (d != r && d->has_rx
+			    && freq_comp_add(&freq_comp, d->device, LMS_CH_RX, in_channel,
+					     d->in_freq - in_lo_freq, in_if_freq) < 0) {
+				exit(1);
 			}
-			else if (tx_read > 0) {
-				int to_write = tx_read / (2 * sizeof(int16_t));
-				if ((ret = LMS_SendStream(&tx_stream, txdata,
-							  to_write,
-							  NULL, 1000)) < 0) {
-					fprintf(stderr, "LMS_SendStream() : %s\n", LMS_GetLastErrorMessage());
-					break;
-				}
-				
-				if (ret != to_write) {
-					fprintf(stderr, "Didn't write to TX FIFO all we expected\n");
-					break;
-				}
+			if (d->has_tx
+			    && freq_comp_add(&freq_comp, d->device, LMS_CH_TX, out_channel,
+					     out_freq - out_lo_freq, out_if_freq) < 0) {
+				exit(1);
 			}
 		}
-
-		// Adjust DC bias
-		for (int i = 0; i < 2 * LINRAD_SAMPLES_PER_PACKET; i++) {
-			((int16_t *) udp_packet.buffer)[i] |= 8; // 3 LSBs are guaranteed to be zero
+		if (freq_comp_start(&freq_comp) < 0) {
+			exit(1);
 		}
+		use_freq_comp = 1;
+	}
 
-		if (linrad_header_fill_time(&udp_packet) < 0) {
-			perror("Could not get system time");
-			break;
+	if (occupancy_path) {
+		if (occupancy_init(&occupancy, occupancy_path, host_sample_rate,
+				   timeline_reference->in_freq, occupancy_width, occupancy_threshold,
+				   occupancy_budget) < 0
+		    || occupancy_start(&occupancy) < 0) {
+			exit(1);
 		}
+		use_occupancy = 1;
+	}
 
-		if (sendto(linrad_udp_socket, &udp_packet, sizeof(udp_packet), 0,
-			   (struct sockaddr *) &linrad_udp_sockaddr,
-			   sizeof(linrad_udp_sockaddr)) < 0) {
-			perror("Could not send UDP packet");
-			break;
+	if (tx_watchdog_start(&watchdog) < 0) {
+		exit(1);
+	}
+
+	if (autotune_trial > 0) {
+		struct trial_setup setup = {
+			.in_channel = in_channel, .out_channel = out_channel,
+			.sample_rate = host_sample_rate
+		};
+		if (stream_tune_run(stream_trial, &setup, host_sample_rate, LINRAD_SAMPLES_PER_PACKET,
+				    block_packets_given ? block_packets : 0, autotune_trial,
+				    &stream_params) < 0
+		    || stream_tune_save(stream_config_path, sample_rate, &stream_params) < 0) {
+			exit(1);
 		}
+		fprintf(stderr, "Best stream parameters: %d packets per read, FIFO RX %d TX %d packets, "
+			"throughput %.2f (%.1f ms), saved to %s\n", stream_params.block_packets,
+			stream_params.rx_fifo, stream_params.tx_fifo, stream_params.throughput,
+			1e3 * stream_params.latency, stream_config_path);
+		keep_reading = 0;
+	}
+	else if (setup_streams(use_stream_params ? &stream_params : NULL, in_channel, out_channel,
+			       host_sample_rate) < 0
+		 || start_streaming() < 0) {
+		exit(1);
+	}
 
-		next_linrad_header(&udp_packet);
+	// Print FIFOs status as often as every 0x512 Linrad packets
+	double status_interval = 0x512 * LINRAD_SAMPLES_PER_PACKET / host_sample_rate;
+	struct timespec status_sleep = {
+		.tv_sec = status_interval,
+		.tv_nsec = 1e9 * (status_interval - (long) status_interval)
+	};
+	while (keep_reading) {
+		print_status();
+		nanosleep(&status_sleep, NULL);
+		if (print_histograms) {
+			print_histograms = 0;
+			latency_probe_print_histograms(&probe);
+		}
+		for (int k = 0; agc_peak != 0 && k < device_count; k++) {
+			struct streamer_device *d = &devices[k];
+			double gain;
+			if (!d->has_rx || !rx_level_agc(&d->level, agc_peak, AGC_HYSTERESIS, &gain)) {
+				continue;
+			}
+			fprintf(stderr, "AGC: RX gain of device %u = %.3f\n", d->index, gain);
+			if (LMS_SetNormalizedGain(d->device, LMS_CH_RX, in_channel, gain) < 0) {
+				fprintf(stderr, "LMS_SetNormalizedGain() (RX) : %s\n", LMS_GetLastErrorMessage());
+			}
+			// The DC offset of the receiver changes with its gain
+			else if (use_iq_corr) {
+				iq_corr_restart(&d->iq);
+			}
+		}
 	}
 
-	LMS_StopStream(&rx_stream);
-	LMS_DestroyStream(device, &rx_stream);
-	LMS_Close(device);
+	if (autotune_trial <= 0) {
+		stop_streaming();
+		destroy_streams();
+	}
+	if (audio_path) {
+		close(audio_socket);
+		unlink(audio_path);
+		ssb_mod_free(&modulator);
+	}
+	if (use_demods) {
+		demod_bank_stop(&demods);
+		demod_bank_free(&demods);
+	}
+	if (use_rtl_tcp) {
+		rtl_tcp_stop(&rtl_server);
+		rtl_tcp_free(&rtl_server);
+	}
+	if (use_freq_comp) {
+		freq_comp_stop(&freq_comp);
+		freq_comp_free(&freq_comp);
+	}
+	if (use_occupancy) {
+		occupancy_stop(&occupancy);
+		occupancy_free(&occupancy);
+	}
+	tx_watchdog_stop(&watchdog);
+	tx_limiter_free(&limiter);
+	if (use_dpd) {
+		dpd_stop(&dpd);
+		dpd_free(&dpd);
+	}
+	if (dpd_log) fclose(dpd_log);
+	if (use_monitor) {
+		own_signal_stop(&monitor);
+		own_signal_free(&monitor);
+	}
+	if (monitor_log) fclose(monitor_log);
+	if (use_tx_bus) iq_bus_close(&tx_bus);
+	if (use_udp_tx) udp_tx_free(&udp_input);
+	if (latency_mode) latency_probe_free(&probe);
+	for (int k = 0; k < device_count; k++) {
+		struct streamer_device *d = &devices[k];
+		if (d->has_rx) {
+			worker_pool_free(&d->pool);
+			rx_level_free(&d->level);
+			if (use_iq_corr) iq_corr_free(&d->iq);
+			if (d->use_bus) iq_bus_close(&d->bus);
+			if (d->use_xdp) xdp_tx_free(&d->xdp);
+		}
+		LMS_Close(d->device);
+	}
+	if (level_log) fclose(level_log);
+	if (iq_log) fclose(iq_log);
 	return 0;
 }
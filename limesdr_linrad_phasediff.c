@@ -43,11 +43,16 @@
 
 #include <lime/LimeSuite.h>
 
+#include "iq_corr.h"
+#include "rx_gap.h"
+#include "rx_level.h"
+
 #define LINRAD_NET_MULTICAST_PAYLOAD 1392
 #define LINRAD_SAMPLES_PER_PACKET (LINRAD_NET_MULTICAST_PAYLOAD/(sizeof(int16_t) * 2))
 
 #define LINRAD_BUFSIZE 4096
 #define LINRAD_BASE_PORT 50100
+#define IQ_CORR_ESTIMATE_SAMPLES 64 // of each packet, for the DC and IQ imbalance estimate
 
 struct linrad_udp_packet {
 	double passband_center;
@@ -338,6 +343,16 @@ int main(int argc, char** argv)
 		return 1;
 	}
 	
+	static struct rx_gap_reader gap;
+	if (rx_gap_init(&gap, host_sample_rate, LINRAD_SAMPLES_PER_PACKET, 1.0) < 0) {
+		exit(1);
+	}
+	static struct iq_corr iq;
+	if (iq_corr_init(&iq, host_sample_rate, LINRAD_SAMPLES_PER_PACKET,
+			 IQ_CORR_ESTIMATE_SAMPLES, NULL, device_i) < 0) {
+		exit(1);
+	}
+
 	if (LMS_StartStream(&rx_stream) < 0) {
 		fprintf(stderr, "LMS_StartStream() (RX) : %s\n", LMS_GetLastErrorMessage());
 	}
@@ -360,28 +375,23 @@ int main(int argc, char** argv)
 					"tv_sec = %lu, tv_nsec = %lu, sunderrun = %d, overrun = %d, dropped = %d\n",
 					t.tv_sec, t.tv_nsec,
 					rx_status.underrun, rx_status.overrun, rx_status.droppedPackets);
+				rx_gap_print(&gap, "");
+				iq_corr_print(&iq, "");
 			}
 		}
 		
-		int just_read;
-		for (int read = 0; read < LINRAD_SAMPLES_PER_PACKET; read += just_read) {
-			int timeout_ms =  1000;
-			just_read = LMS_RecvStream(&rx_stream,
-						   udp_packet.buffer + read * 2 * sizeof(int16_t),
-						   LINRAD_SAMPLES_PER_PACKET - read,
-						   NULL, timeout_ms);
-			if (just_read < 0) {
-				fprintf(stderr, "LMS_RecvStream() : %s\n", LMS_GetLastErrorMessage());
-				goto finish_loop;
-			}
+		uint64_t timestamp;
+		if (rx_gap_read(&gap, &rx_stream, (int16_t *) udp_packet.buffer,
+				LINRAD_SAMPLES_PER_PACKET, &timestamp) < 0) {
+			break;
 		}
 
-		// Adjust DC bias (in a somewhat SIMD way, each pair of IQ samples is
-		// adjusted at a time)
-		for (int i = 0; i < LINRAD_SAMPLES_PER_PACKET; i++) {
-			// 3 LSBs are guaranteed to be zero
-			((uint32_t *) udp_packet.buffer)[i] |= 0x00080008;
-		}
+		// Remove the DC offset and the IQ imbalance
+		struct iq_corr_coefs coefs;
+		iq_corr_update(&iq, (int16_t *) udp_packet.buffer, LINRAD_SAMPLES_PER_PACKET,
+			       RX_LEVEL_GAIN_ONE, &coefs);
+		iq_corr_apply(&coefs, (int16_t *) udp_packet.buffer, (int16_t *) udp_packet.buffer,
+			      LINRAD_SAMPLES_PER_PACKET);
 
 		if (linrad_header_fill_time(&udp_packet) < 0) {
 			perror("Could not get system time");
@@ -398,9 +408,10 @@ int main(int argc, char** argv)
 		next_linrad_header(&udp_packet);
 	}
 
-finish_loop:
 	LMS_StopStream(&rx_stream);
 	LMS_DestroyStream(device, &rx_stream);
+	rx_gap_free(&gap);
+	iq_corr_free(&iq);
 	LMS_Close(device);
 	return 0;
 }
@@ -0,0 +1,788 @@
+/*
+  ===========================================================================
+
+  limesdr_sim - Simulated LimeSDR that implements the subset of the
+  LimeSuite API used by the streamers. TX samples are looped back to RX
+  through a configurable satellite channel model.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The channel model is configured with the following environment
+  variables:
+
+  LIMESDR_SIM_DELAY       round trip delay in seconds (default 0.24)
+  LIMESDR_SIM_DELAY_RATE  delay rate in s/s (default 0)
+  LIMESDR_SIM_FREQ        frequency offset in Hz (default 0)
+  LIMESDR_SIM_DRIFT       LNB frequency drift in Hz/s (default 0)
+  LIMESDR_SIM_DOPPLER     amplitude of a sinusoidal Doppler in Hz (default 0)
+  LIMESDR_SIM_DOPPLER_PERIOD  period of the Doppler in s (default 86164)
+  LIMESDR_SIM_GAIN        channel gain in dB (default 0)
+  LIMESDR_SIM_NOISE       AWGN power in dBFS (default -60)
+  LIMESDR_SIM_OVERRUN     mean interval between injected RX overruns in
+                          seconds (default 0, no overruns)
+  LIMESDR_SIM_OVERRUN_LEN samples lost in each injected overrun (default 4096)
+  LIMESDR_SIM_REALTIME    1 to pace the streams to the wall clock, 0 to run
+                          as fast as the application reads (default 1)
+  LIMESDR_SIM_SEED        seed of the random number generator (default 1)
+  LIMESDR_SIM_DEVICES     number of simulated devices (default 1)
+  LIMESDR_SIM_TEMP        chip temperature in degrees C (default 45)
+  LIMESDR_SIM_TEMP_SWING  amplitude of a sinusoidal temperature change in
+                          degrees C (default 0)
+  LIMESDR_SIM_TEMP_PERIOD period of the temperature change in s (default 86400)
+  LIMESDR_SIM_TEMP_PPM    reference frequency error in ppm per degree C away
+                          from LIMESDR_SIM_TEMP (default 0)
+  LIMESDR_SIM_BEACON      power of a beacon carrier in dBFS (default: none)
+  LIMESDR_SIM_BEACON_FREQ frequency of the beacon in Hz, relative to the
+                          initial RX frequency (default 0)
+  LIMESDR_SIM_PA_SAT      output saturation of a nonlinear TX PA in dBFS
+                          (default: none, linear PA)
+  LIMESDR_SIM_PA_SMOOTH   smoothness of the PA AM/AM (Rapp model, default 2)
+  LIMESDR_SIM_PA_AMPM     PA AM/PM in degrees at saturation (default 0)
+  LIMESDR_SIM_PA_MEMORY   gain of the previous sample at the PA input, for
+                          memory effects (default 0)
+  LIMESDR_SIM_DC          RX DC offset in dBFS, on I and Q alike (default:
+                          none)
+  LIMESDR_SIM_IQ_GAIN     RX gain of Q relative to I in dB (default 0)
+  LIMESDR_SIM_IQ_PHASE    RX phase error of Q in degrees (default 0)
+
+  The reference error moves the RX and TX frequencies, which are the LO
+  frequency plus or minus the NCO, in proportion to them.
+
+  In non-realtime mode the device clock is driven by RX reads, so a run
+  is completely deterministic.
+
+  The streams are used from several threads, as with LimeSuite: RX from
+  the capture thread, TX from the TX thread, and the status and tuning
+  from the main thread. Each device has a lock around its state, which is
+  released while a stream waits for the device clock.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
+#include <errno.h>
+
+#include <time.h>
+#include <pthread.h>
+
+#include <lime/LimeSuite.h>
+
+#define SIM_GAUSS_TABLE_SIZE 65536
+#define SIM_MAX_DEVICES 8
+
+struct sim_stream;
+
+struct sim_device {
+	pthread_mutex_t lock; // everything below, except what is set in LMS_Open()
+	unsigned int index;
+	double sample_rate;
+	double lo_freq[2];
+	double nco_freq[2];
+	int nco_down[2];
+	double start_freq[2]; // when the stream was started
+	double gain[2];
+	double lpf_bw[2];
+	double ref_clock;
+
+	// channel model
+	double delay;
+	double delay_rate;
+	double freq;
+	double drift;
+	double doppler;
+	double doppler_period;
+	float gain_lin;
+	float noise_amp;
+	double overrun_interval;
+	unsigned int overrun_len;
+	int realtime;
+	double temperature;
+	double temp_swing;
+	double temp_period;
+	double temp_ppm;
+	float beacon_amp;
+	double beacon_freq;
+	// TX PA: a filter with one tap of memory followed by the Rapp model
+	double pa_sat; // amplitude, 0 for a linear PA
+	double pa_smooth;
+	double pa_ampm; // radians
+	double pa_memory;
+	float pa_last_i, pa_last_q;
+	// RX impairments: Q = iq_gain (sin(iq_phase) I + cos(iq_phase) Q), plus DC
+	float dc;
+	float iq_sin, iq_cos; // including iq_gain
+	uint32_t rng;
+	float *gauss;
+
+	// device clock. clock_start is set before the streams run
+	int clock_running;
+	struct timespec clock_start;
+
+	// RX state
+	uint64_t rx_next_ts;
+	uint64_t next_overrun_ts;
+	double phase;
+	double beacon_phase;
+	uint32_t rx_overrun, rx_dropped;
+
+	// TX delay line, indexed by device timestamp
+	float *tx_ring;
+	uint64_t tx_ring_size;
+	uint64_t tx_cleared_ts; // ring is zero from here on
+	uint64_t tx_write_ts;
+	uint64_t tx_burst_ts; // timestamp of the current burst start
+	uint32_t tx_underrun, tx_dropped;
+
+	struct sim_stream *rx_stream, *tx_stream;
+};
+
+struct sim_stream {
+	struct sim_device *dev;
+	int is_tx;
+	int active;
+	uint32_t fifo_size;
+};
+
+static __thread char last_error[256] = "";
+static lms_dev_info_t sim_info = {
+	.deviceName = "LimeSDR-sim",
+	.firmwareVersion = "sim",
+	.hardwareVersion = "sim",
+	.protocolVersion = "sim",
+	.gatewareVersion = "sim",
+};
+
+static int sim_error(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(last_error, sizeof(last_error), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+static double sim_env(const char *name, double def) {
+	const char *s = getenv(name);
+	return s ? atof(s) : def;
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static double uniform(uint32_t *state) {
+	return (xorshift32(state) + 0.5) / 4294967296.0;
+}
+
+// Gaussian samples are drawn from a table so that AWGN costs a random
+// index per sample instead of a Box-Muller transform
+static int init_gauss_table(struct sim_device *d) {
+	d->gauss = malloc(SIM_GAUSS_TABLE_SIZE * sizeof(float));
+	if (!d->gauss) return -1;
+	for (int i = 0; i < SIM_GAUSS_TABLE_SIZE; i += 2) {
+		double r = sqrt(-2 * log(uniform(&d->rng)));
+		double a = 2 * M_PI * uniform(&d->rng);
+		d->gauss[i] = r * cos(a);
+		d->gauss[i+1] = r * sin(a);
+	}
+	return 0;
+}
+
+static uint64_t device_now(struct sim_device *d) {
+	if (!d->realtime) return d->rx_next_ts;
+	if (!d->clock_running) return 0;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	double elapsed = (t.tv_sec - d->clock_start.tv_sec)
+		+ (t.tv_nsec - d->clock_start.tv_nsec) * 1e-9;
+	return elapsed * d->sample_rate;
+}
+
+static void wait_device_time(struct sim_device *d, uint64_t ts) {
+	struct timespec t = d->clock_start;
+	double secs = ts / d->sample_rate;
+	t.tv_sec += (time_t) secs;
+	t.tv_nsec += (secs - (time_t) secs) * 1e9;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+}
+
+static void schedule_overrun(struct sim_device *d) {
+	if (d->overrun_interval <= 0) return;
+	d->next_overrun_ts = d->rx_next_ts
+		+ (uint64_t) (2 * uniform(&d->rng) * d->overrun_interval * d->sample_rate);
+}
+
+int LMS_GetDeviceList(lms_info_str_t *dev_list) {
+	int n = sim_env("LIMESDR_SIM_DEVICES", 1);
+	if (n > SIM_MAX_DEVICES) n = SIM_MAX_DEVICES;
+	if (dev_list) {
+		for (int i = 0; i < n; i++) {
+			snprintf(dev_list[i], sizeof(lms_info_str_t),
+				 "LimeSDR-sim, media=sim, index=%d", i);
+		}
+	}
+	return n;
+}
+
+int LMS_Open(lms_device_t **device, const lms_info_str_t info, void *args) {
+	(void) args;
+	struct sim_device *d = calloc(1, sizeof(*d));
+	if (!d) return sim_error("out of memory");
+	const char *idx = strstr(info, "index=");
+	d->index = idx ? atoi(idx + 6) : 0;
+
+	d->sample_rate = 1e6;
+	d->delay = sim_env("LIMESDR_SIM_DELAY", 0.24);
+	d->delay_rate = sim_env("LIMESDR_SIM_DELAY_RATE", 0);
+	d->freq = sim_env("LIMESDR_SIM_FREQ", 0);
+	d->drift = sim_env("LIMESDR_SIM_DRIFT", 0);
+	d->doppler = sim_env("LIMESDR_SIM_DOPPLER", 0);
+	d->doppler_period = sim_env("LIMESDR_SIM_DOPPLER_PERIOD", 86164);
+	d->gain_lin = pow(10, sim_env("LIMESDR_SIM_GAIN", 0) / 20);
+	d->noise_amp = 32768 * pow(10, sim_env("LIMESDR_SIM_NOISE", -60) / 20) / sqrt(2);
+	d->overrun_interval = sim_env("LIMESDR_SIM_OVERRUN", 0);
+	d->overrun_len = sim_env("LIMESDR_SIM_OVERRUN_LEN", 4096);
+	d->realtime = sim_env("LIMESDR_SIM_REALTIME", 1);
+	d->temperature = sim_env("LIMESDR_SIM_TEMP", 45);
+	d->temp_swing = sim_env("LIMESDR_SIM_TEMP_SWING", 0);
+	d->temp_period = sim_env("LIMESDR_SIM_TEMP_PERIOD", 86400);
+	d->temp_ppm = sim_env("LIMESDR_SIM_TEMP_PPM", 0);
+	d->beacon_amp = getenv("LIMESDR_SIM_BEACON")
+		? 32768 * pow(10, sim_env("LIMESDR_SIM_BEACON", 0) / 20) : 0;
+	d->beacon_freq = sim_env("LIMESDR_SIM_BEACON_FREQ", 0);
+	d->pa_sat = getenv("LIMESDR_SIM_PA_SAT")
+		? 32768 * pow(10, sim_env("LIMESDR_SIM_PA_SAT", 0) / 20) : 0;
+	d->pa_smooth = sim_env("LIMESDR_SIM_PA_SMOOTH", 2);
+	d->pa_ampm = sim_env("LIMESDR_SIM_PA_AMPM", 0) * M_PI / 180;
+	d->pa_memory = sim_env("LIMESDR_SIM_PA_MEMORY", 0);
+	d->dc = getenv("LIMESDR_SIM_DC")
+		? 32768 * pow(10, sim_env("LIMESDR_SIM_DC", 0) / 20) / sqrt(2) : 0;
+	double iq_gain = pow(10, sim_env("LIMESDR_SIM_IQ_GAIN", 0) / 20);
+	double iq_phase = sim_env("LIMESDR_SIM_IQ_PHASE", 0) * M_PI / 180;
+	d->iq_sin = iq_gain * sin(iq_phase);
+	d->iq_cos = iq_gain * cos(iq_phase);
+	d->rng = (uint32_t) sim_env("LIMESDR_SIM_SEED", 1) * 2654435761u + d->index + 1;
+	if (d->rng == 0) d->rng = 1;
+	if (init_gauss_table(d) < 0) {
+		free(d);
+		return sim_error("out of memory");
+	}
+
+	pthread_mutex_init(&d->lock, NULL);
+
+	fprintf(stderr, "limesdr_sim: device %u, delay = %g s, freq = %g Hz, drift = %g Hz/s, "
+		"noise = %g dBFS, %s\n", d->index, d->delay, d->freq, d->drift,
+		sim_env("LIMESDR_SIM_NOISE", -60), d->realtime ? "realtime" : "free running");
+
+	*device = d;
+	return 0;
+}
+
+int LMS_Close(lms_device_t *device) {
+	struct sim_device *d = device;
+	if (!d) return 0;
+	free(d->gauss);
+	free(d->tx_ring);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+	return 0;
+}
+
+int LMS_Init(lms_device_t *device) { (void) device; return 0; }
+int LMS_Reset(lms_device_t *device) { (void) device; return 0; }
+
+int LMS_EnableChannel(lms_device_t *device, bool dir_tx, size_t chan, bool enabled) {
+	(void) device; (void) dir_tx; (void) enabled;
+	if (chan != 0) return sim_error("only channel 0 is simulated");
+	return 0;
+}
+
+int LMS_SetSampleRate(lms_device_t *device, float_type rate, size_t oversample) {
+	(void) oversample;
+	struct sim_device *d = device;
+	if (rate <= 0) return sim_error("invalid sample rate");
+	pthread_mutex_lock(&d->lock);
+	d->sample_rate = rate;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetSampleRate(lms_device_t *device, bool dir_tx, size_t chan,
+		      float_type *host_Hz, float_type *rf_Hz) {
+	(void) dir_tx; (void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	if (host_Hz) *host_Hz = d->sample_rate;
+	if (rf_Hz) *rf_Hz = d->sample_rate;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_SetLOFrequency(lms_device_t *device, bool dir_tx, size_t chan, float_type frequency) {
+	(void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	d->lo_freq[dir_tx] = frequency;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetLOFrequency(lms_device_t *device, bool dir_tx, size_t chan, float_type *frequency) {
+	(void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	*frequency = d->lo_freq[dir_tx];
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_SetNCOFrequency(lms_device_t *device, bool dir_tx, size_t chan,
+			const float_type *freq, float_type pho) {
+	(void) chan; (void) pho;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	d->nco_freq[dir_tx] = freq[0];
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetNCOFrequency(lms_device_t *device, bool dir_tx, size_t chan,
+			float_type *freq, float_type *pho) {
+	(void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	freq[0] = d->nco_freq[dir_tx];
+	pthread_mutex_unlock(&d->lock);
+	if (pho) *pho = 0;
+	return 0;
+}
+
+int LMS_SetNCOIndex(lms_device_t *device, bool dir_tx, size_t chan, int index, bool downconv) {
+	(void) chan; (void) index;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	d->nco_down[dir_tx] = downconv;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+// Frequency the channel is tuned to
+static double tuned_freq(struct sim_device *d, int is_tx) {
+	int add = is_tx ? !d->nco_down[is_tx] : d->nco_down[is_tx];
+	return d->lo_freq[is_tx] + (add ? d->nco_freq[is_tx] : -d->nco_freq[is_tx]);
+}
+
+static double sim_temperature(struct sim_device *d, double t) {
+	return d->temperature + d->temp_swing * sin(2 * M_PI * t / d->temp_period);
+}
+
+int LMS_SetLPFBW(lms_device_t *device, bool dir_tx, size_t chan, float_type bandwidth) {
+	(void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	d->lpf_bw[dir_tx] = bandwidth;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_SetNormalizedGain(lms_device_t *device, bool dir_tx, size_t chan, float_type gain) {
+	(void) chan;
+	if (gain < 0 || gain > 1) return sim_error("normalized gain out of range");
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	d->gain[dir_tx] = gain;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetNormalizedGain(lms_device_t *device, bool dir_tx, size_t chan, float_type *gain) {
+	(void) chan;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	*gain = d->gain[dir_tx];
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_Calibrate(lms_device_t *device, bool dir_tx, size_t chan, double bw, unsigned flags) {
+	(void) device; (void) dir_tx; (void) chan; (void) bw; (void) flags;
+	return 0;
+}
+
+int LMS_SetClockFreq(lms_device_t *device, size_t clk_id, float_type freq) {
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	if (clk_id == LMS_CLOCK_REF) d->ref_clock = freq;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetClockFreq(lms_device_t *device, size_t clk_id, float_type *freq) {
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	*freq = clk_id == LMS_CLOCK_REF ? d->ref_clock : d->sample_rate;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_GetChipTemperature(lms_device_t *device, size_t ind, float_type *temp) {
+	(void) ind;
+	struct sim_device *d = device;
+	pthread_mutex_lock(&d->lock);
+	*temp = sim_temperature(d, device_now(d) / d->sample_rate);
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_SetupStream(lms_device_t *device, lms_stream_t *stream) {
+	struct sim_device *d = device;
+	if (stream->dataFmt != LMS_FMT_I16) return sim_error("only LMS_FMT_I16 is simulated");
+
+	struct sim_stream *s = calloc(1, sizeof(*s));
+	if (!s) return sim_error("out of memory");
+	s->dev = d;
+	s->is_tx = stream->isTx;
+	s->fifo_size = stream->fifoSize;
+	stream->handle = (size_t) s;
+
+	pthread_mutex_lock(&d->lock);
+	if (s->is_tx) {
+		d->tx_stream = s;
+	}
+	else {
+		d->rx_stream = s;
+	}
+
+	if (!d->tx_ring) {
+		// Large enough for the channel delay plus a generous TX FIFO
+		uint64_t needed = (d->delay + 2.0) * d->sample_rate + 4 * stream->fifoSize;
+		d->tx_ring_size = 1;
+		while (d->tx_ring_size < needed) d->tx_ring_size <<= 1;
+		d->tx_ring = calloc(2 * d->tx_ring_size, sizeof(float));
+		if (!d->tx_ring) {
+			pthread_mutex_unlock(&d->lock);
+			return sim_error("out of memory");
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_DestroyStream(lms_device_t *device, lms_stream_t *stream) {
+	struct sim_device *d = device;
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	if (!s) return 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->rx_stream == s) d->rx_stream = NULL;
+	if (d->tx_stream == s) d->tx_stream = NULL;
+	pthread_mutex_unlock(&d->lock);
+	free(s);
+	stream->handle = 0;
+	return 0;
+}
+
+int LMS_StartStream(lms_stream_t *stream) {
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	struct sim_device *d = s->dev;
+	pthread_mutex_lock(&d->lock);
+	if (!d->clock_running) {
+		clock_gettime(CLOCK_MONOTONIC, &d->clock_start);
+		d->clock_running = 1;
+		schedule_overrun(d);
+	}
+	d->start_freq[s->is_tx] = tuned_freq(d, s->is_tx);
+	s->active = 1;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+int LMS_StopStream(lms_stream_t *stream) {
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	if (!s) return 0;
+	pthread_mutex_lock(&s->dev->lock);
+	s->active = 0;
+	pthread_mutex_unlock(&s->dev->lock);
+	return 0;
+}
+
+static inline float *tx_at(struct sim_device *d, uint64_t ts) {
+	return d->tx_ring + 2 * (ts & (d->tx_ring_size - 1));
+}
+
+// Zeroes the TX delay line up to ts (exclusive), since those samples
+// will not be read again by the channel model
+static void clear_tx(struct sim_device *d, uint64_t ts) {
+	if (ts <= d->tx_cleared_ts) return;
+	if (ts - d->tx_cleared_ts > d->tx_ring_size) d->tx_cleared_ts = ts - d->tx_ring_size;
+	while (d->tx_cleared_ts < ts) {
+		uint64_t idx = d->tx_cleared_ts & (d->tx_ring_size - 1);
+		uint64_t n = d->tx_ring_size - idx;
+		if (n > ts - d->tx_cleared_ts) n = ts - d->tx_cleared_ts;
+		memset(d->tx_ring + 2 * idx, 0, 2 * n * sizeof(float));
+		d->tx_cleared_ts += n;
+	}
+}
+
+static double channel_freq(struct sim_device *d, double t) {
+	return d->freq + d->drift * t
+		+ d->doppler * sin(2 * M_PI * t / d->doppler_period);
+}
+
+static void channel(struct sim_device *d, int16_t *out, uint64_t t0, size_t count) {
+	double fs = d->sample_rate;
+	double tau0 = d->delay * fs;
+
+	// The frequency is updated once per call, which is plenty for
+	// drifts and Doppler that change over seconds. Retuning and the
+	// reference error move the received frequencies away from those of
+	// the start of the streams
+	double error = 1e-6 * d->temp_ppm * (sim_temperature(d, t0 / fs) - d->temperature);
+	double rx_shift = tuned_freq(d, LMS_CH_RX) * (1 + error) - d->start_freq[LMS_CH_RX];
+	double tx_shift = tuned_freq(d, LMS_CH_TX) * (1 + error) - d->start_freq[LMS_CH_TX];
+	double f = channel_freq(d, t0 / fs) + tx_shift - rx_shift;
+	float dphase_c = cos(2 * M_PI * f / fs), dphase_s = sin(2 * M_PI * f / fs);
+	float rot_c = cos(d->phase), rot_s = sin(d->phase);
+	double fb = channel_freq(d, t0 / fs) + d->beacon_freq - rx_shift;
+	float bphase_c = cos(2 * M_PI * fb / fs), bphase_s = sin(2 * M_PI * fb / fs);
+	float beacon_c = cos(d->beacon_phase), beacon_s = sin(d->beacon_phase);
+	float beacon_gain = d->beacon_amp * pow(10, (70 * d->gain[LMS_CH_RX] - 14) / 20);
+	float rx_gain = d->gain_lin * pow(10, (70 * d->gain[LMS_CH_RX] - 14) / 20);
+	float noise_gain = d->noise_amp * pow(10, (70 * d->gain[LMS_CH_RX] - 14) / 20);
+
+	for (size_t j = 0; j < count; j++) {
+		uint64_t t = t0 + j;
+		double pos = t - tau0 - d->delay_rate * t;
+		float si = 0, sq = 0;
+		if (pos >= 1) {
+			// Cubic Lagrange interpolation for the fractional delay
+			uint64_t ip = (uint64_t) pos;
+			float mu = pos - ip;
+			float c0 = -mu * (mu - 1) * (mu - 2) / 6;
+			float c1 = (mu + 1) * (mu - 1) * (mu - 2) / 2;
+			float c2 = -(mu + 1) * mu * (mu - 2) / 2;
+			float c3 = (mu + 1) * mu * (mu - 1) / 6;
+			const float *x0 = tx_at(d, ip - 1), *x1 = tx_at(d, ip);
+			const float *x2 = tx_at(d, ip + 1), *x3 = tx_at(d, ip + 2);
+			float xi = c0 * x0[0] + c1 * x1[0] + c2 * x2[0] + c3 * x3[0];
+			float xq = c0 * x0[1] + c1 * x1[1] + c2 * x2[1] + c3 * x3[1];
+			si = xi * rot_c - xq * rot_s;
+			sq = xi * rot_s + xq * rot_c;
+		}
+		float tmp = rot_c * dphase_c - rot_s * dphase_s;
+		rot_s = rot_c * dphase_s + rot_s * dphase_c;
+		rot_c = tmp;
+
+		uint32_t r = xorshift32(&d->rng);
+		float yi = rx_gain * si + noise_gain * d->gauss[r & (SIM_GAUSS_TABLE_SIZE - 1)];
+		float yq = rx_gain * sq + noise_gain * d->gauss[r >> 16];
+		if (beacon_gain) {
+			yi += beacon_gain * beacon_c;
+			yq += beacon_gain * beacon_s;
+			tmp = beacon_c * bphase_c - beacon_s * bphase_s;
+			beacon_s = beacon_c * bphase_s + beacon_s * bphase_c;
+			beacon_c = tmp;
+		}
+		tmp = d->iq_sin * yi + d->iq_cos * yq;
+		yi += d->dc;
+		yq = tmp + d->dc;
+
+		// 12 bit ADC, left justified in 16 bits
+		if (yi > 32767) yi = 32767;
+		if (yi < -32768) yi = -32768;
+		if (yq > 32767) yq = 32767;
+		if (yq < -32768) yq = -32768;
+		out[2*j] = (int16_t) lrintf(yi) & ~0xf;
+		out[2*j+1] = (int16_t) lrintf(yq) & ~0xf;
+	}
+
+	d->phase = fmod(d->phase + 2 * M_PI * f / fs * count, 2 * M_PI);
+	d->beacon_phase = fmod(d->beacon_phase + 2 * M_PI * fb / fs * count, 2 * M_PI);
+
+	double pos_end = t0 + count - tau0 - d->delay_rate * (t0 + count);
+	if (pos_end > 4) clear_tx(d, (uint64_t) pos_end - 4);
+}
+
+int LMS_RecvStream(lms_stream_t *stream, void *samples, size_t sample_count,
+		   lms_stream_meta_t *meta, unsigned timeout_ms) {
+	(void) timeout_ms;
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	struct sim_device *d = s->dev;
+	pthread_mutex_lock(&d->lock);
+	if (!s->active) {
+		pthread_mutex_unlock(&d->lock);
+		return sim_error("RX stream not started");
+	}
+
+	if (d->realtime) {
+		uint64_t now = device_now(d);
+		if (now > d->rx_next_ts + s->fifo_size) {
+			// The application did not keep up and the RX FIFO overflowed
+			d->rx_overrun++;
+			d->rx_dropped++;
+			d->rx_next_ts = now - s->fifo_size / 2;
+		}
+		if (d->rx_next_ts + sample_count > now) {
+			// Only this thread moves rx_next_ts
+			uint64_t ts = d->rx_next_ts + sample_count;
+			pthread_mutex_unlock(&d->lock);
+			wait_device_time(d, ts);
+			pthread_mutex_lock(&d->lock);
+		}
+	}
+	if (d->overrun_interval > 0 && d->rx_next_ts >= d->next_overrun_ts) {
+		d->rx_overrun++;
+		d->rx_dropped++;
+		d->rx_next_ts += d->overrun_len;
+		schedule_overrun(d);
+	}
+
+	if (meta) meta->timestamp = d->rx_next_ts;
+	channel(d, samples, d->rx_next_ts, sample_count);
+	d->rx_next_ts += sample_count;
+	pthread_mutex_unlock(&d->lock);
+	return sample_count;
+}
+
+// Amplitude compression r / (1 + (r / sat)^(2p))^(1/(2p)) and a phase
+// shift that grows with the power to ampm at saturation
+static void pa(struct sim_device *d, float xi, float xq, float *y) {
+	float vi = xi + d->pa_memory * d->pa_last_i;
+	float vq = xq + d->pa_memory * d->pa_last_q;
+	d->pa_last_i = xi;
+	d->pa_last_q = xq;
+	double r2 = ((double) vi * vi + (double) vq * vq) / (d->pa_sat * d->pa_sat);
+	double gain = 1 / pow(1 + pow(r2, d->pa_smooth), 1 / (2 * d->pa_smooth));
+	double phase = d->pa_ampm * r2 / (1 + r2);
+	double c = gain * cos(phase), s = gain * sin(phase);
+	y[0] = vi * c - vq * s;
+	y[1] = vi * s + vq * c;
+}
+
+int LMS_SendStream(lms_stream_t *stream, const void *samples, size_t sample_count,
+		   const lms_stream_meta_t *meta, unsigned timeout_ms) {
+	(void) timeout_ms;
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	struct sim_device *d = s->dev;
+	const int16_t *x = samples;
+	pthread_mutex_lock(&d->lock);
+	if (!s->active) {
+		pthread_mutex_unlock(&d->lock);
+		return sim_error("TX stream not started");
+	}
+
+	uint64_t now = device_now(d);
+	int timed = meta && meta->waitForTimestamp;
+	if (timed) {
+		if (meta->timestamp != d->tx_write_ts) d->tx_burst_ts = meta->timestamp;
+		d->tx_write_ts = meta->timestamp;
+	}
+	else if (d->tx_write_ts < now) {
+		if (d->tx_write_ts) d->tx_underrun++;
+		d->tx_write_ts = d->tx_burst_ts = now;
+	}
+
+	// Samples of a burst scheduled in the future sit in the FIFO until
+	// the burst starts
+	uint64_t drain_ts = now > d->tx_burst_ts ? now : d->tx_burst_ts;
+	if (d->realtime && d->tx_write_ts + sample_count > drain_ts + s->fifo_size) {
+		// Block until there is room in the TX FIFO. Only this thread
+		// moves tx_write_ts
+		uint64_t wait_ts = d->tx_write_ts + sample_count - s->fifo_size;
+		pthread_mutex_unlock(&d->lock);
+		wait_device_time(d, wait_ts);
+		pthread_mutex_lock(&d->lock);
+	}
+
+	// Late samples are dropped by the FPGA
+	uint64_t ts = d->tx_write_ts;
+	uint64_t due = timed && now > d->tx_cleared_ts ? now : d->tx_cleared_ts;
+	size_t first = 0;
+	if (ts < due) {
+		d->tx_dropped++;
+		first = due - ts;
+		if (first > sample_count) first = sample_count;
+	}
+	uint64_t limit = d->tx_cleared_ts + d->tx_ring_size;
+	for (size_t j = first; j < sample_count && ts + j < limit; j++) {
+		float *y = tx_at(d, ts + j);
+		if (d->pa_sat > 0) {
+			pa(d, x[2*j], x[2*j+1], y);
+		}
+		else {
+			y[0] = x[2*j];
+			y[1] = x[2*j+1];
+		}
+	}
+	d->tx_write_ts = ts + sample_count;
+	pthread_mutex_unlock(&d->lock);
+	return sample_count;
+}
+
+int LMS_GetStreamStatus(lms_stream_t *stream, lms_stream_status_t *status) {
+	struct sim_stream *s = (struct sim_stream *) stream->handle;
+	struct sim_device *d = s->dev;
+	pthread_mutex_lock(&d->lock);
+	uint64_t now = device_now(d);
+
+	memset(status, 0, sizeof(*status));
+	status->active = s->active;
+	status->fifoSize = s->fifo_size;
+	status->sampleRate = d->sample_rate;
+	status->linkRate = 4 * d->sample_rate;
+	status->timestamp = now;
+	if (s->is_tx) {
+		uint64_t drain_ts = now > d->tx_burst_ts ? now : d->tx_burst_ts;
+		uint64_t filled = d->tx_write_ts > drain_ts ? d->tx_write_ts - drain_ts : 0;
+		status->fifoFilledCount = filled < s->fifo_size ? filled : s->fifo_size;
+		status->underrun = d->tx_underrun;
+		status->droppedPackets = d->tx_dropped;
+		d->tx_underrun = d->tx_dropped = 0;
+	}
+	else {
+		uint64_t filled = now > d->rx_next_ts ? now - d->rx_next_ts : 0;
+		status->fifoFilledCount = filled < s->fifo_size ? filled : s->fifo_size;
+		status->overrun = d->rx_overrun;
+		status->droppedPackets = d->rx_dropped;
+		d->rx_overrun = d->rx_dropped = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+const lms_dev_info_t *LMS_GetDeviceInfo(lms_device_t *device) {
+	(void) device;
+	return &sim_info;
+}
+
+const char *LMS_GetLibraryVersion(void) {
+	return "sim";
+}
+
+const char *LMS_GetLastErrorMessage(void) {
+	return last_error;
+}
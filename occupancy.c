@@ -0,0 +1,426 @@
+/*
+  ===========================================================================
+
+  occupancy - Detection of the signals in the RX passband, with averaged
+  FFTs and a CFAR threshold, that logs when each channel is busy.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The feed thread only copies the samples of the FFT frames, which are
+  spaced so that there are at most budget of them per second, and the
+  detector thread averages their power spectra over a period. The noise
+  floor at each bin is an order statistic of the bins on both sides of it,
+  leaving out the bins next to it, so that it follows the slope of the
+  passband and is not raised by signals that take less than three
+  quarters of the reference bins. A channel goes on when a bin is over
+  the threshold, and off when all its bins have been under the threshold
+  minus a hysteresis for a few periods.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fir.h"
+#include "occupancy.h"
+
+#define BINS_PER_CHANNEL 8 // at least
+#define PERIOD 1.0 // s of FFTs averaged
+#define MIN_FRAMES 4 // in a period to run the detector
+#define USABLE_BANDWIDTH 0.9 // fraction of the sample rate
+#define REFERENCE_CELLS 16 // bins on each side for the noise floor
+#define QUANTILE 0.25 // of the reference cells
+#define HYSTERESIS 3.0 // dB
+#define HANG 2 // periods under the threshold to go off
+#define RING_FRAMES 64
+
+// Quantile of the average of frames exponential variables of mean 1, by
+// the Wilson-Hilferty approximation, so that the noise floor is unbiased
+static double gamma_quantile(int frames, double z) {
+	double a = 1.0 / (9 * frames);
+	double x = 1 - a + z * sqrt(a);
+	return x * x * x;
+}
+
+// The k-th smallest of x[0..n), which is reordered
+static float select_kth(float *x, int n, int k) {
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		float pivot = x[(lo + hi) / 2];
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (x[i] < pivot) i++;
+			while (x[j] > pivot) j--;
+			if (i <= j) {
+				float t = x[i];
+				x[i++] = x[j];
+				x[j--] = t;
+			}
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else break;
+	}
+	return x[k];
+}
+
+static int open_log(struct occupancy *o, const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("Could not open occupancy log");
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	struct occupancy_file_header h;
+	size_t size = sizeof(struct occupancy_record);
+	if (st.st_size == 0) {
+		h = (struct occupancy_file_header) {
+			.magic = OCCUPANCY_MAGIC,
+			.version = OCCUPANCY_VERSION,
+			.record_size = size
+		};
+		if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+			perror("Could not write occupancy log");
+			close(fd);
+			return -1;
+		}
+	}
+	else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != OCCUPANCY_MAGIC
+		 || h.version != OCCUPANCY_VERSION || h.record_size != size) {
+		fprintf(stderr, "ERROR: %s is not an occupancy log\n", path);
+		close(fd);
+		return -1;
+	}
+	else if ((st.st_size - sizeof(h)) % size) {
+		// A record cut by a crash, which would misalign the ones after it
+		if (ftruncate(fd, st.st_size - (st.st_size - sizeof(h)) % size) < 0) {
+			perror("Could not repair occupancy log");
+			close(fd);
+			return -1;
+		}
+	}
+	o->file = fdopen(fd, "a");
+	if (!o->file) {
+		perror("Could not open occupancy log");
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void put_record(struct occupancy *o, enum occupancy_record_type type, double time,
+		       double frequency, double bandwidth, double level) {
+	struct occupancy_record r = {
+		.time = time,
+		.frequency = frequency,
+		.bandwidth = bandwidth,
+		.level = level,
+		.type = type
+	};
+	if (fwrite(&r, sizeof(r), 1, o->file) != 1) atomic_fetch_add(&o->write_errors, 1);
+	o->last_record = time;
+	if (type == OCCUPANCY_ON || type == OCCUPANCY_OFF) atomic_fetch_add(&o->events, 1);
+}
+
+static double channel_freq(struct occupancy *o, int c) {
+	return o->frequency + (c - o->channel_count / 2) * o->channel_width;
+}
+
+int occupancy_init(struct occupancy *o, const char *path, double sample_rate,
+		   double frequency, double channel_width, double threshold, int budget) {
+	memset(o, 0, sizeof(*o));
+	o->sample_rate = sample_rate;
+	o->frequency = frequency;
+	o->channel_width = channel_width;
+	o->threshold = threshold;
+	if (channel_width <= 0 || budget < MIN_FRAMES / PERIOD) {
+		fprintf(stderr, "ERROR: invalid occupancy channel width or FFT budget\n");
+		return -1;
+	}
+
+	o->fft_size = 1;
+	while (o->fft_size * channel_width < BINS_PER_CHANNEL * sample_rate) o->fft_size <<= 1;
+	o->stride = sample_rate / budget;
+	if (o->stride < o->fft_size) o->stride = o->fft_size;
+	// An odd number of channels, with the middle one at the RX frequency
+	double fit = USABLE_BANDWIDTH * sample_rate / channel_width;
+	o->channel_count = 2 * (int) ((fit - 1) / 2) + 1;
+	if (fit < 1) {
+		fprintf(stderr, "ERROR: occupancy channel wider than the passband\n");
+		return -1;
+	}
+	o->window = malloc(o->fft_size * sizeof(float));
+	o->fft_in = fftwf_malloc(o->fft_size * sizeof(fftwf_complex));
+	o->fft_out = fftwf_malloc(o->fft_size * sizeof(fftwf_complex));
+	o->power = calloc(o->fft_size, sizeof(float));
+	o->noise = calloc(o->fft_size, sizeof(float));
+	o->cells = malloc(2 * REFERENCE_CELLS * sizeof(float));
+	o->channels = calloc(o->channel_count, sizeof(*o->channels));
+	if (!o->window || !o->fft_in || !o->fft_out || !o->power || !o->noise || !o->cells
+	    || !o->channels) {
+		fprintf(stderr, "Could not allocate occupancy detector\n");
+		occupancy_free(o);
+		return -1;
+	}
+	o->plan = fftwf_plan_dft_1d(o->fft_size, o->fft_in, o->fft_out, FFTW_FORWARD,
+				    FFTW_ESTIMATE);
+	// Blackman-Harris, whose sidelobes are under the dynamic range of the
+	// LimeSDR, so that a strong signal only spills into the channels next
+	// to it. Scaled so that a full scale carrier is 0 dB
+	fir_blackman_harris(o->window, o->fft_size);
+	double sum = 0;
+	for (int j = 0; j < o->fft_size; j++) sum += o->window[j];
+	for (int j = 0; j < o->fft_size; j++) o->window[j] /= 32768 * sum;
+
+	if (open_log(o, path) < 0) {
+		occupancy_free(o);
+		return -1;
+	}
+	if (block_ring_init(&o->ring, RING_FRAMES, o->fft_size) < 0) {
+		occupancy_free(o);
+		return -1;
+	}
+	atomic_init(&o->noise_floor, NAN);
+	fprintf(stderr, "Occupancy: %d channels of %.0f Hz, %d point FFT, %.0f FFTs/s, "
+		"threshold %.1f dB\n", o->channel_count, channel_width, o->fft_size,
+		sample_rate / o->stride, threshold);
+	return 0;
+}
+
+// First bin of channel c, or the end of the last channel for channel_count
+static int channel_bin(struct occupancy *o, int c) {
+	double bin_width = o->sample_rate / o->fft_size;
+	double f = channel_freq(o, c) - o->channel_width / 2 - o->frequency;
+	return o->fft_size / 2 + lround(f / bin_width);
+}
+
+static void estimate_noise(struct occupancy *o) {
+	int lo = channel_bin(o, 0), hi = channel_bin(o, o->channel_count);
+	int guard = o->channel_width * o->fft_size / o->sample_rate / 2 + 1;
+	if (lo < 0) lo = 0;
+	if (hi > o->fft_size) hi = o->fft_size;
+	double bias = gamma_quantile(o->frames, -0.674); // z of the 25% quantile
+	for (int b = lo; b < hi; b++) {
+		int n = 0;
+		for (int k = b - guard - REFERENCE_CELLS; k < b - guard; k++) {
+			if (k >= lo) o->cells[n++] = o->power[k];
+		}
+		for (int k = b + guard + 1; k <= b + guard + REFERENCE_CELLS; k++) {
+			if (k < hi) o->cells[n++] = o->power[k];
+		}
+		o->noise[b] = n ? select_kth(o->cells, n, QUANTILE * n) / bias : o->power[b];
+	}
+}
+
+static void alive(struct occupancy *o, double time) {
+	put_record(o, OCCUPANCY_ALIVE, time, o->frequency, o->channel_count * o->channel_width,
+		   o->threshold);
+	for (int c = 0; c < o->channel_count; c++) {
+		struct occupancy_channel *ch = &o->channels[c];
+		if (ch->on) {
+			put_record(o, OCCUPANCY_ACTIVE, time, channel_freq(o, c), o->channel_width,
+				   ch->peak);
+		}
+	}
+	o->last_alive = time;
+}
+
+static void end_period(struct occupancy *o) {
+	if (o->frames < MIN_FRAMES) goto reset;
+	for (int b = 0; b < o->fft_size; b++) o->power[b] /= o->frames;
+	estimate_noise(o);
+
+	int busy = 0;
+	for (int c = 0; c < o->channel_count; c++) {
+		struct occupancy_channel *ch = &o->channels[c];
+		double f = channel_freq(o, c);
+		int lo = channel_bin(o, c), hi = channel_bin(o, c + 1);
+		float snr = 0;
+		for (int b = lo < 0 ? 0 : lo; b < hi && b < o->fft_size; b++) {
+			float s = o->power[b] / o->noise[b];
+			if (s > snr) snr = s;
+		}
+		float level = 10 * log10f(snr);
+		if (!ch->on) {
+			if (level >= o->threshold) {
+				ch->on = 1;
+				ch->below = 0;
+				ch->peak = level;
+				put_record(o, OCCUPANCY_ON, o->period_start, f, o->channel_width, level);
+			}
+		}
+		else {
+			if (level > ch->peak) ch->peak = level;
+			if (level >= o->threshold - HYSTERESIS) {
+				ch->below = 0;
+			}
+			else if (!ch->below++) {
+				ch->off_time = o->period_start;
+			}
+			if (ch->below >= HANG) {
+				ch->on = 0;
+				// Never before the last record, to keep the log in time
+				// order
+				double t = ch->off_time > o->last_record ? ch->off_time : o->last_record;
+				put_record(o, OCCUPANCY_OFF, t, f, o->channel_width, ch->peak);
+			}
+		}
+		busy += ch->on;
+	}
+	atomic_store(&o->busy, busy);
+
+	if (o->period_start - o->last_alive >= OCCUPANCY_HEARTBEAT) alive(o, o->period_start);
+	if (fflush(o->file) != 0) atomic_fetch_add(&o->write_errors, 1);
+
+	// Median noise floor, for the status. The averages are not needed
+	// any more
+	int lo = channel_bin(o, 0) < 0 ? 0 : channel_bin(o, 0);
+	int hi = channel_bin(o, o->channel_count);
+	if (hi > o->fft_size) hi = o->fft_size;
+	memcpy(o->power + lo, o->noise + lo, (hi - lo) * sizeof(float));
+	atomic_store(&o->noise_floor, 10 * log10f(select_kth(o->power + lo, hi - lo, (hi - lo) / 2)));
+	atomic_fetch_add(&o->periods, 1);
+
+reset:
+	memset(o->power, 0, o->fft_size * sizeof(float));
+	o->frames = 0;
+}
+
+static void process_frame(struct occupancy *o, const int16_t *samples) {
+	// Without the DC offset, which would keep the middle channel busy
+	long sum_i = 0, sum_q = 0;
+	for (int j = 0; j < o->fft_size; j++) {
+		sum_i += samples[2*j];
+		sum_q += samples[2*j+1];
+	}
+	float dc_i = (float) sum_i / o->fft_size, dc_q = (float) sum_q / o->fft_size;
+	for (int j = 0; j < o->fft_size; j++) {
+		o->fft_in[j][0] = (samples[2*j] - dc_i) * o->window[j];
+		o->fft_in[j][1] = (samples[2*j+1] - dc_q) * o->window[j];
+	}
+	fftwf_execute(o->plan);
+	// With 0 Hz in the middle
+	int half = o->fft_size / 2;
+	for (int j = 0; j < o->fft_size; j++) {
+		const fftwf_complex *x = &o->fft_out[(j + half) % o->fft_size];
+		o->power[j] += (*x)[0] * (*x)[0] + (*x)[1] * (*x)[1];
+	}
+	o->frames++;
+}
+
+static void *occupancy_thread(void *arg) {
+	struct occupancy *o = arg;
+	while (!atomic_load(&o->stop)) {
+		struct block_ring_block *frame = block_ring_read_begin(&o->ring);
+		if (!frame) continue;
+		double t = frame->host_time;
+		if (!o->started) {
+			put_record(o, OCCUPANCY_START, t, o->frequency,
+				   o->channel_count * o->channel_width, o->threshold);
+			o->last_alive = t;
+			o->started = 1;
+		}
+		if (o->frames && t >= o->period_start + PERIOD) end_period(o);
+		if (!o->frames) o->period_start = t;
+		process_frame(o, frame->samples);
+		o->last_time = t;
+		block_ring_read_commit(&o->ring);
+	}
+	return NULL;
+}
+
+int occupancy_start(struct occupancy *o) {
+	if (pthread_create(&o->thread, NULL, occupancy_thread, o) != 0) {
+		fprintf(stderr, "Could not create occupancy thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+void occupancy_push(struct occupancy *o, const int16_t *samples, int count, double host_time) {
+	int j = 0;
+	while (j < count) {
+		if (o->skip) {
+			int n = o->skip < count - j ? o->skip : count - j;
+			o->skip -= n;
+			j += n;
+			continue;
+		}
+		if (!o->fill) {
+			o->frame = block_ring_write_begin(&o->ring);
+			if (!o->frame) {
+				o->skip = o->stride;
+				continue;
+			}
+			o->frame->host_time = host_time + j / o->sample_rate;
+		}
+		int n = o->fft_size - o->fill < count - j ? o->fft_size - o->fill : count - j;
+		memcpy(o->frame->samples + 2 * o->fill, samples + 2 * j, 2 * n * sizeof(int16_t));
+		o->fill += n;
+		j += n;
+		if (o->fill == o->fft_size) {
+			block_ring_write_commit(&o->ring);
+			o->fill = 0;
+			o->skip = o->stride - o->fft_size;
+		}
+	}
+}
+
+void occupancy_print(struct occupancy *o) {
+	fprintf(stderr, "Occupancy: busy = %d of %d channels, noise floor = %.1f dBFS/bin, "
+		"events = %lu, dropped = %lu, write errors = %lu\n",
+		atomic_load(&o->busy), o->channel_count, atomic_load(&o->noise_floor),
+		atomic_load(&o->events), atomic_load(&o->ring.dropped),
+		atomic_load(&o->write_errors));
+}
+
+void occupancy_stop(struct occupancy *o) {
+	atomic_store(&o->stop, 1);
+	block_ring_wake(&o->ring);
+	pthread_join(o->thread, NULL);
+	if (!o->started) return;
+	double t = o->last_time;
+	for (int c = 0; c < o->channel_count; c++) {
+		struct occupancy_channel *ch = &o->channels[c];
+		if (ch->on) {
+			put_record(o, OCCUPANCY_OFF, t, channel_freq(o, c), o->channel_width, ch->peak);
+			ch->on = 0;
+		}
+	}
+	put_record(o, OCCUPANCY_STOP, t, o->frequency, o->channel_count * o->channel_width,
+		   o->threshold);
+	fflush(o->file);
+}
+
+void occupancy_free(struct occupancy *o) {
+	if (o->plan) fftwf_destroy_plan(o->plan);
+	fftwf_free(o->fft_in);
+	fftwf_free(o->fft_out);
+	free(o->window);
+	free(o->power);
+	free(o->noise);
+	free(o->cells);
+	free(o->channels);
+	if (o->file) fclose(o->file);
+	if (o->ring.blocks) block_ring_free(&o->ring);
+}
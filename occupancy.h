@@ -0,0 +1,127 @@
+/*
+  ===========================================================================
+
+  occupancy - Detection of the signals in the RX passband, with averaged
+  FFTs and a CFAR threshold, that logs when each channel is busy.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <fftw3.h>
+
+#include "block_ring.h"
+
+// The file is a header followed by records in time order, which are only
+// ever appended. Little endian
+#define OCCUPANCY_MAGIC 0x43434f51 // "QOCC"
+#define OCCUPANCY_VERSION 1
+// Seconds between ALIVE records. A longer gap without records is a time
+// that was not monitored
+#define OCCUPANCY_HEARTBEAT 60.0
+
+struct occupancy_file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t reserved[2];
+};
+
+enum occupancy_record_type {
+	// Detector started. frequency is the RX frequency, bandwidth the span
+	// monitored and level the threshold
+	OCCUPANCY_START = 1,
+	OCCUPANCY_STOP = 2,
+	// Heartbeat, followed by an ACTIVE record for each busy channel
+	OCCUPANCY_ALIVE = 3,
+	OCCUPANCY_ACTIVE = 4,
+	OCCUPANCY_ON = 5,
+	OCCUPANCY_OFF = 6
+};
+
+struct occupancy_record {
+	double time; // UNIX time
+	double frequency; // Hz, centre of the channel
+	float bandwidth; // Hz
+	float level; // dB over the noise floor, peak while busy for OFF and ACTIVE
+	uint32_t type;
+	uint32_t reserved;
+};
+
+struct occupancy_channel {
+	int on;
+	int below; // periods under the release threshold
+	double off_time; // start of the first of them
+	float peak;
+};
+
+struct occupancy {
+	FILE *file;
+	double sample_rate, frequency;
+	double channel_width, threshold;
+
+	// FFT frames of fft_size samples, one every stride samples, taken in
+	// the feed thread. The frames of a period are averaged
+	int fft_size, stride;
+	int skip; // samples to drop before the next frame
+	int fill; // samples in the frame being taken
+	struct block_ring_block *frame;
+	float *window;
+	fftwf_complex *fft_in, *fft_out;
+	fftwf_plan plan;
+	float *power; // averaged, with 0 Hz in the middle
+	int frames;
+	int started; // the START record is written
+	double period_start;
+	double last_time, last_alive, last_record; // of the last frame, ALIVE and any record
+
+	// Noise floor from an order statistic of the bins around each one
+	float *noise, *cells;
+	int channel_count;
+	struct occupancy_channel *channels;
+
+	struct block_ring ring;
+	pthread_t thread;
+	atomic_int stop;
+	atomic_int busy; // channels on
+	atomic_ulong periods, events, write_errors;
+	_Atomic float noise_floor; // dBFS per bin, median
+};
+
+// Appends to path, which is created if it does not exist. frequency is the
+// RX frequency, channel_width the resolution of the log, threshold in dB
+// over the noise floor, and budget the maximum number of FFTs per second
+int occupancy_init(struct occupancy *o, const char *path, double sample_rate,
+		   double frequency, double channel_width, double threshold, int budget);
+int occupancy_start(struct occupancy *o);
+// Takes count interleaved int16 IQ samples, the first one at host_time. The
+// frames are dropped if the detector is behind
+void occupancy_push(struct occupancy *o, const int16_t *samples, int count, double host_time);
+void occupancy_print(struct occupancy *o);
+// Closes the busy channels in the log
+void occupancy_stop(struct occupancy *o);
+void occupancy_free(struct occupancy *o);
+
+#endif
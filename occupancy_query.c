@@ -0,0 +1,220 @@
+/*
+  ===========================================================================
+
+  occupancy_query - Busy fraction of each channel in an occupancy log of
+  limesdr_linrad over a time range.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The records are in time order, so the start of the range is found by a
+  binary search, and the state of the channels is known from the first
+  ALIVE or START record before it. The busy fraction of a channel is over
+  the time that was monitored, which ends at a STOP record or when the
+  records stop for longer than the heartbeat.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "occupancy.h"
+
+#define MAX_GAP (1.5 * OCCUPANCY_HEARTBEAT)
+
+struct channel {
+	double frequency;
+	int on;
+	double since;
+	double busy; // s
+	unsigned long events;
+};
+
+static double range_start = -INFINITY, range_end = INFINITY;
+static struct channel *channels;
+static int channel_count, channel_alloc;
+static double covered, covered_since;
+static int is_covered;
+
+static double parse_time(const char *s) {
+	struct tm tm = {0};
+	const char *end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end && (*end == 0 || *end == 'Z')) return timegm(&tm);
+	char *e;
+	double t = strtod(s, &e);
+	if (*e) {
+		fprintf(stderr, "ERROR: invalid time %s, use YYYY-mm-ddTHH:MM:SS or UNIX time\n", s);
+		exit(1);
+	}
+	return t;
+}
+
+// Length of [a, b) inside the range
+static double overlap(double a, double b) {
+	if (a < range_start) a = range_start;
+	if (b > range_end) b = range_end;
+	return b > a ? b - a : 0;
+}
+
+static struct channel *find_channel(double frequency) {
+	for (int k = 0; k < channel_count; k++) {
+		if (fabs(channels[k].frequency - frequency) < 0.5) return &channels[k];
+	}
+	if (channel_count == channel_alloc) {
+		channel_alloc = channel_alloc ? 2 * channel_alloc : 64;
+		channels = realloc(channels, channel_alloc * sizeof(*channels));
+		if (!channels) {
+			fprintf(stderr, "Could not allocate channels\n");
+			exit(1);
+		}
+	}
+	struct channel *c = &channels[channel_count++];
+	memset(c, 0, sizeof(*c));
+	c->frequency = frequency;
+	return c;
+}
+
+static void channel_off(struct channel *c, double t) {
+	if (!c->on) return;
+	c->busy += overlap(c->since, t);
+	c->on = 0;
+}
+
+static void channel_on(struct channel *c, double t) {
+	if (c->on) return;
+	c->on = 1;
+	c->since = t;
+}
+
+// The monitoring stopped at t
+static void uncover(double t) {
+	for (int k = 0; k < channel_count; k++) channel_off(&channels[k], t);
+	if (is_covered) covered += overlap(covered_since, t);
+	is_covered = 0;
+}
+
+static int compare_channels(const void *a, const void *b) {
+	const struct channel *x = a, *y = b;
+	return (x->frequency > y->frequency) - (x->frequency < y->frequency);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2 || argc > 4 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		printf("Usage: %s <OCCUPANCY_FILE> [<START> [<END>]]\n", argv[0]);
+		printf("  START, END: YYYY-mm-ddTHH:MM:SS in UTC or UNIX time (default: the whole file)\n");
+		return 1;
+	}
+	if (argc > 2) range_start = parse_time(argv[2]);
+	if (argc > 3) range_end = parse_time(argv[3]);
+
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("Could not open occupancy log");
+		return 1;
+	}
+	const struct occupancy_file_header *h = NULL;
+	if (st.st_size >= (off_t) sizeof(*h)) {
+		h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (h == MAP_FAILED) {
+			perror("Could not map occupancy log");
+			return 1;
+		}
+	}
+	if (!h || h->magic != OCCUPANCY_MAGIC || h->version != OCCUPANCY_VERSION
+	    || h->record_size != sizeof(struct occupancy_record)) {
+		fprintf(stderr, "ERROR: %s is not an occupancy log\n", argv[1]);
+		return 1;
+	}
+	const struct occupancy_record *records = (const void *) (h + 1);
+	size_t count = (st.st_size - sizeof(*h)) / sizeof(*records);
+
+	// First record that can tell the state at the start of the range:
+	// there is an ALIVE record at most a heartbeat before it
+	double from = range_start - MAX_GAP;
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (records[mid].time < from) lo = mid + 1;
+		else hi = mid;
+	}
+
+	double last = NAN;
+	for (size_t n = lo; n < count; n++) {
+		const struct occupancy_record *r = &records[n];
+		double t = r->time;
+		if (t > range_end) {
+			// The last state held until the end of the range
+			if (is_covered && t - last <= MAX_GAP) last = range_end;
+			break;
+		}
+		if (is_covered && (t - last > MAX_GAP || r->type == OCCUPANCY_START)) uncover(last);
+		last = t;
+		struct channel *c;
+		switch (r->type) {
+		case OCCUPANCY_START:
+			is_covered = 1;
+			covered_since = t;
+			break;
+		case OCCUPANCY_STOP:
+			uncover(t);
+			break;
+		case OCCUPANCY_ALIVE:
+			// The ACTIVE records after it tell which channels are busy
+			for (int k = 0; k < channel_count; k++) channel_off(&channels[k], t);
+			if (!is_covered) {
+				is_covered = 1;
+				covered_since = t;
+			}
+			break;
+		case OCCUPANCY_ACTIVE:
+			if (is_covered) channel_on(find_channel(r->frequency), t);
+			break;
+		case OCCUPANCY_ON:
+			c = find_channel(r->frequency);
+			if (is_covered) channel_on(c, t);
+			if (t >= range_start) c->events++;
+			break;
+		case OCCUPANCY_OFF:
+			c = find_channel(r->frequency);
+			channel_off(c, t);
+			break;
+		}
+	}
+	if (is_covered) uncover(last);
+
+	qsort(channels, channel_count, sizeof(*channels), compare_channels);
+	printf("# monitored %.0f s\n", covered);
+	printf("# frequency_hz,busy_s,busy_fraction,on_events\n");
+	for (int k = 0; k < channel_count; k++) {
+		struct channel *c = &channels[k];
+		if (!c->busy && !c->events) continue;
+		printf("%.0f,%.1f,%.4f,%lu\n", c->frequency, c->busy,
+		       covered > 0 ? c->busy / covered : 0, c->events);
+	}
+	free(channels);
+	close(fd);
+	return 0;
+}
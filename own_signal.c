@@ -0,0 +1,659 @@
+/*
+  ===========================================================================
+
+  own_signal - Monitor of our own signal in the downlink, compared with
+  the TX samples it came from, which are delay aligned through the device
+  timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The band of our signal is mixed to 0 Hz and decimated to about twice
+  its bandwidth, in TX as it is sent and in RX where the transponder puts
+  it, so the history of both only takes a few seconds of a narrow band.
+  The decimated samples fall on timestamps that are multiples of the
+  decimation, so TX and RX share the same grid. Every second the worker
+  takes the last second of RX and the TX samples up to the maximum delay
+  before it. Until it is locked, the delay is searched over the whole
+  range by FFT cross-correlation of the power envelopes, which does not
+  care about the frequency offset. Once locked, it is only searched a few
+  samples around the last one. The frequency offset is the peak of the
+  spectrum of RX times the conjugate of the aligned TX. With TX aligned in
+  delay and frequency, the Welch cross-spectrum between them gives the
+  part of RX that is coherent with TX, and so the SNR, the response of
+  the downlink across our signal, and, through its inverse FFT upsampled,
+  the fraction of a sample of delay.
+
+  ===========================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "fir.h"
+#include "own_signal.h"
+
+#define FULL_SCALE 32768.0
+#define CHUNK 256 // samples processed in each pass
+#define OVERSAMPLING 2.0 // of the decimated rate over the bandwidth
+#define FILTER_ATTENUATION 60.0 // dB
+#define RING_SECONDS 4.0 // plus the maximum delay
+#define CAPTURE 1.0 // s of RX in each measurement
+#define INTERVAL 1 // s between measurements
+#define MIN_LEVEL -50.0 // dBFS of TX to measure
+#define MIN_CORRELATION 0.3 // of the envelopes, to take a delay
+#define MIN_COHERENCE 0.05 // fraction of RX coherent with TX, to trust it
+#define TRACK 5e-3 // s searched on each side of the last delay
+#define LOST 3 // measurements missed before searching again
+#define RESYNC 2e-3 // s of error of an estimated timestamp that is followed
+#define PSD_BINS 32 // across the bandwidth
+#define RIPPLE_RANGE 20.0 // dB under the peak of TX of the bins in the ripple
+#define UPSAMPLE 16 // of the cross-correlation, for the fraction of the delay
+#define INTERPOLATION 16 // taps of the fractional delay of TX
+
+static int channel_init(struct own_signal *p, struct own_signal_channel *c, double offset) {
+	c->nco_step = -2 * M_PI * offset / p->sample_rate;
+	c->input_i = calloc(p->taps - 1 + CHUNK, sizeof(float));
+	c->input_q = calloc(p->taps - 1 + CHUNK, sizeof(float));
+	if (sample_ring_init(&c->ring, p->ring_size) < 0) return -1;
+	return c->input_i && c->input_q ? 0 : -1;
+}
+
+static void channel_free(struct own_signal_channel *c) {
+	free(c->input_i);
+	free(c->input_q);
+	sample_ring_free(&c->ring);
+}
+
+int own_signal_init(struct own_signal *p, double sample_rate, double bandwidth,
+		    double tx_offset, double rx_offset, double beacon_offset,
+		    double max_delay, FILE *log) {
+	memset(p, 0, sizeof(*p));
+	p->sample_rate = sample_rate;
+	p->bandwidth = bandwidth;
+	p->log = log;
+	p->use_beacon = !isnan(beacon_offset);
+	pthread_mutex_init(&p->lock, NULL);
+	p->delay = p->snr = p->freq_offset = p->beacon_ratio = p->ripple = NAN;
+	if (bandwidth <= 0 || fabs(tx_offset) + bandwidth / 2 > sample_rate / 2
+	    || fabs(rx_offset) + bandwidth / 2 > sample_rate / 2
+	    || (p->use_beacon && fabs(beacon_offset) + bandwidth / 2 > sample_rate / 2)) {
+		fprintf(stderr, "ERROR: the monitored band must fit in the TX and RX passbands\n");
+		return -1;
+	}
+	if (max_delay <= 0) {
+		fprintf(stderr, "ERROR: invalid maximum delay of the own signal monitor\n");
+		return -1;
+	}
+
+	p->decim = sample_rate / (OVERSAMPLING * bandwidth);
+	if (p->decim < 1) p->decim = 1;
+	p->rate = sample_rate / p->decim;
+	// The passband is the bandwidth, and what aliases into it is stopped
+	p->taps = fir_padded(fir_kaiser_taps(FILTER_ATTENUATION, (p->rate - bandwidth) / sample_rate));
+	p->ring_size = (RING_SECONDS + max_delay) * p->rate;
+	p->capture = CAPTURE * p->rate;
+	p->max_lag = ceil(max_delay * p->rate);
+	int window = p->capture + p->max_lag;
+	p->fft_size = 1;
+	while (p->fft_size < window + p->capture) p->fft_size <<= 1;
+	p->freq_size = 1;
+	while (p->freq_size < 2 * p->capture) p->freq_size <<= 1;
+	p->psd_size = 1;
+	while (p->psd_size < PSD_BINS * p->rate / bandwidth) p->psd_size <<= 1;
+
+	p->filter = malloc(p->taps * sizeof(float));
+	p->tx_copy = malloc(2 * window * sizeof(float));
+	p->rx_copy = malloc(2 * p->capture * sizeof(float));
+	p->beacon_copy = malloc(2 * p->capture * sizeof(float));
+	p->env_tx = malloc(window * sizeof(float));
+	p->env_rx = malloc(p->capture * sizeof(float));
+	p->energy = malloc((window + 1) * sizeof(double));
+	p->aligned = malloc(2 * p->capture * sizeof(float));
+	p->fft_a = fftwf_malloc(p->fft_size * sizeof(fftwf_complex));
+	p->fft_b = fftwf_malloc(p->fft_size * sizeof(fftwf_complex));
+	p->freq_in = fftwf_malloc(p->freq_size * sizeof(fftwf_complex));
+	p->psd_window = malloc(p->psd_size * sizeof(float));
+	p->psd_in = fftwf_malloc(p->psd_size * sizeof(fftwf_complex));
+	p->psd_out = fftwf_malloc(p->psd_size * sizeof(fftwf_complex));
+	p->spectrum = malloc(p->psd_size * sizeof(double complex));
+	p->s_xx = malloc(p->psd_size * sizeof(double));
+	p->s_yy = malloc(p->psd_size * sizeof(double));
+	p->s_bb = malloc(p->psd_size * sizeof(double));
+	p->s_yx = malloc(p->psd_size * sizeof(double complex));
+	p->lag_size = UPSAMPLE * p->psd_size;
+	p->lag_in = fftwf_malloc(p->lag_size * sizeof(fftwf_complex));
+	if (!p->filter || !p->tx_copy || !p->rx_copy || !p->beacon_copy || !p->env_tx
+	    || !p->env_rx || !p->energy || !p->aligned || !p->fft_a || !p->fft_b || !p->freq_in
+	    || !p->psd_window || !p->psd_in || !p->psd_out || !p->spectrum || !p->s_xx
+	    || !p->s_yy || !p->s_bb || !p->s_yx || !p->lag_in
+	    || channel_init(p, &p->tx, tx_offset) < 0 || channel_init(p, &p->rx, rx_offset) < 0
+	    || channel_init(p, &p->beacon, p->use_beacon ? beacon_offset : 0) < 0) {
+		fprintf(stderr, "Could not allocate own signal monitor buffers\n");
+		own_signal_free(p);
+		return -1;
+	}
+	fir_lowpass(p->filter, p->taps, 0.5 / p->decim, fir_kaiser_beta(FILTER_ATTENUATION));
+	p->forward_a = fftwf_plan_dft_1d(p->fft_size, p->fft_a, p->fft_a, FFTW_FORWARD,
+					 FFTW_ESTIMATE);
+	p->forward_b = fftwf_plan_dft_1d(p->fft_size, p->fft_b, p->fft_b, FFTW_FORWARD,
+					 FFTW_ESTIMATE);
+	p->inverse = fftwf_plan_dft_1d(p->fft_size, p->fft_a, p->fft_a, FFTW_BACKWARD,
+				       FFTW_ESTIMATE);
+	p->freq_plan = fftwf_plan_dft_1d(p->freq_size, p->freq_in, p->freq_in, FFTW_FORWARD,
+					 FFTW_ESTIMATE);
+	p->psd_plan = fftwf_plan_dft_1d(p->psd_size, p->psd_in, p->psd_out, FFTW_FORWARD,
+					FFTW_ESTIMATE);
+	p->lag_plan = fftwf_plan_dft_1d(p->lag_size, p->lag_in, p->lag_in, FFTW_BACKWARD,
+					FFTW_ESTIMATE);
+	for (int j = 0; j < p->psd_size; j++) {
+		p->psd_window[j] = 0.5 - 0.5 * cos(2 * M_PI * j / p->psd_size);
+	}
+	fprintf(stderr, "Own signal monitor: decimation %d, %d taps, delay search up to %.0f ms\n",
+		p->decim, p->taps, 1e3 * p->max_lag / p->rate);
+	return 0;
+}
+
+// Mixes and filters count samples, up to CHUNK, that follow those of the
+// last call, and gives the outputs at the timestamps that are multiples of
+// the decimation. Returns their number, and the timestamp of the first
+// divided by the decimation in index
+static int decimate(struct own_signal *p, struct own_signal_channel *c, const int16_t *samples,
+		    int count, float *out, uint64_t *index) {
+	int history = p->taps - 1;
+	float *xi = c->input_i + history, *xq = c->input_q + history;
+	double rot_c = cos(c->nco_phase), rot_s = sin(c->nco_phase);
+	double step_c = cos(c->nco_step), step_s = sin(c->nco_step);
+	for (int j = 0; j < count; j++) {
+		float i = samples[2*j] * (1.0f / FULL_SCALE), q = samples[2*j+1] * (1.0f / FULL_SCALE);
+		xi[j] = i * rot_c - q * rot_s;
+		xq[j] = i * rot_s + q * rot_c;
+		double t = rot_c * step_c - rot_s * step_s;
+		rot_s = rot_c * step_s + rot_s * step_c;
+		rot_c = t;
+	}
+	c->nco_phase = fmod(c->nco_phase + c->nco_step * count, 2 * M_PI);
+
+	int n = 0;
+	uint64_t t = c->next + (p->decim - c->next % p->decim) % p->decim;
+	*index = t / p->decim;
+	for (; t < c->next + count; t += p->decim) {
+		// Over the taps samples up to t
+		int k = t - c->next;
+		out[2*n] = fir_dot(p->filter, c->input_i + k, p->taps);
+		out[2*n+1] = fir_dot(p->filter, c->input_q + k, p->taps);
+		n++;
+	}
+	memmove(c->input_i, c->input_i + count, history * sizeof(float));
+	memmove(c->input_q, c->input_q + count, history * sizeof(float));
+	c->next += count;
+	return n;
+}
+
+static void channel_restart(struct own_signal *p, struct own_signal_channel *c,
+			    uint64_t timestamp) {
+	memset(c->input_i, 0, (p->taps - 1) * sizeof(float));
+	memset(c->input_q, 0, (p->taps - 1) * sizeof(float));
+	c->next = timestamp;
+	c->started = 1;
+}
+
+void own_signal_push_tx(struct own_signal *p, const int16_t *samples, int count,
+			uint64_t timestamp, int estimated) {
+	int64_t error = (int64_t) (timestamp - p->tx.next);
+	if (!p->tx.started || (estimated ? llabs(error) > RESYNC * p->sample_rate : error != 0)) {
+		// A new transmission, after silence, or a jump of the estimate
+		channel_restart(p, &p->tx, timestamp);
+		pthread_mutex_lock(&p->lock);
+		p->tx_restart = (timestamp + p->decim - 1) / p->decim;
+		pthread_mutex_unlock(&p->lock);
+	}
+	float out[2 * CHUNK];
+	for (int pos = 0; pos < count; pos += CHUNK) {
+		int n = count - pos < CHUNK ? count - pos : CHUNK;
+		uint64_t index;
+		int m = decimate(p, &p->tx, samples + 2 * pos, n, out, &index);
+		if (!m) continue;
+		pthread_mutex_lock(&p->lock);
+		sample_ring_write(&p->tx.ring, out, m, index);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+void own_signal_push_rx(struct own_signal *p, const int16_t *samples, int count,
+			uint64_t timestamp) {
+	if (!p->rx.started || timestamp != p->rx.next) {
+		channel_restart(p, &p->rx, timestamp);
+		channel_restart(p, &p->beacon, timestamp);
+	}
+	float out[2 * CHUNK], beacon[2 * CHUNK];
+	for (int pos = 0; pos < count; pos += CHUNK) {
+		int n = count - pos < CHUNK ? count - pos : CHUNK;
+		uint64_t index;
+		int m = decimate(p, &p->rx, samples + 2 * pos, n, out, &index);
+		if (p->use_beacon) decimate(p, &p->beacon, samples + 2 * pos, n, beacon, &index);
+		if (!m) continue;
+		// Both rings hold the same span
+		pthread_mutex_lock(&p->lock);
+		sample_ring_write(&p->rx.ring, out, m, index);
+		if (p->use_beacon) sample_ring_write(&p->beacon.ring, beacon, m, index);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+// Takes the last capture of RX and the TX samples up to max_lag before it.
+// Returns 0 if the rings do not have them, which happens when we are not
+// transmitting, and -1 if the TX timestamps were restarted among them, as
+// the part before may not be aligned with the part after
+static int take_capture(struct own_signal *p) {
+	int ret = 0;
+	pthread_mutex_lock(&p->lock);
+	const struct sample_ring *tx = &p->tx.ring, *rx = &p->rx.ring;
+	uint64_t r0 = rx->end - p->capture;
+	if (rx->end >= (uint64_t) (p->capture + p->max_lag) && r0 >= rx->start
+	    && tx->end >= rx->end && p->tx_restart > r0 - p->max_lag) {
+		ret = -1;
+	}
+	else if (rx->end >= (uint64_t) (p->capture + p->max_lag) && r0 >= rx->start
+		 && tx->start + p->max_lag <= r0 && tx->end >= rx->end) {
+		sample_ring_read(&p->rx.ring, p->rx_copy, p->capture, r0);
+		if (p->use_beacon) sample_ring_read(&p->beacon.ring, p->beacon_copy, p->capture, r0);
+		sample_ring_read(&p->tx.ring, p->tx_copy, p->capture + p->max_lag, r0 - p->max_lag);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+// Power envelopes of the copies without their mean, and the cumulative
+// energy of that of TX
+static void envelopes(struct own_signal *p) {
+	int window = p->capture + p->max_lag;
+	double mean = 0;
+	for (int j = 0; j < window; j++) {
+		p->env_tx[j] = p->tx_copy[2*j] * p->tx_copy[2*j] + p->tx_copy[2*j+1] * p->tx_copy[2*j+1];
+		mean += p->env_tx[j];
+	}
+	mean /= window;
+	p->energy[0] = 0;
+	for (int j = 0; j < window; j++) {
+		p->env_tx[j] -= mean;
+		p->energy[j + 1] = p->energy[j] + p->env_tx[j] * p->env_tx[j];
+	}
+	mean = 0;
+	for (int j = 0; j < p->capture; j++) {
+		p->env_rx[j] = p->rx_copy[2*j] * p->rx_copy[2*j] + p->rx_copy[2*j+1] * p->rx_copy[2*j+1];
+		mean += p->env_rx[j];
+	}
+	mean /= p->capture;
+	for (int j = 0; j < p->capture; j++) p->env_rx[j] -= mean;
+}
+
+static double rx_envelope_energy(struct own_signal *p) {
+	double e = 0;
+	for (int j = 0; j < p->capture; j++) e += p->env_rx[j] * p->env_rx[j];
+	return e;
+}
+
+// Offset in the TX copy of the sample that comes back as the first RX
+// sample, over the whole range, and its normalized correlation
+static int search(struct own_signal *p, double *correlation) {
+	for (int j = 0; j < p->fft_size; j++) {
+		p->fft_a[j][0] = j < p->capture + p->max_lag ? p->env_tx[j] : 0;
+		p->fft_b[j][0] = j < p->capture ? p->env_rx[j] : 0;
+		p->fft_a[j][1] = p->fft_b[j][1] = 0;
+	}
+	fftwf_execute(p->forward_a);
+	fftwf_execute(p->forward_b);
+	for (int j = 0; j < p->fft_size; j++) {
+		// A times the conjugate of B
+		float ar = p->fft_a[j][0], ai = p->fft_a[j][1];
+		float br = p->fft_b[j][0], bi = p->fft_b[j][1];
+		p->fft_a[j][0] = ar * br + ai * bi;
+		p->fft_a[j][1] = ai * br - ar * bi;
+	}
+	fftwf_execute(p->inverse);
+
+	double rx_energy = rx_envelope_energy(p);
+	int best = 0;
+	*correlation = -1;
+	for (int k = 0; k <= p->max_lag; k++) {
+		double tx_energy = p->energy[k + p->capture] - p->energy[k];
+		if (tx_energy <= 0) continue;
+		double c = p->fft_a[k][0] / p->fft_size / sqrt(tx_energy * rx_energy);
+		if (c > *correlation) {
+			*correlation = c;
+			best = k;
+		}
+	}
+	return best;
+}
+
+// As search(), but only up to span samples around offset
+static int track(struct own_signal *p, int offset, int span, double *correlation) {
+	double rx_energy = rx_envelope_energy(p);
+	int best = offset;
+	*correlation = -1;
+	int from = offset - span < 0 ? 0 : offset - span;
+	int to = offset + span > p->max_lag ? p->max_lag : offset + span;
+	for (int k = from; k <= to; k++) {
+		double tx_energy = p->energy[k + p->capture] - p->energy[k];
+		if (tx_energy <= 0) continue;
+		double sum = 0;
+		for (int j = 0; j < p->capture; j++) sum += p->env_tx[k + j] * p->env_rx[j];
+		double c = sum / sqrt(tx_energy * rx_energy);
+		if (c > *correlation) {
+			*correlation = c;
+			best = k;
+		}
+	}
+	return best;
+}
+
+// Frequency of RX relative to TX at offset, in cycles per sample, from the
+// peak of the spectrum of their product
+static double frequency(struct own_signal *p, int offset) {
+	const float *tx = p->tx_copy + 2 * offset;
+	for (int j = 0; j < p->freq_size; j++) {
+		if (j < p->capture) {
+			// RX times the conjugate of TX
+			float ar = p->rx_copy[2*j], ai = p->rx_copy[2*j+1];
+			float br = tx[2*j], bi = tx[2*j+1];
+			p->freq_in[j][0] = ar * br + ai * bi;
+			p->freq_in[j][1] = ai * br - ar * bi;
+		}
+		else {
+			p->freq_in[j][0] = p->freq_in[j][1] = 0;
+		}
+	}
+	fftwf_execute(p->freq_plan);
+	int n = p->freq_size, best = 0;
+	double best_power = -1;
+	for (int j = 0; j < n; j++) {
+		double power = p->freq_in[j][0] * p->freq_in[j][0] + p->freq_in[j][1] * p->freq_in[j][1];
+		if (power > best_power) {
+			best_power = power;
+			best = j;
+		}
+	}
+	double a = hypot(p->freq_in[(best + n - 1) % n][0], p->freq_in[(best + n - 1) % n][1]);
+	double b = sqrt(best_power);
+	double c = hypot(p->freq_in[(best + 1) % n][0], p->freq_in[(best + 1) % n][1]);
+	double d = a - 2 * b + c, fraction = d < 0 ? 0.5 * (a - c) / d : 0;
+	double bin = best + fraction;
+	if (bin >= n / 2) bin -= n;
+	return bin / n;
+}
+
+// Adds the spectrum of a segment, with 0 Hz in the middle, to the Welch
+// sums: |FFT|^2 to power and, if cross is not NULL, FFT times the conjugate
+// of p->spectrum. If keep is not NULL the FFT is also left there
+static void segment(struct own_signal *p, const float *samples, double *power,
+		    double complex *cross, double complex *keep) {
+	int n = p->psd_size;
+	for (int j = 0; j < n; j++) {
+		p->psd_in[j][0] = p->psd_window[j] * samples[2*j];
+		p->psd_in[j][1] = p->psd_window[j] * samples[2*j+1];
+	}
+	fftwf_execute(p->psd_plan);
+	for (int j = 0; j < n; j++) {
+		const fftwf_complex *z = &p->psd_out[(j + n / 2) % n];
+		double complex v = (*z)[0] + I * (*z)[1];
+		power[j] += creal(v * conj(v));
+		if (cross) cross[j] += v * conj(p->spectrum[j]);
+		if (keep) keep[j] = v;
+	}
+}
+
+// TX at offset + j - fraction for each RX sample j, by windowed sinc
+// interpolation, and mixed by the frequency f of RX relative to it
+static void align(struct own_signal *p, int offset, double fraction, double f) {
+	int whole = floor(fraction);
+	double mu = fraction - whole;
+	float h[INTERPOLATION];
+	double sum = 0;
+	for (int m = 0; m < INTERPOLATION; m++) {
+		// Tap m takes the TX sample INTERPOLATION / 2 - 1 - m after the
+		// one at offset + j - whole
+		double x = m - INTERPOLATION / 2 + 1 - mu;
+		double w = 0.5 + 0.5 * cos(M_PI * x / (INTERPOLATION / 2));
+		h[m] = (x == 0 ? 1 : sin(M_PI * x) / (M_PI * x)) * w;
+		sum += h[m];
+	}
+	for (int m = 0; m < INTERPOLATION; m++) h[m] /= sum;
+
+	int window = p->capture + p->max_lag;
+	double rot_c = 1, rot_s = 0;
+	double step_c = cos(2 * M_PI * f), step_s = sin(2 * M_PI * f);
+	for (int j = 0; j < p->capture; j++) {
+		float xi = 0, xq = 0;
+		int first = offset + j - whole + INTERPOLATION / 2 - 1;
+		for (int m = 0; m < INTERPOLATION; m++) {
+			int k = first - m;
+			if (k < 0 || k >= window) continue;
+			xi += h[m] * p->tx_copy[2*k];
+			xq += h[m] * p->tx_copy[2*k+1];
+		}
+		p->aligned[2*j] = xi * rot_c - xq * rot_s;
+		p->aligned[2*j+1] = xi * rot_s + xq * rot_c;
+		double t = rot_c * step_c - rot_s * step_s;
+		rot_s = rot_c * step_s + rot_s * step_c;
+		rot_c = t;
+	}
+}
+
+// Welch spectra of the aligned TX, RX and the beacon
+static void spectra(struct own_signal *p) {
+	int n = p->psd_size;
+	memset(p->s_xx, 0, n * sizeof(double));
+	memset(p->s_yy, 0, n * sizeof(double));
+	memset(p->s_bb, 0, n * sizeof(double));
+	memset(p->s_yx, 0, n * sizeof(double complex));
+	for (int pos = 0; pos + n <= p->capture; pos += n / 2) {
+		segment(p, p->aligned + 2 * pos, p->s_xx, NULL, p->spectrum);
+		segment(p, p->rx_copy + 2 * pos, p->s_yy, p->s_yx, NULL);
+		if (p->use_beacon) segment(p, p->beacon_copy + 2 * pos, p->s_bb, NULL, NULL);
+	}
+}
+
+// Delay of RX after the aligned TX, within a sample, from the peak of
+// their cross-correlation upsampled by zero padding S_yx over the bins of
+// the bandwidth
+static double fraction_of_delay(struct own_signal *p, int half) {
+	int n = p->psd_size, size = p->lag_size;
+	memset(p->lag_in, 0, size * sizeof(fftwf_complex));
+	for (int j = n / 2 - half; j <= n / 2 + half; j++) {
+		int k = (j - n / 2 + size) % size;
+		p->lag_in[k][0] = creal(p->s_yx[j]);
+		p->lag_in[k][1] = cimag(p->s_yx[j]);
+	}
+	fftwf_execute(p->lag_plan);
+	int best = 0;
+	double best_power = -1;
+	for (int q = -UPSAMPLE; q <= UPSAMPLE; q++) {
+		const fftwf_complex *z = &p->lag_in[(q + size) % size];
+		double power = (*z)[0] * (*z)[0] + (*z)[1] * (*z)[1];
+		if (power > best_power) {
+			best_power = power;
+			best = q;
+		}
+	}
+	const fftwf_complex *za = &p->lag_in[(best - 1 + size) % size];
+	const fftwf_complex *zc = &p->lag_in[(best + 1 + size) % size];
+	double a = hypot((*za)[0], (*za)[1]), b = sqrt(best_power), c = hypot((*zc)[0], (*zc)[1]);
+	double d = a - 2 * b + c;
+	return (best + (d < 0 ? 0.5 * (a - c) / d : 0)) / UPSAMPLE;
+}
+
+// Measures the downlink with TX at offset. Returns -1 if RX is not
+// coherent enough with TX to trust it
+static int measure(struct own_signal *p, int offset, double *snr, double *freq_offset,
+		   double *beacon_ratio, double *ripple, double *fraction) {
+	double f = frequency(p, offset);
+	*freq_offset = f * p->rate;
+	// Whole samples first, and then again with the fraction, so that the
+	// Welch segments of TX and RX hold the same part of the signal
+	int n = p->psd_size;
+	int half = 0.5 * p->bandwidth / p->rate * n;
+	align(p, offset, 0, f);
+	spectra(p);
+	*fraction = fraction_of_delay(p, half);
+	align(p, offset, *fraction, f);
+	spectra(p);
+	*fraction += fraction_of_delay(p, half);
+
+	// Over the bins of the bandwidth
+	double coherent = 0, total = 0, beacon = 0, peak = 0;
+	for (int j = n / 2 - half; j <= n / 2 + half; j++) {
+		if (p->s_xx[j] > 0) coherent += creal(p->s_yx[j] * conj(p->s_yx[j])) / p->s_xx[j];
+		total += p->s_yy[j];
+		beacon += p->s_bb[j];
+		if (p->s_xx[j] > peak) peak = p->s_xx[j];
+	}
+	if (!(coherent >= MIN_COHERENCE * total) || peak == 0) return -1;
+	double noise = total - coherent;
+	*snr = 10 * log10(coherent / noise);
+	// The beacon channel has the same noise as ours
+	*beacon_ratio = p->use_beacon && beacon > noise ? 10 * log10(coherent / (beacon - noise)) : NAN;
+
+	// Response H = S_yx / S_xx where TX has power
+	double threshold = peak * pow(10, -RIPPLE_RANGE / 10);
+	double sum = 0, sum2 = 0;
+	int bins = 0;
+	for (int j = n / 2 - half; j <= n / 2 + half; j++) {
+		if (p->s_xx[j] < threshold) continue;
+		double h = 10 * log10(creal(p->s_yx[j] * conj(p->s_yx[j])) / (p->s_xx[j] * p->s_xx[j]));
+		sum += h;
+		sum2 += h * h;
+		bins++;
+	}
+	double mean = sum / bins;
+	*ripple = sqrt(fmax(sum2 / bins - mean * mean, 0));
+	return 0;
+}
+
+static void update(void *arg) {
+	struct own_signal *p = arg;
+	int ret = take_capture(p);
+	if (ret < 0) {
+		pthread_mutex_lock(&p->lock);
+		p->broken++;
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+	if (!ret) goto idle;
+	double level = 0;
+	for (int j = 0; j < p->capture + p->max_lag; j++) {
+		level += p->tx_copy[2*j] * p->tx_copy[2*j] + p->tx_copy[2*j+1] * p->tx_copy[2*j+1];
+	}
+	level /= p->capture + p->max_lag;
+	if (!(10 * log10(level) >= MIN_LEVEL)) goto idle;
+
+	envelopes(p);
+	double correlation;
+	int offset;
+	if (p->locked) {
+		offset = track(p, p->offset, ceil(TRACK * p->rate), &correlation);
+	}
+	else {
+		pthread_mutex_lock(&p->lock);
+		p->searches++;
+		pthread_mutex_unlock(&p->lock);
+		offset = search(p, &correlation);
+	}
+	double snr, freq_offset, beacon_ratio, ripple, fraction;
+	if (!(correlation >= MIN_CORRELATION)
+	    || measure(p, offset, &snr, &freq_offset, &beacon_ratio, &ripple, &fraction) < 0) {
+		if (p->locked && ++p->misses >= LOST) p->locked = 0;
+		return;
+	}
+	p->locked = 1;
+	p->misses = 0;
+	p->offset = offset;
+
+	pthread_mutex_lock(&p->lock);
+	p->delay = (p->max_lag - offset + fraction) / p->rate;
+	p->snr = snr;
+	p->freq_offset = freq_offset;
+	p->beacon_ratio = beacon_ratio;
+	p->ripple = ripple;
+	p->measurements++;
+	if (p->log) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		fprintf(p->log, "%.3f,%.4f,%.2f,%.2f,%.2f,%.2f\n", now.tv_sec + 1e-9 * now.tv_nsec,
+			1e3 * p->delay, p->snr, p->freq_offset, p->beacon_ratio, p->ripple);
+		fflush(p->log);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return;
+
+idle:
+	pthread_mutex_lock(&p->lock);
+	p->idle++;
+	pthread_mutex_unlock(&p->lock);
+}
+
+int own_signal_start(struct own_signal *p) {
+	if (p->log) fprintf(p->log, "# time,delay_ms,snr_db,freq_offset_hz,beacon_ratio_db,ripple_db\n");
+	return idle_worker_start(&p->worker, "own signal monitor", INTERVAL, update, p);
+}
+
+void own_signal_print(struct own_signal *p) {
+	pthread_mutex_lock(&p->lock);
+	fprintf(stderr, "Own signal: delay %.3f ms, SNR %.1f dB, offset %+.1f Hz, over beacon %.1f dB, "
+		"ripple %.1f dB, %lu measurements, %lu idle, %lu broken, %lu searches\n",
+		1e3 * p->delay, p->snr, p->freq_offset, p->beacon_ratio, p->ripple,
+		p->measurements, p->idle, p->broken, p->searches);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void own_signal_stop(struct own_signal *p) {
+	idle_worker_stop(&p->worker);
+}
+
+void own_signal_free(struct own_signal *p) {
+	if (p->forward_a) fftwf_destroy_plan(p->forward_a);
+	if (p->forward_b) fftwf_destroy_plan(p->forward_b);
+	if (p->inverse) fftwf_destroy_plan(p->inverse);
+	if (p->freq_plan) fftwf_destroy_plan(p->freq_plan);
+	if (p->psd_plan) fftwf_destroy_plan(p->psd_plan);
+	if (p->lag_plan) fftwf_destroy_plan(p->lag_plan);
+	fftwf_free(p->fft_a);
+	fftwf_free(p->fft_b);
+	fftwf_free(p->freq_in);
+	fftwf_free(p->psd_in);
+	fftwf_free(p->psd_out);
+	fftwf_free(p->lag_in);
+	free(p->psd_window);
+	free(p->filter);
+	free(p->tx_copy);
+	free(p->rx_copy);
+	free(p->beacon_copy);
+	free(p->env_tx);
+	free(p->env_rx);
+	free(p->energy);
+	free(p->aligned);
+	free(p->spectrum);
+	free(p->s_xx);
+	free(p->s_yy);
+	free(p->s_bb);
+	free(p->s_yx);
+	channel_free(&p->tx);
+	channel_free(&p->rx);
+	channel_free(&p->beacon);
+}
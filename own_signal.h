@@ -0,0 +1,122 @@
+/*
+  ===========================================================================
+
+  own_signal - Monitor of our own signal in the downlink, compared with
+  the TX samples it came from, which are delay aligned through the device
+  timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef OWN_SIGNAL_H
+#define OWN_SIGNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <complex.h>
+
+#include <fftw3.h>
+
+#include "idle_worker.h"
+#include "sample_ring.h"
+
+// A band mixed to 0 Hz and decimated into a ring indexed by the device
+// timestamp divided by the decimation
+struct own_signal_channel {
+	double nco_step, nco_phase;
+	float *input_i, *input_q; // taps - 1 samples of history and a chunk
+	uint64_t next; // timestamp of the next input sample
+	int started;
+	struct sample_ring ring;
+};
+
+struct own_signal {
+	double sample_rate;
+	double bandwidth;
+	int decim;
+	double rate; // after decimation
+	int taps;
+	float *filter;
+	FILE *log;
+
+	// tx is written by the TX thread, rx and beacon by the feed thread.
+	// The ring spans are protected by lock
+	struct own_signal_channel tx, rx, beacon;
+	int use_beacon;
+	int ring_size; // minimum samples in the rings
+	uint64_t tx_restart; // first index after the last restart of the TX timestamps
+
+	// Used only by the worker thread
+	int capture, max_lag; // decimated samples
+	float *tx_copy, *rx_copy, *beacon_copy;
+	float *env_tx, *env_rx; // power envelopes without their mean
+	double *energy; // cumulative, of env_tx
+	float *aligned; // TX samples aligned to RX, in delay and frequency
+	int fft_size;
+	fftwf_complex *fft_a, *fft_b;
+	fftwf_plan forward_a, forward_b, inverse;
+	int freq_size;
+	fftwf_complex *freq_in;
+	fftwf_plan freq_plan;
+	int psd_size;
+	float *psd_window;
+	fftwf_complex *psd_in, *psd_out;
+	fftwf_plan psd_plan;
+	double complex *spectrum; // of the TX segment
+	double *s_xx, *s_yy, *s_bb;
+	double complex *s_yx;
+	int lag_size;
+	fftwf_complex *lag_in;
+	fftwf_plan lag_plan;
+	int locked, misses;
+	int offset; // in the TX copy of the sample that comes back first in RX
+
+	struct idle_worker worker;
+	pthread_mutex_t lock;
+	// Protected by lock
+	double delay; // s, from TX to RX
+	double snr; // dB, in the bandwidth
+	double freq_offset; // Hz, of the downlink from where it is expected
+	double beacon_ratio; // dB, of our signal over the beacon
+	double ripple; // dB rms of the downlink response across our signal
+	unsigned long measurements, idle, broken, searches;
+};
+
+// tx_offset is the centre of our signal relative to the TX frequency, and
+// rx_offset where it is expected in RX. beacon_offset is the beacon in RX,
+// or NAN if there is none. max_delay is the longest TX to RX delay that is
+// searched. If log is not NULL a line is written to it after each
+// measurement
+int own_signal_init(struct own_signal *p, double sample_rate, double bandwidth,
+		    double tx_offset, double rx_offset, double beacon_offset,
+		    double max_delay, FILE *log);
+int own_signal_start(struct own_signal *p);
+// Takes count TX samples. timestamp is the device timestamp of the first
+// one. If it is estimated, it is only followed when it is far from the
+// end of the previous samples
+void own_signal_push_tx(struct own_signal *p, const int16_t *samples, int count,
+			uint64_t timestamp, int estimated);
+// Takes count RX samples with their device timestamp
+void own_signal_push_rx(struct own_signal *p, const int16_t *samples, int count,
+			uint64_t timestamp);
+void own_signal_print(struct own_signal *p);
+void own_signal_stop(struct own_signal *p);
+void own_signal_free(struct own_signal *p);
+
+#endif
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <math.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -43,6 +44,10 @@
 
 #include <lime/LimeSuite.h>
 
+#include "ranging_code.h"
+#include "ranging_tracker.h"
+#include "tx_scheduler.h"
+
 #define LINRAD_NET_MULTICAST_PAYLOAD 1392
 #define LINRAD_SAMPLES_PER_PACKET (LINRAD_NET_MULTICAST_PAYLOAD/(sizeof(int16_t) * 2))
 
@@ -215,7 +220,27 @@ int main(int argc, char** argv)
 		       "  -oc <CHANNEL_INDEX> (default: 0)\n"
 		       "  -r <REFERENCE_CLOCK> (default: do not change)\n"
 		       "  -ip <IP TO SEND UDP>\n"
-		       "  -c <0|1> (calibration mode: listen on TX freq, default: 0)\n");
+		       "  -c <0|1> (calibration mode: listen on TX freq, default: 0)\n"
+		       "  -t <0|1> (acquire and track the ranging signal, default: 1)\n"
+		       "  -ti <TRACKING_INTEGRATION_TIME> (default: 0.01s)\n"
+		       "  -tb <DLL_BANDWIDTH> (default: 0.5Hz)\n"
+		       "  -pb <PLL_BANDWIDTH> (default: 10Hz)\n"
+		       "  -fb <FLL_BANDWIDTH> (default: 2Hz)\n"
+		       "  -fs <ACQUISITION_FREQUENCY_SEARCH> (default: 200Hz)\n"
+		       "  -ds <CORRELATOR_SPACING> (default: 1 sample)\n"
+		       "  -tl <LOCK_CN0_THRESHOLD> (default: 35dB-Hz)\n"
+		       "  -to <RANGING_OUTPUT_INTERVAL> (default: 0.1s)\n"
+		       "  -code <FILE|mseq|gold> (ranging waveform, default: tx_signal.int16)\n"
+		       "  -cd <CODE_DEGREE> (code length 2^degree - 1 chips, default: 18)\n"
+		       "  -ci <GOLD_CODE_INDEX> (default: 0)\n"
+		       "  -cr <CHIP_RATE> (default: 500e3)\n"
+		       "  -cp <none|rrc> (pulse shaping, default: rrc)\n"
+		       "  -cb <RRC_ROLLOFF> (default: 0.35)\n"
+		       "  -ca <CODE_AMPLITUDE> (peak, relative to full scale, default: 0.7)\n"
+		       "  -bp <BURST_PERIOD> (default: 0s, continuous TX)\n"
+		       "  -bl <BURST_LENGTH> (default: 1s)\n"
+		       "  -tm <TX_SCHEDULING_MARGIN> (default: 0.01s)\n"
+		       "  -md <MINIMUM_DELAY> (resolves the code period ambiguity, default: 0.2s)\n");
 		return 1;
 	}
 	int i;
@@ -231,7 +256,32 @@ int main(int argc, char** argv)
 	unsigned int in_channel = 0, out_channel = 0;
 	double reference_clock = 0;
 	int calibration_mode = 0;
-	char *ip = NULL;	
+	char *ip = NULL;
+	int tracking = 1;
+	struct ranging_tracker_config tracker_cfg = {
+		.int_time = 0.01,
+		.dll_bw = 0.5,
+		.pll_bw = 10,
+		.fll_bw = 2,
+		.freq_search = 200,
+		.spacing = 1,
+		.output_interval = 0.1,
+		.lock_cn0 = 35,
+		.min_delay = 0.2
+	};
+	struct ranging_code_config code_cfg = {
+		.type = RANGING_CODE_FILE,
+		.file = "tx_signal.int16",
+		.degree = 18,
+		.gold_index = 0,
+		.chip_rate = 500e3,
+		.shaping = RANGING_SHAPING_RRC,
+		.rolloff = 0.35,
+		.amplitude = 0.7
+	};
+	char *code_shaping = "rrc";
+	double burst_period = 0, burst_length = 1;
+	double tx_margin = 0.01;
 	for ( i = 1; i < argc-1; i += 2 ) {
 		if      (strcmp(argv[i], "-if") == 0) { in_freq = atof( argv[i+1] ); }
 		else if (strcmp(argv[i], "-il") == 0) { in_lo_freq = atof(argv[i+1]); }
@@ -249,6 +299,26 @@ int main(int argc, char** argv)
 		else if (strcmp(argv[i], "-r") == 0) { reference_clock = atof(argv[i+1]); }
 		else if (strcmp(argv[i], "-ip") == 0) { ip = argv[i+1]; }
 		else if (strcmp(argv[i], "-c") == 0) { calibration_mode = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-t") == 0) { tracking = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-ti") == 0) { tracker_cfg.int_time = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-tb") == 0) { tracker_cfg.dll_bw = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-pb") == 0) { tracker_cfg.pll_bw = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-fb") == 0) { tracker_cfg.fll_bw = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-fs") == 0) { tracker_cfg.freq_search = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ds") == 0) { tracker_cfg.spacing = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-tl") == 0) { tracker_cfg.lock_cn0 = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-to") == 0) { tracker_cfg.output_interval = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-code") == 0) { code_cfg.file = argv[i+1]; }
+		else if (strcmp(argv[i], "-cd") == 0) { code_cfg.degree = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-ci") == 0) { code_cfg.gold_index = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-cr") == 0) { code_cfg.chip_rate = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-cp") == 0) { code_shaping = argv[i+1]; }
+		else if (strcmp(argv[i], "-cb") == 0) { code_cfg.rolloff = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-ca") == 0) { code_cfg.amplitude = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-bp") == 0) { burst_period = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-bl") == 0) { burst_length = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-tm") == 0) { tx_margin = atof(argv[i+1]); }
+		else if (strcmp(argv[i], "-md") == 0) { tracker_cfg.min_delay = atof(argv[i+1]); }
 	}
 	in_freq = out_freq + qo100_lo;
 	if (in_freq == 0) {
@@ -267,6 +337,32 @@ int main(int argc, char** argv)
 		fprintf(stderr, "Invalid calibration mode\n");
 		exit(1);
 	}
+	if (tracker_cfg.spacing < 1) {
+		fprintf(stderr, "Invalid correlator spacing\n");
+		exit(1);
+	}
+	if (burst_period < 0 || (burst_period > 0 && (burst_length <= 0 || burst_length > burst_period))) {
+		fprintf(stderr, "Invalid TX burst period or length\n");
+		exit(1);
+	}
+	if (tx_margin < 0 || tracker_cfg.min_delay < 0) {
+		fprintf(stderr, "Invalid TX scheduling margin or minimum delay\n");
+		exit(1);
+	}
+	tracker_cfg.burst_period = burst_period;
+	tracker_cfg.burst_length = burst_length;
+	if (strcmp(code_cfg.file, "mseq") == 0) code_cfg.type = RANGING_CODE_MSEQ;
+	else if (strcmp(code_cfg.file, "gold") == 0) code_cfg.type = RANGING_CODE_GOLD;
+	if (strcmp(code_shaping, "none") == 0) code_cfg.shaping = RANGING_SHAPING_NONE;
+	else if (strcmp(code_shaping, "rrc") == 0) code_cfg.shaping = RANGING_SHAPING_RRC;
+	else {
+		fprintf(stderr, "Invalid pulse shaping\n");
+		exit(1);
+	}
+	if (code_cfg.gold_index < 0 || code_cfg.rolloff < 0 || code_cfg.rolloff > 1) {
+		fprintf(stderr, "Invalid ranging code parameters\n");
+		exit(1);
+	}
 
 	int linrad_udp_socket;
 	struct sockaddr_in linrad_udp_sockaddr;
@@ -278,26 +374,6 @@ int main(int argc, char** argv)
 	}
 	init_linrad_header(&udp_packet, 1e-6*out_freq);
 
-	const int tx_data_size = 2400000;
-	const int tx_data_samples = tx_data_size / (2 * sizeof(int16_t));
-	int tx_data_idx = 0;
-	uint8_t *tx_data = malloc(2 * tx_data_size); // we have two copies of the data in the buffer
-	if (!tx_data) {
-		perror("Could not allocate tx_data buffer");
-		exit(1);
-	}
-	FILE *f = fopen("tx_signal.int16", "rb");
-	if (!f) {
-		perror("Could not open tx_signal.int16");
-		exit(1);
-	}
-	if (fread(tx_data, tx_data_size, 1, f) != 1) {
-		perror("Could not read tx_signal.int16");
-		exit(1);
-	}
-	fclose(f);
-	memcpy(tx_data + tx_data_size, tx_data, tx_data_size);
-	
 	lms_device_t* device = NULL;
 	double host_sample_rate;
 
@@ -319,6 +395,30 @@ int main(int argc, char** argv)
 		exit(1);
 	}
 	fprintf(stderr, "sample_rate: %f\n", host_sample_rate);
+
+	struct ranging_code code;
+	if (ranging_code_init(&code, &code_cfg, host_sample_rate) < 0) {
+		exit(1);
+	}
+	fprintf(stderr, "ranging code period: %d samples (%f s)\n",
+		code.period, code.period / host_sample_rate);
+
+	static struct ranging_tracker tracker;
+	if (tracking) {
+		// The generator also gives the correlator reference
+		int16_t *reference = malloc(2 * code.period * sizeof(int16_t));
+		if (!reference) {
+			perror("Could not allocate ranging reference");
+			exit(1);
+		}
+		ranging_code_fill(&code, reference, 0, code.period);
+		tracker_cfg.sample_rate = host_sample_rate;
+		if (ranging_tracker_init(&tracker, &tracker_cfg, reference,
+					 code.period, LINRAD_SAMPLES_PER_PACKET) < 0) {
+			exit(1);
+		}
+		free(reference);
+	}
 	
 	fprintf(stderr, "Setting RX frequency\n");
 	if (calibration_mode) {
@@ -415,14 +515,11 @@ int main(int argc, char** argv)
 	uint64_t total_samples_read = 0;
 	const int delay = 1024*128;
 
-	tx_data_idx = delay * 2 * sizeof(int16_t);
-	
-	lms_stream_meta_t rx_meta, tx_meta;
+	static struct tx_scheduler scheduler;
+	uint64_t t0 = 0;
 	int synchronized = 0;
-
-	memset(&rx_meta, 0, sizeof(rx_meta));
-	memset(&tx_meta, 0, sizeof(tx_meta));
-	tx_meta.waitForTimestamp = true;
+	lms_stream_meta_t block_meta;
+	memset(&block_meta, 0, sizeof(block_meta));
 
 	while (keep_reading) {
 		if (laps++ % 0x512 == 0) {
@@ -451,25 +548,49 @@ int main(int argc, char** argv)
 				tx_underrun, tx_overrun, tx_dropped, tx_status.timestamp,
 				rx_status.fifoFilledCount, rx_status.fifoSize,
 				rx_underrun, rx_overrun, rx_dropped, rx_status.timestamp);
+			if (synchronized) {
+				tx_scheduler_print(&scheduler);
+			}
+			if (tracking) {
+				ranging_tracker_print(&tracker);
+			}
 		}
 		
-		lms_stream_meta_t *meta;
+		uint64_t block_timestamp = 0;
 		for (int read = 0; read < LINRAD_SAMPLES_PER_PACKET; read += just_read) {
 			int timeout_ms =  1000;
-			meta = synchronized == 0 ? &rx_meta : NULL;
 			just_read = LMS_RecvStream(&rx_stream,
 						   udp_packet.buffer + read * 2 * sizeof(int16_t),
 						   LINRAD_SAMPLES_PER_PACKET - read,
-						   meta, timeout_ms);
+						   &block_meta, timeout_ms);
 			if (just_read < 0) {
 				fprintf(stderr, "LMS_RecvStream() : %s\n", LMS_GetLastErrorMessage());
 				keep_reading = 0;
 				break;
 			}
-			if (synchronized == 0) synchronized = 1;
+			if (read == 0) block_timestamp = block_meta.timestamp;
+		}
+		if (!synchronized) {
+			// Sample 0 of the ranging code corresponds to the first RX
+			// timestamp, and the first burst is sent delay samples later
+			t0 = block_timestamp;
+			synchronized = 1;
+			if (tx_scheduler_init(&scheduler, &code, t0, host_sample_rate,
+					      tx_margin, tx_stream.fifoSize) < 0) {
+				break;
+			}
+			if (burst_period > 0) {
+				tx_scheduler_periodic(&scheduler, t0 + delay,
+						      llround(burst_period * host_sample_rate),
+						      llround(burst_length * host_sample_rate));
+			}
+			else {
+				tx_scheduler_queue(&scheduler, t0 + delay, UINT64_MAX / 2);
+			}
+			if (tracking && ranging_tracker_start(&tracker, t0, t0 + delay) < 0) {
+				break;
+			}
 		}
-
-		int ret;
 
 		lms_stream_status_t tx_status;
 		if (LMS_GetStreamStatus(&tx_stream, &tx_status) < 0) {
@@ -479,27 +600,9 @@ int main(int argc, char** argv)
 		tx_underrun += tx_status.underrun;
 		tx_overrun += tx_status.overrun;
 		tx_dropped += tx_status.droppedPackets;
-		int send_samples = tx_status.fifoSize - tx_status.fifoFilledCount;
-		if (send_samples > tx_data_samples) send_samples = tx_data_samples;
-		if (send_samples) {
-			if (synchronized == 1) {
-				meta = &tx_meta;
-				tx_meta.timestamp = rx_meta.timestamp + delay;
-				synchronized = 2;
-			}
-			else {
-				meta = NULL;
-			}
-			if ((ret = LMS_SendStream(&tx_stream, tx_data + tx_data_idx, send_samples, meta, 1000)) < 0) {
-				fprintf(stderr, "LMS_SendStream() : %s\n", LMS_GetLastErrorMessage());
-				break;
-			}
-			if (ret != send_samples) {
-				fprintf(stderr, "Didn't write to TX FIFO all we expected\n");
-				break;
-			}
-			tx_data_idx += send_samples * 2 * sizeof(int16_t);
-			if (tx_data_idx > tx_data_size) tx_data_idx -= tx_data_size;
+		if (tx_scheduler_send(&scheduler, &tx_stream, block_timestamp + LINRAD_SAMPLES_PER_PACKET,
+				      tx_status.fifoSize - tx_status.fifoFilledCount) < 0) {
+			break;
 		}
 
 		// Adjust DC bias
@@ -507,6 +610,10 @@ int main(int argc, char** argv)
 			((int16_t *) udp_packet.buffer)[i] |= 8; // 3 LSBs are guaranteed to be zero
 		}
 
+		if (tracking) {
+			ranging_tracker_push(&tracker, (int16_t *) udp_packet.buffer, block_timestamp);
+		}
+
 		if (linrad_header_fill_time(&udp_packet) < 0) {
 			perror("Could not get system time");
 			break;
@@ -523,6 +630,11 @@ int main(int argc, char** argv)
 		total_samples_read += LINRAD_SAMPLES_PER_PACKET;
 	}
 
+	if (tracking) {
+		ranging_tracker_stop(&tracker);
+	}
+	tx_scheduler_free(&scheduler);
+	ranging_code_free(&code);
 	LMS_StopStream(&rx_stream);
 	LMS_DestroyStream(device, &rx_stream);
 	LMS_Close(device);
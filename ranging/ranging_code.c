@@ -0,0 +1,289 @@
+/*
+  ===========================================================================
+
+  ranging_code - Ranging waveforms: a pre-generated file, or maximal-length
+  and Gold code BPSK generated on the fly.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  Generated codes keep only one bit per chip plus a table with the shaped
+  waveform of every combination of neighbouring chips at every sample
+  phase, so any stretch of the waveform can be produced at any time with
+  one table lookup per sample and without filtering.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ranging_code.h"
+
+#define MAX_DEGREE 20
+#define MAX_DENOMINATOR 64
+#define MAX_PHASES 4096
+#define MAX_PERIOD (1 << 24)
+#define RRC_SPAN 4 // chips at each side
+
+// Primitive polynomials, as the exponents of their non-constant terms
+static const int mseq_polys[MAX_DEGREE + 1][4] = {
+	[3] = {3, 2}, [4] = {4, 3}, [5] = {5, 3}, [6] = {6, 5},
+	[7] = {7, 6}, [8] = {8, 6, 5, 4}, [9] = {9, 5}, [10] = {10, 7},
+	[11] = {11, 9}, [12] = {12, 6, 4, 1}, [13] = {13, 4, 3, 1},
+	[14] = {14, 5, 3, 1}, [15] = {15, 14}, [16] = {16, 15, 13, 4},
+	[17] = {17, 14}, [18] = {18, 11}, [19] = {19, 6, 2, 1}, [20] = {20, 17}
+};
+
+// Preferred pairs of primitive polynomials for Gold codes
+static const int gold_polys[MAX_DEGREE + 1][2][4] = {
+	[5] = {{5, 2}, {5, 4, 3, 2}},
+	[6] = {{6, 1}, {6, 5, 2, 1}},
+	[7] = {{7, 3}, {7, 3, 2, 1}},
+	[9] = {{9, 4}, {9, 6, 4, 3}},
+	[10] = {{10, 3}, {10, 8, 3, 2}},
+	[11] = {{11, 2}, {11, 8, 5, 2}}
+};
+
+// Writes the 2^degree - 1 bits of the m-sequence of a Fibonacci LFSR
+static void lfsr(const int *poly, int degree, uint8_t *bits) {
+	uint32_t mask = 0;
+	for (int j = 0; j < 4 && poly[j]; j++) {
+		mask |= 1U << (degree - poly[j]);
+	}
+	uint32_t state = 1;
+	int len = (1 << degree) - 1;
+	for (int n = 0; n < len; n++) {
+		bits[n] = state & 1;
+		uint32_t feedback = __builtin_parity(state & mask);
+		state = (state >> 1) | (feedback << (degree - 1));
+	}
+}
+
+// Finds p / q = x with a small denominator, or returns -1
+static int rational(double x, int *p, int *q) {
+	for (int d = 1; d <= MAX_DENOMINATOR; d++) {
+		double n = round(x * d);
+		if (n >= 1 && fabs(n / d - x) < 1e-9 * x) {
+			*p = n;
+			*q = d;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Root raised cosine pulse, with t in chips
+static double rrc(double t, double beta) {
+	if (fabs(t) < 1e-9) return 1 - beta + 4 * beta / M_PI;
+	if (beta > 0 && fabs(fabs(t) - 1 / (4 * beta)) < 1e-9) {
+		return beta / sqrt(2) * ((1 + 2 / M_PI) * sin(M_PI / (4 * beta))
+					 + (1 - 2 / M_PI) * cos(M_PI / (4 * beta)));
+	}
+	return (sin(M_PI * t * (1 - beta)) + 4 * beta * t * cos(M_PI * t * (1 + beta)))
+		/ (M_PI * t * (1 - 16 * beta * beta * t * t));
+}
+
+static int load_file(struct ranging_code *c, const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size <= 0 || size % (2 * sizeof(int16_t)) != 0
+	    || size / (2 * sizeof(int16_t)) > MAX_PERIOD) {
+		fprintf(stderr, "Invalid size of %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	c->period = size / (2 * sizeof(int16_t));
+	c->samples = malloc(size);
+	if (!c->samples) {
+		perror("Could not allocate ranging waveform");
+		fclose(f);
+		return -1;
+	}
+	if (fread(c->samples, size, 1, f) != 1) {
+		fprintf(stderr, "Could not read %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int generate(struct ranging_code *c, const struct ranging_code_config *cfg,
+		    double sample_rate) {
+	int degree = cfg->degree;
+	if (cfg->amplitude <= 0 || cfg->amplitude > 1) {
+		fprintf(stderr, "Invalid ranging code amplitude\n");
+		return -1;
+	}
+	if (degree < 1 || degree > MAX_DEGREE
+	    || (cfg->type == RANGING_CODE_MSEQ && !mseq_polys[degree][0])
+	    || (cfg->type == RANGING_CODE_GOLD && !gold_polys[degree][0][0])) {
+		fprintf(stderr, "Unsupported code degree %d\n", degree);
+		return -1;
+	}
+	c->chips = (1 << degree) - 1;
+
+	if (cfg->chip_rate <= 0 || cfg->chip_rate > sample_rate
+	    || rational(sample_rate / cfg->chip_rate, &c->p, &c->q) < 0
+	    || c->p > MAX_PHASES) {
+		fprintf(stderr, "The chip rate must be at most the sample rate and "
+			"a simple fraction of it\n");
+		return -1;
+	}
+	// Otherwise the waveform would only repeat after several codes, giving
+	// several correlation peaks per period
+	if (c->chips % c->q != 0) {
+		fprintf(stderr, "The code period must be a whole number of samples\n");
+		return -1;
+	}
+	int64_t period = (int64_t) c->chips / c->q * c->p;
+	if (period > MAX_PERIOD) {
+		fprintf(stderr, "Ranging code period too long\n");
+		return -1;
+	}
+	c->period = period;
+
+	uint8_t *bits = malloc(c->chips);
+	c->window = malloc(c->chips * sizeof(uint16_t));
+	if (!bits || !c->window) {
+		perror("Could not allocate ranging code");
+		return -1;
+	}
+	if (cfg->type == RANGING_CODE_MSEQ) {
+		lfsr(mseq_polys[degree], degree, bits);
+	}
+	else {
+		uint8_t *v = malloc(c->chips);
+		if (!v) {
+			perror("Could not allocate ranging code");
+			return -1;
+		}
+		lfsr(gold_polys[degree][0], degree, bits);
+		lfsr(gold_polys[degree][1], degree, v);
+		int shift = cfg->gold_index % c->chips;
+		for (int n = 0; n < c->chips; n++) {
+			bits[n] ^= v[(n + shift) % c->chips];
+		}
+		free(v);
+	}
+
+	int span = cfg->shaping == RANGING_SHAPING_RRC ? RRC_SPAN : 0;
+	c->taps = 2 * span + 1;
+	for (int n = 0; n < c->chips; n++) {
+		uint16_t w = 0;
+		for (int k = -span; k <= span; k++) {
+			w |= bits[((n + k) % c->chips + c->chips) % c->chips] << (k + span);
+		}
+		c->window[n] = w;
+	}
+	free(bits);
+
+	int patterns = 1 << c->taps;
+	double *shaped = malloc(patterns * c->p * sizeof(double));
+	c->table = malloc(2 * patterns * c->p * sizeof(int16_t));
+	if (!shaped || !c->table) {
+		perror("Could not allocate ranging code table");
+		return -1;
+	}
+	double peak = 0;
+	for (int w = 0; w < patterns; w++) {
+		for (int r = 0; r < c->p; r++) {
+			double x = 0;
+			for (int k = -span; k <= span; k++) {
+				double chip = (w >> (k + span)) & 1 ? -1 : 1;
+				x += chip * (span ? rrc((double) r / c->p - k, cfg->rolloff) : 1);
+			}
+			shaped[w * c->p + r] = x;
+			if (fabs(x) > peak) peak = fabs(x);
+		}
+	}
+	double scale = cfg->amplitude * 32767 / peak;
+	for (int j = 0; j < patterns * c->p; j++) {
+		c->table[2*j] = lrint(scale * shaped[j]);
+		c->table[2*j+1] = 0;
+	}
+	free(shaped);
+	return 0;
+}
+
+int ranging_code_init(struct ranging_code *c, const struct ranging_code_config *cfg,
+		      double sample_rate) {
+	memset(c, 0, sizeof(*c));
+	if (cfg->type == RANGING_CODE_FILE) {
+		return load_file(c, cfg->file);
+	}
+	return generate(c, cfg, sample_rate);
+}
+
+void ranging_code_fill(const struct ranging_code *c, int16_t *out, uint64_t n, int count) {
+	n %= c->period;
+
+	if (c->samples) {
+		while (count) {
+			int len = c->period - n;
+			if (len > count) len = count;
+			memcpy(out, c->samples + 2 * n, 2 * len * sizeof(int16_t));
+			out += 2 * len;
+			count -= len;
+			n = 0;
+		}
+		return;
+	}
+
+	uint64_t pos = n * c->q;
+	int chip = (pos / c->p) % c->chips;
+	int r = pos % c->p;
+	if (c->q == 1) {
+		// Whole number of samples per chip: copy a run from the table
+		while (count) {
+			int len = c->p - r;
+			if (len > count) len = count;
+			memcpy(out, c->table + 2 * (c->window[chip] * c->p + r),
+			       2 * len * sizeof(int16_t));
+			out += 2 * len;
+			count -= len;
+			r = 0;
+			if (++chip == c->chips) chip = 0;
+		}
+		return;
+	}
+	for (int j = 0; j < count; j++) {
+		const int16_t *x = c->table + 2 * (c->window[chip] * c->p + r);
+		out[2*j] = x[0];
+		out[2*j+1] = x[1];
+		r += c->q;
+		if (r >= c->p) {
+			r -= c->p;
+			if (++chip == c->chips) chip = 0;
+		}
+	}
+}
+
+void ranging_code_free(struct ranging_code *c) {
+	free(c->samples);
+	free(c->window);
+	free(c->table);
+}
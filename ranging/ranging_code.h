@@ -0,0 +1,76 @@
+/*
+  ===========================================================================
+
+  ranging_code - Ranging waveforms: a pre-generated file, or maximal-length
+  and Gold code BPSK generated on the fly.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef RANGING_CODE_H
+#define RANGING_CODE_H
+
+#include <stdint.h>
+
+enum ranging_code_type {
+	RANGING_CODE_FILE,
+	RANGING_CODE_MSEQ,
+	RANGING_CODE_GOLD
+};
+
+enum ranging_code_shaping {
+	RANGING_SHAPING_NONE,
+	RANGING_SHAPING_RRC
+};
+
+struct ranging_code_config {
+	enum ranging_code_type type;
+	const char *file; // interleaved int16 IQ, for RANGING_CODE_FILE
+	int degree; // LFSR degree, the code has 2^degree - 1 chips
+	int gold_index; // relative shift of the two m-sequences of a Gold code
+	double chip_rate;
+	enum ranging_code_shaping shaping;
+	double rolloff;
+	double amplitude; // peak amplitude, as a fraction of full scale
+};
+
+struct ranging_code {
+	int period; // samples
+
+	// RANGING_CODE_FILE: one period of the waveform
+	int16_t *samples;
+
+	// Generated codes. There are p / q samples per chip. Sample n lies at
+	// phase (n q) mod p within chip floor(n q / p), and its value depends
+	// only on that phase and on the chips around it, so it is looked up in
+	// a table indexed by the bits of the neighbouring chips and the phase
+	int chips;
+	int p, q;
+	int taps; // chips that contribute to a sample
+	uint16_t *window; // for each chip, the bits of the taps chips around it
+	int16_t *table; // interleaved IQ, [1 << taps][p]
+};
+
+int ranging_code_init(struct ranging_code *c, const struct ranging_code_config *cfg,
+		      double sample_rate);
+// Writes count samples of the waveform, starting at sample number n (which
+// may be larger than the period), as interleaved int16 IQ
+void ranging_code_fill(const struct ranging_code *c, int16_t *out, uint64_t n, int count);
+void ranging_code_free(struct ranging_code *c);
+
+#endif
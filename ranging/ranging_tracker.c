@@ -0,0 +1,506 @@
+/*
+  ===========================================================================
+
+  ranging_tracker - Acquisition and delay/carrier tracking of the ranging
+  signal received back from QO-100.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  A full period of the RX signal is correlated once against the TX
+  signal using FFTs, searching in delay and frequency. After that, the
+  delay is tracked with an early/prompt/late correlator (DLL) and the
+  carrier with an FLL-assisted PLL, which only cost a few operations per
+  sample. A fourth correlator, half a period away from the prompt, gives
+  the noise reference for the C/N0 estimate used to detect loss of lock.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "ranging_tracker.h"
+
+#define SPEED_OF_LIGHT 299792458.0
+#define ACQ_THRESHOLD 25.0 // peak to mean correlation power
+#define LOOP_DAMPING 0.707
+#define LOCK_LOSS_SECONDS 3
+
+static double wrap(double x, double period) {
+	x = fmod(x, period);
+	return x < 0 ? x + period : x;
+}
+
+// |sum_n s(n) conj(s(n + x))| using the same linear interpolation as the
+// tracking correlators
+static double ref_autocorr(struct ranging_tracker *tr, double x) {
+	int shift = floor(x);
+	float mu = x - shift;
+	double re = 0, im = 0;
+	for (int n = 0; n < tr->code_len; n++) {
+		const float *a = tr->ref + 2 * (tr->pad + n);
+		int m = (n + shift + tr->code_len) % tr->code_len;
+		const float *b = tr->ref + 2 * (tr->pad + m);
+		float bi = (1 - mu) * b[0] + mu * b[2];
+		float bq = (1 - mu) * b[1] + mu * b[3];
+		re += a[0] * bi + a[1] * bq;
+		im += a[1] * bi - a[0] * bq;
+	}
+	return hypot(re, im);
+}
+
+// Round trip delay in samples, taking the one not below the minimum delay
+// out of those that differ by a code period
+static double delay_samples(struct ranging_tracker *tr) {
+	double min_delay = tr->cfg.min_delay * tr->cfg.sample_rate;
+	return min_delay + wrap(tr->tau - min_delay, tr->code_len);
+}
+
+// Whether a block of RX samples holds signal that was transmitted entirely
+// within a TX burst
+static int in_burst(struct ranging_tracker *tr, uint64_t timestamp) {
+	double tx = (double) (int64_t) (timestamp - tr->tx_start) - delay_samples(tr);
+	if (tx < 0) return 0;
+	if (tr->burst_period == 0) return 1;
+	return fmod(tx, tr->burst_period) + tr->block_size <= tr->burst_length;
+}
+
+static double dll_discriminator(double early, double late) {
+	return early + late > 0 ? (early - late) / (early + late) : 0;
+}
+
+int ranging_tracker_init(struct ranging_tracker *tr, const struct ranging_tracker_config *cfg,
+			 const int16_t *tx_signal, int code_len, int block_size) {
+	memset(tr, 0, sizeof(*tr));
+	tr->cfg = *cfg;
+	tr->code_len = code_len;
+	tr->pad = cfg->spacing + 2;
+	tr->block_size = block_size;
+
+	tr->ref = malloc(2 * (code_len + 2 * tr->pad) * sizeof(float));
+	if (!tr->ref) {
+		perror("Could not allocate ranging reference");
+		return -1;
+	}
+	double power = 0;
+	for (int n = 0; n < 2 * code_len; n++) {
+		power += (double) tx_signal[n] * tx_signal[n];
+	}
+	power /= code_len;
+	if (power == 0) {
+		fprintf(stderr, "Ranging reference signal is empty\n");
+		return -1;
+	}
+	float scale = 1 / sqrt(power);
+	for (int n = -tr->pad; n < code_len + tr->pad; n++) {
+		int m = (n + code_len) % code_len;
+		tr->ref[2 * (n + tr->pad)] = scale * tx_signal[2*m];
+		tr->ref[2 * (n + tr->pad) + 1] = scale * tx_signal[2*m+1];
+	}
+
+	const double delta = 0.1;
+	double d = cfg->spacing;
+	tr->disc_gain = (dll_discriminator(ref_autocorr(tr, delta + d), ref_autocorr(tr, delta - d))
+			 - dll_discriminator(ref_autocorr(tr, -delta + d), ref_autocorr(tr, -delta - d)))
+		/ (2 * delta);
+	if (fabs(tr->disc_gain) < 1e-6) {
+		fprintf(stderr, "Ranging reference has a flat correlation peak; increase the correlator spacing\n");
+		return -1;
+	}
+
+	tr->acq_buf = fftwf_malloc(code_len * sizeof(fftwf_complex));
+	tr->acq_spec = fftwf_malloc(code_len * sizeof(fftwf_complex));
+	tr->ref_spec = fftwf_malloc(code_len * sizeof(fftwf_complex));
+	tr->acq_corr = fftwf_malloc(code_len * sizeof(fftwf_complex));
+	if (!tr->acq_buf || !tr->acq_spec || !tr->ref_spec || !tr->acq_corr) {
+		perror("Could not allocate acquisition buffers");
+		return -1;
+	}
+	tr->acq_fwd = fftwf_plan_dft_1d(code_len, tr->acq_buf, tr->acq_spec, FFTW_FORWARD, FFTW_ESTIMATE);
+	tr->acq_inv = fftwf_plan_dft_1d(code_len, tr->acq_corr, tr->acq_buf, FFTW_BACKWARD, FFTW_ESTIMATE);
+	memcpy(tr->acq_buf, tr->ref + 2 * tr->pad, code_len * sizeof(fftwf_complex));
+	fftwf_execute(tr->acq_fwd);
+	for (int n = 0; n < code_len; n++) {
+		tr->ref_spec[n][0] = tr->acq_spec[n][0];
+		tr->ref_spec[n][1] = -tr->acq_spec[n][1];
+	}
+
+	tr->ring_size = 1;
+	while (tr->ring_size * block_size < 0.5 * cfg->sample_rate) tr->ring_size <<= 1;
+	tr->ring = calloc(tr->ring_size, sizeof(*tr->ring));
+	int16_t *samples = malloc(tr->ring_size * 2 * block_size * sizeof(int16_t));
+	if (!tr->ring || !samples) {
+		perror("Could not allocate ranging ring");
+		return -1;
+	}
+	for (unsigned int j = 0; j < tr->ring_size; j++) {
+		tr->ring[j].samples = samples + j * 2 * block_size;
+	}
+	sem_init(&tr->ring_sem, 0, 0);
+
+	tr->int_blocks = lround(cfg->int_time * cfg->sample_rate / block_size);
+	if (tr->int_blocks < 1) tr->int_blocks = 1;
+	tr->burst_period = round(cfg->burst_period * cfg->sample_rate);
+	tr->burst_length = round(cfg->burst_length * cfg->sample_rate);
+
+	return 0;
+}
+
+static void start_acquisition(struct ranging_tracker *tr) {
+	tr->acq_fill = 0;
+	atomic_store(&tr->state, RANGING_ACQUIRING);
+}
+
+static void run_acquisition(struct ranging_tracker *tr) {
+	int n = tr->code_len;
+	double fs = tr->cfg.sample_rate;
+	int bins = ceil(tr->cfg.freq_search / (fs / n));
+
+	double best_metric = 0, best_power = 0, best_k_frac = 0, best_m_frac = 0;
+	int best_k = 0, best_m = 0;
+	float best_value[2] = {0, 0};
+	double prev_peak = 0, peak_before_best = 0, peak_after_best = 0;
+
+	fftwf_execute(tr->acq_fwd);
+	for (int m = -bins; m <= bins; m++) {
+		// Remove a frequency offset of m bins by rotating the spectrum
+		for (int i = 0; i < n; i++) {
+			const float *a = tr->acq_spec[(i + m + n) % n];
+			const float *b = tr->ref_spec[i];
+			tr->acq_corr[i][0] = a[0] * b[0] - a[1] * b[1];
+			tr->acq_corr[i][1] = a[0] * b[1] + a[1] * b[0];
+		}
+		fftwf_execute(tr->acq_inv);
+
+		double sum = 0, peak = 0;
+		int k_peak = 0;
+		for (int k = 0; k < n; k++) {
+			double p = tr->acq_buf[k][0] * tr->acq_buf[k][0]
+				+ tr->acq_buf[k][1] * tr->acq_buf[k][1];
+			sum += p;
+			if (p > peak) {
+				peak = p;
+				k_peak = k;
+			}
+		}
+		double metric = peak / (sum / n);
+
+		if (m == best_m + 1) peak_after_best = peak;
+		if (metric > best_metric) {
+			best_metric = metric;
+			best_power = peak;
+			best_k = k_peak;
+			best_m = m;
+			best_value[0] = tr->acq_buf[k_peak][0];
+			best_value[1] = tr->acq_buf[k_peak][1];
+			peak_before_best = prev_peak;
+			peak_after_best = 0;
+			// Parabolic interpolation of the correlation peak in delay
+			double a = sqrt(tr->acq_buf[(k_peak + n - 1) % n][0] * tr->acq_buf[(k_peak + n - 1) % n][0]
+					+ tr->acq_buf[(k_peak + n - 1) % n][1] * tr->acq_buf[(k_peak + n - 1) % n][1]);
+			double c = sqrt(tr->acq_buf[(k_peak + 1) % n][0] * tr->acq_buf[(k_peak + 1) % n][0]
+					+ tr->acq_buf[(k_peak + 1) % n][1] * tr->acq_buf[(k_peak + 1) % n][1]);
+			double b = sqrt(peak);
+			best_k_frac = a - 2 * b + c != 0 ? 0.5 * (a - c) / (a - 2 * b + c) : 0;
+		}
+		prev_peak = peak;
+	}
+
+	if (best_metric < ACQ_THRESHOLD) {
+		fprintf(stderr, "Ranging: acquisition failed (metric %.1f)\n", best_metric);
+		start_acquisition(tr);
+		return;
+	}
+
+	if (peak_before_best > 0 && peak_after_best > 0) {
+		double a = sqrt(peak_before_best), b = sqrt(best_power), c = sqrt(peak_after_best);
+		if (a - 2 * b + c != 0) best_m_frac = 0.5 * (a - c) / (a - 2 * b + c);
+	}
+
+	// The RX signal is the TX signal delayed by best_k samples with
+	// respect to acq_ts, whose code phase is acq_ts - t0
+	tr->tau = wrap(best_k + best_k_frac + (double) (tr->acq_ts - tr->t0), n);
+	tr->tau_rate = 0;
+	tr->nco_freq = tr->pll_integ = 2 * M_PI * (best_m + best_m_frac) * fs / n;
+	tr->nco_phase = atan2(best_value[1], best_value[0]);
+	tr->nco_ts = tr->acq_ts;
+	memset(tr->early, 0, sizeof(tr->early));
+	memset(tr->prompt, 0, sizeof(tr->prompt));
+	memset(tr->late, 0, sizeof(tr->late));
+	memset(tr->noise, 0, sizeof(tr->noise));
+	tr->have_prev_prompt = 0;
+	tr->acc_blocks = 0;
+	tr->sig_acc = tr->noise_acc = 0;
+	tr->cn0_count = 0;
+	tr->unlocked_count = 0;
+	tr->next_output = 0;
+
+	fprintf(stderr, "Ranging: acquired delay = %.9f s, frequency = %.2f Hz, metric = %.1f\n",
+		tr->tau / fs, tr->nco_freq / (2 * M_PI), best_metric);
+	atomic_store(&tr->state, RANGING_TRACKING);
+}
+
+static void acquire_block(struct ranging_tracker *tr, const struct ranging_block *b) {
+	// The echo of the first TX sample can take up to one code period to
+	// arrive, so earlier samples would give a partial correlation
+	if (b->timestamp < tr->acq_start) return;
+	if (tr->acq_fill && b->timestamp != tr->acq_ts + tr->acq_fill) {
+		// Lost samples; a full contiguous period is needed
+		tr->acq_fill = 0;
+	}
+	if (tr->acq_fill == 0) tr->acq_ts = b->timestamp;
+
+	int count = tr->code_len - tr->acq_fill;
+	if (count > tr->block_size) count = tr->block_size;
+	for (int j = 0; j < count; j++) {
+		tr->acq_buf[tr->acq_fill + j][0] = b->samples[2*j];
+		tr->acq_buf[tr->acq_fill + j][1] = b->samples[2*j+1];
+	}
+	tr->acq_fill += count;
+
+	if (tr->acq_fill == tr->code_len) {
+		run_acquisition(tr);
+	}
+}
+
+static void update_loops(struct ranging_tracker *tr) {
+	double fs = tr->cfg.sample_rate;
+	double T = (double) tr->int_blocks * tr->block_size / fs;
+	double *p = tr->prompt;
+
+	// FLL-assisted second order PLL
+	double e_pll = atan2(p[1], p[0]);
+	double e_fll = 0;
+	if (tr->have_prev_prompt) {
+		double *q = tr->prev_prompt;
+		e_fll = atan2(q[0] * p[1] - q[1] * p[0], q[0] * p[0] + q[1] * p[1]) / T;
+	}
+	double wn_pll = tr->cfg.pll_bw / 0.53;
+	double wn_fll = 4 * tr->cfg.fll_bw;
+	tr->pll_integ += T * (wn_pll * wn_pll * e_pll + wn_fll * e_fll);
+	tr->nco_freq = tr->pll_integ + 2 * LOOP_DAMPING * wn_pll * e_pll;
+	tr->prev_prompt[0] = p[0];
+	tr->prev_prompt[1] = p[1];
+	tr->have_prev_prompt = 1;
+
+	// Second order DLL with a normalized early minus late envelope discriminator
+	double eps = dll_discriminator(hypot(tr->early[0], tr->early[1]),
+				       hypot(tr->late[0], tr->late[1])) / tr->disc_gain;
+	if (eps > tr->cfg.spacing) eps = tr->cfg.spacing;
+	if (eps < -tr->cfg.spacing) eps = -tr->cfg.spacing;
+	double wn_dll = tr->cfg.dll_bw / 0.53;
+	tr->tau_rate += T * wn_dll * wn_dll * eps;
+	tr->tau += 2 * LOOP_DAMPING * wn_dll * T * eps;
+
+	// C/N0 from the prompt and noise correlators, averaged over a second
+	tr->sig_acc += p[0] * p[0] + p[1] * p[1];
+	tr->noise_acc += tr->noise[0] * tr->noise[0] + tr->noise[1] * tr->noise[1];
+	if (++tr->cn0_count * T >= 1.0) {
+		double snr = tr->noise_acc > 0 ? (tr->sig_acc - tr->noise_acc) / tr->noise_acc : 0;
+		tr->cn0 = snr > 0 ? 10 * log10(snr / T) : 0;
+		tr->sig_acc = tr->noise_acc = 0;
+		tr->cn0_count = 0;
+		if (tr->cn0 < tr->cfg.lock_cn0) {
+			if (++tr->unlocked_count >= LOCK_LOSS_SECONDS) {
+				fprintf(stderr, "Ranging: lost lock (C/N0 = %.1f dB-Hz), reacquiring\n", tr->cn0);
+				start_acquisition(tr);
+				return;
+			}
+		}
+		else {
+			tr->unlocked_count = 0;
+		}
+	}
+
+	double t = (double) (tr->int_ts - tr->t0) / fs;
+	if (t >= tr->next_output) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		double delay = delay_samples(tr) / fs;
+		printf("%.3f %llu %.9f %.4f %.4f %.3f %.1f %s\n",
+		       now.tv_sec + 1e-9 * now.tv_nsec,
+		       (unsigned long long) tr->int_ts, delay,
+		       1e-3 * SPEED_OF_LIGHT * delay / 2,
+		       SPEED_OF_LIGHT * tr->tau_rate / fs / 2,
+		       tr->pll_integ / (2 * M_PI), tr->cn0,
+		       tr->unlocked_count ? "UNLOCKED" : "LOCKED");
+		fflush(stdout);
+		tr->next_output = t + tr->cfg.output_interval;
+	}
+}
+
+static void track_block(struct ranging_tracker *tr, const struct ranging_block *b) {
+	double fs = tr->cfg.sample_rate;
+	int n = tr->code_len;
+	int d = tr->cfg.spacing;
+
+	// Carrier NCO and code phase are computed from the block timestamp,
+	// so that blocks dropped by the ring do not disturb the loops
+	double gap = (double) (int64_t) (b->timestamp - tr->nco_ts);
+	tr->nco_phase = wrap(tr->nco_phase + tr->nco_freq * gap / fs, 2 * M_PI);
+	tr->tau += tr->tau_rate * gap / fs;
+	tr->nco_ts = b->timestamp;
+
+	if (!in_burst(tr, b->timestamp)) {
+		// Between bursts the loops coast and the integration restarts
+		// with the next burst
+		tr->acc_blocks = 0;
+		tr->have_prev_prompt = 0;
+		return;
+	}
+
+	if (tr->acc_blocks == 0) {
+		tr->int_ts = b->timestamp;
+		memset(tr->early, 0, sizeof(tr->early));
+		memset(tr->prompt, 0, sizeof(tr->prompt));
+		memset(tr->late, 0, sizeof(tr->late));
+		memset(tr->noise, 0, sizeof(tr->noise));
+	}
+
+	double phi = wrap((double) (b->timestamp - tr->t0) - tr->tau, n);
+	double dphi = 1 - tr->tau_rate / fs;
+	float rot_c = cos(tr->nco_phase), rot_s = -sin(tr->nco_phase);
+	float drot_c = cos(tr->nco_freq / fs), drot_s = -sin(tr->nco_freq / fs);
+	float e_re = 0, e_im = 0, p_re = 0, p_im = 0, l_re = 0, l_im = 0, n_re = 0, n_im = 0;
+
+	for (int j = 0; j < tr->block_size; j++) {
+		int ip = phi;
+		float mu = phi - ip;
+		const float *r = tr->ref + 2 * (tr->pad + ip);
+		const float *rn = tr->ref + 2 * (tr->pad + (ip + n / 2) % n);
+
+		float xi = b->samples[2*j], xq = b->samples[2*j+1];
+		float yi = xi * rot_c - xq * rot_s;
+		float yq = xi * rot_s + xq * rot_c;
+
+		float si = (1 - mu) * r[0] + mu * r[2], sq = (1 - mu) * r[1] + mu * r[3];
+		p_re += yi * si + yq * sq;
+		p_im += yq * si - yi * sq;
+		si = (1 - mu) * r[2*d] + mu * r[2*d+2];
+		sq = (1 - mu) * r[2*d+1] + mu * r[2*d+3];
+		e_re += yi * si + yq * sq;
+		e_im += yq * si - yi * sq;
+		si = (1 - mu) * r[-2*d] + mu * r[-2*d+2];
+		sq = (1 - mu) * r[-2*d+1] + mu * r[-2*d+3];
+		l_re += yi * si + yq * sq;
+		l_im += yq * si - yi * sq;
+		si = (1 - mu) * rn[0] + mu * rn[2];
+		sq = (1 - mu) * rn[1] + mu * rn[3];
+		n_re += yi * si + yq * sq;
+		n_im += yq * si - yi * sq;
+
+		float tmp = rot_c * drot_c - rot_s * drot_s;
+		rot_s = rot_c * drot_s + rot_s * drot_c;
+		rot_c = tmp;
+		phi += dphi;
+		if (phi >= n) phi -= n;
+	}
+
+	tr->early[0] += e_re; tr->early[1] += e_im;
+	tr->prompt[0] += p_re; tr->prompt[1] += p_im;
+	tr->late[0] += l_re; tr->late[1] += l_im;
+	tr->noise[0] += n_re; tr->noise[1] += n_im;
+
+	tr->nco_phase = wrap(tr->nco_phase + tr->nco_freq * tr->block_size / fs, 2 * M_PI);
+	tr->tau += tr->tau_rate * tr->block_size / fs;
+	tr->nco_ts += tr->block_size;
+
+	if (++tr->acc_blocks == tr->int_blocks) {
+		tr->acc_blocks = 0;
+		update_loops(tr);
+	}
+}
+
+static void *ranging_tracker_thread(void *arg) {
+	struct ranging_tracker *tr = arg;
+
+	while (1) {
+		sem_wait(&tr->ring_sem);
+		if (atomic_load(&tr->stop)) break;
+
+		unsigned int tail = atomic_load_explicit(&tr->ring_tail, memory_order_relaxed);
+		struct ranging_block *b = &tr->ring[tail & (tr->ring_size - 1)];
+		if (atomic_load(&tr->state) == RANGING_ACQUIRING) {
+			acquire_block(tr, b);
+		}
+		else {
+			track_block(tr, b);
+		}
+		atomic_store_explicit(&tr->ring_tail, tail + 1, memory_order_release);
+	}
+	return NULL;
+}
+
+int ranging_tracker_start(struct ranging_tracker *tr, uint64_t t0, uint64_t tx_start) {
+	tr->t0 = t0;
+	tr->tx_start = tx_start;
+	tr->acq_start = tx_start + tr->code_len;
+	start_acquisition(tr);
+	if (pthread_create(&tr->thread, NULL, ranging_tracker_thread, tr) != 0) {
+		fprintf(stderr, "Could not create ranging tracker thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+void ranging_tracker_push(struct ranging_tracker *tr, const int16_t *samples, uint64_t timestamp) {
+	if (atomic_load(&tr->state) == RANGING_IDLE) return;
+
+	unsigned int head = atomic_load_explicit(&tr->ring_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&tr->ring_tail, memory_order_acquire);
+	if (head - tail >= tr->ring_size) {
+		atomic_fetch_add(&tr->dropped_blocks, 1);
+		return;
+	}
+	struct ranging_block *b = &tr->ring[head & (tr->ring_size - 1)];
+	memcpy(b->samples, samples, 2 * tr->block_size * sizeof(int16_t));
+	b->timestamp = timestamp;
+	atomic_store_explicit(&tr->ring_head, head + 1, memory_order_release);
+	sem_post(&tr->ring_sem);
+}
+
+void ranging_tracker_print(struct ranging_tracker *tr) {
+	static const char *states[] = { "idle", "acquiring", "tracking" };
+	int state = atomic_load(&tr->state);
+	fprintf(stderr, "Ranging: %s, dropped blocks = %lu",
+		states[state], atomic_load(&tr->dropped_blocks));
+	if (state == RANGING_TRACKING) {
+		fprintf(stderr, ", delay = %.9f s, C/N0 = %.1f dB-Hz",
+			delay_samples(tr) / tr->cfg.sample_rate, tr->cn0);
+	}
+	fprintf(stderr, "\n");
+}
+
+void ranging_tracker_stop(struct ranging_tracker *tr) {
+	if (atomic_load(&tr->state) != RANGING_IDLE) {
+		atomic_store(&tr->stop, 1);
+		sem_post(&tr->ring_sem);
+		pthread_join(tr->thread, NULL);
+	}
+	fftwf_destroy_plan(tr->acq_fwd);
+	fftwf_destroy_plan(tr->acq_inv);
+	fftwf_free(tr->acq_buf);
+	fftwf_free(tr->acq_spec);
+	fftwf_free(tr->ref_spec);
+	fftwf_free(tr->acq_corr);
+	free(tr->ring[0].samples);
+	free(tr->ring);
+	free(tr->ref);
+}
@@ -0,0 +1,123 @@
+/*
+  ===========================================================================
+
+  ranging_tracker - Acquisition and delay/carrier tracking of the ranging
+  signal received back from QO-100.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef RANGING_TRACKER_H
+#define RANGING_TRACKER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <fftw3.h>
+
+struct ranging_tracker_config {
+	double sample_rate;
+	double int_time; // coherent integration of the tracking correlators (s)
+	double dll_bw; // Hz
+	double pll_bw; // Hz
+	double fll_bw; // Hz
+	double freq_search; // acquisition frequency search (+/- Hz)
+	int spacing; // early-late spacing (samples)
+	double output_interval; // s
+	double lock_cn0; // dB-Hz
+	double min_delay; // s, resolves the ambiguity of the code period
+	double burst_period; // s, 0 if TX is continuous
+	double burst_length; // s
+};
+
+enum ranging_tracker_state {
+	RANGING_IDLE,
+	RANGING_ACQUIRING,
+	RANGING_TRACKING
+};
+
+struct ranging_block {
+	uint64_t timestamp;
+	int16_t *samples;
+};
+
+struct ranging_tracker {
+	struct ranging_tracker_config cfg;
+
+	// Reference: one period of the TX signal as complex float with unit
+	// power, padded at both ends so that correlators do not need to wrap
+	int code_len;
+	int pad;
+	float *ref;
+	double disc_gain;
+	uint64_t t0; // device timestamp at which the TX signal has phase 0
+	uint64_t tx_start;
+	double burst_period, burst_length; // samples
+
+	// Input ring, filled by the RX loop
+	int block_size;
+	unsigned int ring_size;
+	struct ranging_block *ring;
+	atomic_uint ring_head, ring_tail;
+	atomic_ulong dropped_blocks;
+	sem_t ring_sem;
+	atomic_int stop;
+	pthread_t thread;
+
+	atomic_int state;
+
+	// Acquisition
+	fftwf_complex *acq_buf, *acq_spec, *ref_spec, *acq_corr;
+	fftwf_plan acq_fwd, acq_inv;
+	int acq_fill;
+	uint64_t acq_ts;
+	uint64_t acq_start;
+
+	// Tracking
+	double tau; // delay (samples)
+	double tau_rate; // samples/s
+	double pll_integ; // rad/s
+	double nco_freq; // rad/s
+	double nco_phase;
+	uint64_t nco_ts;
+	double early[2], prompt[2], late[2], noise[2];
+	double prev_prompt[2];
+	int have_prev_prompt;
+	int int_blocks, acc_blocks;
+	uint64_t int_ts;
+	double sig_acc, noise_acc;
+	int cn0_count;
+	double cn0;
+	int unlocked_count;
+	double next_output;
+};
+
+int ranging_tracker_init(struct ranging_tracker *tr, const struct ranging_tracker_config *cfg,
+			 const int16_t *tx_signal, int code_len, int block_size);
+// Starts acquisition. t0 is the device timestamp at which the sample 0 of
+// tx_signal is (or would have been) transmitted, and tx_start the device
+// timestamp of the first transmitted sample
+int ranging_tracker_start(struct ranging_tracker *tr, uint64_t t0, uint64_t tx_start);
+// Queues an RX block of block_size samples. Called from the RX loop
+void ranging_tracker_push(struct ranging_tracker *tr, const int16_t *samples, uint64_t timestamp);
+void ranging_tracker_print(struct ranging_tracker *tr);
+void ranging_tracker_stop(struct ranging_tracker *tr);
+
+#endif
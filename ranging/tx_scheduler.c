@@ -0,0 +1,175 @@
+/*
+  ===========================================================================
+
+  tx_scheduler - Sends TX bursts of the ranging waveform at absolute
+  device timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  Every send carries the timestamp of its first sample, and the waveform
+  is taken from the code at that timestamp, so the code phase is tied to
+  the device clock regardless of gaps between bursts. Samples that cannot
+  reach the LimeSDR before they are due are not sent, so that a late
+  burst is shortened instead of being transmitted at the wrong time.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tx_scheduler.h"
+
+int tx_scheduler_init(struct tx_scheduler *s, const struct ranging_code *code,
+		      uint64_t t0, double sample_rate, double margin, int lookahead) {
+	memset(s, 0, sizeof(*s));
+	s->code = code;
+	s->t0 = t0;
+	s->sample_rate = sample_rate;
+	s->margin = margin * sample_rate;
+	s->lookahead = lookahead;
+	s->min_lead = INT64_MAX;
+	s->buffer_size = lookahead;
+	s->buffer = malloc(2 * lookahead * sizeof(int16_t));
+	if (!s->buffer) {
+		perror("Could not allocate TX scheduler buffer");
+		return -1;
+	}
+	return 0;
+}
+
+int tx_scheduler_queue(struct tx_scheduler *s, uint64_t start, uint64_t length) {
+	if (s->head - s->tail == TX_SCHEDULER_QUEUE) return -1;
+	if (s->head != s->tail) {
+		const struct tx_burst *last = &s->queue[(s->head - 1) % TX_SCHEDULER_QUEUE];
+		if (start < last->start + last->length) return -1;
+	}
+	s->queue[s->head % TX_SCHEDULER_QUEUE] = (struct tx_burst) {
+		.start = start,
+		.length = length
+	};
+	s->head++;
+	return 0;
+}
+
+void tx_scheduler_periodic(struct tx_scheduler *s, uint64_t first, uint64_t period, uint64_t length) {
+	s->periodic = 1;
+	s->next_start = first;
+	s->period = period;
+	s->length = length;
+}
+
+// Skips the samples of the oldest burst that are already too late to be sent
+static void skip_late(struct tx_scheduler *s, struct tx_burst *b, uint64_t earliest) {
+	uint64_t ts = b->start + s->sent;
+	if (ts >= earliest) return;
+
+	uint64_t late = earliest - ts;
+	if (late > b->length - s->sent) late = b->length - s->sent;
+	if (s->sent == 0) {
+		s->late_bursts++;
+		if (late > s->max_late) s->max_late = late;
+		if (late < b->length) {
+			fprintf(stderr, "TX burst at %llu late: starts %.3f ms after the requested time\n",
+				(unsigned long long) b->start, 1e3 * late / s->sample_rate);
+		}
+	}
+	s->late_samples += late;
+	s->sent += late;
+}
+
+static void next_burst(struct tx_scheduler *s, const struct tx_burst *b) {
+	if (s->burst_sent) {
+		s->bursts++;
+	}
+	else {
+		s->dropped_bursts++;
+		fprintf(stderr, "TX burst at %llu dropped: too late\n", (unsigned long long) b->start);
+	}
+	s->tail++;
+	s->sent = 0;
+	s->burst_sent = 0;
+}
+
+int tx_scheduler_send(struct tx_scheduler *s, lms_stream_t *stream, uint64_t now, int room) {
+	int total = 0;
+	uint64_t earliest = now + s->margin;
+	uint64_t horizon = earliest + s->lookahead;
+
+	while (s->periodic && s->head - s->tail < TX_SCHEDULER_QUEUE) {
+		tx_scheduler_queue(s, s->next_start, s->length);
+		s->next_start += s->period;
+	}
+
+	while (room > 0 && s->head != s->tail) {
+		struct tx_burst *b = &s->queue[s->tail % TX_SCHEDULER_QUEUE];
+		if (s->sent == 0 && b->start < horizon) {
+			int64_t lead = (int64_t) (b->start - now);
+			if (lead < s->min_lead) s->min_lead = lead;
+		}
+		// A burst is only started with some margin, but once started
+		// its samples are only late when they are already due
+		skip_late(s, b, s->sent ? now : earliest);
+		if (s->sent == b->length) {
+			next_burst(s, b);
+			continue;
+		}
+
+		uint64_t ts = b->start + s->sent;
+		if (ts >= horizon) break;
+		uint64_t count = b->length - s->sent;
+		if (count > (uint64_t) room) count = room;
+		if (count > horizon - ts) count = horizon - ts;
+
+		lms_stream_meta_t meta = {
+			.timestamp = ts,
+			.waitForTimestamp = true,
+			.flushPartialPacket = s->sent + count == b->length
+		};
+		ranging_code_fill(s->code, s->buffer, ts - s->t0, count);
+		int ret = LMS_SendStream(stream, s->buffer, count, &meta, 1000);
+		if (ret < 0) {
+			fprintf(stderr, "LMS_SendStream() : %s\n", LMS_GetLastErrorMessage());
+			return -1;
+		}
+		if (ret != (int) count) {
+			fprintf(stderr, "Didn't write to TX FIFO all we expected\n");
+			return -1;
+		}
+		s->sent += count;
+		s->burst_sent += count;
+		room -= count;
+		total += count;
+		if (s->sent == b->length) {
+			next_burst(s, b);
+		}
+	}
+	return total;
+}
+
+void tx_scheduler_print(struct tx_scheduler *s) {
+	fprintf(stderr, "TX bursts: %lu sent, %lu late, %lu dropped, late samples = %llu, "
+		"max late = %.3f ms, min lead = %.3f ms\n",
+		s->bursts, s->late_bursts, s->dropped_bursts,
+		(unsigned long long) s->late_samples, 1e3 * s->max_late / s->sample_rate,
+		s->min_lead == INT64_MAX ? 0 : 1e3 * s->min_lead / s->sample_rate);
+}
+
+void tx_scheduler_free(struct tx_scheduler *s) {
+	free(s->buffer);
+}
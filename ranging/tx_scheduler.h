@@ -0,0 +1,80 @@
+/*
+  ===========================================================================
+
+  tx_scheduler - Sends TX bursts of the ranging waveform at absolute
+  device timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef TX_SCHEDULER_H
+#define TX_SCHEDULER_H
+
+#include <stdint.h>
+
+#include <lime/LimeSuite.h>
+
+#include "ranging_code.h"
+
+#define TX_SCHEDULER_QUEUE 64
+
+struct tx_burst {
+	uint64_t start; // device timestamp
+	uint64_t length; // samples
+};
+
+struct tx_scheduler {
+	const struct ranging_code *code;
+	uint64_t t0; // device timestamp of sample 0 of the code
+	double sample_rate;
+	uint64_t margin; // samples must be sent this long before they are due
+	uint64_t lookahead; // and at most this long before the margin
+
+	// Bursts are sent in order. Periodic bursts are queued as they are needed
+	struct tx_burst queue[TX_SCHEDULER_QUEUE];
+	unsigned int head, tail;
+	uint64_t sent; // samples of the oldest burst already sent or skipped
+	uint64_t burst_sent; // samples of the oldest burst already sent
+	int periodic;
+	uint64_t next_start, period, length;
+
+	int16_t *buffer;
+	int buffer_size;
+
+	unsigned long bursts;
+	unsigned long late_bursts;
+	unsigned long dropped_bursts;
+	uint64_t late_samples;
+	uint64_t max_late; // samples
+	int64_t min_lead; // samples between the send and the burst start
+};
+
+int tx_scheduler_init(struct tx_scheduler *s, const struct ranging_code *code,
+		      uint64_t t0, double sample_rate, double margin, int lookahead);
+// Queues a burst at an absolute device timestamp, after all queued bursts
+int tx_scheduler_queue(struct tx_scheduler *s, uint64_t start, uint64_t length);
+// Queues bursts of length samples every period samples, starting at first
+void tx_scheduler_periodic(struct tx_scheduler *s, uint64_t first, uint64_t period, uint64_t length);
+// Sends up to room samples that are due before now + margin + lookahead.
+// now is the current device timestamp. Returns the number of samples sent,
+// or -1
+int tx_scheduler_send(struct tx_scheduler *s, lms_stream_t *stream, uint64_t now, int room);
+void tx_scheduler_print(struct tx_scheduler *s);
+void tx_scheduler_free(struct tx_scheduler *s);
+
+#endif
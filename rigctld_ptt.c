@@ -0,0 +1,467 @@
+/*
+  ===========================================================================
+
+  rigctld_ptt - Minimal rigctld network server that switches the PTT
+  GPIO. Replaces rigctld_ptt.py.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "gpio.h"
+
+#define RIGCTLD_PORT 4532
+#define RIGCTLD_MAX_CLIENTS 32
+#define RIGCTLD_LINE_SIZE 1024
+#define RIGCTLD_OUT_SIZE 16384
+
+static const char rig_state[] =
+	"0\n"
+	"1\n"
+	"2\n"
+	"150000.000000 1500000000.000000 0x1ff -1 -1 0x10000003 0x3\n"
+	"0 0 0 0 0 0 0\n"
+	"0 0 0 0 0 0 0\n"
+	"0x1ff 1\n"
+	"0x1ff 0\n"
+	"0 0\n"
+	"0x1e 2400\n"
+	"0x2 500\n"
+	"0x1 8000\n"
+	"0x1 2400\n"
+	"0x20 15000\n"
+	"0x20 8000\n"
+	"0x40 230000\n"
+	"0 0\n"
+	"9990\n"
+	"9990\n"
+	"10000\n"
+	"0\n"
+	"10 \n"
+	"10 20 30 \n"
+	"0xffffffff\n"
+	"0xffffffff\n"
+	"0xf7ffffff\n"
+	"0x83ffffff\n"
+	"0xffffffff\n"
+	"0xffffffbf\n";
+
+struct rigctld_client {
+	int fd;
+	struct sockaddr_in addr;
+	char in[RIGCTLD_LINE_SIZE];
+	size_t in_len;
+	int discarding; // current line overflowed the buffer, skip until newline
+	int watching; // gets the PTT state on every change
+	char out[RIGCTLD_OUT_SIZE];
+	size_t out_len;
+};
+
+struct latency_stats {
+	uint64_t count;
+	double sum_us;
+	double max_us;
+};
+
+static struct gpio ptt_gpio;
+static int ptt_state = 0;
+static int epoll_fd = -1;
+static struct rigctld_client *clients[RIGCTLD_MAX_CLIENTS];
+static int verbose = 0;
+static struct latency_stats cmd_latency, ptt_latency;
+static volatile sig_atomic_t print_stats = 0;
+
+static double timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) * 1e-3;
+}
+
+static void latency_update(struct latency_stats *s, double us) {
+	s->count++;
+	s->sum_us += us;
+	if (us > s->max_us) s->max_us = us;
+}
+
+static void latency_print(const char *name, const struct latency_stats *s) {
+	fprintf(stderr, "%s: %llu commands, mean = %.1f us, max = %.1f us\n",
+		name, (unsigned long long) s->count,
+		s->count ? s->sum_us / s->count : 0.0, s->max_us);
+}
+
+static void handle_sigusr1(int sig) {
+	(void) sig;
+	print_stats = 1;
+}
+
+int open_rigctld_socket(int *sock, unsigned int port) {
+	*sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (*sock < 0) return -1;
+
+	int one = 1;
+	if (setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) return -1;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(*sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+	if (listen(*sock, 8) < 0) return -1;
+
+	return 0;
+}
+
+// Queues a reply. Returns -1 if the client does not drain its replies
+int client_reply(struct rigctld_client *c, const char *s, size_t len) {
+	if (c->out_len + len > sizeof(c->out)) return -1;
+	memcpy(c->out + c->out_len, s, len);
+	c->out_len += len;
+	return 0;
+}
+
+int client_flush(struct rigctld_client *c) {
+	while (c->out_len) {
+		ssize_t sent = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		memmove(c->out, c->out + sent, c->out_len - sent);
+		c->out_len -= sent;
+	}
+	return 0;
+}
+
+// Sends the PTT state to the clients that asked for it with \watch_ptt.
+// A client that cannot take it is shut down, and closed by the main loop
+void notify_watchers(void) {
+	const char *s = ptt_state ? "1\n" : "0\n";
+	for (int i = 0; i < RIGCTLD_MAX_CLIENTS; i++) {
+		struct rigctld_client *c = clients[i];
+		if (!c || !c->watching) continue;
+		if (client_reply(c, s, 2) < 0 || client_flush(c) < 0) {
+			shutdown(c->fd, SHUT_RDWR);
+			continue;
+		}
+		if (c->out_len) {
+			struct epoll_event cev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &cev);
+		}
+	}
+}
+
+int ptt_set(int state) {
+	int previous = ptt_state;
+	ptt_state = state ? 1 : 0;
+	if (gpio_set(&ptt_gpio, ptt_state) < 0) {
+		perror("Could not set PTT GPIO");
+		return -1;
+	}
+	if (ptt_state != previous) notify_watchers();
+	return 0;
+}
+
+// Handles a single command line (without the newline). Returns 1 if the
+// client asked to close the connection and -1 on error
+int handle_command(struct rigctld_client *c, char *line) {
+	char reply[64];
+
+	// Accept short and long (backslash) command forms, as rigctld does
+	char *arg = line;
+	while (*arg && *arg != ' ') arg++;
+	while (*arg == ' ') *arg++ = '\0';
+
+	if (strcmp(line, "\\dump_state") == 0) {
+		return client_reply(c, rig_state, sizeof(rig_state) - 1);
+	}
+	else if (strcmp(line, "v") == 0 || strcmp(line, "\\get_vfo") == 0) {
+		return client_reply(c, "VFOA\n", 5);
+	}
+	else if (strcmp(line, "t") == 0 || strcmp(line, "\\get_ptt") == 0) {
+		int len = snprintf(reply, sizeof(reply), "%d\n", ptt_state);
+		return client_reply(c, reply, len);
+	}
+	else if (strcmp(line, "\\watch_ptt") == 0) {
+		// Not in rigctld. Used by the TX watchdog of limesdr_linrad
+		c->watching = 1;
+		int len = snprintf(reply, sizeof(reply), "%d\n", ptt_state);
+		return client_reply(c, reply, len);
+	}
+	else if (strcmp(line, "f") == 0 || strcmp(line, "\\get_freq") == 0) {
+		return client_reply(c, "145000000\n", 10);
+	}
+	else if (strcmp(line, "m") == 0 || strcmp(line, "\\get_mode") == 0) {
+		return client_reply(c, "USB\n15000\n", 10);
+	}
+	else if (strcmp(line, "T") == 0 || strcmp(line, "\\set_ptt") == 0) {
+		if (*arg == '\0') {
+			return client_reply(c, "RPRT -1\n", 8);
+		}
+		if (ptt_set(atoi(arg)) < 0) {
+			return client_reply(c, "RPRT -6\n", 8);
+		}
+		fprintf(stderr, "ptt set to %d\n", ptt_state);
+		return client_reply(c, "RPRT 0\n", 7);
+	}
+	else if (strcmp(line, "q") == 0 || strcmp(line, "Q") == 0
+		 || strcmp(line, "\\quit") == 0) {
+		return 1;
+	}
+	else if (line[0] == '\0') {
+		return 0;
+	}
+
+	// Unknown commands get an empty reply, as rigctld_ptt.py did
+	return client_reply(c, "\n", 1);
+}
+
+// Parses every complete line received so far, so that pipelined commands
+// coalesced in a single read are all answered in order
+int client_process_input(struct rigctld_client *c, const struct timespec *rx_time) {
+	size_t start = 0;
+	for (size_t i = 0; i < c->in_len; i++) {
+		if (c->in[i] != '\n') continue;
+
+		char *line = c->in + start;
+		size_t len = i - start;
+		start = i + 1;
+		if (c->discarding) {
+			c->discarding = 0;
+			continue;
+		}
+		if (len && line[len-1] == '\r') len--;
+		line[len] = '\0';
+
+		int is_ptt = line[0] == 'T' || strncmp(line, "\\set_ptt", 8) == 0;
+		int ret = handle_command(c, line);
+		if (ret != 0) return ret;
+
+		struct timespec done;
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		double us = timespec_diff_us(rx_time, &done);
+		latency_update(&cmd_latency, us);
+		if (is_ptt) {
+			latency_update(&ptt_latency, us);
+		}
+		if (verbose || is_ptt) {
+			fprintf(stderr, "fd %d: command latency %.1f us\n", c->fd, us);
+		}
+	}
+
+	memmove(c->in, c->in + start, c->in_len - start);
+	c->in_len -= start;
+	if (c->in_len == sizeof(c->in)) {
+		fprintf(stderr, "fd %d: command line too long, discarding\n", c->fd);
+		c->in_len = 0;
+		c->discarding = 1;
+	}
+
+	return 0;
+}
+
+void client_close(struct rigctld_client *c) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	for (int i = 0; i < RIGCTLD_MAX_CLIENTS; i++) {
+		if (clients[i] == c) clients[i] = NULL;
+	}
+	fprintf(stderr, "Connection from %s closed\n", inet_ntoa(c->addr.sin_addr));
+	free(c);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+		printf("Usage: %s <OPTIONS>\n", argv[0]);
+		printf("  -p <PORT> (default: 4532)\n"
+		       "  -c <GPIO_CHIP> (default: /dev/gpiochip3)\n"
+		       "  -l <GPIO_LINE> (default: 20)\n"
+		       "  -f <GPIO_VALUE_FILE> (use a sysfs value file or a stand-in file instead of GPIO_CHIP)\n"
+		       "  -v <0|1> (log latency of every command, default: 0)\n");
+		return 1;
+	}
+	int i;
+	unsigned int port = RIGCTLD_PORT;
+	const char *chip = "/dev/gpiochip3";
+	unsigned int line = 20; // gpio116 on the BeagleBone Black
+	const char *value_file = NULL;
+	for ( i = 1; i < argc-1; i += 2 ) {
+		if      (strcmp(argv[i], "-p") == 0) { port = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-c") == 0) { chip = argv[i+1]; }
+		else if (strcmp(argv[i], "-l") == 0) { line = atoi(argv[i+1]); }
+		else if (strcmp(argv[i], "-f") == 0) { value_file = argv[i+1]; }
+		else if (strcmp(argv[i], "-v") == 0) { verbose = atoi(argv[i+1]); }
+	}
+
+	if (value_file) {
+		if (gpio_open_file(&ptt_gpio, value_file) < 0) {
+			perror("Could not open GPIO value file");
+			exit(1);
+		}
+	}
+	else if (gpio_open_chardev(&ptt_gpio, chip, line, 0) < 0) {
+		perror("Could not request GPIO line");
+		exit(1);
+	}
+	if (ptt_set(0) < 0) {
+		exit(1);
+	}
+	fprintf(stderr, "ptt set to 0\n");
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, handle_sigusr1);
+
+	int listen_sock;
+	if (open_rigctld_socket(&listen_sock, port) < 0) {
+		perror("Could not open rigctld socket");
+		exit(1);
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1()");
+		exit(1);
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+		perror("epoll_ctl()");
+		exit(1);
+	}
+
+	struct epoll_event events[RIGCTLD_MAX_CLIENTS + 1];
+
+	while (1) {
+		int n = epoll_wait(epoll_fd, events, RIGCTLD_MAX_CLIENTS + 1, -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				perror("epoll_wait()");
+				break;
+			}
+			if (print_stats) {
+				print_stats = 0;
+				latency_print("all", &cmd_latency);
+				latency_print("ptt", &ptt_latency);
+			}
+			continue;
+		}
+
+		for (int j = 0; j < n; j++) {
+			struct rigctld_client *c = events[j].data.ptr;
+
+			if (c == NULL) {
+				struct sockaddr_in addr;
+				socklen_t addrlen = sizeof(addr);
+				int fd;
+				while ((fd = accept4(listen_sock, (struct sockaddr *) &addr, &addrlen,
+						     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					int slot;
+					for (slot = 0; slot < RIGCTLD_MAX_CLIENTS && clients[slot]; slot++);
+					if (slot == RIGCTLD_MAX_CLIENTS) {
+						fprintf(stderr, "Too many clients, rejecting %s\n",
+							inet_ntoa(addr.sin_addr));
+						close(fd);
+						continue;
+					}
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					c = calloc(1, sizeof(*c));
+					if (!c) {
+						perror("Could not allocate client");
+						close(fd);
+						continue;
+					}
+					c->fd = fd;
+					c->addr = addr;
+					struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev) < 0) {
+						perror("epoll_ctl()");
+						close(fd);
+						free(c);
+						continue;
+					}
+					clients[slot] = c;
+					fprintf(stderr, "Connection from %s\n", inet_ntoa(addr.sin_addr));
+					addrlen = sizeof(addr);
+				}
+				continue;
+			}
+
+			int close_client = 0;
+			if (events[j].events & EPOLLIN) {
+				ssize_t len = recv(c->fd, c->in + c->in_len,
+						   sizeof(c->in) - c->in_len, 0);
+				struct timespec rx_time;
+				clock_gettime(CLOCK_MONOTONIC, &rx_time);
+				if (len == 0) {
+					close_client = 1;
+				}
+				else if (len < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+						close_client = 1;
+					}
+				}
+				else {
+					c->in_len += len;
+					if (client_process_input(c, &rx_time) != 0) {
+						close_client = 1;
+					}
+				}
+			}
+			if (events[j].events & (EPOLLERR | EPOLLHUP)) {
+				close_client = 1;
+			}
+			if (!close_client && client_flush(c) < 0) {
+				close_client = 1;
+			}
+			if (close_client) {
+				client_close(c);
+				continue;
+			}
+
+			// Wait for the socket to become writable only while replies are pending
+			struct epoll_event cev = {
+				.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0),
+				.data.ptr = c
+			};
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &cev);
+		}
+	}
+
+	ptt_set(0);
+	gpio_close(&ptt_gpio);
+	return 0;
+}
@@ -0,0 +1,520 @@
+/*
+  ===========================================================================
+
+  rtl_tcp - Server of the RX samples to the clients of rtl_tcp, each with
+  its own frequency and sample rate inside the RX passband.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The server looks like an R820T dongle. The frequency that a client asks
+  for is taken to 0 Hz with an NCO, and the sample rate is obtained with a
+  rational resampler, so any rate whose ratio to the RX rate has a small
+  enough numerator works. The tuner gain does not touch the LimeSDR: it is
+  the gain from the int16 samples to the uint8 ones of that client, and in
+  automatic mode it follows the level. All the clients are served by one
+  thread with epoll, which never blocks on them: each client has a queue
+  of half a second, and what does not fit in it is dropped.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "fir.h"
+#include "rtl_tcp.h"
+
+#define TUNER_R820T 5
+#define MAX_RATE 3.2e6 // Hz, of an RTL-SDR
+#define DEFAULT_RATE 2.048e6 // Hz, that of rtl_tcp
+#define MAX_INTERP 1024
+#define PASSBAND 0.8 // fraction of the output rate
+#define FILTER_ATTENUATION 60.0 // dB
+#define QUEUE_SECONDS 0.5
+#define AGC_TARGET 0.2 // rms of the output, as a fraction of full scale
+#define AGC_TIME 1.0 // s
+#define MAX_GAIN 60.0 // dB
+#define RING_SECONDS 0.25
+#define MIN_RING_BLOCKS 16
+#define LISTENER RTL_TCP_MAX_CLIENTS // epoll tags
+#define EVENT (RTL_TCP_MAX_CLIENTS + 1)
+
+enum {
+	SET_FREQUENCY = 0x01,
+	SET_SAMPLE_RATE = 0x02,
+	SET_GAIN_MODE = 0x03,
+	SET_GAIN = 0x04,
+	SET_GAIN_BY_INDEX = 0x0d
+};
+
+// Tenths of dB, as reported by librtlsdr for the R820T
+static const int r820t_gains[] = {
+	0, 9, 14, 27, 37, 77, 87, 125, 144, 157, 166, 197, 207, 229, 254,
+	280, 297, 328, 338, 364, 372, 386, 402, 421, 434, 439, 445, 480, 496
+};
+#define GAIN_COUNT (sizeof(r820t_gains) / sizeof(r820t_gains[0]))
+
+struct dongle_info {
+	char magic[4];
+	uint32_t tuner_type; // big endian
+	uint32_t gain_count;
+};
+
+int rtl_tcp_init(struct rtl_tcp *s, int port, double sample_rate, double frequency,
+		 int max_block) {
+	memset(s, 0, sizeof(*s));
+	s->listener = s->epoll = s->event = -1;
+	for (int k = 0; k < RTL_TCP_MAX_CLIENTS; k++) s->clients[k].socket = -1;
+	s->sample_rate = sample_rate;
+	s->frequency = frequency;
+	s->max_block = max_block;
+	if (frequency - sample_rate / 2 < 0 || frequency + sample_rate / 2 > UINT32_MAX) {
+		fprintf(stderr, "ERROR: the rtl_tcp frequencies do not fit in 32 bits, "
+			"set the LNB LO frequency with -il\n");
+		return -1;
+	}
+
+	unsigned int blocks = RING_SECONDS * sample_rate / max_block;
+	if (blocks < MIN_RING_BLOCKS) blocks = MIN_RING_BLOCKS;
+	if (block_ring_init(&s->ring, blocks, max_block) < 0) return -1;
+
+	s->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int one = 1;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+	if (s->listener < 0
+	    || setsockopt(s->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+	    || bind(s->listener, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	    || listen(s->listener, RTL_TCP_MAX_CLIENTS) < 0) {
+		perror("Could not listen for rtl_tcp clients");
+		rtl_tcp_free(s);
+		return -1;
+	}
+	s->epoll = epoll_create1(0);
+	s->event = eventfd(0, EFD_NONBLOCK);
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = LISTENER };
+	struct epoll_event wake = { .events = EPOLLIN, .data.u32 = EVENT };
+	if (s->epoll < 0 || s->event < 0
+	    || epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->listener, &ev) < 0
+	    || epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->event, &wake) < 0) {
+		perror("Could not set up rtl_tcp server");
+		rtl_tcp_free(s);
+		return -1;
+	}
+	fprintf(stderr, "rtl_tcp: port %d, %.0f Hz in the middle of the passband\n",
+		port, frequency);
+	return 0;
+}
+
+// Moves the client frequency to 0 Hz. The parts of the client band that
+// fall outside the RX passband wrap around to the other edge
+static void set_nco(struct rtl_tcp *s, struct rtl_tcp_client *c) {
+	c->nco_step = -2 * M_PI * remainder(c->offset, s->sample_rate) / s->sample_rate;
+}
+
+static void free_resampler(struct rtl_tcp_client *c) {
+	free(c->phases);
+	free(c->input_i);
+	free(c->input_q);
+	free(c->output_i);
+	free(c->output_q);
+	free(c->queue);
+	free(c->bytes);
+	c->phases = c->input_i = c->input_q = c->output_i = c->output_q = NULL;
+	c->queue = c->bytes = NULL;
+}
+
+static int set_rate(struct rtl_tcp *s, struct rtl_tcp_client *c, double rate) {
+	long fo = lround(rate), fs = lround(s->sample_rate);
+	long g = fo > 0 && fs > 0 ? fir_gcd(fo, fs) : 0;
+	if (rate > MAX_RATE || !g || fo / g > MAX_INTERP) {
+		fprintf(stderr, "rtl_tcp: %s: unsupported sample rate %.0f Hz\n", c->name, rate);
+		return -1;
+	}
+	free_resampler(c);
+	c->rate = fo;
+	c->interp = fo / g;
+	c->decim = fs / g;
+	c->phase = c->input = 0;
+
+	int proto_taps = 0;
+	float *proto = NULL;
+	if (c->interp == 1 && c->decim == 1) {
+		c->phase_taps = 1;
+	}
+	else {
+		// The passband of the client, up to the edge of the RX one
+		double bandwidth = fo < fs ? fo : fs;
+		double upsampled_rate = c->interp * s->sample_rate;
+		c->phase_taps = fir_padded(fir_kaiser_taps(FILTER_ATTENUATION,
+							   (1 - PASSBAND) / 2 * bandwidth / s->sample_rate));
+		proto_taps = c->interp * c->phase_taps;
+		proto = malloc(proto_taps * sizeof(float));
+		c->phases = malloc(proto_taps * sizeof(float));
+		if (proto && c->phases) {
+			fir_lowpass(proto, proto_taps, (1 + PASSBAND) / 4 * bandwidth / upsampled_rate,
+				    fir_kaiser_beta(FILTER_ATTENUATION));
+			for (int p = 0; p < c->interp; p++) {
+				for (int k = 0; k < c->phase_taps; k++) {
+					c->phases[p * c->phase_taps + c->phase_taps - 1 - k]
+						= c->interp * proto[p + k * c->interp];
+				}
+			}
+		}
+	}
+	free(proto);
+
+	int max_output = (long) s->max_block * c->interp / c->decim + 1;
+	c->queue_size = 2 * (size_t) (QUEUE_SECONDS * fo);
+	c->queue_start = c->queue_count = 0;
+	c->input_i = calloc(c->phase_taps - 1 + s->max_block, sizeof(float));
+	c->input_q = calloc(c->phase_taps - 1 + s->max_block, sizeof(float));
+	c->output_i = malloc(max_output * sizeof(float));
+	c->output_q = malloc(max_output * sizeof(float));
+	c->bytes = malloc(2 * max_output);
+	c->queue = malloc(c->queue_size);
+	if ((proto_taps && !c->phases) || !c->input_i || !c->input_q || !c->output_i
+	    || !c->output_q || !c->bytes || !c->queue) {
+		fprintf(stderr, "Could not allocate rtl_tcp client\n");
+		free_resampler(c);
+		return -1;
+	}
+	set_nco(s, c);
+	fprintf(stderr, "rtl_tcp: %s: %.0f Hz sample rate (%d/%d of the RX), %d taps\n",
+		c->name, rate, c->interp, c->decim, c->interp * c->phase_taps);
+	return 0;
+}
+
+static void close_client(struct rtl_tcp *s, struct rtl_tcp_client *c) {
+	epoll_ctl(s->epoll, EPOLL_CTL_DEL, c->socket, NULL);
+	close(c->socket);
+	c->socket = -1;
+	free_resampler(c);
+	atomic_fetch_sub(&s->client_count, 1);
+	fprintf(stderr, "rtl_tcp: %s disconnected\n", c->name);
+}
+
+static void watch_write(struct rtl_tcp *s, struct rtl_tcp_client *c, int want) {
+	if (c->want_write == want) return;
+	struct epoll_event ev = {
+		.events = EPOLLIN | (want ? EPOLLOUT : 0),
+		.data.u32 = c - s->clients
+	};
+	epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->socket, &ev);
+	c->want_write = want;
+}
+
+// Sends as much of the queue as the socket takes. Returns -1 if the client
+// is gone
+static int flush(struct rtl_tcp *s, struct rtl_tcp_client *c) {
+	while (c->queue_count) {
+		size_t n = c->queue_size - c->queue_start;
+		if (n > c->queue_count) n = c->queue_count;
+		ssize_t ret = send(c->socket, c->queue + c->queue_start, n,
+				   MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		atomic_fetch_add(&s->sent, ret);
+		c->queue_start = (c->queue_start + ret) % c->queue_size;
+		c->queue_count -= ret;
+	}
+	watch_write(s, c, c->queue_count > 0);
+	return 0;
+}
+
+// Appends to the queue whatever fits of n bytes, a whole number of samples
+static void enqueue(struct rtl_tcp *s, struct rtl_tcp_client *c, const uint8_t *bytes,
+		    size_t n) {
+	size_t room = (c->queue_size - c->queue_count) & ~(size_t) 1;
+	if (n > room) {
+		atomic_fetch_add(&s->dropped, n - room);
+		n = room;
+	}
+	size_t end = (c->queue_start + c->queue_count) % c->queue_size;
+	size_t first = c->queue_size - end < n ? c->queue_size - end : n;
+	memcpy(c->queue + end, bytes, first);
+	memcpy(c->queue, bytes + first, n - first);
+	c->queue_count += n;
+}
+
+static void accept_client(struct rtl_tcp *s) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = accept4(s->listener, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK);
+	if (fd < 0) return;
+	struct rtl_tcp_client *c = NULL;
+	for (int k = 0; k < RTL_TCP_MAX_CLIENTS && !c; k++) {
+		if (s->clients[k].socket < 0) c = &s->clients[k];
+	}
+	if (!c) {
+		fprintf(stderr, "rtl_tcp: too many clients, refusing %s\n", inet_ntoa(addr.sin_addr));
+		close(fd);
+		return;
+	}
+	memset(c, 0, sizeof(*c));
+	c->socket = fd;
+	snprintf(c->name, sizeof(c->name), "%s:%d", inet_ntoa(addr.sin_addr),
+		 ntohs(addr.sin_port));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = c - s->clients };
+	if (epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		c->socket = -1;
+		return;
+	}
+	atomic_fetch_add(&s->client_count, 1);
+	atomic_fetch_add(&s->connections, 1);
+	fprintf(stderr, "rtl_tcp: %s connected\n", c->name);
+
+	// Until the client asks for something else, the whole passband, or
+	// as much of it as a dongle could give
+	double rate = s->sample_rate < MAX_RATE ? s->sample_rate : MAX_RATE;
+	if (set_rate(s, c, rate) < 0 && set_rate(s, c, DEFAULT_RATE) < 0) {
+		close_client(s, c);
+		return;
+	}
+	struct dongle_info info = {
+		.magic = "RTL0",
+		.tuner_type = htonl(TUNER_R820T),
+		.gain_count = htonl(GAIN_COUNT)
+	};
+	enqueue(s, c, (const uint8_t *) &info, sizeof(info));
+	if (flush(s, c) < 0) close_client(s, c);
+}
+
+static void run_command(struct rtl_tcp *s, struct rtl_tcp_client *c) {
+	uint32_t param;
+	memcpy(&param, c->command + 1, sizeof(param));
+	param = ntohl(param);
+	switch (c->command[0]) {
+	case SET_FREQUENCY:
+		c->offset = param - s->frequency;
+		set_nco(s, c);
+		break;
+	case SET_SAMPLE_RATE:
+		if (param != c->rate && set_rate(s, c, param) < 0 && !c->queue) close_client(s, c);
+		break;
+	case SET_GAIN_MODE:
+		c->manual_gain = param != 0;
+		break;
+	case SET_GAIN:
+		c->gain = (int32_t) param / 10.0;
+		break;
+	case SET_GAIN_BY_INDEX:
+		if (param < GAIN_COUNT) c->gain = r820t_gains[param] / 10.0;
+		break;
+	}
+}
+
+static void read_commands(struct rtl_tcp *s, struct rtl_tcp_client *c) {
+	while (c->socket >= 0) {
+		ssize_t ret = recv(c->socket, c->command + c->command_count,
+				   sizeof(c->command) - c->command_count, MSG_DONTWAIT);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			close_client(s, c);
+			return;
+		}
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		c->command_count += ret;
+		if (c->command_count == sizeof(c->command)) {
+			c->command_count = 0;
+			run_command(s, c);
+		}
+	}
+}
+
+// To offset binary uint8, as the RTL-SDR. Written so that the compiler
+// vectorizes it
+static void to_uint8(const float *i, const float *q, int n, float gain, uint8_t *out) {
+	for (int j = 0; j < n; j++) {
+		float a = i[j] * gain + 128.0f, b = q[j] * gain + 128.0f;
+		a = a < 0.0f ? 0.0f : a > 255.0f ? 255.0f : a;
+		b = b < 0.0f ? 0.0f : b > 255.0f ? 255.0f : b;
+		out[2*j] = a;
+		out[2*j+1] = b;
+	}
+}
+
+static void client_process(struct rtl_tcp *s, struct rtl_tcp_client *c, const int16_t *samples,
+			   int count) {
+	float *xi = c->input_i + c->phase_taps - 1, *xq = c->input_q + c->phase_taps - 1;
+	double rot_c = cos(c->nco_phase), rot_s = sin(c->nco_phase);
+	double step_c = cos(c->nco_step), step_s = sin(c->nco_step);
+	for (int j = 0; j < count; j++) {
+		float i = samples[2*j] * (1.0f / 32768), q = samples[2*j+1] * (1.0f / 32768);
+		xi[j] = i * rot_c - q * rot_s;
+		xq[j] = i * rot_s + q * rot_c;
+		double t = rot_c * step_c - rot_s * step_s;
+		rot_s = rot_c * step_s + rot_s * step_c;
+		rot_c = t;
+	}
+	c->nco_phase = fmod(c->nco_phase + c->nco_step * count, 2 * M_PI);
+
+	int n = 0;
+	const float *yi = c->output_i, *yq = c->output_q;
+	if (!c->phases) {
+		yi = xi;
+		yq = xq;
+		n = count;
+	}
+	else {
+		while (c->input < count) {
+			const float *h = c->phases + c->phase * c->phase_taps;
+			c->output_i[n] = fir_dot(h, c->input_i + c->input, c->phase_taps);
+			c->output_q[n] = fir_dot(h, c->input_q + c->input, c->phase_taps);
+			n++;
+			c->phase += c->decim;
+			c->input += c->phase / c->interp;
+			c->phase %= c->interp;
+		}
+		c->input -= count;
+		memmove(c->input_i, c->input_i + count, (c->phase_taps - 1) * sizeof(float));
+		memmove(c->input_q, c->input_q + count, (c->phase_taps - 1) * sizeof(float));
+	}
+	if (!n) return;
+
+	if (!c->manual_gain) {
+		float power = 0;
+		for (int j = 0; j < n; j++) power += yi[j] * yi[j] + yq[j] * yq[j];
+		power /= n;
+		float a = n / (AGC_TIME * c->rate);
+		c->power = c->power ? c->power + (a < 1 ? a : 1) * (power - c->power) : power;
+		float gain = c->power > 0 ? 10 * log10f(AGC_TARGET * AGC_TARGET / c->power) : MAX_GAIN;
+		c->gain = gain < MAX_GAIN ? gain : MAX_GAIN;
+	}
+	to_uint8(yi, yq, n, 127.5f * powf(10, c->gain / 20), c->bytes);
+	enqueue(s, c, c->bytes, 2 * n);
+}
+
+static void process_block(struct rtl_tcp *s, const int16_t *samples, int count) {
+	for (int k = 0; k < RTL_TCP_MAX_CLIENTS; k++) {
+		struct rtl_tcp_client *c = &s->clients[k];
+		if (c->socket < 0 || !c->queue) continue;
+		client_process(s, c, samples, count);
+		if (flush(s, c) < 0) close_client(s, c);
+	}
+}
+
+static void *rtl_tcp_thread(void *arg) {
+	struct rtl_tcp *s = arg;
+	struct epoll_event events[RTL_TCP_MAX_CLIENTS + 2];
+	while (!atomic_load(&s->stop)) {
+		int n = epoll_wait(s->epoll, events, RTL_TCP_MAX_CLIENTS + 2, -1);
+		for (int j = 0; j < n; j++) {
+			uint32_t tag = events[j].data.u32;
+			if (tag == LISTENER) {
+				accept_client(s);
+			}
+			else if (tag == EVENT) {
+				uint64_t count;
+				if (read(s->event, &count, sizeof(count)) < 0) continue;
+				while (block_ring_count(&s->ring)) {
+					struct block_ring_block *block = block_ring_read_begin(&s->ring);
+					if (!block) break;
+					process_block(s, block->samples, block->count);
+					block_ring_read_commit(&s->ring);
+				}
+			}
+			else {
+				struct rtl_tcp_client *c = &s->clients[tag];
+				if (c->socket < 0) continue;
+				if (events[j].events & (EPOLLERR | EPOLLHUP)) {
+					close_client(s, c);
+					continue;
+				}
+				if (events[j].events & EPOLLOUT && flush(s, c) < 0) {
+					close_client(s, c);
+					continue;
+				}
+				if (events[j].events & EPOLLIN) read_commands(s, c);
+			}
+		}
+	}
+	return NULL;
+}
+
+int rtl_tcp_start(struct rtl_tcp *s) {
+	if (pthread_create(&s->thread, NULL, rtl_tcp_thread, s) != 0) {
+		fprintf(stderr, "Could not create rtl_tcp thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+void rtl_tcp_push(struct rtl_tcp *s, const int16_t *samples, int count) {
+	if (!atomic_load(&s->client_count)) return;
+	struct block_ring_block *block = block_ring_write_begin(&s->ring);
+	if (!block) return;
+	memcpy(block->samples, samples, 2 * count * sizeof(int16_t));
+	block->count = count;
+	block_ring_write_commit(&s->ring);
+	// It can only fail if the counter is about to overflow, and then the
+	// thread is woken anyway
+	uint64_t one = 1;
+	ssize_t ret = write(s->event, &one, sizeof(one));
+	(void) ret;
+}
+
+void rtl_tcp_print(struct rtl_tcp *s) {
+	fprintf(stderr, "rtl_tcp: clients = %d, connections = %lu, sent = %.1f MB, "
+		"dropped = %.1f MB, blocks dropped = %lu\n",
+		atomic_load(&s->client_count), atomic_load(&s->connections),
+		1e-6 * atomic_load(&s->sent), 1e-6 * atomic_load(&s->dropped),
+		atomic_load(&s->ring.dropped));
+}
+
+void rtl_tcp_stop(struct rtl_tcp *s) {
+	atomic_store(&s->stop, 1);
+	uint64_t one = 1;
+	if (write(s->event, &one, sizeof(one)) < 0) {
+		perror("Could not wake rtl_tcp thread");
+	}
+	pthread_join(s->thread, NULL);
+}
+
+void rtl_tcp_free(struct rtl_tcp *s) {
+	for (int k = 0; k < RTL_TCP_MAX_CLIENTS; k++) {
+		struct rtl_tcp_client *c = &s->clients[k];
+		if (c->socket < 0) continue;
+		close(c->socket);
+		free_resampler(c);
+	}
+	if (s->listener >= 0) close(s->listener);
+	if (s->epoll >= 0) close(s->epoll);
+	if (s->event >= 0) close(s->event);
+	if (s->ring.blocks) block_ring_free(&s->ring);
+}
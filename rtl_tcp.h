@@ -0,0 +1,94 @@
+/*
+  ===========================================================================
+
+  rtl_tcp - Server of the RX samples to the clients of rtl_tcp, each with
+  its own frequency and sample rate inside the RX passband.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef RTL_TCP_H
+#define RTL_TCP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "block_ring.h"
+
+#define RTL_TCP_MAX_CLIENTS 16
+
+struct rtl_tcp_client {
+	int socket; // -1 if the slot is free
+	char name[64]; // address and port, for the log
+	uint8_t command[5];
+	int command_count;
+
+	// Shift of the client frequency to 0 Hz
+	double offset; // Hz from the RX frequency, as asked by the client
+	double nco_step, nco_phase; // radians per sample
+
+	// Polyphase resampler to the client rate, bypassed if interp and decim
+	// are 1
+	double rate;
+	int interp, decim;
+	int phase_taps;
+	float *phases; // interp filters, reversed
+	int phase, input; // of the next output
+	float *input_i, *input_q; // phase_taps - 1 samples of history, then the block
+	float *output_i, *output_q;
+
+	// Gain to uint8, set by the client or following the level
+	int manual_gain;
+	float gain; // dB
+	float power; // of the output, for the automatic gain
+
+	// Bytes waiting to be sent, dropped when full
+	uint8_t *queue, *bytes;
+	size_t queue_size, queue_start, queue_count;
+	int want_write; // EPOLLOUT is set
+};
+
+struct rtl_tcp {
+	double sample_rate;
+	double frequency; // reported to the clients as the RX frequency
+	int max_block; // samples per block
+
+	int listener, epoll, event; // event wakes the thread for a block or to stop
+	struct rtl_tcp_client clients[RTL_TCP_MAX_CLIENTS];
+
+	struct block_ring ring;
+	pthread_t thread;
+	atomic_int stop;
+	atomic_int client_count;
+	atomic_ulong connections, sent, dropped; // bytes sent and dropped
+};
+
+// Listens on port. frequency is the one that the clients tune to for the
+// middle of the RX passband, which must fit in 32 bits
+int rtl_tcp_init(struct rtl_tcp *s, int port, double sample_rate, double frequency,
+		 int max_block);
+int rtl_tcp_start(struct rtl_tcp *s);
+// Queues count interleaved int16 IQ samples, up to max_block, for the
+// clients. The block is dropped if the server is behind
+void rtl_tcp_push(struct rtl_tcp *s, const int16_t *samples, int count);
+void rtl_tcp_print(struct rtl_tcp *s);
+void rtl_tcp_stop(struct rtl_tcp *s);
+void rtl_tcp_free(struct rtl_tcp *s);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+  ===========================================================================
+
+  rx_gap - Reads an RX stream keeping the sample count in step with the
+  device timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  When LimeSuite loses samples, the next read starts at a later
+  timestamp. The missing samples are replaced by zeros, so that every
+  sample after the gap keeps its place in time. As long as there are no
+  gaps, the samples are read directly into the caller's buffer and the
+  only cost is comparing one timestamp per read.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rx_gap.h"
+
+int rx_gap_init(struct rx_gap_reader *r, double sample_rate, int max_read, double max_fill) {
+	memset(r, 0, sizeof(*r));
+	r->sample_rate = sample_rate;
+	r->max_fill = max_fill * sample_rate;
+	r->pending = malloc(2 * max_read * sizeof(int16_t));
+	if (!r->pending) {
+		perror("Could not allocate RX gap buffer");
+		return -1;
+	}
+	atomic_init(&r->gaps, 0);
+	atomic_init(&r->resyncs, 0);
+	atomic_init(&r->lost_samples, 0);
+	atomic_init(&r->max_gap, 0);
+	return 0;
+}
+
+int rx_gap_read(struct rx_gap_reader *r, lms_stream_t *stream, int16_t *buffer, int count,
+		uint64_t *timestamp) {
+	int filled = 0;
+	*timestamp = r->next_timestamp;
+
+	for (int pos = 0; pos < count; ) {
+		int n = count - pos;
+		if (r->zeros) {
+			if ((uint64_t) n > r->zeros) n = r->zeros;
+			memset(buffer + 2 * pos, 0, 2 * n * sizeof(int16_t));
+			r->zeros -= n;
+			filled += n;
+		}
+		else if (r->pending_count) {
+			if (n > r->pending_count) n = r->pending_count;
+			memcpy(buffer + 2 * pos, r->pending + 2 * r->pending_offset,
+			       2 * n * sizeof(int16_t));
+			r->pending_offset += n;
+			r->pending_count -= n;
+		}
+		else {
+			lms_stream_meta_t meta = {0};
+			int timeout_ms = 1000;
+			n = LMS_RecvStream(stream, buffer + 2 * pos, n, &meta, timeout_ms);
+			if (n < 0) {
+				fprintf(stderr, "LMS_RecvStream() : %s\n", LMS_GetLastErrorMessage());
+				return -1;
+			}
+			if (!r->started) {
+				r->started = 1;
+				r->next_timestamp = meta.timestamp;
+				if (pos == 0) *timestamp = meta.timestamp;
+			}
+			int64_t gap = meta.timestamp - r->next_timestamp;
+			if (gap > 0 && (uint64_t) gap <= r->max_fill) {
+				// Fill the gap and then deliver what has just been read
+				memcpy(r->pending, buffer + 2 * pos, 2 * n * sizeof(int16_t));
+				r->pending_count = n;
+				r->pending_offset = 0;
+				r->zeros = gap;
+				atomic_fetch_add(&r->gaps, 1);
+				atomic_fetch_add(&r->lost_samples, gap);
+				if ((uint64_t) gap > atomic_load(&r->max_gap)) atomic_store(&r->max_gap, gap);
+				fprintf(stderr, "RX gap at timestamp %llu: %lld samples (%.3f ms)\n",
+					(unsigned long long) r->next_timestamp, (long long) gap,
+					1e3 * gap / r->sample_rate);
+				continue;
+			}
+			if (gap != 0) {
+				// Too long to fill, or the timestamps went back. The
+				// buffer starts again with these samples, so that it
+				// stays contiguous and *timestamp is that of the first
+				atomic_fetch_add(&r->resyncs, 1);
+				fprintf(stderr, "RX timestamp jump at %llu: %lld samples, resynchronizing\n",
+					(unsigned long long) r->next_timestamp, (long long) gap);
+				memmove(buffer, buffer + 2 * pos, 2 * n * sizeof(int16_t));
+				pos = 0;
+				filled = 0;
+				*timestamp = meta.timestamp;
+				r->next_timestamp = meta.timestamp;
+			}
+		}
+		pos += n;
+		r->next_timestamp += n;
+	}
+	return filled;
+}
+
+void rx_gap_print(struct rx_gap_reader *r, const char *prefix) {
+	fprintf(stderr, "%sRX gaps: %lu, lost = %lu samples, max = %lu samples (%.3f ms), resyncs = %lu\n",
+		prefix, atomic_load(&r->gaps), atomic_load(&r->lost_samples),
+		atomic_load(&r->max_gap), 1e3 * atomic_load(&r->max_gap) / r->sample_rate,
+		atomic_load(&r->resyncs));
+}
+
+void rx_gap_free(struct rx_gap_reader *r) {
+	free(r->pending);
+}
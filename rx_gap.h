@@ -0,0 +1,60 @@
+/*
+  ===========================================================================
+
+  rx_gap - Reads an RX stream keeping the sample count in step with the
+  device timestamps.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef RX_GAP_H
+#define RX_GAP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <lime/LimeSuite.h>
+
+struct rx_gap_reader {
+	double sample_rate;
+	uint64_t max_fill; // longer gaps are not filled
+	int started;
+	uint64_t next_timestamp;
+
+	// Samples read after a gap, delivered once the gap has been filled
+	int16_t *pending;
+	int pending_count, pending_offset;
+	uint64_t zeros; // zeros still to insert before the pending samples
+
+	atomic_ulong gaps, resyncs;
+	atomic_ulong lost_samples, max_gap;
+};
+
+// max_read is the largest count passed to rx_gap_read(). Gaps up to
+// max_fill seconds are filled with zeros
+int rx_gap_init(struct rx_gap_reader *r, double sample_rate, int max_read, double max_fill);
+// Fills buffer with count samples, contiguous in time, and gives the
+// timestamp of the first one. The samples before a jump that is too long
+// to fill are dropped from the buffer. Returns the number of zeros that
+// were inserted in the buffer to replace lost samples, or -1 on error
+int rx_gap_read(struct rx_gap_reader *r, lms_stream_t *stream, int16_t *buffer, int count,
+		uint64_t *timestamp);
+void rx_gap_print(struct rx_gap_reader *r, const char *prefix);
+void rx_gap_free(struct rx_gap_reader *r);
+
+#endif
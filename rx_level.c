@@ -0,0 +1,245 @@
+/*
+  ===========================================================================
+
+  rx_level - Signal level statistics of the RX blocks, and the digital and
+  analog gain control built on them.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The statistics are computed in a single pass over each block, which is
+  still in the cache from the RX read. The digital gain has a fast attack,
+  so that a strong signal never takes the packets to full scale, and a
+  slow release. The analog AGC moves the LimeSDR gain once per second at
+  most, and only when the peak level leaves a window, so that it does not
+  hunt around a signal that is close to a threshold.
+
+  ===========================================================================
+*/
+
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rx_level.h"
+
+#define FULL_SCALE 32768.0
+#define DIGITAL_PEAK 0.5 // the digital gain keeps the peak below -6 dBFS
+#define DIGITAL_RELEASE 3.0 // dB/s
+#define ANALOG_GAIN_RANGE 70.0 // dB spanned by the normalized RX gain
+#define AGC_MAX_STEP 10.0 // dB
+#define AGC_CLIP_STEP 6.0 // dB, at least, when the ADC clips
+#define AGC_HOLD 3 // seconds below the window before raising the gain
+
+static void measure_scalar(const int16_t *samples, int count, struct rx_level_stats *s) {
+	for (int j = 0; j < 2 * count; j += 2) {
+		int i = samples[j], q = samples[j+1];
+		s->energy += (uint64_t) (i * i) + (uint64_t) (q * q);
+		int ai = i < 0 ? -i : i, aq = q < 0 ? -q : q;
+		// Same as the saturating absolute value of the SIMD version
+		if (ai > 32767) ai = 32767;
+		if (aq > 32767) aq = 32767;
+		int a = ai > aq ? ai : aq;
+		if (a > s->peak) s->peak = a;
+		s->clipped += a >= RX_LEVEL_CLIP;
+	}
+}
+
+void rx_level_measure(const int16_t *samples, int count, struct rx_level_stats *s) {
+	int j = 0;
+#ifdef __SSE2__
+	// 4 samples per iteration, each in a 32 bit lane
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i clip = _mm_set1_epi16(RX_LEVEL_CLIP - 1);
+	const __m128i one = _mm_set1_epi32(1);
+	__m128i energy = zero, peak = zero, clipped = zero;
+	for (; j + 4 <= count; j += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (samples + 2 * j));
+		// I^2 + Q^2 fits in 32 bits unsigned
+		__m128i p = _mm_madd_epi16(x, x);
+		energy = _mm_add_epi64(energy, _mm_unpacklo_epi32(p, zero));
+		energy = _mm_add_epi64(energy, _mm_unpackhi_epi32(p, zero));
+		__m128i a = _mm_max_epi16(x, _mm_subs_epi16(zero, x));
+		peak = _mm_max_epi16(peak, a);
+		__m128i unclipped = _mm_cmpeq_epi32(_mm_cmpgt_epi16(a, clip), zero);
+		clipped = _mm_add_epi32(clipped, _mm_andnot_si128(unclipped, one));
+	}
+	uint64_t e[2];
+	_mm_storeu_si128((__m128i *) e, energy);
+	s->energy += e[0] + e[1];
+	int16_t p[8];
+	_mm_storeu_si128((__m128i *) p, peak);
+	for (int k = 0; k < 8; k++) {
+		if (p[k] > s->peak) s->peak = p[k];
+	}
+	uint32_t c[4];
+	_mm_storeu_si128((__m128i *) c, clipped);
+	s->clipped += c[0] + c[1] + c[2] + c[3];
+#endif
+	measure_scalar(samples + 2 * j, count - j, s);
+	s->samples += count;
+}
+
+static double dbfs(double power) {
+	return 10 * log10(power / (FULL_SCALE * FULL_SCALE));
+}
+
+double rx_level_rms_dbfs(const struct rx_level_stats *s) {
+	return s->samples ? dbfs((double) s->energy / s->samples) : -INFINITY;
+}
+
+double rx_level_peak_dbfs(const struct rx_level_stats *s) {
+	return dbfs((double) s->peak * s->peak);
+}
+
+int rx_level_init(struct rx_level *l, double sample_rate, double max_digital_gain,
+		  FILE *log, unsigned int device, double analog_gain) {
+	memset(l, 0, sizeof(*l));
+	if (max_digital_gain < 0 || max_digital_gain > RX_LEVEL_MAX_DIGITAL_GAIN) {
+		fprintf(stderr, "ERROR: digital gain must be between 0 and %.0f dB\n",
+			RX_LEVEL_MAX_DIGITAL_GAIN);
+		return -1;
+	}
+	l->sample_rate = sample_rate;
+	l->log = log;
+	l->device = device;
+	l->max_gain = pow(10, max_digital_gain / 20);
+	l->gain = 1;
+	l->release = pow(10, DIGITAL_RELEASE / 20 / sample_rate);
+	l->current_min_gain = 1;
+	l->second_gain = 1;
+	l->analog_gain = analog_gain;
+	pthread_mutex_init(&l->lock, NULL);
+	return 0;
+}
+
+static void end_second(struct rx_level *l) {
+	pthread_mutex_lock(&l->lock);
+	l->second = l->current;
+	l->second_gain = l->current_min_gain;
+	l->seconds++;
+	double analog_gain = l->analog_gain;
+	pthread_mutex_unlock(&l->lock);
+
+	if (l->log) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		fprintf(l->log, "%.3f,%u,%.1f,%.1f,%lu,%.3f,%.1f\n",
+			t.tv_sec + 1e-9 * t.tv_nsec, l->device,
+			rx_level_rms_dbfs(&l->current), rx_level_peak_dbfs(&l->current),
+			l->current.clipped, analog_gain, 20 * log10(l->current_min_gain));
+		fflush(l->log);
+	}
+	memset(&l->current, 0, sizeof(l->current));
+	l->current_min_gain = l->gain;
+}
+
+int rx_level_process(struct rx_level *l, const int16_t *samples, int count) {
+	struct rx_level_stats block = {0};
+	rx_level_measure(samples, count, &block);
+	l->current.energy += block.energy;
+	l->current.samples += block.samples;
+	l->current.clipped += block.clipped;
+	if (block.peak > l->current.peak) l->current.peak = block.peak;
+
+	if (l->max_gain > 1) {
+		double gain = l->gain * pow(l->release, count);
+		if (gain > l->max_gain) gain = l->max_gain;
+		if (block.peak * gain > DIGITAL_PEAK * FULL_SCALE) {
+			gain = DIGITAL_PEAK * FULL_SCALE / block.peak;
+		}
+		if (gain < 1) gain = 1;
+		l->gain = gain;
+		if (gain < l->current_min_gain) l->current_min_gain = gain;
+	}
+
+	if (l->current.samples >= l->sample_rate) end_second(l);
+	return lrint(l->gain * RX_LEVEL_GAIN_ONE);
+}
+
+void rx_level_apply(int16_t *out, const int16_t *in, int count, int gain) {
+	// Written so that the compiler vectorizes it
+	for (int j = 0; j < 2 * count; j++) {
+		int x = (in[j] * gain + RX_LEVEL_GAIN_ONE / 2) >> 8;
+		if (x > RX_LEVEL_CLIP) x = RX_LEVEL_CLIP;
+		if (x < -32768) x = -32768;
+		out[j] = x & ~0xf;
+	}
+}
+
+int rx_level_agc(struct rx_level *l, double target, double hysteresis, double *gain) {
+	pthread_mutex_lock(&l->lock);
+	if (l->seconds <= l->agc_second) {
+		pthread_mutex_unlock(&l->lock);
+		return 0;
+	}
+	l->agc_second = l->seconds;
+	struct rx_level_stats s = l->second;
+	double analog_gain = l->analog_gain;
+	pthread_mutex_unlock(&l->lock);
+
+	double peak = rx_level_peak_dbfs(&s);
+	// Aim at the middle of the window
+	double change = target - hysteresis / 2 - peak;
+	if (s.clipped) {
+		if (change > -AGC_CLIP_STEP) change = -AGC_CLIP_STEP;
+	}
+	else if (peak < target - hysteresis) {
+		if (++l->agc_low < AGC_HOLD) return 0;
+	}
+	else if (peak <= target) {
+		l->agc_low = 0;
+		return 0;
+	}
+	l->agc_low = 0;
+	if (change > AGC_MAX_STEP) change = AGC_MAX_STEP;
+	if (change < -AGC_MAX_STEP) change = -AGC_MAX_STEP;
+
+	double new_gain = analog_gain + change / ANALOG_GAIN_RANGE;
+	if (new_gain < 0) new_gain = 0;
+	if (new_gain > 1) new_gain = 1;
+	if (new_gain == analog_gain) return 0;
+
+	pthread_mutex_lock(&l->lock);
+	l->analog_gain = new_gain;
+	// The next second is measured partly with the old gain
+	l->agc_second = l->seconds + 1;
+	pthread_mutex_unlock(&l->lock);
+	*gain = new_gain;
+	return 1;
+}
+
+void rx_level_print(struct rx_level *l, const char *prefix) {
+	pthread_mutex_lock(&l->lock);
+	if (!l->seconds) {
+		pthread_mutex_unlock(&l->lock);
+		return;
+	}
+	struct rx_level_stats s = l->second;
+	double digital_gain = l->second_gain, analog_gain = l->analog_gain;
+	pthread_mutex_unlock(&l->lock);
+	fprintf(stderr, "%slevel: rms = %.1f dBFS, peak = %.1f dBFS, clipped = %lu, "
+		"gain = %.3f, digital gain = %.1f dB\n",
+		prefix, rx_level_rms_dbfs(&s), rx_level_peak_dbfs(&s), s.clipped,
+		analog_gain, 20 * log10(digital_gain));
+}
+
+void rx_level_free(struct rx_level *l) {
+	pthread_mutex_destroy(&l->lock);
+}
@@ -0,0 +1,86 @@
+/*
+  ===========================================================================
+
+  rx_level - Signal level statistics of the RX blocks, and the digital and
+  analog gain control built on them.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef RX_LEVEL_H
+#define RX_LEVEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// 12 bit ADC, left justified in 16 bits
+#define RX_LEVEL_CLIP 0x7ff0
+#define RX_LEVEL_GAIN_ONE 256 // digital gains are Q8
+#define RX_LEVEL_MAX_DIGITAL_GAIN 42.0 // dB, keeps the Q8 products in 31 bits
+
+struct rx_level_stats {
+	uint64_t energy; // sum of I^2 + Q^2
+	unsigned long samples;
+	int peak; // largest |I| or |Q|
+	unsigned long clipped; // samples with I or Q at full scale
+};
+
+struct rx_level {
+	double sample_rate;
+	FILE *log;
+	unsigned int device;
+
+	// Digital gain, used only by the feed thread
+	double max_gain, gain; // linear
+	double release; // per sample
+	struct rx_level_stats current;
+	double current_min_gain;
+
+	pthread_mutex_t lock;
+	// Protected by lock
+	struct rx_level_stats second; // last complete second
+	double second_gain; // smallest digital gain in it
+	unsigned long seconds;
+	double analog_gain; // normalized
+
+	// Analog AGC, used only by the thread that calls rx_level_agc()
+	unsigned long agc_second;
+	int agc_low;
+};
+
+// Accumulates the statistics of count samples in s
+void rx_level_measure(const int16_t *samples, int count, struct rx_level_stats *s);
+double rx_level_rms_dbfs(const struct rx_level_stats *s);
+double rx_level_peak_dbfs(const struct rx_level_stats *s);
+
+// max_digital_gain is in dB, 0 for no digital gain. If log is not NULL a
+// line with the statistics is written to it each second
+int rx_level_init(struct rx_level *l, double sample_rate, double max_digital_gain,
+		  FILE *log, unsigned int device, double analog_gain);
+// Accounts a block of samples and returns the digital gain to apply to it
+int rx_level_process(struct rx_level *l, const int16_t *samples, int count);
+// Copies count samples applying a digital gain, keeping the 12 bit format
+void rx_level_apply(int16_t *out, const int16_t *in, int count, int gain);
+// Slow AGC on the analog gain, keeping the peak level between target and
+// target - hysteresis dBFS. Returns 1 and sets gain if it has to change
+int rx_level_agc(struct rx_level *l, double target, double hysteresis, double *gain);
+void rx_level_print(struct rx_level *l, const char *prefix);
+void rx_level_free(struct rx_level *l);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+  ===========================================================================
+
+  sample_ring - Ring of float IQ samples indexed by their timestamp, for
+  the captures of the measurement threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample_ring.h"
+
+int sample_ring_init(struct sample_ring *r, int min_size) {
+	memset(r, 0, sizeof(*r));
+	r->size = 1;
+	while (r->size < min_size) r->size <<= 1;
+	r->samples = calloc(2 * r->size, sizeof(float));
+	return r->samples ? 0 : -1;
+}
+
+void sample_ring_write(struct sample_ring *r, const float *samples, int count,
+		       uint64_t timestamp) {
+	uint64_t mask = r->size - 1;
+	if (timestamp != r->end) {
+		if (timestamp > r->end && timestamp - r->end < (uint64_t) r->size) {
+			// Nothing was written in between
+			for (uint64_t t = r->end; t < timestamp; t++) {
+				r->samples[2 * (t & mask)] = r->samples[2 * (t & mask) + 1] = 0;
+			}
+		}
+		else {
+			r->start = timestamp;
+		}
+	}
+	for (int j = 0; j < count; j++) {
+		uint64_t k = (timestamp + j) & mask;
+		r->samples[2*k] = samples[2*j];
+		r->samples[2*k+1] = samples[2*j+1];
+	}
+	r->end = timestamp + count;
+	if (r->end - r->start > (uint64_t) r->size) r->start = r->end - r->size;
+}
+
+void sample_ring_read(const struct sample_ring *r, float *samples, int count,
+		      uint64_t timestamp) {
+	uint64_t mask = r->size - 1;
+	for (int j = 0; j < count; j++) {
+		uint64_t k = (timestamp + j) & mask;
+		samples[2*j] = r->samples[2*k];
+		samples[2*j+1] = r->samples[2*k+1];
+	}
+}
+
+void sample_ring_free(struct sample_ring *r) {
+	free(r->samples);
+	r->samples = NULL;
+}
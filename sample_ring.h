@@ -0,0 +1,48 @@
+/*
+  ===========================================================================
+
+  sample_ring - Ring of float IQ samples indexed by their timestamp, for
+  the captures of the measurement threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdint.h>
+
+struct sample_ring {
+	float *samples; // interleaved
+	int size; // power of 2
+	uint64_t start, end; // timestamps held
+};
+
+// Allocates a ring of at least min_size samples
+int sample_ring_init(struct sample_ring *r, int min_size);
+// Writes count samples at timestamp. A gap after the last samples is
+// filled with zeros if it fits in the ring, otherwise the ring starts
+// again at timestamp
+void sample_ring_write(struct sample_ring *r, const float *samples, int count,
+		       uint64_t timestamp);
+// Reads count samples at timestamp, which must be held
+void sample_ring_read(const struct sample_ring *r, float *samples, int count,
+		      uint64_t timestamp);
+void sample_ring_free(struct sample_ring *r);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+  ===========================================================================
+
+  ssb_mod - SSB and CW modulator that turns PCM audio into int16 IQ samples
+  at the LimeSDR sample rate.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  This does the same as the band-pass filter, Hilbert transform, rational
+  resampler and signal source of eshail_300k.grc. The band-pass filter and
+  the Hilbert transform are a single complex filter, a lowpass shifted to
+  the centre of the audio band, whose output is the analytic signal. The
+  resampler is polyphase, so that only the output samples are computed.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fir.h"
+#include "ssb_mod.h"
+
+#define AUDIO_LOW 200.0 // Hz, -6 dB edges of the audio band
+#define AUDIO_HIGH 3100.0
+#define BPF_TAPS 255
+#define BPF_ATTENUATION 60.0 // dB, opposite sideband
+#define PHASE_TAPS 16
+#define RESAMPLER_ATTENUATION 80.0 // dB
+#define CW_THRESHOLD 0.03 // about -30 dBFS of audio keys the carrier
+#define CW_HANG 0.01 // s
+#define CW_RISE 0.005 // s
+
+int ssb_mod_init(struct ssb_mod *m, enum ssb_mod_mode mode, double audio_rate,
+		 double sample_rate, double offset, double level) {
+	memset(m, 0, sizeof(*m));
+	m->mode = mode;
+	m->scale = 32767 * pow(10, level / 20);
+
+	long fa = lround(audio_rate), fs = lround(sample_rate);
+	long g = fa > 0 && fs > 0 ? fir_gcd(fs, fa) : 0;
+	if (!g || fs / g > SSB_MOD_MAX_INTERP) {
+		fprintf(stderr, "ERROR: the sample rate must be a simple multiple of the audio rate\n");
+		return -1;
+	}
+	m->interp = fs / g;
+	m->decim = fa / g;
+
+	m->bpf_taps = fir_padded(BPF_TAPS);
+	m->phase_taps = fir_padded(PHASE_TAPS);
+	m->max_output = (long) SSB_MOD_MAX_AUDIO * m->interp / m->decim + 1;
+	int proto_taps = m->interp * m->phase_taps;
+	float *proto = malloc(proto_taps * sizeof(float));
+	m->bpf_i = calloc(m->bpf_taps, sizeof(float));
+	m->bpf_q = calloc(m->bpf_taps, sizeof(float));
+	m->audio = calloc(m->bpf_taps - 1 + SSB_MOD_MAX_AUDIO, sizeof(float));
+	m->phases = malloc(proto_taps * sizeof(float));
+	m->baseband_i = calloc(m->phase_taps - 1 + SSB_MOD_MAX_AUDIO, sizeof(float));
+	m->baseband_q = calloc(m->phase_taps - 1 + SSB_MOD_MAX_AUDIO, sizeof(float));
+	m->nco = malloc(2 * m->max_output * sizeof(float));
+	m->out_i = malloc(m->max_output * sizeof(float));
+	m->out_q = malloc(m->max_output * sizeof(float));
+	if (!proto || !m->bpf_i || !m->bpf_q || !m->audio || !m->phases || !m->baseband_i
+	    || !m->baseband_q || !m->nco || !m->out_i || !m->out_q) {
+		fprintf(stderr, "Could not allocate SSB modulator\n");
+		free(proto);
+		ssb_mod_free(m);
+		return -1;
+	}
+
+	// The lowpass has twice the gain, as the positive frequencies of a
+	// real signal only carry half of its amplitude
+	float lowpass[BPF_TAPS];
+	double centre = (AUDIO_HIGH + AUDIO_LOW) / 2;
+	fir_lowpass(lowpass, BPF_TAPS, (AUDIO_HIGH - AUDIO_LOW) / 2 / audio_rate,
+		    fir_kaiser_beta(BPF_ATTENUATION));
+	for (int j = 0; j < BPF_TAPS; j++) {
+		double w = 2 * M_PI * centre / audio_rate * (j - (BPF_TAPS - 1) / 2.0);
+		int k = m->bpf_taps - 1 - j;
+		m->bpf_i[k] = 2 * lowpass[j] * cos(w);
+		m->bpf_q[k] = 2 * lowpass[j] * sin(w) * (mode == SSB_MOD_LSB ? -1 : 1);
+	}
+
+	int rate_ratio = m->interp > m->decim ? m->interp : m->decim;
+	fir_lowpass(proto, proto_taps, 0.5 / rate_ratio,
+		    fir_kaiser_beta(RESAMPLER_ATTENUATION));
+	for (int p = 0; p < m->interp; p++) {
+		for (int k = 0; k < m->phase_taps; k++) {
+			m->phases[p * m->phase_taps + m->phase_taps - 1 - k] =
+				m->interp * proto[p + k * m->interp];
+		}
+	}
+	free(proto);
+
+	m->nco_step = 2 * M_PI * offset / sample_rate;
+	for (int k = 0; k < m->max_output; k++) {
+		m->nco[2*k] = cos(m->nco_step * k);
+		m->nco[2*k+1] = sin(m->nco_step * k);
+	}
+
+	m->envelope_decay = exp(-1 / (CW_HANG * audio_rate));
+	m->key_step = 1 / (CW_RISE * audio_rate);
+	return 0;
+}
+
+int ssb_mod_max_output(struct ssb_mod *m) {
+	return m->max_output;
+}
+
+// Baseband of the keyed carrier, with raised cosine edges
+static void cw_key(struct ssb_mod *m, const float *audio, int count, float *out_i, float *out_q) {
+	for (int j = 0; j < count; j++) {
+		float a = fabsf(audio[j]);
+		m->envelope *= m->envelope_decay;
+		if (a > m->envelope) m->envelope = a;
+		if (m->envelope > CW_THRESHOLD) {
+			m->key = m->key + m->key_step < 1 ? m->key + m->key_step : 1;
+		}
+		else {
+			m->key = m->key - m->key_step > 0 ? m->key - m->key_step : 0;
+		}
+		out_i[j] = 0.5f - 0.5f * cosf(M_PI * m->key);
+		out_q[j] = 0;
+	}
+}
+
+int ssb_mod_process(struct ssb_mod *m, const int16_t *audio, int count, int16_t *out) {
+	float *x = m->audio + m->bpf_taps - 1;
+	float *bi = m->baseband_i + m->phase_taps - 1;
+	float *bq = m->baseband_q + m->phase_taps - 1;
+	for (int j = 0; j < count; j++) x[j] = audio[j] * (1.0f / 32768);
+
+	if (m->mode == SSB_MOD_CW) {
+		cw_key(m, x, count, bi, bq);
+	}
+	else {
+		for (int j = 0; j < count; j++) {
+			bi[j] = fir_dot(m->bpf_i, m->audio + j, m->bpf_taps);
+			bq[j] = fir_dot(m->bpf_q, m->audio + j, m->bpf_taps);
+		}
+	}
+	memmove(m->audio, m->audio + count, (m->bpf_taps - 1) * sizeof(float));
+
+	int n = 0;
+	while (m->input < count) {
+		const float *h = m->phases + m->phase * m->phase_taps;
+		m->out_i[n] = fir_dot(h, m->baseband_i + m->input, m->phase_taps);
+		m->out_q[n] = fir_dot(h, m->baseband_q + m->input, m->phase_taps);
+		n++;
+		m->phase += m->decim;
+		m->input += m->phase / m->interp;
+		m->phase %= m->interp;
+	}
+	m->input -= count;
+	memmove(m->baseband_i, m->baseband_i + count, (m->phase_taps - 1) * sizeof(float));
+	memmove(m->baseband_q, m->baseband_q + count, (m->phase_taps - 1) * sizeof(float));
+
+	// Frequency shift and conversion to int16, written so that the
+	// compiler vectorizes it
+	float rot_c = m->scale * cos(m->nco_phase), rot_s = m->scale * sin(m->nco_phase);
+	for (int k = 0; k < n; k++) {
+		float c = rot_c * m->nco[2*k] - rot_s * m->nco[2*k+1];
+		float s = rot_c * m->nco[2*k+1] + rot_s * m->nco[2*k];
+		float yi = m->out_i[k] * c - m->out_q[k] * s;
+		float yq = m->out_i[k] * s + m->out_q[k] * c;
+		yi = yi > 32767 ? 32767 : yi < -32767 ? -32767 : yi;
+		yq = yq > 32767 ? 32767 : yq < -32767 ? -32767 : yq;
+		out[2*k] = yi;
+		out[2*k+1] = yq;
+	}
+	m->nco_phase = fmod(m->nco_phase + m->nco_step * n, 2 * M_PI);
+	return n;
+}
+
+void ssb_mod_free(struct ssb_mod *m) {
+	free(m->bpf_i);
+	free(m->bpf_q);
+	free(m->audio);
+	free(m->phases);
+	free(m->baseband_i);
+	free(m->baseband_q);
+	free(m->nco);
+	free(m->out_i);
+	free(m->out_q);
+}
@@ -0,0 +1,81 @@
+/*
+  ===========================================================================
+
+  ssb_mod - SSB and CW modulator that turns PCM audio into int16 IQ samples
+  at the LimeSDR sample rate.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef SSB_MOD_H
+#define SSB_MOD_H
+
+#include <stdint.h>
+
+#define SSB_MOD_MAX_AUDIO 1024 // samples per call to ssb_mod_process()
+#define SSB_MOD_MAX_INTERP 1024
+
+enum ssb_mod_mode {
+	SSB_MOD_USB,
+	SSB_MOD_LSB,
+	SSB_MOD_CW, // carrier keyed while there is audio
+	SSB_MOD_MODES
+};
+
+struct ssb_mod {
+	enum ssb_mod_mode mode;
+	float scale; // full scale audio to int16
+
+	// Complex band-pass filter at the audio rate, which only passes the
+	// positive (USB) or negative (LSB) audio frequencies. The taps are
+	// reversed, and padded at the start to a multiple of FIR_VECTOR
+	int bpf_taps;
+	float *bpf_i, *bpf_q;
+	float *audio; // bpf_taps - 1 samples of history, then the block
+
+	// Polyphase resampler from the audio rate to the sample rate
+	int interp, decim;
+	int phase_taps;
+	float *phases; // interp filters, reversed
+	int phase, input; // of the next output sample
+	float *baseband_i, *baseband_q; // phase_taps - 1 samples of history, then the block
+
+	// Frequency shift of the output
+	double nco_step, nco_phase; // radians per sample
+	float *nco; // exp(j * nco_step * k), interleaved
+	float *out_i, *out_q;
+	int max_output;
+
+	// CW keying
+	float envelope, envelope_decay;
+	float key, key_step; // 0 to 1, before shaping
+};
+
+// offset is the frequency of the zero audio frequency in the output, and
+// level the output level for full scale audio, in dBFS. The sample rate
+// must be a simple rational multiple of the audio rate
+int ssb_mod_init(struct ssb_mod *m, enum ssb_mod_mode mode, double audio_rate,
+		 double sample_rate, double offset, double level);
+// Largest number of IQ samples returned by ssb_mod_process()
+int ssb_mod_max_output(struct ssb_mod *m);
+// Modulates count audio samples, up to SSB_MOD_MAX_AUDIO, into interleaved
+// int16 IQ samples. Returns the number of IQ samples
+int ssb_mod_process(struct ssb_mod *m, const int16_t *audio, int count, int16_t *out);
+void ssb_mod_free(struct ssb_mod *m);
+
+#endif
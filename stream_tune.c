@@ -0,0 +1,224 @@
+/*
+  ===========================================================================
+
+  stream_tune - Search of the LimeSuite stream parameters that give the
+  lowest latency without overruns or underruns on this host, and the file
+  where they are kept for each host and sample rate.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The trials are run by the caller, which streams with the parameters as
+  it does normally, so that the whole processing chain loads the host. The
+  latency is measured end to end when the caller can, or else estimated:
+  the time a sample waits in the RX FIFO and in the read block, plus the
+  time it waits in the TX FIFO. For each read size and
+  throughputVsLatency, the FIFOs grow until there are no errors, and the
+  candidate with the lowest latency wins. Larger reads are only tried
+  while they can still beat it. The FIFOs of the winner grow again if it
+  has errors in a longer trial.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "stream_tune.h"
+
+// Candidates, in increasing order of latency
+static const int block_list[] = {1, 2, 4, 8, STREAM_TUNE_MAX_BLOCK};
+static const double throughput_list[] = {0.25, 0.5, 0.75, 1.0};
+static const int fifo_list[] = {4, 10, 20, 50, 100, 200, 500, 1000, 2048};
+
+#define COUNT(x) (sizeof(x) / sizeof((x)[0]))
+// The winner is confirmed with a longer trial, as a short one can be clean
+// by luck
+#define CONFIRM 4
+#define MAX_LINE 256
+
+// The measured latency if there is one, or else the estimate
+static double trial_latency(const struct stream_tune_result *r) {
+	return isnan(r->latency) ? r->rx_latency + r->tx_latency : r->latency;
+}
+
+static void print_trial(const char *what, const struct stream_tune_params *p,
+			const struct stream_tune_result *r) {
+	fprintf(stderr, "Stream %s: read %d, throughput %.2f, FIFO RX %d TX %d packets: "
+		"RX errors %lu, TX errors %lu, latency RX %.1f ms TX %.1f ms",
+		what, p->block_packets, p->throughput, p->rx_fifo, p->tx_fifo,
+		r->rx_errors, r->tx_errors, 1e3 * r->rx_latency, 1e3 * r->tx_latency);
+	if (!isnan(r->latency)) fprintf(stderr, ", measured %.1f ms", 1e3 * r->latency);
+	fprintf(stderr, "\n");
+}
+
+// Next FIFO size in the list, or the same at the end
+static int grow_fifo(int fifo) {
+	for (unsigned f = 0; f < COUNT(fifo_list); f++) {
+		if (fifo_list[f] > fifo) return fifo_list[f];
+	}
+	return fifo;
+}
+
+int stream_tune_run(stream_tune_trial trial, void *arg, double sample_rate,
+		    int packet_samples, int block_packets, double seconds,
+		    struct stream_tune_params *best) {
+	int found = 0;
+	unsigned long best_errors = ULONG_MAX;
+	// A read size given by the caller is the only candidate
+	const int *blocks = block_packets ? &block_packets : block_list;
+	unsigned block_count = block_packets ? 1 : COUNT(block_list);
+
+	memset(best, 0, sizeof(*best));
+	best->latency = INFINITY;
+	for (unsigned b = 0; b < block_count; b++) {
+		struct stream_tune_params p = { .block_packets = blocks[b] };
+		if (found && p.block_packets * packet_samples / sample_rate >= best->latency) break;
+
+		for (unsigned t = 0; t < COUNT(throughput_list); t++) {
+			int rx_fifo = 0, tx_fifo = 0;
+			struct stream_tune_result r;
+			p.throughput = throughput_list[t];
+
+			// Once a direction has no errors, its FIFO stays put while
+			// the other one grows
+			for (unsigned f = 0; f < COUNT(fifo_list) && !(rx_fifo && tx_fifo); f++) {
+				int fifo = fifo_list[f];
+				p.rx_fifo = rx_fifo ? rx_fifo
+					: fifo < 2 * p.block_packets ? 2 * p.block_packets : fifo;
+				p.tx_fifo = tx_fifo ? tx_fifo : fifo;
+				if (trial(arg, &p, seconds, &r) < 0) return -1;
+				print_trial("trial", &p, &r);
+				if (!rx_fifo && !r.rx_errors) rx_fifo = p.rx_fifo;
+				if (!tx_fifo && !r.tx_errors) tx_fifo = p.tx_fifo;
+			}
+
+			// The last trial had the final FIFO sizes
+			if (rx_fifo && tx_fifo) {
+				if (!found || trial_latency(&r) < best->latency) {
+					*best = p;
+					best->latency = trial_latency(&r);
+				}
+				found = 1;
+			}
+			else if (!found && r.rx_errors + r.tx_errors < best_errors) {
+				// Nothing clean yet: keep the largest FIFOs with the fewest
+				// errors
+				best_errors = r.rx_errors + r.tx_errors;
+				*best = p;
+				best->rx_fifo = rx_fifo ? rx_fifo : fifo_list[COUNT(fifo_list) - 1];
+				best->tx_fifo = tx_fifo ? tx_fifo : fifo_list[COUNT(fifo_list) - 1];
+				best->latency = trial_latency(&r);
+			}
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "WARNING: no stream parameters without errors, "
+			"keeping the ones with the fewest\n");
+		return 0;
+	}
+
+	for (;;) {
+		struct stream_tune_result r;
+		if (trial(arg, best, CONFIRM * seconds, &r) < 0) return -1;
+		print_trial("confirmation", best, &r);
+		best->latency = trial_latency(&r);
+		int rx_fifo = r.rx_errors ? grow_fifo(best->rx_fifo) : best->rx_fifo;
+		int tx_fifo = r.tx_errors ? grow_fifo(best->tx_fifo) : best->tx_fifo;
+		if (rx_fifo == best->rx_fifo && tx_fifo == best->tx_fifo) break;
+		best->rx_fifo = rx_fifo;
+		best->tx_fifo = tx_fifo;
+	}
+	return 0;
+}
+
+static int same_entry(const char *line, const char *host, double sample_rate) {
+	char h[MAX_LINE];
+	double rate;
+	return line[0] != '#' && sscanf(line, "%255s %lf", h, &rate) == 2
+		&& strcmp(h, host) == 0 && fabs(rate - sample_rate) < 0.5;
+}
+
+static void get_host(char *host, size_t size) {
+	if (gethostname(host, size) < 0) snprintf(host, size, "localhost");
+	host[size - 1] = 0;
+}
+
+int stream_tune_load(const char *path, double sample_rate, struct stream_tune_params *params) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT) return 0;
+		perror("Could not open stream configuration");
+		return -1;
+	}
+	char host[MAX_LINE], line[MAX_LINE];
+	get_host(host, sizeof(host));
+	int found = 0;
+	while (!found && fgets(line, sizeof(line), f)) {
+		char h[MAX_LINE];
+		double rate, latency_ms;
+		struct stream_tune_params p;
+		if (!same_entry(line, host, sample_rate)
+		    || sscanf(line, "%255s %lf %d %d %d %lf %lf", h, &rate, &p.block_packets,
+			      &p.rx_fifo, &p.tx_fifo, &p.throughput, &latency_ms) != 7) {
+			continue;
+		}
+		if (p.block_packets < 1 || p.rx_fifo < 1 || p.tx_fifo < 1
+		    || p.throughput < 0 || p.throughput > 1) {
+			fprintf(stderr, "ERROR: invalid stream configuration in %s\n", path);
+			fclose(f);
+			return -1;
+		}
+		p.latency = 1e-3 * latency_ms;
+		*params = p;
+		found = 1;
+	}
+	fclose(f);
+	return found;
+}
+
+// Replaces the file in one step, so that it is never left half written
+int stream_tune_save(const char *path, double sample_rate, const struct stream_tune_params *params) {
+	char host[MAX_LINE], line[MAX_LINE], tmp[4096];
+	get_host(host, sizeof(host));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *out = fopen(tmp, "w");
+	if (!out) {
+		perror("Could not write stream configuration");
+		return -1;
+	}
+	fprintf(out, "# host sample_rate packets_per_read rx_fifo_packets tx_fifo_packets "
+		"throughput_vs_latency latency_ms\n");
+	FILE *in = fopen(path, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (line[0] == '#' || same_entry(line, host, sample_rate)) continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %.0f %d %d %d %.2f %.1f\n", host, sample_rate, params->block_packets,
+		params->rx_fifo, params->tx_fifo, params->throughput, 1e3 * params->latency);
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		perror("Could not write stream configuration");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+  ===========================================================================
+
+  stream_tune - Search of the LimeSuite stream parameters that give the
+  lowest latency without overruns or underruns on this host, and the file
+  where they are kept for each host and sample rate.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef STREAM_TUNE_H
+#define STREAM_TUNE_H
+
+// Largest read size that the search tries, in packets
+#define STREAM_TUNE_MAX_BLOCK 16
+// Errors in the first seconds of a trial, while the streams start, are not
+// counted
+#define STREAM_TUNE_WARMUP 0.5
+
+struct stream_tune_params {
+	int block_packets; // packets per RX read
+	int rx_fifo, tx_fifo; // packets
+	double throughput; // throughputVsLatency of both streams
+	double latency; // s, estimated when tuned
+};
+
+struct stream_tune_result {
+	unsigned long rx_errors, tx_errors;
+	// s, estimated from the FIFO levels and the read size
+	double rx_latency, tx_latency;
+	double latency; // s, measured end to end, or NAN if it was not
+};
+
+// Streams with params for STREAM_TUNE_WARMUP plus seconds and fills result.
+// Returns -1 on error
+typedef int (*stream_tune_trial)(void *arg, const struct stream_tune_params *params,
+				 double seconds, struct stream_tune_result *result);
+
+// Fills params with the line of path for this host and sample_rate.
+// Returns 1 if there is one, 0 if not and -1 on error
+int stream_tune_load(const char *path, double sample_rate, struct stream_tune_params *params);
+// Replaces the line of path for this host and sample_rate, keeping the rest
+int stream_tune_save(const char *path, double sample_rate, const struct stream_tune_params *params);
+// Runs trial with each candidate for seconds and gives the best one.
+// packet_samples is the size of a packet. block_packets is the read size,
+// or 0 to search it too. Returns -1 on error
+int stream_tune_run(stream_tune_trial trial, void *arg, double sample_rate,
+		    int packet_samples, int block_packets, double seconds,
+		    struct stream_tune_params *best);
+
+#endif
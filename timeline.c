@@ -0,0 +1,126 @@
+/*
+  ===========================================================================
+
+  timeline - Relation between the sample timestamps of a LimeSDR and the
+  host clock, used to put several devices on a common timeline.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The time at which the host gets a sample is the time at which it was
+  taken plus a latency that is never smaller than that of the USB
+  transfers. Keeping, for each second, the sample that arrived with the
+  smallest latency and fitting a line through the last minute of these
+  gives a relation between timestamps and host time that is free of the
+  scheduling jitter.
+
+  ===========================================================================
+*/
+
+#include <string.h>
+
+#include "timeline.h"
+
+void timeline_init(struct timeline *t, double sample_rate) {
+	memset(t, 0, sizeof(*t));
+	pthread_mutex_init(&t->lock, NULL);
+	t->sample_rate = sample_rate;
+	t->b = 1 / sample_rate;
+}
+
+static void fit(struct timeline *t) {
+	unsigned int n = t->points < TIMELINE_POINTS ? t->points : TIMELINE_POINTS;
+	if (n < 2) {
+		t->b = 1 / t->sample_rate;
+		t->a = t->y[0] - t->b * t->x[0];
+		return;
+	}
+	double sx = 0, sy = 0;
+	for (unsigned int j = 0; j < n; j++) {
+		sx += t->x[j];
+		sy += t->y[j];
+	}
+	double mx = sx / n, my = sy / n;
+	double sxx = 0, sxy = 0;
+	for (unsigned int j = 0; j < n; j++) {
+		sxx += (t->x[j] - mx) * (t->x[j] - mx);
+		sxy += (t->x[j] - mx) * (t->y[j] - my);
+	}
+	t->b = sxy / sxx;
+	t->a = my - t->b * mx;
+}
+
+void timeline_update(struct timeline *t, uint64_t timestamp, double host_time) {
+	pthread_mutex_lock(&t->lock);
+	if (!t->has_ref) {
+		t->has_ref = 1;
+		t->ts_ref = timestamp;
+		t->host_ref = host_time;
+		t->bin_end = timestamp + (uint64_t) t->sample_rate;
+	}
+
+	double x = timestamp - t->ts_ref;
+	double y = host_time - t->host_ref;
+	double latency = y - x / t->sample_rate;
+	if (!t->bin_valid || latency < t->bin_latency) {
+		t->bin_valid = 1;
+		t->bin_ts = timestamp;
+		t->bin_host = host_time;
+		t->bin_latency = latency;
+		if (t->points == 0) {
+			// Until there is a point, use the best sample so far
+			t->b = 1 / t->sample_rate;
+			t->a = y - t->b * x;
+		}
+	}
+
+	if (timestamp >= t->bin_end) {
+		unsigned int j = t->points++ % TIMELINE_POINTS;
+		t->x[j] = t->bin_ts - t->ts_ref;
+		t->y[j] = t->bin_host - t->host_ref;
+		fit(t);
+		t->bin_valid = 0;
+		while (t->bin_end <= timestamp) t->bin_end += (uint64_t) t->sample_rate;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+int timeline_valid(struct timeline *t) {
+	pthread_mutex_lock(&t->lock);
+	int valid = t->has_ref;
+	pthread_mutex_unlock(&t->lock);
+	return valid;
+}
+
+double timeline_host_time(struct timeline *t, uint64_t timestamp) {
+	pthread_mutex_lock(&t->lock);
+	double host_time = t->host_ref + t->a + t->b * (double) (int64_t) (timestamp - t->ts_ref);
+	pthread_mutex_unlock(&t->lock);
+	return host_time;
+}
+
+double timeline_timestamp(struct timeline *t, double host_time) {
+	pthread_mutex_lock(&t->lock);
+	double timestamp = t->ts_ref + (host_time - t->host_ref - t->a) / t->b;
+	pthread_mutex_unlock(&t->lock);
+	return timestamp;
+}
+
+double timeline_ppm(struct timeline *t) {
+	pthread_mutex_lock(&t->lock);
+	double ppm = 1e6 * (1 / (t->b * t->sample_rate) - 1);
+	pthread_mutex_unlock(&t->lock);
+	return ppm;
+}
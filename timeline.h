@@ -0,0 +1,68 @@
+/*
+  ===========================================================================
+
+  timeline - Relation between the sample timestamps of a LimeSDR and the
+  host clock, used to put several devices on a common timeline.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define TIMELINE_POINTS 64
+
+struct timeline {
+	pthread_mutex_t lock;
+	double sample_rate;
+
+	// Everything below is protected by lock
+	int has_ref;
+	uint64_t ts_ref;
+	double host_ref;
+
+	// Sample with the smallest host latency in the current second
+	uint64_t bin_end;
+	int bin_valid;
+	uint64_t bin_ts;
+	double bin_host;
+	double bin_latency;
+
+	// One point per second, relative to the references
+	double x[TIMELINE_POINTS], y[TIMELINE_POINTS];
+	unsigned int points;
+
+	// host_time - host_ref = a + b * (timestamp - ts_ref)
+	double a, b;
+};
+
+void timeline_init(struct timeline *t, double sample_rate);
+// Accounts that the sample with the given timestamp had been received by
+// host_time (CLOCK_REALTIME)
+void timeline_update(struct timeline *t, uint64_t timestamp, double host_time);
+// Returns 0 until the first update
+int timeline_valid(struct timeline *t);
+double timeline_host_time(struct timeline *t, uint64_t timestamp);
+double timeline_timestamp(struct timeline *t, double host_time);
+// Rate of the sample clock with respect to the host clock
+double timeline_ppm(struct timeline *t);
+
+#endif
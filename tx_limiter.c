@@ -0,0 +1,319 @@
+/*
+  ===========================================================================
+
+  tx_limiter - Level measurement, look-ahead peak limiter and crest factor
+  reduction of the TX samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  Each sample needs a gain r = min(1, threshold / |x|). The gain applied
+  is the minimum of r over the look-ahead window, found without branches
+  by the van Herk, Gil and Werman method, averaged over another window of
+  the same length, and the samples are delayed so that the gain
+  has smoothly come down to r by the time the peak goes out. This is the
+  peak windowing method of crest factor reduction. The threshold is the
+  peak limit, or the average level plus the crest factor if that is lower.
+  Everything except the running minimum and average is done in SSE2
+  passes over chunks of samples, and the measurements use those of
+  rx_level.
+
+  ===========================================================================
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tx_limiter.h"
+
+#define FULL_SCALE 32768.0
+#define LOOKAHEAD 0.2e-3 // s
+#define MIN_LOOKAHEAD 4 // samples
+#define AVERAGE_TIME 0.1 // s
+#define CHUNK 256 // samples processed in each pass
+
+int tx_limiter_init(struct tx_limiter *l, double sample_rate, double limit, double crest,
+		    FILE *log, double out_gain) {
+	memset(l, 0, sizeof(*l));
+	l->sample_rate = sample_rate;
+	l->log = log;
+	l->out_gain = out_gain;
+	l->min_gain = 1;
+	l->second_min_gain = 1;
+	pthread_mutex_init(&l->lock, NULL);
+	if (limit == 0 && crest == 0) return 0;
+	if (limit > 0 || crest < 0) {
+		fprintf(stderr, "ERROR: invalid TX limiter settings\n");
+		return -1;
+	}
+
+	l->limit = FULL_SCALE * pow(10, limit / 20);
+	if (l->limit > 32767) l->limit = 32767;
+	l->crest = crest ? pow(10, crest / 20) : 0;
+	// Until there is a signal, only the peak limit applies
+	l->average = l->crest ? l->limit * l->limit / (l->crest * l->crest) : 0;
+	l->average_log = -1 / (AVERAGE_TIME * sample_rate);
+	l->lookahead = LOOKAHEAD * sample_rate;
+	if (l->lookahead < MIN_LOOKAHEAD) l->lookahead = MIN_LOOKAHEAD;
+	l->delay = calloc(2 * (l->lookahead - 1 + CHUNK), sizeof(int16_t));
+	l->ratio = malloc(l->lookahead * sizeof(float));
+	l->suffix = malloc((l->lookahead + 1) * sizeof(float));
+	l->smooth = malloc(l->lookahead * sizeof(float));
+	if (!l->delay || !l->ratio || !l->suffix || !l->smooth) {
+		fprintf(stderr, "Could not allocate TX limiter\n");
+		tx_limiter_free(l);
+		return -1;
+	}
+	for (int j = 0; j < l->lookahead; j++) {
+		l->ratio[j] = 1;
+		l->smooth[j] = 1;
+	}
+	for (int j = 0; j <= l->lookahead; j++) l->suffix[j] = 1;
+	l->smooth_sum = l->lookahead;
+	return 0;
+}
+
+int tx_limiter_delay(struct tx_limiter *l) {
+	return l->limit ? l->lookahead - 1 : 0;
+}
+
+// Gain that each sample needs, min(1, threshold / |x|)
+static void ratios(const float *power, float *ratio, int count, float threshold) {
+	int j = 0;
+#ifdef __SSE2__
+	const __m128 one = _mm_set1_ps(1), t = _mm_set1_ps(threshold);
+	for (; j + 4 <= count; j += 4) {
+		// A zero power gives an infinite ratio, so 1
+		__m128 r = _mm_div_ps(t, _mm_sqrt_ps(_mm_loadu_ps(power + j)));
+		_mm_storeu_ps(ratio + j, _mm_min_ps(one, r));
+	}
+#endif
+	for (; j < count; j++) {
+		ratio[j] = power[j] > threshold * threshold ? threshold / sqrtf(power[j]) : 1;
+	}
+}
+
+// Power of each sample. Returns the sum, and the number of non-zero samples
+static uint64_t powers(const int16_t *x, float *power, int count, int *active) {
+	uint64_t energy = 0;
+	int j = 0;
+	*active = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero, nonzero = zero;
+	for (; j + 4 <= count; j += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (x + 2 * j));
+		// I^2 + Q^2 fits in 32 bits unsigned. Halve it before the
+		// signed conversion
+		__m128i p = _mm_madd_epi16(v, v);
+		_mm_storeu_ps(power + j, _mm_mul_ps(_mm_set1_ps(2),
+						    _mm_cvtepi32_ps(_mm_srli_epi32(p, 1))));
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(p, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(p, zero));
+		nonzero = _mm_sub_epi32(nonzero, _mm_andnot_si128(_mm_cmpeq_epi32(p, zero),
+								  _mm_set1_epi32(-1)));
+	}
+	uint64_t e[2];
+	uint32_t a[4];
+	_mm_storeu_si128((__m128i *) e, sum);
+	_mm_storeu_si128((__m128i *) a, nonzero);
+	energy = e[0] + e[1];
+	*active = a[0] + a[1] + a[2] + a[3];
+#endif
+	for (; j < count; j++) {
+		unsigned int p = x[2*j] * x[2*j] + x[2*j+1] * x[2*j+1];
+		power[j] = p;
+		energy += p;
+		*active += p != 0;
+	}
+	return energy;
+}
+
+// out = in * gain, rounded
+static void apply_gain(const int16_t *in, const float *gain, int16_t *out, int count) {
+	int j = 0;
+#ifdef __SSE2__
+	for (; j + 4 <= count; j += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + 2 * j));
+		__m128 g = _mm_loadu_ps(gain + j);
+		// Sign extension of the int16 to int32
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		__m128 ylo = _mm_mul_ps(_mm_cvtepi32_ps(lo), _mm_unpacklo_ps(g, g));
+		__m128 yhi = _mm_mul_ps(_mm_cvtepi32_ps(hi), _mm_unpackhi_ps(g, g));
+		_mm_storeu_si128((__m128i *) (out + 2 * j),
+				 _mm_packs_epi32(_mm_cvtps_epi32(ylo), _mm_cvtps_epi32(yhi)));
+	}
+#endif
+	for (; j < count; j++) {
+		out[2*j] = lrintf(in[2*j] * gain[j]);
+		out[2*j+1] = lrintf(in[2*j+1] * gain[j]);
+	}
+}
+
+static void limit_chunk(struct tx_limiter *l, int16_t *x, int count) {
+	int n = l->lookahead;
+	float power[CHUNK], ratio[CHUNK], gain[CHUNK];
+	int active;
+	uint64_t energy = powers(x, power, count, &active);
+	// The zeros sent between transmissions do not count in the average
+	if (active) {
+		double decay = 1 - exp(active * l->average_log);
+		l->average += decay * ((double) energy / active - l->average);
+	}
+	float threshold = l->limit;
+	if (l->crest && l->crest * sqrt(l->average) < threshold) {
+		threshold = l->crest * sqrt(l->average);
+	}
+	ratios(power, ratio, count, threshold);
+
+	// The state is kept in locals, as the compiler cannot tell that the
+	// stores to the rings do not change it
+	float *ring = l->ratio, *suffix = l->suffix, *smooth = l->smooth;
+	int slot = l->slot;
+	float prefix = l->prefix;
+	double sum = l->smooth_sum, inverse = 1.0 / n;
+	unsigned long limited = 0;
+	float min_gain = l->min_gain;
+	for (int j = 0; j < count; j++) {
+		int k = slot;
+		slot = k + 1 < n ? k + 1 : 0;
+		// Minimum over the window, which is the end of the previous
+		// block of n samples and the start of the current one (van
+		// Herk, Gil and Werman)
+		float r = ratio[j];
+		ring[k] = r;
+		prefix = k && prefix < r ? prefix : r;
+		float m = suffix[k + 1] < prefix ? suffix[k + 1] : prefix;
+		if (k == n - 1) {
+			for (int i = n - 1; i >= 0; i--) {
+				suffix[i] = ring[i] < suffix[i + 1] ? ring[i] : suffix[i + 1];
+			}
+		}
+
+		sum += m - smooth[k];
+		smooth[k] = m;
+		if (k == 0) {
+			// Do not let rounding errors accumulate
+			sum = 0;
+			for (int i = 0; i < n; i++) sum += smooth[i];
+		}
+		float g = sum * inverse;
+		gain[j] = g;
+		limited += g < 1 - 1e-6f;
+		min_gain = g < min_gain ? g : min_gain;
+	}
+	l->slot = slot;
+	l->prefix = prefix;
+	l->smooth_sum = sum;
+	l->limited += limited;
+	l->min_gain = min_gain;
+
+	// The output is the input delayed by n - 1 samples
+	int16_t *history = l->delay;
+	memcpy(history + 2 * (n - 1), x, 2 * count * sizeof(int16_t));
+	apply_gain(history, gain, x, count);
+	memmove(history, history + 2 * count, 2 * (n - 1) * sizeof(int16_t));
+}
+
+static void limit(struct tx_limiter *l, int16_t *samples, int count) {
+	for (int j = 0; j < count; j += CHUNK) {
+		limit_chunk(l, samples + 2 * j, count - j < CHUNK ? count - j : CHUNK);
+	}
+}
+
+static void end_second(struct tx_limiter *l) {
+	pthread_mutex_lock(&l->lock);
+	l->second_in = l->in;
+	l->second_out = l->out;
+	l->second_limited = l->limited;
+	l->second_min_gain = l->min_gain;
+	l->seconds++;
+	pthread_mutex_unlock(&l->lock);
+
+	if (l->log) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		fprintf(l->log, "%.3f,tx,%.1f,%.1f,%lu,%.3f,%.1f\n",
+			t.tv_sec + 1e-9 * t.tv_nsec,
+			rx_level_rms_dbfs(&l->out), rx_level_peak_dbfs(&l->out),
+			l->in.clipped, l->out_gain, 20 * log10(l->min_gain));
+		fflush(l->log);
+	}
+	memset(&l->in, 0, sizeof(l->in));
+	memset(&l->out, 0, sizeof(l->out));
+	l->limited = 0;
+	l->min_gain = 1;
+}
+
+static void measure_output(struct tx_limiter *l, const int16_t *samples, int count) {
+	rx_level_measure(samples, count, &l->out);
+	if (l->out.samples >= l->sample_rate) end_second(l);
+}
+
+void tx_limiter_process(struct tx_limiter *l, int16_t *samples, int count) {
+	rx_level_measure(samples, count, &l->in);
+	if (l->limit) {
+		limit(l, samples, count);
+		l->pending = tx_limiter_delay(l);
+	}
+	measure_output(l, samples, count);
+}
+
+int tx_limiter_flush(struct tx_limiter *l, int16_t *samples, int max) {
+	int count = l->pending < max ? l->pending : max;
+	if (count <= 0) return 0;
+	memset(samples, 0, 2 * count * sizeof(int16_t));
+	limit(l, samples, count);
+	l->pending -= count;
+	measure_output(l, samples, count);
+	return count;
+}
+
+void tx_limiter_print(struct tx_limiter *l) {
+	pthread_mutex_lock(&l->lock);
+	if (!l->seconds) {
+		pthread_mutex_unlock(&l->lock);
+		return;
+	}
+	struct rx_level_stats in = l->second_in, out = l->second_out;
+	unsigned long limited = l->second_limited;
+	double min_gain = l->second_min_gain;
+	pthread_mutex_unlock(&l->lock);
+	fprintf(stderr, "TX level: rms = %.1f dBFS, peak = %.1f dBFS, PAPR = %.1f dB, "
+		"input peak = %.1f dBFS, input clipped = %lu",
+		rx_level_rms_dbfs(&out), rx_level_peak_dbfs(&out),
+		rx_level_peak_dbfs(&out) - rx_level_rms_dbfs(&out),
+		rx_level_peak_dbfs(&in), in.clipped);
+	if (l->limit) {
+		fprintf(stderr, ", limited = %.2f%%, limiter gain = %.1f dB",
+			100.0 * limited / out.samples, 20 * log10(min_gain));
+	}
+	fprintf(stderr, "\n");
+}
+
+void tx_limiter_free(struct tx_limiter *l) {
+	free(l->delay);
+	free(l->ratio);
+	free(l->suffix);
+	free(l->smooth);
+	pthread_mutex_destroy(&l->lock);
+}
@@ -0,0 +1,81 @@
+/*
+  ===========================================================================
+
+  tx_limiter - Level measurement, look-ahead peak limiter and crest factor
+  reduction of the TX samples.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef TX_LIMITER_H
+#define TX_LIMITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rx_level.h"
+
+struct tx_limiter {
+	double sample_rate;
+	FILE *log;
+	double out_gain; // normalized TX gain, for the log
+
+	// Limiter, disabled if limit is 0
+	double limit; // amplitude
+	double crest; // amplitude ratio to the average, 0 for no CFR
+	double average; // power
+	double average_log; // log of the decay per sample
+	int lookahead;
+	int slot; // of the next sample in the rings
+	int pending; // input samples still in the delay line
+	int16_t *delay; // lookahead - 1 samples, followed by room for a chunk
+	float *ratio; // gain that each sample needs, ring of lookahead
+	float *suffix; // minima from each slot to the end of the last ring
+	float prefix; // minimum from the start of the ring to the last slot
+	float *smooth; // ring of lookahead minima, averaged into the gain
+	double smooth_sum;
+
+	// Used only by the TX thread
+	struct rx_level_stats in, out;
+	unsigned long limited;
+	double min_gain;
+
+	pthread_mutex_t lock;
+	// Protected by lock, last complete second
+	struct rx_level_stats second_in, second_out;
+	unsigned long second_limited;
+	double second_min_gain;
+	unsigned long seconds;
+};
+
+// limit is the peak amplitude in dBFS and crest the largest peak to
+// average ratio in dB, 0 to disable them
+int tx_limiter_init(struct tx_limiter *l, double sample_rate, double limit, double crest,
+		    FILE *log, double out_gain);
+// Conditions count samples in place. The output is delayed by
+// tx_limiter_delay() samples
+void tx_limiter_process(struct tx_limiter *l, int16_t *samples, int count);
+int tx_limiter_delay(struct tx_limiter *l);
+// Pushes up to max of the samples left in the delay line into samples and
+// returns their number. Called again, it continues with the rest
+int tx_limiter_flush(struct tx_limiter *l, int16_t *samples, int max);
+void tx_limiter_print(struct tx_limiter *l);
+void tx_limiter_free(struct tx_limiter *l);
+
+#endif
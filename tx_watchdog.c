@@ -0,0 +1,453 @@
+/*
+  ===========================================================================
+
+  tx_watchdog - Transmit timeout and duty cycle watchdog for the TX stream.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "tx_watchdog.h"
+
+#define TX_WATCHDOG_BUCKET_MS 1000
+#define TX_WATCHDOG_HANG_TIME 0.2
+
+static uint64_t monotonic_ms(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void advance_buckets(struct tx_watchdog *wd, uint64_t now) {
+	unsigned int steps = 0;
+	while (now >= wd->bucket_start_ms + TX_WATCHDOG_BUCKET_MS) {
+		wd->bucket_start_ms += TX_WATCHDOG_BUCKET_MS;
+		if (steps++ >= wd->duty_buckets) {
+			// Idle for longer than the window, skip ahead
+			wd->bucket_start_ms = now - (now - wd->bucket_start_ms) % TX_WATCHDOG_BUCKET_MS;
+			continue;
+		}
+		wd->bucket_idx = (wd->bucket_idx + 1) % wd->duty_buckets;
+		wd->window_samples -= wd->buckets[wd->bucket_idx];
+		wd->buckets[wd->bucket_idx] = 0;
+	}
+}
+
+static double duty_cycle(struct tx_watchdog *wd) {
+	return wd->window_samples / (wd->sample_rate * wd->duty_buckets);
+}
+
+// Returns 1 if the transmitting state changed
+static int update_transmitting(struct tx_watchdog *wd, uint64_t now) {
+	int transmitting = wd->ptt || wd->rf_on;
+	if (transmitting == wd->transmitting) return 0;
+
+	wd->transmitting = transmitting;
+	if (transmitting) {
+		wd->on_since_ms = now;
+	}
+	else if (wd->muted == TX_WATCHDOG_TIMEOUT) {
+		fprintf(stderr, "Watchdog: TX stopped, unmuting\n");
+		wd->muted = TX_WATCHDOG_UNMUTED;
+	}
+	return 1;
+}
+
+// Connects to rigctld_ptt and asks it to send the PTT state on every change
+static int rig_connect(struct tx_watchdog *wd, const char *address) {
+	const char *colon = strrchr(address, ':');
+	char ip[64];
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	snprintf(ip, sizeof(ip), "%.*s", colon ? (int) (colon - address) : 0, address);
+	if (!colon || !inet_aton(ip, &addr.sin_addr)) {
+		fprintf(stderr, "Invalid rigctld address %s, should be IP:PORT\n", address);
+		return -1;
+	}
+	addr.sin_port = htons(atoi(colon + 1));
+
+	wd->rig_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (wd->rig_fd < 0
+	    || connect(wd->rig_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Could not connect to rigctld_ptt");
+		return -1;
+	}
+	const char watch[] = "\\watch_ptt\n";
+	if (send(wd->rig_fd, watch, sizeof(watch) - 1, MSG_NOSIGNAL) != sizeof(watch) - 1) {
+		perror("Could not send to rigctld_ptt");
+		return -1;
+	}
+	int flags = fcntl(wd->rig_fd, F_GETFL);
+	if (flags < 0 || fcntl(wd->rig_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl()");
+		return -1;
+	}
+	return 0;
+}
+
+// Reads the state lines sent by rigctld_ptt, skipping the replies to our
+// own commands. Returns -1 if the connection is lost
+static int rig_receive(struct tx_watchdog *wd) {
+	while (1) {
+		ssize_t len = recv(wd->rig_fd, wd->rig_in + wd->rig_len,
+				   sizeof(wd->rig_in) - wd->rig_len, 0);
+		if (len == 0) return -1;
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		wd->rig_len += len;
+
+		size_t start = 0;
+		for (size_t i = 0; i < wd->rig_len; i++) {
+			if (wd->rig_in[i] != '\n') continue;
+			char c = wd->rig_in[start];
+			if (i - start == 1 && (c == '0' || c == '1')) {
+				wd->rig_ptt = c == '1';
+			}
+			start = i + 1;
+		}
+		memmove(wd->rig_in, wd->rig_in + start, wd->rig_len - start);
+		wd->rig_len -= start;
+		if (wd->rig_len == sizeof(wd->rig_in)) wd->rig_len = 0;
+	}
+}
+
+static void release_ptt(struct tx_watchdog *wd) {
+	if (wd->has_gpio && gpio_set(&wd->ptt_gpio, 0) < 0) {
+		perror("Could not release PTT GPIO");
+	}
+	if (wd->rig_fd >= 0 && send(wd->rig_fd, "T 0\n", 4, MSG_NOSIGNAL) != 4) {
+		perror("Could not release PTT through rigctld_ptt");
+	}
+}
+
+int tx_watchdog_init(struct tx_watchdog *wd, double sample_rate,
+		     double timeout, double duty_limit, double duty_window,
+		     double threshold_dbfs, const char *ptt_gpio, const char *rigctld) {
+	memset(wd, 0, sizeof(*wd));
+	wd->sample_rate = sample_rate;
+	wd->timeout = timeout;
+	wd->duty_limit = duty_limit;
+	wd->duty_buckets = duty_window * 1000 / TX_WATCHDOG_BUCKET_MS;
+	if (wd->duty_buckets < 1) wd->duty_buckets = 1;
+	wd->energy_threshold = 32768.0 * 32768.0 * pow(10, threshold_dbfs / 10);
+	wd->hang_samples = TX_WATCHDOG_HANG_TIME * sample_rate;
+	wd->inotify_fd = wd->timer_fd = wd->wake_fd = wd->rig_fd = -1;
+	wd->ptt_gpio.fd = -1;
+
+	wd->buckets = calloc(wd->duty_buckets, sizeof(*wd->buckets));
+	if (!wd->buckets) {
+		perror("Could not allocate watchdog buckets");
+		return -1;
+	}
+	wd->bucket_start_ms = monotonic_ms();
+
+	if (ptt_gpio) {
+		// sysfs notifies value changes to inotify when the GPIO "edge"
+		// attribute is set, and so does a regular file standing in for it
+		if (gpio_open_file(&wd->ptt_gpio, ptt_gpio) < 0) {
+			perror("Could not open PTT GPIO value file");
+			return -1;
+		}
+		if (gpio_file_watch_edges(ptt_gpio) < 0) {
+			perror("Could not set the PTT GPIO edge to both");
+			return -1;
+		}
+		wd->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (wd->inotify_fd < 0
+		    || inotify_add_watch(wd->inotify_fd, ptt_gpio, IN_MODIFY) < 0) {
+			perror("Could not watch PTT GPIO value file");
+			return -1;
+		}
+		wd->has_gpio = 1;
+	}
+	if (wd->has_gpio && gpio_get(&wd->ptt_gpio, &wd->ptt) < 0) {
+		perror("Could not read PTT GPIO");
+		return -1;
+	}
+	if (rigctld && rig_connect(wd, rigctld) < 0) {
+		return -1;
+	}
+
+	wd->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wd->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wd->timer_fd < 0 || wd->wake_fd < 0) {
+		perror("Could not create watchdog timer");
+		return -1;
+	}
+
+	update_transmitting(wd, monotonic_ms());
+	pthread_mutex_init(&wd->lock, NULL);
+	return 0;
+}
+
+static void mute(struct tx_watchdog *wd, enum tx_watchdog_mute reason) {
+	wd->muted = reason;
+	if (reason == TX_WATCHDOG_TIMEOUT) {
+		wd->timeouts++;
+		fprintf(stderr, "Watchdog timeout, muting TX\n");
+	}
+	else {
+		wd->duty_trips++;
+		fprintf(stderr, "Watchdog: duty cycle %.1f%% over limit, muting TX\n",
+			100.0 * duty_cycle(wd));
+	}
+	release_ptt(wd);
+}
+
+// Checks the limits and returns the next time (in ms) at which they must
+// be checked again, or 0 if nothing can expire
+static uint64_t check_limits(struct tx_watchdog *wd, uint64_t now) {
+	uint64_t deadline = 0;
+
+	advance_buckets(wd, now);
+
+	if (wd->muted == TX_WATCHDOG_DUTY_CYCLE) {
+		if (duty_cycle(wd) < 0.9 * wd->duty_limit) {
+			fprintf(stderr, "Watchdog: duty cycle back under limit, unmuting\n");
+			wd->muted = TX_WATCHDOG_UNMUTED;
+		}
+		else {
+			return wd->bucket_start_ms + TX_WATCHDOG_BUCKET_MS;
+		}
+	}
+	if (wd->muted != TX_WATCHDOG_UNMUTED || !wd->transmitting) return 0;
+
+	if (wd->timeout > 0) {
+		uint64_t expiry = wd->on_since_ms + wd->timeout * 1000;
+		if (now >= expiry) {
+			mute(wd, TX_WATCHDOG_TIMEOUT);
+			return 0;
+		}
+		deadline = expiry;
+	}
+	if (wd->duty_limit < 1 && wd->rf_on) {
+		double budget = wd->duty_limit * wd->sample_rate * wd->duty_buckets
+			- wd->window_samples;
+		if (budget <= 0) {
+			mute(wd, TX_WATCHDOG_DUTY_CYCLE);
+			return wd->bucket_start_ms + TX_WATCHDOG_BUCKET_MS;
+		}
+		uint64_t expiry = now + (uint64_t) ceil(1000 * budget / wd->sample_rate);
+		if (deadline == 0 || expiry < deadline) deadline = expiry;
+	}
+
+	return deadline;
+}
+
+static void *tx_watchdog_thread(void *arg) {
+	struct tx_watchdog *wd = arg;
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1()");
+		return NULL;
+	}
+	int fds[] = { wd->timer_fd, wd->wake_fd, wd->inotify_fd, wd->rig_fd };
+	for (int i = 0; i < 4; i++) {
+		if (fds[i] < 0) continue;
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+			perror("epoll_ctl()");
+			close(epoll_fd);
+			return NULL;
+		}
+	}
+
+	while (1) {
+		struct epoll_event events[4];
+		int n = epoll_wait(epoll_fd, events, 4, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			break;
+		}
+
+		char buf[256];
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == wd->rig_fd) {
+				if (rig_receive(wd) < 0) {
+					fprintf(stderr, "Watchdog: lost the connection to rigctld_ptt\n");
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wd->rig_fd, NULL);
+					close(wd->rig_fd);
+					wd->rig_fd = -1;
+					wd->rig_ptt = 0;
+				}
+				continue;
+			}
+			// Drain the other event sources. Their content is not
+			// important, since the state is reevaluated below anyway
+			while (read(events[i].data.fd, buf, sizeof(buf)) > 0);
+		}
+
+		pthread_mutex_lock(&wd->lock);
+		if (wd->stop) {
+			pthread_mutex_unlock(&wd->lock);
+			break;
+		}
+		uint64_t now = monotonic_ms();
+		int was_ptt = wd->ptt;
+		if (wd->has_gpio) {
+			int ptt;
+			if (gpio_get(&wd->ptt_gpio, &ptt) == 0) {
+				wd->ptt = ptt;
+			}
+		}
+		else {
+			wd->ptt = wd->rig_ptt;
+		}
+		if (wd->ptt && !was_ptt && wd->muted != TX_WATCHDOG_UNMUTED) {
+			fprintf(stderr, "Watchdog: PTT keyed while TX is muted, releasing it\n");
+			release_ptt(wd);
+		}
+		// When the source stops sending samples, tx_watchdog_process()
+		// is not called and cannot see the silence
+		uint64_t hang_end = wd->last_energy_ms + TX_WATCHDOG_HANG_TIME * 1000;
+		if (wd->rf_on && now >= hang_end) {
+			wd->rf_on = 0;
+		}
+		update_transmitting(wd, now);
+		uint64_t deadline = check_limits(wd, now);
+		if (wd->rf_on && (deadline == 0 || hang_end < deadline)) {
+			deadline = hang_end;
+		}
+		pthread_mutex_unlock(&wd->lock);
+
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		if (deadline) {
+			its.it_value.tv_sec = deadline / 1000;
+			its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+		}
+		timerfd_settime(wd->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	close(epoll_fd);
+	return NULL;
+}
+
+int tx_watchdog_start(struct tx_watchdog *wd) {
+	if (pthread_create(&wd->thread, NULL, tx_watchdog_thread, wd) != 0) {
+		fprintf(stderr, "Could not create watchdog thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+static double block_power(const int16_t *samples, int count) {
+	int64_t acc = 0;
+	for (int i = 0; i < 2 * count; i++) {
+		acc += (int32_t) samples[i] * samples[i];
+	}
+	return (double) acc / count;
+}
+
+int tx_watchdog_process(struct tx_watchdog *wd, int16_t *samples, int count) {
+	if (count <= 0) return 0;
+
+	double power = block_power(samples, count);
+	uint64_t now = monotonic_ms();
+	int changed = 0;
+
+	pthread_mutex_lock(&wd->lock);
+	advance_buckets(wd, now);
+	if (power > wd->energy_threshold) {
+		wd->quiet_samples = 0;
+		wd->last_energy_ms = now;
+		if (!wd->rf_on) {
+			wd->rf_on = 1;
+			changed = 1;
+		}
+	}
+	else if (wd->rf_on) {
+		wd->quiet_samples += count;
+		if (wd->quiet_samples >= wd->hang_samples) {
+			wd->rf_on = 0;
+			changed = 1;
+		}
+	}
+	changed |= update_transmitting(wd, now);
+	int muted = wd->muted != TX_WATCHDOG_UNMUTED;
+	if (wd->rf_on && !muted) {
+		wd->tx_samples += count;
+		wd->buckets[wd->bucket_idx] += count;
+		wd->window_samples += count;
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	if (changed) {
+		uint64_t one = 1;
+		if (write(wd->wake_fd, &one, sizeof(one)) < 0) {
+			perror("Could not wake watchdog thread");
+		}
+	}
+	if (muted) {
+		memset(samples, 0, 2 * sizeof(int16_t) * count);
+	}
+	return muted;
+}
+
+void tx_watchdog_print(struct tx_watchdog *wd) {
+	pthread_mutex_lock(&wd->lock);
+	uint64_t now = monotonic_ms();
+	advance_buckets(wd, now);
+	fprintf(stderr,
+		"TX time: total = %.1f s, current = %.1f s, duty = %.1f%%, "
+		"timeouts = %u, duty trips = %u%s\n",
+		wd->tx_samples / wd->sample_rate,
+		wd->transmitting ? (now - wd->on_since_ms) * 1e-3 : 0.0,
+		100.0 * duty_cycle(wd), wd->timeouts, wd->duty_trips,
+		wd->muted != TX_WATCHDOG_UNMUTED ? " MUTED" : "");
+	pthread_mutex_unlock(&wd->lock);
+}
+
+void tx_watchdog_stop(struct tx_watchdog *wd) {
+	pthread_mutex_lock(&wd->lock);
+	wd->stop = 1;
+	pthread_mutex_unlock(&wd->lock);
+	uint64_t one = 1;
+	if (write(wd->wake_fd, &one, sizeof(one)) == sizeof(one)) {
+		pthread_join(wd->thread, NULL);
+	}
+	if (wd->has_gpio) gpio_close(&wd->ptt_gpio);
+	if (wd->inotify_fd >= 0) close(wd->inotify_fd);
+	if (wd->rig_fd >= 0) close(wd->rig_fd);
+	close(wd->timer_fd);
+	close(wd->wake_fd);
+	free(wd->buckets);
+}
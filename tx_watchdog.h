@@ -0,0 +1,93 @@
+/*
+  ===========================================================================
+
+  tx_watchdog - Transmit timeout and duty cycle watchdog for the TX stream.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef TX_WATCHDOG_H
+#define TX_WATCHDOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "gpio.h"
+
+enum tx_watchdog_mute {
+	TX_WATCHDOG_UNMUTED = 0,
+	TX_WATCHDOG_TIMEOUT,
+	TX_WATCHDOG_DUTY_CYCLE
+};
+
+struct tx_watchdog {
+	double sample_rate;
+	double timeout; // seconds, 0 to disable
+	double duty_limit; // fraction of duty_buckets seconds, 1 to disable
+	unsigned int duty_buckets;
+	double energy_threshold; // mean |x|^2 of a block, in int16 units
+	unsigned int hang_samples;
+
+	struct gpio ptt_gpio;
+	int has_gpio;
+	int inotify_fd;
+	// Connection to rigctld_ptt, used only by the watchdog thread
+	int rig_fd;
+	char rig_in[64];
+	size_t rig_len;
+	int rig_ptt;
+	int timer_fd;
+	int wake_fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+
+	// Everything below is protected by lock
+	int stop;
+	int ptt;
+	int rf_on;
+	int transmitting;
+	uint64_t on_since_ms;
+	uint64_t last_energy_ms;
+	unsigned int quiet_samples;
+	enum tx_watchdog_mute muted;
+
+	// TX samples sent in each second of the duty cycle window
+	uint64_t *buckets;
+	unsigned int bucket_idx;
+	uint64_t bucket_start_ms;
+	uint64_t window_samples;
+
+	uint64_t tx_samples;
+	unsigned int timeouts;
+	unsigned int duty_trips;
+};
+
+// The PTT is watched, and released on a mute, through ptt_gpio, a sysfs
+// value file, or through rigctld, the IP:PORT of rigctld_ptt. Both can be
+// NULL, and then a mute only zeroes the samples
+int tx_watchdog_init(struct tx_watchdog *wd, double sample_rate,
+		     double timeout, double duty_limit, double duty_window,
+		     double threshold_dbfs, const char *ptt_gpio, const char *rigctld);
+int tx_watchdog_start(struct tx_watchdog *wd);
+// Accounts a block of interleaved int16 IQ samples before it is sent to
+// LMS_SendStream. The block is zeroed if TX is muted. Returns 1 if muted.
+int tx_watchdog_process(struct tx_watchdog *wd, int16_t *samples, int count);
+void tx_watchdog_print(struct tx_watchdog *wd);
+void tx_watchdog_stop(struct tx_watchdog *wd);
+
+#endif
@@ -0,0 +1,303 @@
+/*
+  ===========================================================================
+
+  udp_tx - TX input over UDP, with sequence numbers and sample timestamps,
+  that puts the samples at their device time and conceals lost packets.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The first packet of a burst fixes the offset between the timestamps of
+  the sender and those of the device, so that it goes out the playout
+  delay after it arrived. The packets are written at their device time in
+  a ring, in whatever order they arrive, and the TX thread takes the
+  samples a little ahead of the device time. A packet that has not
+  arrived by then is lost: its place is filled by the last samples sent,
+  continued with their phase rotation and faded out, then zeros, and the
+  samples after the gap are faded in. A burst ends when there are no
+  samples left, and the next packet starts a new one.
+
+  ===========================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "udp_tx.h"
+
+#define MAX_PACKET (sizeof(struct udp_tx_header) + 2 * sizeof(int16_t) * UDP_TX_MAX_SAMPLES)
+#define FADE 1e-3 // seconds
+#define RING_MARGIN 0.5 // seconds beyond twice the playout delay
+#define SOCKET_BUFFER (1 << 20) // bytes
+#define REORDER_WINDOW 1024 // packets, older sequence numbers are a new sender
+
+int udp_tx_init(struct udp_tx *u, int port, double sample_rate, double delay) {
+	memset(u, 0, sizeof(*u));
+	u->socket = -1;
+	u->sample_rate = sample_rate;
+	u->delay = delay * sample_rate;
+	u->fade = FADE * sample_rate;
+	u->ring_size = 1;
+	while (u->ring_size < 2 * u->delay + RING_MARGIN * sample_rate) u->ring_size <<= 1;
+	u->ring = malloc(2 * sizeof(int16_t) * u->ring_size);
+	u->valid = calloc(u->ring_size, 1);
+	u->buffers = malloc(UDP_TX_BATCH * MAX_PACKET);
+	u->msgs = calloc(UDP_TX_BATCH, sizeof(*u->msgs));
+	u->iovecs = calloc(UDP_TX_BATCH, sizeof(*u->iovecs));
+	if (!u->ring || !u->valid || !u->buffers || !u->msgs || !u->iovecs) {
+		fprintf(stderr, "Could not allocate UDP TX buffers\n");
+		return -1;
+	}
+	for (int j = 0; j < UDP_TX_BATCH; j++) {
+		u->iovecs[j].iov_base = u->buffers + j * MAX_PACKET;
+		u->iovecs[j].iov_len = MAX_PACKET;
+		u->msgs[j].msg_hdr.msg_iov = &u->iovecs[j];
+		u->msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+
+	u->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	if (u->socket < 0) {
+		perror("Could not open UDP TX socket");
+		return -1;
+	}
+	// The TX thread drains the socket once per FIFO service, so it has
+	// to hold the bursts that arrive in between
+	int size = SOCKET_BUFFER;
+	setsockopt(u->socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+	if (bind(u->socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Could not bind UDP TX socket");
+		close(u->socket);
+		u->socket = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// Marks the samples from ts to end as not received
+static void clear(struct udp_tx *u, uint64_t ts, uint64_t end) {
+	if (end - ts >= u->ring_size) {
+		memset(u->valid, 0, u->ring_size);
+		return;
+	}
+	while (ts < end) {
+		uint64_t idx = ts & (u->ring_size - 1);
+		uint64_t n = u->ring_size - idx;
+		if (n > end - ts) n = end - ts;
+		memset(u->valid + idx, 0, n);
+		ts += n;
+	}
+}
+
+static void store(struct udp_tx *u, uint64_t ts, const int16_t *samples, int count) {
+	while (count) {
+		uint64_t idx = ts & (u->ring_size - 1);
+		int n = u->ring_size - idx;
+		if (n > count) n = count;
+		memcpy(u->ring + 2 * idx, samples, 2 * sizeof(int16_t) * n);
+		memset(u->valid + idx, 1, n);
+		ts += n;
+		samples += 2 * n;
+		count -= n;
+	}
+}
+
+static uint64_t device_timestamp(struct udp_tx *u, const struct udp_tx_header *h) {
+	return h->flags & UDP_TX_DEVICE_TIME ? h->timestamp : h->timestamp + u->base;
+}
+
+static void start_burst(struct udp_tx *u, const struct udp_tx_header *h, uint64_t now) {
+	memset(u->valid, 0, u->ring_size);
+	u->base = now + u->delay - h->timestamp;
+	u->next_ts = u->newest_end = device_timestamp(u, h);
+	u->highest_seq = h->seq;
+	u->prev_i = u->prev_q = u->last_i = u->last_q = 0;
+	u->concealing = 0;
+	u->ramp = u->fade; // a burst starts at full level
+	u->active = 1;
+	atomic_fetch_add(&u->bursts, 1);
+}
+
+static void handle_packet(struct udp_tx *u, const struct udp_tx_header *h,
+			  const int16_t *samples, uint64_t now) {
+	atomic_fetch_add(&u->packets, 1);
+	if (!u->active) {
+		// A packet of the previous burst
+		int32_t ahead = h->seq - u->highest_seq;
+		if (atomic_load(&u->bursts) && !(h->flags & UDP_TX_STREAM_START)
+		    && ahead <= 0 && ahead > -REORDER_WINDOW) {
+			atomic_fetch_add(&u->late, 1);
+			return;
+		}
+		start_burst(u, h, now);
+	}
+	else {
+		int32_t ahead = h->seq - u->highest_seq;
+		if (ahead > 0) {
+			atomic_fetch_add(&u->lost, ahead - 1);
+			u->highest_seq = h->seq;
+		}
+		else if (ahead < 0) {
+			// It was counted as lost when a later one arrived
+			atomic_fetch_add(&u->reordered, 1);
+			if (atomic_load(&u->lost)) atomic_fetch_sub(&u->lost, 1);
+		}
+	}
+
+	int64_t offset = device_timestamp(u, h) - u->next_ts;
+	if (offset + h->count + (int64_t) u->delay < 0
+	    || offset + h->count > (int64_t) u->ring_size) {
+		// Far outside the ring: the sender restarted or its clock jumped
+		atomic_fetch_add(&u->resyncs, 1);
+		start_burst(u, h, now);
+		offset = 0;
+	}
+	int count = h->count;
+	if (offset < 0) {
+		// Partly or completely sent already
+		atomic_fetch_add(&u->late, 1);
+		if (offset + count <= 0) return;
+		samples += 2 * -offset;
+		count += offset;
+		offset = 0;
+	}
+	store(u, u->next_ts + offset, samples, count);
+	if (u->next_ts + offset + count > u->newest_end) u->newest_end = u->next_ts + offset + count;
+}
+
+void udp_tx_receive(struct udp_tx *u, uint64_t now) {
+	int n;
+	do {
+		n = recvmmsg(u->socket, u->msgs, UDP_TX_BATCH, MSG_DONTWAIT, NULL);
+		for (int j = 0; j < n; j++) {
+			const uint8_t *p = u->iovecs[j].iov_base;
+			unsigned int len = u->msgs[j].msg_len;
+			struct udp_tx_header h;
+			memcpy(&h, p, sizeof(h));
+			if (len < sizeof(h) || h.magic != UDP_TX_MAGIC || h.count > UDP_TX_MAX_SAMPLES
+			    || len != sizeof(h) + 2 * sizeof(int16_t) * h.count) {
+				atomic_fetch_add(&u->invalid, 1);
+				continue;
+			}
+			handle_packet(u, &h, (const int16_t *) (p + sizeof(h)), now);
+		}
+	} while (n == UDP_TX_BATCH);
+	if (u->active) atomic_store(&u->buffered, u->newest_end - u->next_ts);
+}
+
+// Continues the last samples with their phase rotation, fading out
+static void conceal(struct udp_tx *u, int16_t *y) {
+	if (u->concealing == 0) {
+		// Rotation from the previous sample to the last one
+		float i = u->last_i * u->prev_i + u->last_q * u->prev_q;
+		float q = u->last_q * u->prev_i - u->last_i * u->prev_q;
+		float m = sqrtf(i * i + q * q);
+		u->step_i = m > 0 ? i / m : 1;
+		u->step_q = m > 0 ? q / m : 0;
+	}
+	if (u->concealing < u->fade) {
+		float i = u->last_i * u->step_i - u->last_q * u->step_q;
+		u->last_q = u->last_i * u->step_q + u->last_q * u->step_i;
+		u->last_i = i;
+		float g = 1 - (float) u->concealing / u->fade;
+		y[0] = u->last_i * g;
+		y[1] = u->last_q * g;
+	}
+	else {
+		y[0] = y[1] = 0;
+	}
+	u->concealing++;
+	u->ramp = 0;
+}
+
+int udp_tx_read(struct udp_tx *u, int16_t *samples, int max, uint64_t now, uint64_t lead,
+		uint64_t *timestamp) {
+	if (!u->active) return 0;
+	if (u->next_ts < now) {
+		// The device time has passed these samples
+		atomic_fetch_add(&u->skipped, now - u->next_ts);
+		clear(u, u->next_ts, now);
+		u->next_ts = now;
+	}
+	if (u->next_ts >= u->newest_end) {
+		u->active = 0;
+		atomic_store(&u->buffered, 0);
+		return 0;
+	}
+	if (u->next_ts >= now + lead) return 0;
+	int n = now + lead - u->next_ts;
+	if (n > max) n = max;
+
+	unsigned long concealed = 0;
+	for (int j = 0; j < n; j++) {
+		uint64_t idx = (u->next_ts + j) & (u->ring_size - 1);
+		int16_t *y = samples + 2 * j;
+		if (!u->valid[idx]) {
+			conceal(u, y);
+			concealed++;
+			continue;
+		}
+		u->valid[idx] = 0;
+		float i = u->ring[2*idx], q = u->ring[2*idx+1];
+		if (u->ramp < u->fade) {
+			float g = (float) u->ramp++ / u->fade;
+			i *= g;
+			q *= g;
+		}
+		u->concealing = 0;
+		u->prev_i = u->last_i;
+		u->prev_q = u->last_q;
+		u->last_i = i;
+		u->last_q = q;
+		y[0] = i;
+		y[1] = q;
+	}
+	if (concealed) atomic_fetch_add(&u->concealed, concealed);
+	*timestamp = u->next_ts;
+	u->next_ts += n;
+	atomic_store(&u->buffered, u->newest_end > u->next_ts ? u->newest_end - u->next_ts : 0);
+	return n;
+}
+
+void udp_tx_print(struct udp_tx *u) {
+	double ms = 1e3 / u->sample_rate;
+	fprintf(stderr, "UDP TX: packets = %lu, lost = %lu, late = %lu, reordered = %lu, "
+		"invalid = %lu, bursts = %lu, resyncs = %lu, concealed = %.1f ms, "
+		"skipped = %.1f ms, buffer = %.1f ms\n",
+		atomic_load(&u->packets), atomic_load(&u->lost), atomic_load(&u->late),
+		atomic_load(&u->reordered), atomic_load(&u->invalid), atomic_load(&u->bursts),
+		atomic_load(&u->resyncs), ms * atomic_load(&u->concealed),
+		ms * atomic_load(&u->skipped), ms * atomic_load(&u->buffered));
+}
+
+void udp_tx_free(struct udp_tx *u) {
+	if (u->socket >= 0) close(u->socket);
+	free(u->ring);
+	free(u->valid);
+	free(u->buffers);
+	free(u->msgs);
+	free(u->iovecs);
+}
@@ -0,0 +1,101 @@
+/*
+  ===========================================================================
+
+  udp_tx - TX input over UDP, with sequence numbers and sample timestamps,
+  that puts the samples at their device time and conceals lost packets.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef UDP_TX_H
+#define UDP_TX_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define UDP_TX_MAGIC 0x55585451 // "QTXU"
+#define UDP_TX_MAX_SAMPLES 4096 // per packet
+// Samples of a packet that fits in a 1500 byte MTU
+#define UDP_TX_MTU_SAMPLES 362
+
+// Header flags
+// The timestamp is a device timestamp of the TX device instead of a
+// sample count of the sender
+#define UDP_TX_DEVICE_TIME 1
+// First packet of a stream, so that a restarted sender is not taken for
+// late packets of the previous burst
+#define UDP_TX_STREAM_START 2
+
+// Little endian, followed by count interleaved int16 IQ samples
+struct udp_tx_header {
+	uint32_t magic;
+	uint32_t seq; // +1 for each packet
+	uint64_t timestamp; // of the first sample, in samples
+	uint16_t count;
+	uint16_t flags;
+	uint32_t reserved;
+};
+
+#define UDP_TX_BATCH 16
+
+struct udp_tx {
+	int socket;
+	double sample_rate;
+	uint64_t delay; // samples between the arrival of a burst and its start
+	uint64_t fade; // samples of the concealment ramps
+
+	// Samples received, indexed by device timestamp
+	int16_t *ring;
+	uint8_t *valid;
+	uint64_t ring_size; // power of 2
+
+	int active; // in a burst
+	int64_t base; // device timestamp minus sender timestamp
+	uint64_t next_ts; // device timestamp of the next sample to send
+	uint64_t newest_end; // device timestamp after the newest sample received
+	uint32_t highest_seq;
+
+	// Concealment
+	float prev_i, prev_q, last_i, last_q; // last two samples sent
+	float step_i, step_q; // phase rotation between them
+	uint64_t concealing; // samples concealed in the current gap
+	uint64_t ramp; // samples since the gap, while fading in
+
+	// UDP_TX_BATCH packets for recvmmsg()
+	uint8_t *buffers;
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+
+	atomic_ulong packets, lost, late, reordered, invalid;
+	atomic_ulong bursts, resyncs, concealed, skipped;
+	atomic_long buffered; // samples
+};
+
+// Listens on port. delay is the playout delay in seconds, which absorbs
+// the network jitter
+int udp_tx_init(struct udp_tx *u, int port, double sample_rate, double delay);
+// Takes the packets waiting in the socket. now is the device timestamp
+void udp_tx_receive(struct udp_tx *u, uint64_t now);
+// Gives up to max samples to send before now + lead, and the device
+// timestamp of the first one. Returns 0 if there is nothing to send yet
+int udp_tx_read(struct udp_tx *u, int16_t *samples, int max, uint64_t now, uint64_t lead,
+		uint64_t *timestamp);
+void udp_tx_print(struct udp_tx *u);
+void udp_tx_free(struct udp_tx *u);
+
+#endif
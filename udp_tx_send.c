@@ -0,0 +1,118 @@
+/*
+  ===========================================================================
+
+  udp_tx_send - Sends the IQ samples read from stdin, as interleaved
+  int16, to the UDP TX input of limesdr_linrad.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The timestamps count samples, but they jump forward when the source
+  stops for a while, so that the pauses are kept at the other end.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "udp_tx.h"
+
+#define STALL 0.05 // seconds behind the wall clock that count as a pause
+#define LEAD 0.02 // seconds ahead of the wall clock that packets are sent
+
+static double monotonic_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		printf("Usage: %s <IP> <PORT> <SAMPLE_RATE> [<SAMPLES_PER_PACKET>]\n", argv[0]);
+		printf("  SAMPLES_PER_PACKET (default: %d, to fit in a 1500 byte MTU)\n",
+		       UDP_TX_MTU_SAMPLES);
+		return 1;
+	}
+	double sample_rate = atof(argv[3]);
+	int packet_samples = argc > 4 ? atoi(argv[4]) : UDP_TX_MTU_SAMPLES;
+	if (sample_rate <= 0 || packet_samples < 1 || packet_samples > UDP_TX_MAX_SAMPLES) {
+		fprintf(stderr, "ERROR: invalid sample rate or packet size\n");
+		return 1;
+	}
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(atoi(argv[2])),
+		.sin_addr.s_addr = inet_addr(argv[1])
+	};
+	if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Could not open UDP socket");
+		return 1;
+	}
+
+	struct {
+		struct udp_tx_header h;
+		int16_t samples[2 * UDP_TX_MAX_SAMPLES];
+	} packet = { .h = { .magic = UDP_TX_MAGIC, .flags = UDP_TX_STREAM_START } };
+	uint64_t timestamp = 0, errors = 0;
+	double start = monotonic_now();
+	// A restarted sender does not continue the sequence numbers where the
+	// previous one stopped, in case its first packet is lost
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	uint32_t first_seq = t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	packet.h.seq = first_seq;
+	size_t have = 0; // bytes, a read may end in the middle of a packet
+	size_t packet_bytes = 2 * sizeof(int16_t) * packet_samples;
+	while (1) {
+		ssize_t ret = read(STDIN_FILENO, (char *) packet.samples + have, packet_bytes - have);
+		if (ret <= 0) break;
+		have += ret;
+		if (have < packet_bytes) continue;
+		have = 0;
+
+		double now = (monotonic_now() - start) * sample_rate;
+		if (now - STALL * sample_rate > timestamp) timestamp = now - STALL * sample_rate;
+		// Samples read faster than real time, as from a file, would
+		// overflow the receiver buffer
+		double ahead = (timestamp - now) / sample_rate - LEAD;
+		if (ahead > 0) {
+			struct timespec wait = {
+				.tv_sec = ahead,
+				.tv_nsec = 1e9 * (ahead - (long) ahead)
+			};
+			nanosleep(&wait, NULL);
+		}
+		packet.h.timestamp = timestamp;
+		packet.h.count = packet_samples;
+		if (send(sock, &packet, sizeof(packet.h) + packet_bytes, 0) < 0) errors++;
+		packet.h.seq++;
+		packet.h.flags = 0;
+		timestamp += packet_samples;
+	}
+	fprintf(stderr, "%" PRIu32 " packets, %" PRIu64 " errors\n", packet.h.seq - first_seq, errors);
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+  ===========================================================================
+
+  worker_pool - Splits a loop over several threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "worker_pool.h"
+
+static void run_part(struct worker_pool *p, int index) {
+	int begin = (long) p->count * index / p->threads;
+	int end = (long) p->count * (index + 1) / p->threads;
+	if (end > begin) p->fn(p->arg, begin, end);
+}
+
+static void *worker(void *arg) {
+	struct worker_pool *p = ((struct worker_pool_thread *) arg)->pool;
+	int index = ((struct worker_pool_thread *) arg)->index;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && p->generation == generation) {
+			pthread_cond_wait(&p->start, &p->lock);
+		}
+		if (p->stop) break;
+		generation = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		run_part(p, index);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->pending == 0) pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+int worker_pool_init(struct worker_pool *p, int threads) {
+	memset(p, 0, sizeof(*p));
+	if (threads < 1) threads = 1;
+	if (threads > WORKER_POOL_MAX) threads = WORKER_POOL_MAX;
+	p->threads = threads;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	// The caller of worker_pool_run() takes part 0
+	for (int j = 1; j < threads; j++) {
+		struct worker_pool_thread *w = &p->workers[j];
+		w->pool = p;
+		w->index = j;
+		if (pthread_create(&w->thread, NULL, worker, w) != 0) {
+			fprintf(stderr, "Could not create worker thread\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void worker_pool_run(struct worker_pool *p, worker_pool_fn fn, void *arg, int count) {
+	if (p->threads == 1) {
+		fn(arg, 0, count);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->count = count;
+	p->pending = p->threads - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	run_part(p, 0);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->pending) pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void worker_pool_free(struct worker_pool *p) {
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	for (int j = 1; j < p->threads; j++) {
+		pthread_join(p->workers[j].thread, NULL);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+}
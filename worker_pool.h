@@ -0,0 +1,63 @@
+/*
+  ===========================================================================
+
+  worker_pool - Splits a loop over several threads.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+#define WORKER_POOL_MAX 16
+
+// Processes items [begin, end)
+typedef void (*worker_pool_fn)(void *arg, int begin, int end);
+
+struct worker_pool;
+
+struct worker_pool_thread {
+	struct worker_pool *pool;
+	int index;
+	pthread_t thread;
+};
+
+struct worker_pool {
+	int threads; // including the caller of worker_pool_run()
+	struct worker_pool_thread workers[WORKER_POOL_MAX];
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long generation;
+	int pending;
+	int stop;
+
+	worker_pool_fn fn;
+	void *arg;
+	int count;
+};
+
+int worker_pool_init(struct worker_pool *p, int threads);
+// Runs fn over count items split in equal parts between the threads, and
+// returns when all of them have finished
+void worker_pool_run(struct worker_pool *p, worker_pool_fn fn, void *arg, int count);
+void worker_pool_free(struct worker_pool *p);
+
+#endif
@@ -0,0 +1,354 @@
+/*
+  ===========================================================================
+
+  xdp_tx - Sends UDP datagrams through an AF_XDP socket, bypassing the
+  kernel network stack.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  The frames are built in the UMEM, where the payload is written directly
+  by the caller, and their addresses go through the TX ring to the driver,
+  which takes them without a copy if it supports zero-copy mode. Only TX
+  is used, so no XDP program is needed. Each frame is given back through
+  the completion ring once it has been sent.
+
+  ===========================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include "xdp_tx.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#define FILL_RING_SIZE 64
+#define ARP_RETRIES 10
+#define DRAIN_TRIES 100
+
+static int map_ring(struct xdp_tx_ring *r, int fd, const struct xdp_ring_offset *off,
+		    size_t entries, size_t entry_size, off_t pgoff) {
+	r->map_size = off->desc + entries * entry_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		perror("Could not map AF_XDP ring");
+		return -1;
+	}
+	r->producer = (uint32_t *) ((char *) r->map + off->producer);
+	r->consumer = (uint32_t *) ((char *) r->map + off->consumer);
+	r->flags = (uint32_t *) ((char *) r->map + off->flags);
+	r->descs = (char *) r->map + off->desc;
+	return 0;
+}
+
+static int parse_mac(const char *s, uint8_t *mac) {
+	return sscanf(s, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+		      &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6 ? 0 : -1;
+}
+
+static int arp_lookup(struct in_addr ip, const char *ifname, uint8_t *mac) {
+	FILE *f = fopen("/proc/net/arp", "r");
+	if (!f) return -1;
+	char line[256], addr[64], hw[64], dev[64];
+	int found = -1;
+	if (!fgets(line, sizeof(line), f)) goto out; // header
+	while (fgets(line, sizeof(line), f)) {
+		unsigned int type, flags;
+		if (sscanf(line, "%63s 0x%x 0x%x %63s %*s %63s", addr, &type, &flags, hw, dev) != 5) {
+			continue;
+		}
+		// Flag 2 is a complete entry
+		if ((flags & 2) && strcmp(dev, ifname) == 0 && inet_addr(addr) == ip.s_addr
+		    && parse_mac(hw, mac) == 0) {
+			found = 0;
+			break;
+		}
+	}
+out:
+	fclose(f);
+	return found;
+}
+
+// Looks up the destination MAC address, asking the kernel to resolve it if
+// it is not in the ARP table yet
+static int resolve_mac(const struct sockaddr_in *dst, const char *ifname, uint8_t *mac) {
+	for (int j = 0; j < ARP_RETRIES; j++) {
+		if (arp_lookup(dst->sin_addr, ifname, mac) == 0) return 0;
+		if (j == 0) {
+			int s = socket(AF_INET, SOCK_DGRAM, 0);
+			if (s >= 0) {
+				struct sockaddr_in discard = *dst;
+				discard.sin_port = htons(9);
+				sendto(s, NULL, 0, 0, (struct sockaddr *) &discard, sizeof(discard));
+				close(s);
+			}
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "Could not find the MAC address of %s on %s. "
+		"Is it on the same link? It can be given with -xm\n",
+		inet_ntoa(dst->sin_addr), ifname);
+	return -1;
+}
+
+static uint16_t ip_checksum(const uint8_t *h, int len) {
+	uint32_t sum = 0;
+	for (int j = 0; j < len; j += 2) sum += (h[j] << 8) | h[j+1];
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static int build_header(struct xdp_tx *x, const char *ifname, const struct sockaddr_in *dst,
+			const char *dst_mac) {
+	uint8_t *h = x->header;
+	struct ifreq ifr;
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		perror("socket()");
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) < 0) {
+		perror("Could not get the MAC address of the XDP interface");
+		close(s);
+		return -1;
+	}
+	memcpy(h + 6, ifr.ifr_hwaddr.sa_data, 6);
+	if (ioctl(s, SIOCGIFADDR, &ifr) < 0) {
+		perror("Could not get the IP address of the XDP interface");
+		close(s);
+		return -1;
+	}
+	struct in_addr src = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
+	close(s);
+
+	if (dst_mac) {
+		if (parse_mac(dst_mac, h) < 0) {
+			fprintf(stderr, "Invalid MAC address %s\n", dst_mac);
+			return -1;
+		}
+	}
+	else if (resolve_mac(dst, ifname, h) < 0) {
+		return -1;
+	}
+	h[12] = 0x08; // IPv4
+	h[13] = 0x00;
+
+	// IPv4, with DF and ID 0 the header is the same for every datagram
+	uint8_t *ip = h + 14;
+	uint16_t ip_len = 20 + 8 + x->payload_size;
+	ip[0] = 0x45;
+	ip[2] = ip_len >> 8;
+	ip[3] = ip_len;
+	ip[6] = 0x40; // DF
+	ip[8] = 64; // TTL
+	ip[9] = 17; // UDP
+	memcpy(ip + 12, &src, 4);
+	memcpy(ip + 16, &dst->sin_addr, 4);
+	uint16_t csum = ip_checksum(ip, 20);
+	ip[10] = csum >> 8;
+	ip[11] = csum;
+
+	// UDP, without checksum
+	uint8_t *udp = ip + 20;
+	uint16_t udp_len = 8 + x->payload_size;
+	memcpy(udp, &dst->sin_port, 2); // source port, same as destination
+	memcpy(udp + 2, &dst->sin_port, 2);
+	udp[4] = udp_len >> 8;
+	udp[5] = udp_len;
+	return 0;
+}
+
+int xdp_tx_init(struct xdp_tx *x, const char *ifname, int queue,
+		const struct sockaddr_in *dst, const char *dst_mac, size_t payload_size) {
+	memset(x, 0, sizeof(*x));
+	x->fd = -1;
+	x->payload_size = payload_size;
+	if (XDP_TX_HEADER + payload_size > XDP_TX_FRAME_SIZE) {
+		fprintf(stderr, "Datagrams too large for AF_XDP frames\n");
+		return -1;
+	}
+	unsigned int ifindex = if_nametoindex(ifname);
+	if (!ifindex) {
+		fprintf(stderr, "Unknown interface %s\n", ifname);
+		return -1;
+	}
+	if (build_header(x, ifname, dst, dst_mac) < 0) return -1;
+
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (x->fd < 0) {
+		perror("Could not open AF_XDP socket");
+		return -1;
+	}
+
+	size_t umem_size = (size_t) XDP_TX_FRAMES * XDP_TX_FRAME_SIZE;
+	x->umem = mmap(NULL, umem_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		x->umem = NULL;
+		perror("Could not allocate AF_XDP UMEM");
+		return -1;
+	}
+	struct xdp_umem_reg reg = {
+		.addr = (uintptr_t) x->umem,
+		.len = umem_size,
+		.chunk_size = XDP_TX_FRAME_SIZE,
+		.headroom = 0
+	};
+	int tx_size = XDP_TX_FRAMES, fill_size = FILL_RING_SIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0
+	    || setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(int)) < 0
+	    || setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &tx_size, sizeof(int)) < 0
+	    || setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &tx_size, sizeof(int)) < 0) {
+		perror("Could not set up AF_XDP rings");
+		return -1;
+	}
+
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		perror("Could not get AF_XDP ring offsets");
+		return -1;
+	}
+	if (map_ring(&x->tx, x->fd, &off.tx, XDP_TX_FRAMES, sizeof(struct xdp_desc),
+		     XDP_PGOFF_TX_RING) < 0
+	    || map_ring(&x->completion, x->fd, &off.cr, XDP_TX_FRAMES, sizeof(uint64_t),
+			XDP_UMEM_PGOFF_COMPLETION_RING) < 0
+	    || map_ring(&x->fill, x->fd, &off.fr, FILL_RING_SIZE, sizeof(uint64_t),
+			XDP_UMEM_PGOFF_FILL_RING) < 0) {
+		return -1;
+	}
+
+	// Zero-copy if the driver supports it, or else copy mode
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_ifindex = ifindex,
+		.sxdp_queue_id = queue,
+		.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP
+	};
+	x->zerocopy = 1;
+	x->need_wakeup = 1;
+	if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+		x->zerocopy = 0;
+		sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+		if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+			x->need_wakeup = 0;
+			sxdp.sxdp_flags = XDP_COPY;
+			if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+				perror("Could not bind AF_XDP socket");
+				return -1;
+			}
+		}
+	}
+	fprintf(stderr, "AF_XDP on %s queue %d, %s mode\n", ifname, queue,
+		x->zerocopy ? "zero-copy" : "copy");
+
+	for (unsigned int j = 0; j < XDP_TX_FRAMES; j++) {
+		uint64_t addr = (uint64_t) j * XDP_TX_FRAME_SIZE;
+		memcpy((char *) x->umem + addr, x->header, XDP_TX_HEADER);
+		x->free_frames[j] = addr;
+	}
+	x->free_count = XDP_TX_FRAMES;
+	return 0;
+}
+
+static void reclaim(struct xdp_tx *x) {
+	struct xdp_tx_ring *r = &x->completion;
+	uint32_t producer = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+	uint64_t *addrs = r->descs;
+	while (r->cached != producer) {
+		x->free_frames[x->free_count++] = addrs[r->cached & (XDP_TX_FRAMES - 1)];
+		r->cached++;
+	}
+	__atomic_store_n(r->consumer, r->cached, __ATOMIC_RELEASE);
+}
+
+int xdp_tx_reserve(struct xdp_tx *x, void **payloads, int count) {
+	if (x->free_count < (unsigned int) count) reclaim(x);
+	if (x->free_count < (unsigned int) count) {
+		// Frames still queued in the kernel. Make sure that it is
+		// sending them
+		sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		errno = EAGAIN;
+		return -1;
+	}
+	for (int j = 0; j < count; j++) {
+		uint64_t addr = x->free_frames[--x->free_count];
+		x->reserved[x->reserved_count++] = addr;
+		payloads[j] = (char *) x->umem + addr + XDP_TX_HEADER;
+	}
+	return count;
+}
+
+void xdp_tx_submit(struct xdp_tx *x) {
+	// There is a TX ring entry for every frame, so there is always room
+	struct xdp_tx_ring *r = &x->tx;
+	struct xdp_desc *descs = r->descs;
+	for (unsigned int j = 0; j < x->reserved_count; j++) {
+		struct xdp_desc *d = &descs[r->cached & (XDP_TX_FRAMES - 1)];
+		d->addr = x->reserved[j];
+		d->len = XDP_TX_HEADER + x->payload_size;
+		d->options = 0;
+		r->cached++;
+	}
+	x->reserved_count = 0;
+	__atomic_store_n(r->producer, r->cached, __ATOMIC_RELEASE);
+	if (!x->need_wakeup || (__atomic_load_n(r->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+		sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	}
+}
+
+void xdp_tx_release(struct xdp_tx *x) {
+	while (x->reserved_count) {
+		x->free_frames[x->free_count++] = x->reserved[--x->reserved_count];
+	}
+}
+
+void xdp_tx_free(struct xdp_tx *x) {
+	// Let the frames still in the kernel go out before the socket is
+	// closed, for at most DRAIN_TRIES * 1 ms
+	if (x->fd >= 0 && x->completion.map) {
+		struct timespec ms = { .tv_sec = 0, .tv_nsec = 1000000 };
+		for (int j = 0; j < DRAIN_TRIES; j++) {
+			reclaim(x);
+			if (x->free_count + x->reserved_count >= XDP_TX_FRAMES) break;
+			sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+			nanosleep(&ms, NULL);
+		}
+	}
+	if (x->tx.map) munmap(x->tx.map, x->tx.map_size);
+	if (x->completion.map) munmap(x->completion.map, x->completion.map_size);
+	if (x->fill.map) munmap(x->fill.map, x->fill.map_size);
+	if (x->fd >= 0) close(x->fd);
+	if (x->umem) munmap(x->umem, (size_t) XDP_TX_FRAMES * XDP_TX_FRAME_SIZE);
+}
@@ -0,0 +1,78 @@
+/*
+  ===========================================================================
+
+  xdp_tx - Sends UDP datagrams through an AF_XDP socket, bypassing the
+  kernel network stack.
+
+  Copyright (C) 2022 Daniel Estevez <daniel@destevez.net>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+  ===========================================================================
+*/
+
+#ifndef XDP_TX_H
+#define XDP_TX_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/if_xdp.h>
+
+#define XDP_TX_FRAMES 4096
+#define XDP_TX_FRAME_SIZE 2048
+#define XDP_TX_HEADER 42 // Ethernet, IPv4 and UDP
+
+struct xdp_tx_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *descs;
+	void *map;
+	size_t map_size;
+	uint32_t cached; // our own producer or consumer
+};
+
+struct xdp_tx {
+	int fd;
+	void *umem;
+	size_t payload_size;
+	int zerocopy;
+	int need_wakeup;
+	struct xdp_tx_ring tx, completion, fill;
+
+	// Frames not in use by the kernel
+	uint64_t free_frames[XDP_TX_FRAMES];
+	unsigned int free_count;
+	// Frames given out by xdp_tx_reserve() and not yet submitted
+	uint64_t reserved[XDP_TX_FRAMES];
+	unsigned int reserved_count;
+
+	uint8_t header[XDP_TX_HEADER];
+};
+
+// Opens an AF_XDP socket on a queue of the interface, for datagrams of
+// payload_size bytes to dst. The destination MAC address is taken from
+// dst_mac if not NULL, or else from the ARP table
+int xdp_tx_init(struct xdp_tx *x, const char *ifname, int queue,
+		const struct sockaddr_in *dst, const char *dst_mac, size_t payload_size);
+// Gives the payloads of count frames to be filled in. Returns count, or
+// -1 with errno = EAGAIN if there are not enough free frames
+int xdp_tx_reserve(struct xdp_tx *x, void **payloads, int count);
+// Sends the reserved frames
+void xdp_tx_submit(struct xdp_tx *x);
+// Returns the reserved frames unsent
+void xdp_tx_release(struct xdp_tx *x);
+void xdp_tx_free(struct xdp_tx *x);
+
+#endif